@@ -9,6 +9,7 @@
 
 #include "pxScene2d.h"
 #include "pxContext.h"
+#include "pxFont.h"
 #include "rtSettings.h"
 #include "pxEventLoop.h"
 
@@ -271,6 +272,9 @@ void benchmarkWindow::reset()
         case pxApiFixture::type::xDrawTextureQuads:
             mGroupName = "DrawTextureQuads";
             break;
+        case pxApiFixture::type::xLayoutText:
+            mGroupName = "LayoutText";
+            break;
         /*case pxApiFixture::type::xDrawImage9Ran:
             mGroupName = "DrawImage9Ran";
             break;
@@ -661,6 +665,29 @@ void pxApiFixture::TestDrawImagePNG ()
     context.drawImage(mCurrentX, mCurrentY, mUnitWidth, mUnitHeight, mTextureRef, mTextureMaskRef, false, NULL, ((int)mCurrentX) % 2 == 0 ? pxConstantsStretch::STRETCH : pxConstantsStretch::REPEAT, ((int)mCurrentX) % 2 == 0 ? pxConstantsStretch::STRETCH : ((int)mCurrentY) % 2 == 0 ? pxConstantsStretch::REPEAT : pxConstantsStretch::NONE, true, ((int)mCurrentX) % 2 == 0 ? pxConstantsMaskOperation::NORMAL : pxConstantsMaskOperation::INVERT);
 }
 
+void pxApiFixture::TestLayoutText ()
+{
+    // Mix of direct-indexed (ASCII/Latin-1) and hashed (Greek, Cyrillic) glyph lookups
+    static const char* text = "The quick brown fox jumps over the lazy dog. "
+                              "Fa\xc3\xa7" "ade na\xc3\xafve r\xc3\xa9sum\xc3\xa9 "
+                              "\xce\xb1\xce\xb2\xce\xb3 \xd0\xb0\xd0\xb1\xd0\xb2";
+    static rtRef<pxFont> font = pxFontManager::getFont(defaultFont);
+    
+    if (!font || !font->isFontLoaded())
+        return;
+    
+    uint32_t pixelSize = 12 + ((int)mCurrentX / 25) % 4 * 4;
+    float w, h;
+    font->measureTextInternal(text, pixelSize, 1.0, 1.0, w, h);
+    
+#ifdef PXSCENE_FONT_ATLAS
+    static float color[4] = {1.0, 1.0, 1.0, 1.0};
+    pxTexturedQuads quads;
+    font->renderTextToQuads(text, pixelSize, 1.0, 1.0, quads, mCurrentX, mCurrentY);
+    quads.draw(0, 0, color);
+#endif
+}
+
 void pxApiFixture::TestDrawAll ()
 {
     TestDrawRect();
@@ -768,6 +795,9 @@ void pxApiFixture::onExperimentStart(const celero::TestFixture::ExperimentValue&
         case xDrawTextureQuads:
             TestDrawTextureQuads();
             break;
+        case xLayoutText:
+            TestLayoutText();
+            break;
         /*case xDrawImage9Ran:
             TestDrawImage9Ran();
             break;
@@ -109,6 +109,7 @@ class pxApiFixture : public celero::TestFixture
     void TestDrawImageMasked ();
     void TestDrawTextureQuads ();
     void TestDrawOffscreen ();
+    void TestLayoutText ();
     
     void TestDrawImageRan ();
     void TestDrawImage9Ran ();
@@ -137,6 +138,7 @@ public:
         xDrawTextureQuadsRan,*/
         xDrawImageJPG,
         xDrawImagePNG,
+        xLayoutText,
         xDrawAll,
         xEnd
     };
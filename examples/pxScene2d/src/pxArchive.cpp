@@ -23,10 +23,13 @@ limitations under the License.
 extern rtThreadQueue* gUIThreadQueue;
 
 #include "rtFileDownloader.h"
+#include "pxContext.h"
+
+extern pxContext context;
 
 pxArchive::pxArchive(): mIsFile(true),mDownloadRequest(NULL), mZip(),
                         mDownloadStatusCode(0), mHttpStatusCode(0), mArchiveData(NULL), mArchiveDataSize(0),
-                        mUseDownloadedData(false), mArchiveDataMutex()
+                        mUseDownloadedData(false), mArchiveDataMutex(), mAccountedMemoryBytes(0)
 {
 }
 
@@ -43,6 +46,29 @@ pxArchive::~pxArchive()
     gUIThreadQueue->removeAllTasksForObject(this);
   }
   clearDownloadedData();
+  context.adjustCurrentCpuMemorySize(PX_CPU_MEMORY_ARCHIVE, -mAccountedMemoryBytes);
+}
+
+// Reports changes in the archive buffers to the CPU memory accounting
+void pxArchive::updateMemoryUsage()
+{
+  mArchiveDataMutex.lock();
+  int64_t bytes = (int64_t)mData.length() + (int64_t)mArchiveView.length();
+  if (mArchiveData != NULL)
+  {
+    bytes += (int64_t)mArchiveDataSize;
+  }
+  context.adjustCurrentCpuMemorySize(PX_CPU_MEMORY_ARCHIVE, bytes - mAccountedMemoryBytes);
+  mAccountedMemoryBytes = bytes;
+  mArchiveDataMutex.unlock();
+}
+
+uint64_t pxArchive::cpuMemoryUsage()
+{
+  mArchiveDataMutex.lock();
+  uint64_t bytes = (uint64_t)mAccountedMemoryBytes;
+  mArchiveDataMutex.unlock();
+  return bytes;
 }
 
 void pxArchive::clearDownloadedData()
@@ -50,11 +76,13 @@ void pxArchive::clearDownloadedData()
   mArchiveDataMutex.lock();
   if (mArchiveData != NULL)
   {
-    delete [] mArchiveData;
+    free(mArchiveData);
     mArchiveData = NULL;
   }
   mArchiveDataSize = 0;
+  mArchiveView.term();
   mArchiveDataMutex.unlock();
+  updateMemoryUsage();
 }
 
 void pxArchive::setupArchive()
@@ -68,18 +96,34 @@ void pxArchive::setupArchive()
     mLoadStatus.set("errorString", mErrorString);
 
     if (mDownloadStatusCode == 0) {
-      mData.init((uint8_t *) mArchiveData, mArchiveDataSize);
+      if (mArchiveView.isView())
+        mData.initView(mArchiveView, 0, mArchiveView.length());
+      else
+        mData.init((uint8_t *) mArchiveData, mArchiveDataSize);
       process(mData.data(), mData.length());
     }
     if (mArchiveData != NULL) {
-      delete[] mArchiveData;
+      free(mArchiveData);
       mArchiveData = NULL;
     }
+    mArchiveView.term();
   }
   mArchiveDataMutex.unlock();
+  updateMemoryUsage();
 }
 
 void pxArchive::setArchiveData(int downloadStatusCode, uint32_t httpStatusCode, const char* data, const size_t dataSize, const rtString& errorString)
+{
+  char* archiveData = NULL;
+  if (data != NULL)
+  {
+    archiveData = (char*)malloc(dataSize);
+    memcpy(archiveData, data, dataSize);
+  }
+  adoptArchiveData(downloadStatusCode, httpStatusCode, archiveData, dataSize, errorString);
+}
+
+void pxArchive::adoptArchiveData(int downloadStatusCode, uint32_t httpStatusCode, char* data, const size_t dataSize, const rtString& errorString)
 {
   mArchiveDataMutex.lock();
   mDownloadStatusCode = downloadStatusCode;
@@ -87,9 +131,10 @@ void pxArchive::setArchiveData(int downloadStatusCode, uint32_t httpStatusCode,
   mErrorString = errorString;
   if (mArchiveData != NULL)
   {
-    delete [] mArchiveData;
+    free(mArchiveData);
     mArchiveData = NULL;
   }
+  mArchiveView.term();
   if (data == NULL)
   {
     mArchiveData = NULL;
@@ -97,11 +142,20 @@ void pxArchive::setArchiveData(int downloadStatusCode, uint32_t httpStatusCode,
   }
   else
   {
-    mArchiveData = new char[dataSize];
+    mArchiveData = data;
     mArchiveDataSize = dataSize;
-    memcpy(mArchiveData, data, mArchiveDataSize);
   }
   mArchiveDataMutex.unlock();
+  updateMemoryUsage();
+}
+
+void pxArchive::shareArchiveData(int downloadStatusCode, uint32_t httpStatusCode, rtData& data, const rtString& errorString)
+{
+  adoptArchiveData(downloadStatusCode, httpStatusCode, NULL, 0, errorString);
+  mArchiveDataMutex.lock();
+  mArchiveView.initView(data, 0, data.length());
+  mArchiveDataMutex.unlock();
+  updateMemoryUsage();
 }
 
 rtError pxArchive::initFromUrl(const rtString& url, const rtCORSRef& cors, rtObjectRef archive)
@@ -166,6 +220,7 @@ rtError pxArchive::initFromUrl(const rtString& url, const rtCORSRef& cors, rtObj
     if (loadStatus == RT_OK)
     {
       process(mData.data(), mData.length());
+      updateMemoryUsage();
     }
 
     if (gUIThreadQueue)
@@ -286,9 +341,29 @@ void pxArchive::onDownloadComplete(rtFileDownloadRequest* downloadRequest)
 
   if (a != NULL)
   {
-    a->setArchiveData(downloadRequest->downloadStatusCode(), (uint32_t)downloadRequest->httpStatusCode(),
-                      downloadRequest->downloadedData(), downloadRequest->downloadedDataSize(),
-                      downloadRequest->errorString());
+    char* data = NULL;
+    size_t dataSize = 0;
+#ifdef ENABLE_HTTP_CACHE
+    rtData cachedData;
+#endif
+    if (downloadRequest->takeDownloadedData(data, dataSize))
+    {
+      a->adoptArchiveData(downloadRequest->downloadStatusCode(), (uint32_t)downloadRequest->httpStatusCode(),
+                          data, dataSize, downloadRequest->errorString());
+    }
+#ifdef ENABLE_HTTP_CACHE
+    else if (downloadRequest->cachedData(cachedData))
+    {
+      a->shareArchiveData(downloadRequest->downloadStatusCode(), (uint32_t)downloadRequest->httpStatusCode(),
+                          cachedData, downloadRequest->errorString());
+    }
+#endif
+    else
+    {
+      a->setArchiveData(downloadRequest->downloadStatusCode(), (uint32_t)downloadRequest->httpStatusCode(),
+                        downloadRequest->downloadedData(), downloadRequest->downloadedDataSize(),
+                        downloadRequest->errorString());
+    }
 
     if (gUIThreadQueue)
     {
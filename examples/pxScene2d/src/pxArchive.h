@@ -57,16 +57,22 @@ public:
   rtError fileNames(rtObjectRef& names) const;
 
   void setArchiveData(int downloadStatusCode, uint32_t httpStatusCode, const char* data, const size_t dataSize, const rtString& errorString);
+  // Takes over a malloc'ed buffer instead of copying it
+  void adoptArchiveData(int downloadStatusCode, uint32_t httpStatusCode, char* data, const size_t dataSize, const rtString& errorString);
+  // Keeps a view of the data, such as an archive mapped from the cache, instead of copying it
+  void shareArchiveData(int downloadStatusCode, uint32_t httpStatusCode, rtData& data, const rtString& errorString);
   void setupArchive();
 
   bool isFile();
   rtString getName();
+  uint64_t cpuMemoryUsage();
 
 protected:
   static void onDownloadComplete(rtFileDownloadRequest* downloadRequest);
   static void onDownloadCompleteUI(void* context, void* data);
   void process(void* data, size_t dataSize);
   void clearDownloadedData();
+  void updateMemoryUsage();
 
   bool mIsFile;
   rtString mUrl;
@@ -82,9 +88,11 @@ protected:
   uint32_t mHttpStatusCode;
   char* mArchiveData;
   size_t mArchiveDataSize;
+  rtData mArchiveView;
   bool mUseDownloadedData;
   rtMutex mArchiveDataMutex;
   rtString mErrorString;
+  int64_t mAccountedMemoryBytes;
 };
 
 #endif
@@ -23,6 +23,7 @@
 
 #include "rtCore.h"
 #include "rtRef.h"
+#include "rtMutex.h"
 
 #include "pxCore.h"
 #include "pxOffscreen.h"
@@ -51,6 +52,16 @@
   #define PXSCENE_DEFAULT_TEXTURE_MEMORY_LIMIT_THRESHOLD_PADDING_IN_BYTES (5 * 1024 * 1024)
 #endif
 
+// CPU-side memory pools tracked alongside texture memory
+enum pxCpuMemoryPool
+{
+  PX_CPU_MEMORY_COMPRESSED_IMAGE = 0,  // encoded image data kept by textures for reloading
+  PX_CPU_MEMORY_DECODED_IMAGE,         // decoded pixels waiting for texture upload
+  PX_CPU_MEMORY_FONT,                  // font file data
+  PX_CPU_MEMORY_ARCHIVE,               // archive file data
+  PX_CPU_MEMORY_POOL_COUNT
+};
+
 //enum pxStretch { PX_NONE = 0, PX_STRETCH = 1, PX_REPEAT = 2 };
 
 class pxContext {
@@ -67,7 +78,12 @@ class pxContext {
   , mEnableTextureMemoryMonitoring(false)
 #endif
   , mEjectTextureAge(DEFAULT_EJECT_TEXTURE_AGE)
-  {}
+  , mCpuMemoryLimitInBytes(0)
+  , mCpuMemoryMutex()
+  {
+    for (int i = 0; i < PX_CPU_MEMORY_POOL_COUNT; i++)
+      mCurrentCpuMemorySizeInBytes[i] = 0;
+  }
   ~pxContext();
 
   void init();
@@ -77,6 +93,8 @@ class pxContext {
   bool showOutlines() { return mShowOutlines; }
   void setShowOutlines(bool v) { mShowOutlines = v; }
 
+  // starts a frame; textures note the frame they were last drawn in
+  void beginFrame();
   void setSize(int w, int h);
   void getSize(int& w, int& h);
   void clear(int w, int h);
@@ -108,6 +126,13 @@ class pxContext {
 
   void snapshot(pxOffscreen& o);
 
+  // Asynchronous variant of snapshot().  beginSnapshot() queues a readback of
+  // the current framebuffer (through a pixel pack buffer where the platform
+  // supports it) and finishSnapshot() collects the pixels on a later frame.
+  // The returned offscreen is owned by the caller.
+  pxError beginSnapshot(uint32_t& readbackId);
+  pxError finishSnapshot(uint32_t readbackId, pxOffscreen*& o);
+
   void drawRect(float w, float h, float lineWidth, float* fillColor, float* lineColor);
 
   // conveinience method
@@ -129,6 +154,10 @@ class pxContext {
   // 6 vertices (12 floats) and 6 uvs (12 floats) per quad
   void drawTexturedQuads(int numQuads, const void *verts, const void* uvs,
                           pxTextureRef t, float* color);
+  // Same with positions and uvs interleaved as x,y,u,v per vertex (24 floats
+  // per quad).  x,y offsets the quads through the matrix.
+  void drawTexturedQuads(int numQuads, const void *vertices,
+                          pxTextureRef t, float* color, float x = 0, float y = 0);
 #endif                          
 
   void drawImage9(float w, float h, float x1, float y1,
@@ -152,13 +181,49 @@ class pxContext {
   void adjustCurrentTextureMemorySize(int64_t changeInBytes, bool allowGarbageCollect=true);
   void setTextureMemoryLimit(int64_t textureMemoryLimitInBytes);
   bool isTextureSpaceAvailable(pxTextureRef texture, bool allowGarbageCollect=true, int32_t bytesPerPixel=4);
+  bool isTextureSpaceAvailable(int64_t bytes, bool allowGarbageCollect=true);
   int64_t currentTextureMemoryUsageInBytes();
   int64_t textureMemoryOverflow(pxTextureRef texture);
+  int64_t textureMemoryOverflow(int64_t bytes);
   int64_t ejectTextureMemory(int64_t bytesRequested, bool forceEject=false);
   
   pxError setEjectTextureAge(uint32_t age);
   pxError enableInternalContext(bool enable);
 
+  // CPU memory accounting.  Any thread may adjust the pools; ejectCpuMemory()
+  // drops the compressed copies of uploaded textures that can be fetched
+  // again and must be called from the render thread.  A limit of 0 means
+  // no limit.
+  void adjustCurrentCpuMemorySize(pxCpuMemoryPool pool, int64_t changeInBytes)
+  {
+    mCpuMemoryMutex.lock();
+    mCurrentCpuMemorySizeInBytes[pool] += changeInBytes;
+    mCpuMemoryMutex.unlock();
+  }
+  int64_t currentCpuMemoryUsageInBytes(pxCpuMemoryPool pool)
+  {
+    rtMutexLockGuard lock(mCpuMemoryMutex);
+    return mCurrentCpuMemorySizeInBytes[pool];
+  }
+  int64_t currentCpuMemoryUsageInBytes()
+  {
+    rtMutexLockGuard lock(mCpuMemoryMutex);
+    int64_t total = 0;
+    for (int i = 0; i < PX_CPU_MEMORY_POOL_COUNT; i++)
+      total += mCurrentCpuMemorySizeInBytes[i];
+    return total;
+  }
+  void setCpuMemoryLimit(int64_t cpuMemoryLimitInBytes) { mCpuMemoryLimitInBytes = cpuMemoryLimitInBytes; }
+  int64_t cpuMemoryLimit() { return mCpuMemoryLimitInBytes; }
+  int64_t cpuMemoryOverflow()
+  {
+    if (mCpuMemoryLimitInBytes <= 0)
+      return 0;
+    int64_t overflow = currentCpuMemoryUsageInBytes() - mCpuMemoryLimitInBytes;
+    return (overflow > 0) ? overflow : 0;
+  }
+  int64_t ejectCpuMemory(int64_t bytesRequested);
+
 private:
   bool mShowOutlines;
   int64_t mCurrentTextureMemorySizeInBytes;
@@ -166,6 +231,9 @@ private:
   int64_t mTextureMemoryLimitThresholdPaddingInBytes;
   bool mEnableTextureMemoryMonitoring;
   uint32_t mEjectTextureAge;
+  int64_t mCurrentCpuMemorySizeInBytes[PX_CPU_MEMORY_POOL_COUNT];
+  int64_t mCpuMemoryLimitInBytes;
+  rtMutex mCpuMemoryMutex;
 };
 
 
@@ -30,6 +30,7 @@
 #include "pxContext.h"
 #include "pxUtil.h"
 #include <algorithm>
+#include <map>
 #include <ctime>
 #include <cstdlib>
 
@@ -823,7 +824,7 @@ private:
     rtThreadPool *mainThreadPool = rtThreadPool::globalInstance();
     
     DecodeImageData *imageData = new DecodeImageData(this);
-    rtThreadTask         *task = new rtThreadTask(cleanupOffscreen, imageData, "");
+    rtThreadTask         *task = new rtThreadTask(cleanupOffscreen, imageData, "", RT_THREAD_PRIORITY_LOW);
     
     mainThreadPool->executeTask(task);
   }
@@ -2105,6 +2106,10 @@ void pxContext::init()
   {
     setTextureMemoryLimit((int64_t)val.toInt32() * (int64_t)1024 * (int64_t)1024);
   }
+  if (RT_OK == rtSettings::instance()->value("cpuMemoryLimitInMb", val))
+  {
+    setCpuMemoryLimit((int64_t)val.toInt32() * (int64_t)1024 * (int64_t)1024);
+  }
 
   rtLogSetLevel(RT_LOG_INFO); // LOG LEVEL
 
@@ -2117,6 +2122,11 @@ void pxContext::term()  // clean up statics
   swRasterTexture = NULL;
 }
 
+void pxContext::beginFrame()
+{
+  gRenderTick++;
+}
+
 void pxContext::setSize(int w, int h)
 {
   gResW = w;
@@ -2808,6 +2818,33 @@ void pxContext::snapshot(pxOffscreen& o)
 //JUNK
 }
 
+// DirectFB surfaces are read directly; readbacks complete immediately
+static std::map<uint32_t, pxOffscreen*> gSnapshotReadbacks;
+static uint32_t gSnapshotReadbackId = 0;
+
+pxError pxContext::beginSnapshot(uint32_t& readbackId)
+{
+  readbackId = ++gSnapshotReadbackId;
+
+  pxOffscreen* o = new pxOffscreen();
+  snapshot(*o);
+  gSnapshotReadbacks[readbackId] = o;
+  return PX_OK;
+}
+
+pxError pxContext::finishSnapshot(uint32_t readbackId, pxOffscreen*& o)
+{
+  o = NULL;
+  std::map<uint32_t, pxOffscreen*>::iterator it = gSnapshotReadbacks.find(readbackId);
+  if (it == gSnapshotReadbacks.end())
+  {
+    return PX_FAIL;
+  }
+  o = it->second;
+  gSnapshotReadbacks.erase(it);
+  return PX_OK;
+}
+
 void pxContext::mapToScreenCoordinates(float inX, float inY, int &outX, int &outY)
 {
   pxVector4f positionVector(inX, inY, 0, 1);
@@ -2917,7 +2954,14 @@ bool pxContext::isTextureSpaceAvailable(pxTextureRef texture, bool allowGarbageC
   if (!mEnableTextureMemoryMonitoring)
     return true;
 
-  int textureSize = (texture->width()*texture->height()*4);
+  return isTextureSpaceAvailable((int64_t)(texture->width()*texture->height()*4), allowGarbageCollect);
+}
+
+bool pxContext::isTextureSpaceAvailable(int64_t textureSize, bool allowGarbageCollect)
+{
+  if (!mEnableTextureMemoryMonitoring)
+    return true;
+
   if ((textureSize + mCurrentTextureMemorySizeInBytes) >
              (mTextureMemoryLimitInBytes + mTextureMemoryLimitThresholdPaddingInBytes))
   {
@@ -2941,7 +2985,11 @@ int64_t pxContext::currentTextureMemoryUsageInBytes()
 
 int64_t pxContext::textureMemoryOverflow(pxTextureRef texture)
 {
-  int64_t textureSize = (texture->width()*texture->height()*4);
+  return textureMemoryOverflow((int64_t)(texture->width()*texture->height()*4));
+}
+
+int64_t pxContext::textureMemoryOverflow(int64_t textureSize)
+{
   int64_t availableBytes = mTextureMemoryLimitInBytes - mCurrentTextureMemorySizeInBytes;
   if (textureSize > availableBytes)
   {
@@ -2950,6 +2998,13 @@ int64_t pxContext::textureMemoryOverflow(pxTextureRef texture)
   return 0;
 }
 
+int64_t pxContext::ejectCpuMemory(int64_t /*bytesRequested*/)
+{
+  // DirectFB textures keep no compressed copy that could be fetched again,
+  // so there is nothing to release
+  return 0;
+}
+
 int64_t pxContext::ejectTextureMemory(int64_t bytesRequested, bool forceEject)
 {
   if (!mEnableTextureMemoryMonitoring)
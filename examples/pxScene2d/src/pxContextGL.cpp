@@ -26,10 +26,16 @@
 #include "rtMutex.h"
 #include "rtScript.h"
 #include "rtSettings.h"
+#include "rtFile.h"
+#include "rtFileDownloader.h"
+#ifdef ENABLE_HTTP_CACHE
+#include "rtFileCache.h"
+#endif
 
 #include "pxContext.h"
 #include "pxUtil.h"
 #include <algorithm>
+#include <map>
 #include <ctime>
 #include <cstdlib>
 
@@ -123,7 +129,7 @@ extern pxContext context;
 rtThreadQueue* gUIThreadQueue = new rtThreadQueue();
 
 enum pxCurrentGLProgram { PROGRAM_UNKNOWN = 0, PROGRAM_SOLID_SHADER,  PROGRAM_A_TEXTURE_SHADER, PROGRAM_TEXTURE_SHADER,
-    PROGRAM_TEXTURE_MASKED_SHADER, PROGRAM_TEXTURE_BORDER_SHADER};
+    PROGRAM_TEXTURE_MASKED_SHADER, PROGRAM_TEXTURE_BORDER_SHADER, PROGRAM_SDF_TEXTURE_SHADER};
 
 pxCurrentGLProgram currentGLProgram = PROGRAM_UNKNOWN;
 
@@ -143,6 +149,75 @@ rtMutex textureListMutex;
 rtMutex contextLock;
 #endif //ENABLE_BACKGROUND_TEXTURE_CREATION
 
+// Pixel pack buffers are not available in GLES2
+#if !defined(PX_PLATFORM_WAYLAND_EGL) && !defined(PX_PLATFORM_GENERIC_EGL) && defined(GL_PIXEL_PACK_BUFFER)
+#define PX_SNAPSHOT_PBO_SUPPORT
+#endif
+
+// double buffered asynchronous readback
+#define PX_SNAPSHOT_PBO_COUNT 2
+
+// Pixel buffers are kept in a small ring and reused; a buffer is only
+// reallocated when the snapshot size changes
+struct pxSnapshotPBO
+{
+  GLuint pbo;
+  int width;
+  int height;
+  bool inUse;
+};
+
+struct pxSnapshotReadback
+{
+  int width;
+  int height;
+  int pboIndex;
+  pxOffscreen* offscreen;
+};
+
+static std::map<uint32_t, pxSnapshotReadback> gSnapshotReadbacks;
+static uint32_t gSnapshotReadbackId = 0;
+static pxSnapshotPBO gSnapshotPBOs[PX_SNAPSHOT_PBO_COUNT];
+
+#ifdef PX_SNAPSHOT_PBO_SUPPORT
+static bool snapshotPBOSupported()
+{
+  static int supported = -1;
+  if (supported == -1)
+  {
+    const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+    supported = (extensions != NULL && strstr(extensions, "GL_ARB_pixel_buffer_object") != NULL) ? 1 : 0;
+    rtLogInfo("asynchronous snapshot readback %s", supported ? "enabled" : "not supported");
+  }
+  return supported == 1;
+}
+
+// Returns the index of a free ring buffer sized for w x h, or -1 if every
+// buffer is still waiting to be collected
+static int acquireSnapshotPBO(int w, int h)
+{
+  for (int i = 0; i < PX_SNAPSHOT_PBO_COUNT; i++)
+  {
+    pxSnapshotPBO& buffer = gSnapshotPBOs[i];
+    if (buffer.inUse)
+      continue;
+
+    if (buffer.pbo == 0)
+      glGenBuffers(1, &buffer.pbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.pbo);
+    if (buffer.width != w || buffer.height != h)
+    {
+      glBufferData(GL_PIXEL_PACK_BUFFER, w*h*4, NULL, GL_STREAM_READ);
+      buffer.width = w;
+      buffer.height = h;
+    }
+    buffer.inUse = true;
+    return i;
+  }
+  return -1;
+}
+#endif //PX_SNAPSHOT_PBO_SUPPORT
+
 
 pxError lockContext()
 {
@@ -294,6 +369,31 @@ static const char *fATextureShaderText =
   "  gl_FragColor = a_color*a;"
   "}";
 
+#ifdef PXSCENE_FONT_ATLAS
+// assume premultiplied
+// alpha holds a signed distance, 0.5 at the glyph edge
+static const char *fSdfTextureShaderText =
+  "#ifdef GL_ES \n"
+  "  #extension GL_OES_standard_derivatives : enable \n"
+  "  precision mediump float; \n"
+  "#endif \n"
+  "uniform sampler2D s_texture;"
+  "uniform float u_alpha;"
+  "uniform vec4 a_color;"
+  "varying vec2 v_uv;"
+  "void main()"
+  "{"
+  "  float d = texture2D(s_texture, v_uv).a;"
+  "\n#if !defined(GL_ES) || defined(GL_OES_standard_derivatives) \n"
+  "  float w = clamp(0.7 * fwidth(d), 0.001, 0.5);"
+  "\n#else \n"
+  "  float w = 0.08;"
+  "\n#endif \n"
+  "  float a = u_alpha * smoothstep(0.5 - w, 0.5 + w, d);"
+  "  gl_FragColor = a_color*a;"
+  "}";
+#endif //PXSCENE_FONT_ATLAS
+
 static const char *vShaderText =
   "uniform vec2 u_resolution;"
   "uniform mat4 amymatrix;"
@@ -591,18 +691,53 @@ typedef rtRef<pxTextureOffscreen> pxTextureOffscreenRef;
 
 struct DecodeImageData
 {
-  DecodeImageData(pxTextureOffscreenRef t) : textureOffscreen(t)
+  DecodeImageData(pxTextureOffscreenRef t, bool mipmaps = false, bool mipmapsOnly = false)
+    : textureOffscreen(t), buildMipmaps(mipmaps), buildMipmapsOnly(mipmapsOnly),
+      downloadedData(NULL), downloadedDataSize(0)
+  {
+  }
+  ~DecodeImageData()
   {
+    free(downloadedData);
   }
   pxTextureOffscreenRef textureOffscreen;
+  // also build levels 1..n from the decoded image
+  bool buildMipmaps;
+  // the base level is already uploaded; only the levels are wanted
+  bool buildMipmapsOnly;
+  // fetched again after the cached copy went away; malloc'ed
+  char* downloadedData;
+  size_t downloadedDataSize;
+};
 
+// result of decodeTextureData(), handed to onDecodeComplete()
+struct DecodedTextureData
+{
+  DecodedTextureData() : offscreen(NULL), levels()
+  {
+  }
+  pxOffscreen* offscreen;
+  std::vector<pxOffscreen*> levels;
 };
 
+// images drawn at less than this fraction of their size get mipmaps
+#define PXSCENE_AUTO_MIPMAP_SCALE_THRESHOLD 0.5f
+
+static bool gAutoMipmapEnabled = true;
+
 void onDecodeComplete(void* context, void* data);
 void decodeTextureData(void* data);
+void onCompressedDataDownloaded(rtFileDownloadRequest* downloadRequest);
+bool buildMipmapLevels(pxOffscreen& decoded, std::vector<pxOffscreen*>& levels);
 void onOffscreenCleanupComplete(void* context, void*);
 void cleanupOffscreen(void* data);
 
+// Uploaded textures whose compressed data can be fetched again, least
+// recently drawn first.  ejectCpuMemory() releases from the head.
+static pxTextureOffscreen* gReleasableHead = NULL;
+static pxTextureOffscreen* gReleasableTail = NULL;
+static rtMutex gReleasableMutex;
+
 class pxTextureOffscreen : public pxTexture
 {
 public:
@@ -610,7 +745,11 @@ public:
                          mTextureUploaded(false), mTextureDataAvailable(false),
                          mLoadTextureRequested(false), mWidth(0), mHeight(0), mOffscreenMutex(),
                          mFreeOffscreenDataRequested(false), mCompressedData(NULL), mCompressedDataSize(0),
-                         mMipmapCreated(false), mTextureListener(NULL), mTextureListenerMutex()
+                         mMipmapCreated(false), mTextureListeners(), mTextureListenerMutex(),
+                         mMipmapLevels(), mMipmapLevelsRequested(false), mMipmapLevelsFailed(false),
+                         mMipmapMemoryBytes(0), mTextureWidth(0), mTextureHeight(0),
+                         mCompressedDataUrl(), mDecodedMemoryBytes(0), mCompressedDataReaders(0),
+                         mReleasable(false), mReleasablePrev(NULL), mReleasableNext(NULL), mReleasableTick(0)
   {
     mTextureType = PX_TEXTURE_OFFSCREEN;
     addToTextureList(this);
@@ -621,7 +760,11 @@ public:
                                        mTextureUploaded(false), mTextureDataAvailable(false),
                                        mLoadTextureRequested(false), mWidth(0), mHeight(0), mOffscreenMutex(),
                                        mFreeOffscreenDataRequested(false), mCompressedData(NULL), mCompressedDataSize(0),
-                                       mMipmapCreated(false), mTextureListener(NULL), mTextureListenerMutex()
+                                       mMipmapCreated(false), mTextureListeners(), mTextureListenerMutex(),
+                                       mMipmapLevels(), mMipmapLevelsRequested(false), mMipmapLevelsFailed(false),
+                                       mMipmapMemoryBytes(0), mTextureWidth(0), mTextureHeight(0),
+                                       mCompressedDataUrl(), mDecodedMemoryBytes(0), mCompressedDataReaders(0),
+                                       mReleasable(false), mReleasablePrev(NULL), mReleasableNext(NULL), mReleasableTick(0)
   {
     mTextureType = PX_TEXTURE_OFFSCREEN;
     setCompressedData(compressedData, compressedDataSize);
@@ -629,7 +772,7 @@ public:
     addToTextureList(this);
   }
 
-  ~pxTextureOffscreen() { deleteTexture(); removeFromTextureList(this);};
+  ~pxTextureOffscreen() { deleteTexture(); freeMipmapLevels(); setDecodedMemoryUsage(0); removeFromTextureList(this);};
 
   virtual pxError createTexture(pxOffscreen& o)
   {
@@ -700,6 +843,7 @@ public:
       }
     }
 
+    setDecodedMemoryUsage((int64_t)mOffscreen.width() * (int64_t)mOffscreen.height() * 4);
     mFreeOffscreenDataRequested = false;
     mOffscreenMutex.unlock();
 
@@ -707,9 +851,9 @@ public:
     mInitialized = true;
 
     mTextureListenerMutex.lock();
-    if (mTextureListener != NULL)
+    for (size_t i = 0; i < mTextureListeners.size(); i++)
     {
-      mTextureListener->textureReady();
+      mTextureListeners[i]->textureReady();
     }
     mTextureListenerMutex.unlock();
 
@@ -732,11 +876,15 @@ public:
       glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
                    mOffscreen.width(), mOffscreen.height(), 0, GL_RGBA,
                    GL_UNSIGNED_BYTE, mOffscreen.base());
+      mTextureWidth = mOffscreen.width();
+      mTextureHeight = mOffscreen.height();
       if (mDownscaleSmooth)
       {
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
         glGenerateMipmap(GL_TEXTURE_2D);
         mMipmapCreated = true;
+        mMipmapMemoryBytes = mipmapChainBytes(mTextureWidth, mTextureHeight);
+        context.adjustCurrentTextureMemorySize(mMipmapMemoryBytes, false);
       }
       context.adjustCurrentTextureMemorySize(mOffscreen.width()*mOffscreen.height()*4, false);
     }
@@ -752,6 +900,7 @@ public:
   {
     rtLogDebug("pxTextureOffscreen::deleteTexture()");
 
+    removeReleasable();
     unloadTextureData();
 
     freeCompressedData();
@@ -763,9 +912,13 @@ public:
   {
     if (!mLoadTextureRequested && mTextureDataAvailable)
     {
+      // a reload after ejection builds the mip chain from the same decode
+      bool mipmaps = (mDownscaleSmooth || mMipmapRequested) && !mMipmapCreated;
+      mMipmapLevelsRequested = mMipmapLevelsRequested || mipmaps;
       rtThreadPool *mainThreadPool = rtThreadPool::globalInstance();
-      DecodeImageData *decodeImageData = new DecodeImageData(this);
+      DecodeImageData *decodeImageData = new DecodeImageData(this, mipmaps);
       rtThreadTask *task = new rtThreadTask(decodeTextureData, decodeImageData, "");
+      mCompressedDataReaders++;
       mainThreadPool->executeTask(task);
       mLoadTextureRequested = true;
     }
@@ -780,14 +933,19 @@ public:
       if (mTextureName)
       {
         glDeleteTextures(1, &mTextureName);
-        context.adjustCurrentTextureMemorySize(-1 * mWidth * mHeight * 4);
+        context.adjustCurrentTextureMemorySize(-1 * mWidth * mHeight * 4 - mMipmapMemoryBytes);
       }
 
       mTextureName = 0;
       mInitialized = false;
       mTextureUploaded = false;
+      mMipmapCreated = false;
+      mMipmapMemoryBytes = 0;
+      mMipmapLevelsRequested = false;
+      freeMipmapLevels();
       mOffscreenMutex.lock();
       mOffscreen.term();
+      setDecodedMemoryUsage(0);
       mFreeOffscreenDataRequested = false;
       mOffscreenMutex.unlock();
     }
@@ -801,6 +959,7 @@ public:
     {
       rtLogDebug("freeing offscreen data");
       mOffscreen.term();
+      setDecodedMemoryUsage(0);
     }
     mFreeOffscreenDataRequested = false;
     mOffscreenMutex.unlock();
@@ -810,7 +969,34 @@ public:
   virtual pxError setTextureListener(pxTextureListener* textureListener)
   {
     mTextureListenerMutex.lock();
-    mTextureListener = textureListener;
+    mTextureListeners.clear();
+    if (textureListener != NULL)
+    {
+      mTextureListeners.push_back(textureListener);
+    }
+    mTextureListenerMutex.unlock();
+    return PX_OK;
+  }
+
+  virtual pxError addTextureListener(pxTextureListener* textureListener)
+  {
+    mTextureListenerMutex.lock();
+    if (std::find(mTextureListeners.begin(), mTextureListeners.end(), textureListener) == mTextureListeners.end())
+    {
+      mTextureListeners.push_back(textureListener);
+    }
+    mTextureListenerMutex.unlock();
+    return PX_OK;
+  }
+
+  virtual pxError removeTextureListener(pxTextureListener* textureListener)
+  {
+    mTextureListenerMutex.lock();
+    std::vector<pxTextureListener*>::iterator it = std::find(mTextureListeners.begin(), mTextureListeners.end(), textureListener);
+    if (it != mTextureListeners.end())
+    {
+      mTextureListeners.erase(it);
+    }
     mTextureListenerMutex.unlock();
     return PX_OK;
   }
@@ -860,37 +1046,25 @@ public:
         glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
                      mOffscreen.width(), mOffscreen.height(), 0, GL_RGBA,
                      GL_UNSIGNED_BYTE, mOffscreen.base());
-        if (mDownscaleSmooth)
-        {
-          glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-          glGenerateMipmap(GL_TEXTURE_2D);
-          mMipmapCreated = true;
-        }
+        mTextureWidth = mOffscreen.width();
+        mTextureHeight = mOffscreen.height();
         context.adjustCurrentTextureMemorySize(mOffscreen.width()*mOffscreen.height()*4);
       }
       else
       {
         glBindTexture(GL_TEXTURE_2D, mTextureName);   TRACK_TEX_CALLS();
-        if (mDownscaleSmooth && !mMipmapCreated)
-        {
-          glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-          glGenerateMipmap(GL_TEXTURE_2D);
-          mMipmapCreated = true;
-        }
       }
+      updateMipmaps();
       mTextureUploaded = true;
+      addReleasable();
       //free up unneeded offscreen memory
       freeOffscreenDataInBackground();
     }
     else
     {
       glBindTexture(GL_TEXTURE_2D, mTextureName);   TRACK_TEX_CALLS();
-      if (mDownscaleSmooth && !mMipmapCreated)
-      {
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glGenerateMipmap(GL_TEXTURE_2D);
-        mMipmapCreated = true;
-      }
+      updateMipmaps();
+      touchReleasable();
     }
 
     glUniform1i(tLoc, 1);
@@ -937,7 +1111,10 @@ public:
                    mOffscreen.width(), mOffscreen.height(), 0, GL_RGBA,
                    GL_UNSIGNED_BYTE, mOffscreen.base());
       mTextureUploaded = true;
+      mTextureWidth = mOffscreen.width();
+      mTextureHeight = mOffscreen.height();
       context.adjustCurrentTextureMemorySize(mOffscreen.width()*mOffscreen.height()*4);
+      addReleasable();
 
       //free up unneeded offscreen memory
       freeOffscreenDataInBackground();
@@ -945,186 +1122,1145 @@ public:
     else
     {
       glBindTexture(GL_TEXTURE_2D, mTextureName);   TRACK_TEX_CALLS();
+      touchReleasable();
+    }
+
+    glUniform1i(mLoc, 2);
+
+    return PX_OK;
+  }
+
+  virtual pxError getOffscreen(pxOffscreen& o)
+  {
+    if (!mInitialized)
+    {
+      return PX_NOTINITIALIZED;
+    }
+
+    if (mCompressedData != NULL)
+    {
+      pxLoadImage(mCompressedData, mCompressedDataSize, o);
+    }
+
+    return PX_OK;
+  }
+
+  virtual int width()  { return mWidth;  }
+  virtual int height() { return mHeight; }
+
+  pxError compressedDataWeakReference(char*& data, size_t& dataSize)
+  {
+    data = mCompressedData;
+    dataSize = mCompressedDataSize;
+    return PX_OK;
+  }
+
+  // url is only set when the data can be read back from it without the
+  // network: a local file, or a download that was stored in the cache
+  virtual pxError setCompressedDataUrl(const char* url)
+  {
+    mCompressedDataUrl = url;
+    if (mCompressedDataUrl.isEmpty())
+    {
+      removeReleasable();
+    }
+    else if (mTextureUploaded)
+    {
+      addReleasable();
+    }
+    return PX_OK;
+  }
+
+  virtual int64_t releaseCompressedData()
+  {
+    removeReleasable();
+    return releaseUnusedCompressedData();
+  }
+
+  virtual int64_t cpuMemoryUsage()
+  {
+    return (int64_t)mCompressedDataSize + mDecodedMemoryBytes;
+  }
+
+  // Releases the compressed data of the least recently drawn textures until
+  // bytesRequested have been freed; render thread only
+  static int64_t releaseLeastRecentlyDrawn(int64_t bytesRequested)
+  {
+    int64_t bytesFreed = 0;
+    gReleasableMutex.lock();
+    pxTextureOffscreen* texture = gReleasableHead;
+    while (texture != NULL && bytesFreed < bytesRequested)
+    {
+      pxTextureOffscreen* next = texture->mReleasableNext;
+      if (texture->mCompressedDataReaders == 0 && !texture->cacheWritePending())
+      {
+        // a texture that was unloaded, or whose data is already gone, leaves
+        // the list too; it is added again the next time it is uploaded
+        texture->unlinkReleasable();
+        bytesFreed += texture->releaseUnusedCompressedData();
+      }
+      texture = next;
+    }
+    gReleasableMutex.unlock();
+    return bytesFreed;
+  }
+
+  // Reads the compressed data back after releaseCompressedData(); called from
+  // the decode worker.  Never revalidates: a texture reload only reaches the
+  // network through downloadCompressedData() once the cached copy is gone.
+  pxError reloadCompressedData(rtData& data)
+  {
+    if (mCompressedDataUrl.isEmpty())
+    {
+      return PX_FAIL;
+    }
+    if (mCompressedDataUrl.beginsWith("http:") || mCompressedDataUrl.beginsWith("https:"))
+    {
+#ifdef ENABLE_HTTP_CACHE
+      rtHttpCacheData cachedData(mCompressedDataUrl.cString());
+      if ((NULL != rtFileCache::instance()) &&
+          (RT_OK == rtFileCache::instance()->httpCacheData(mCompressedDataUrl.cString(), cachedData)) &&
+          (RT_OK == cachedData.storedData(data)))
+      {
+        // data is a view of the mapped cache file
+        return PX_OK;
+      }
+#endif //ENABLE_HTTP_CACHE
+      rtLogWarn("compressed image data for %s is no longer cached", mCompressedDataUrl.cString());
+      return PX_FAIL;
+    }
+    return (rtLoadFile(mCompressedDataUrl.cString(), data) == RT_OK) ? PX_OK : PX_FAIL;
+  }
+
+  // Fetches the released data again when the cache no longer has it, for
+  // instance after the entry was evicted.  imageData is handed back to the
+  // decode worker from onCompressedDataDownloaded().
+  pxError downloadCompressedData(DecodeImageData* imageData)
+  {
+    if (!mCompressedDataUrl.beginsWith("http:") && !mCompressedDataUrl.beginsWith("https:"))
+    {
+      return PX_FAIL;
+    }
+    rtFileDownloadRequest* downloadRequest = new rtFileDownloadRequest(mCompressedDataUrl.cString(), imageData,
+                                                                       onCompressedDataDownloaded);
+    if (!rtFileDownloader::instance()->addToDownloadQueue(downloadRequest))
+    {
+      delete downloadRequest;
+      return PX_FAIL;
+    }
+    return PX_OK;
+  }
+
+  // a reload that produced nothing; the next draw asks for it again
+  void decodeFailed()
+  {
+    mLoadTextureRequested = false;
+  }
+
+  // called on the render thread when a decode or mipmap task that read the
+  // compressed data has finished with it
+  void compressedDataReadComplete()
+  {
+    if (mCompressedDataReaders > 0)
+    {
+      mCompressedDataReaders--;
+    }
+  }
+
+  virtual int64_t mipmapMemoryUsage()
+  {
+    if (mMipmapCreated)
+      return mMipmapMemoryBytes;
+    if (mDownscaleSmooth || mMipmapRequested)
+      return mipmapChainBytes(mWidth, mHeight);
+    return 0;
+  }
+
+  // takes ownership of the levels built by decodeTextureData()
+  // an empty set means the worker could not build them
+  void setMipmapLevels(std::vector<pxOffscreen*>& levels)
+  {
+    freeMipmapLevels();
+    mMipmapLevels.swap(levels);
+    mMipmapLevelsFailed = mMipmapLevels.empty();
+  }
+
+  static int64_t mipmapChainBytes(int w, int h)
+  {
+    int64_t bytes = 0;
+    while (w > 1 || h > 1)
+    {
+      w = (w > 1) ? w/2 : 1;
+      h = (h > 1) ? h/2 : 1;
+      bytes += (int64_t)w * (int64_t)h * 4;
+    }
+    return bytes;
+  }
+
+protected:
+
+  // Mipmaps are used when the app asks for smooth downscaling or when draws
+  // have been observed minifying the texture.  The levels are built by the
+  // decode worker from the image it decodes; the render thread only uploads
+  // them.
+  void updateMipmaps()
+  {
+    if (mMipmapCreated || !(mDownscaleSmooth || mMipmapRequested))
+    {
+      return;
+    }
+
+    if (!mMipmapLevels.empty())
+    {
+      uploadMipmapLevels();
+    }
+    else if (!mTextureDataAvailable || mMipmapLevelsFailed)
+    {
+      // nothing to decode from; build the chain in the driver
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+      glGenerateMipmap(GL_TEXTURE_2D);
+      mMipmapCreated = true;
+      mMipmapMemoryBytes = mipmapChainBytes(mTextureWidth, mTextureHeight);
+      context.adjustCurrentTextureMemorySize(mMipmapMemoryBytes);
+    }
+    else if (!mMipmapLevelsRequested)
+    {
+      mMipmapLevelsRequested = true;
+      rtThreadPool *mainThreadPool = rtThreadPool::globalInstance();
+      DecodeImageData *imageData = new DecodeImageData(this, true, true);
+      rtThreadTask *task = new rtThreadTask(decodeTextureData, imageData, "", RT_THREAD_PRIORITY_LOW);
+      mCompressedDataReaders++;
+      mainThreadPool->executeTask(task);
+    }
+  }
+
+  void uploadMipmapLevels()
+  {
+    int64_t bytes = 0;
+    for (size_t i = 0; i < mMipmapLevels.size(); i++)
+    {
+      bytes += (int64_t)mMipmapLevels[i]->width() * (int64_t)mMipmapLevels[i]->height() * 4;
+    }
+
+    if (!context.isTextureSpaceAvailable(bytes))
+    {
+      context.ejectTextureMemory(context.textureMemoryOverflow(bytes));
+      if (!context.isTextureSpaceAvailable(bytes))
+      {
+        // keep sampling the base level; try again on a later bind
+        rtLogWarn("not enough texture memory remaining for mipmaps");
+        return;
+      }
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    for (size_t i = 0; i < mMipmapLevels.size(); i++)
+    {
+      pxOffscreen* level = mMipmapLevels[i];
+      glTexImage2D(GL_TEXTURE_2D, (GLint)(i+1), GL_RGBA,
+                   level->width(), level->height(), 0, GL_RGBA,
+                   GL_UNSIGNED_BYTE, level->base());
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    mMipmapCreated = true;
+    mMipmapMemoryBytes = bytes;
+    context.adjustCurrentTextureMemorySize(bytes);
+    freeMipmapLevels();
+  }
+
+  void freeMipmapLevels()
+  {
+    for (size_t i = 0; i < mMipmapLevels.size(); i++)
+    {
+      delete mMipmapLevels[i];
+    }
+    mMipmapLevels.clear();
+  }
+
+  void freeOffscreenDataInBackground()
+  {
+    mOffscreenMutex.lock();
+    mFreeOffscreenDataRequested = true;
+    mOffscreenMutex.unlock();
+    rtLogDebug("request to free offscreen data");
+    rtThreadPool *mainThreadPool = rtThreadPool::globalInstance();
+    DecodeImageData *imageData = new DecodeImageData(this);
+    rtThreadTask *task = new rtThreadTask(cleanupOffscreen, imageData, "", RT_THREAD_PRIORITY_LOW);
+    mainThreadPool->executeTask(task);
+  }
+
+  void setCompressedData(const char* data, const size_t dataSize)
+  {
+    freeCompressedData();
+    if (data == NULL)
+    {
+      mCompressedData = NULL;
+      mCompressedDataSize = 0;
+    }
+    else
+    {
+      mCompressedData = new char[dataSize];
+      mCompressedDataSize = dataSize;
+      memcpy(mCompressedData, data, mCompressedDataSize);
+      mTextureDataAvailable = true;
+      context.adjustCurrentCpuMemorySize(PX_CPU_MEMORY_COMPRESSED_IMAGE, (int64_t)mCompressedDataSize);
+    }
+  }
+
+  pxError freeCompressedData()
+  {
+    if (mCompressedData != NULL)
+    {
+      delete [] mCompressedData;
+      mCompressedData = NULL;
+      context.adjustCurrentCpuMemorySize(PX_CPU_MEMORY_COMPRESSED_IMAGE, -(int64_t)mCompressedDataSize);
+    }
+    mCompressedDataSize = 0;
+    mTextureDataAvailable = false;
+    return PX_OK;
+  }
+
+  // the compressed data may only be freed while no worker reads it through
+  // compressedDataWeakReference(), and a download only once its cache write
+  // has landed; the write is queued behind other work and can fail
+  int64_t releaseUnusedCompressedData()
+  {
+    if (mCompressedData == NULL || !mTextureUploaded || mCompressedDataUrl.isEmpty() ||
+        mCompressedDataReaders > 0 || !compressedDataReadable())
+    {
+      return 0;
+    }
+    int64_t bytes = (int64_t)mCompressedDataSize;
+    freeCompressedData();
+    mTextureDataAvailable = true;
+    return bytes;
+  }
+
+  // the data can be released but its cache write has not landed yet; the
+  // texture keeps its place in the list until it has
+  bool cacheWritePending()
+  {
+    return mCompressedData != NULL && mTextureUploaded && !mCompressedDataUrl.isEmpty() &&
+           !compressedDataReadable();
+  }
+
+  bool compressedDataReadable()
+  {
+    if (mCompressedDataUrl.beginsWith("http:") || mCompressedDataUrl.beginsWith("https:"))
+    {
+#ifdef ENABLE_HTTP_CACHE
+      return (NULL != rtFileCache::instance()) && rtFileCache::instance()->contains(mCompressedDataUrl.cString());
+#else
+      return false;
+#endif //ENABLE_HTTP_CACHE
     }
+    return true;
+  }
+
+  void addReleasable()
+  {
+    if (mCompressedData == NULL || mCompressedDataUrl.isEmpty())
+    {
+      return;
+    }
+    gReleasableMutex.lock();
+    if (!mReleasable)
+    {
+      linkReleasable();
+    }
+    gReleasableMutex.unlock();
+    mReleasableTick = gRenderTick;
+  }
+
+  void removeReleasable()
+  {
+    gReleasableMutex.lock();
+    if (mReleasable)
+    {
+      unlinkReleasable();
+    }
+    gReleasableMutex.unlock();
+  }
+
+  // moves the texture to the most recently drawn end, once per frame
+  void touchReleasable()
+  {
+    if (mReleasableTick == gRenderTick)
+    {
+      return;
+    }
+    mReleasableTick = gRenderTick;
+    gReleasableMutex.lock();
+    if (mReleasable && gReleasableTail != this)
+    {
+      unlinkReleasable();
+      linkReleasable();
+    }
+    gReleasableMutex.unlock();
+  }
+
+  // caller holds gReleasableMutex
+  void linkReleasable()
+  {
+    mReleasablePrev = gReleasableTail;
+    mReleasableNext = NULL;
+    if (gReleasableTail != NULL)
+    {
+      gReleasableTail->mReleasableNext = this;
+    }
+    else
+    {
+      gReleasableHead = this;
+    }
+    gReleasableTail = this;
+    mReleasable = true;
+  }
+
+  // caller holds gReleasableMutex
+  void unlinkReleasable()
+  {
+    if (mReleasablePrev != NULL)
+    {
+      mReleasablePrev->mReleasableNext = mReleasableNext;
+    }
+    else
+    {
+      gReleasableHead = mReleasableNext;
+    }
+    if (mReleasableNext != NULL)
+    {
+      mReleasableNext->mReleasablePrev = mReleasablePrev;
+    }
+    else
+    {
+      gReleasableTail = mReleasablePrev;
+    }
+    mReleasablePrev = NULL;
+    mReleasableNext = NULL;
+    mReleasable = false;
+  }
+
+  // caller holds mOffscreenMutex
+  void setDecodedMemoryUsage(int64_t bytes)
+  {
+    context.adjustCurrentCpuMemorySize(PX_CPU_MEMORY_DECODED_IMAGE, bytes - mDecodedMemoryBytes);
+    mDecodedMemoryBytes = bytes;
+  }
+
+  pxOffscreen mOffscreen;
+
+  bool mInitialized;
+  GLuint mTextureName;
+  bool mTextureUploaded;
+  bool mTextureDataAvailable;
+  bool mLoadTextureRequested;
+  int mWidth;
+  int mHeight;
+  rtMutex mOffscreenMutex;
+  bool mFreeOffscreenDataRequested;
+  char* mCompressedData;
+  size_t mCompressedDataSize;
+  bool mMipmapCreated;
+  std::vector<pxTextureListener*> mTextureListeners;
+  rtMutex mTextureListenerMutex;
+  std::vector<pxOffscreen*> mMipmapLevels;
+  bool mMipmapLevelsRequested;
+  bool mMipmapLevelsFailed;
+  int64_t mMipmapMemoryBytes;
+  int mTextureWidth;
+  int mTextureHeight;
+  rtString mCompressedDataUrl;
+  int64_t mDecodedMemoryBytes;
+  int mCompressedDataReaders;
+  bool mReleasable;
+  pxTextureOffscreen* mReleasablePrev;
+  pxTextureOffscreen* mReleasableNext;
+  uint32_t mReleasableTick;
+
+}; // CLASS - pxTextureOffscreen
+
+void onDecodeComplete(void* context, void* data)
+{
+  DecodeImageData* imageData = (DecodeImageData*)context;
+  DecodedTextureData* decoded = (DecodedTextureData*)data;
+  if (imageData != NULL && imageData->textureOffscreen.getPtr() != NULL)
+  {
+    pxTextureOffscreenRef texture = imageData->textureOffscreen;
+    if (!imageData->buildMipmapsOnly)
+    {
+      if (decoded != NULL && decoded->offscreen != NULL)
+      {
+        texture->createTexture(*decoded->offscreen);
+      }
+      else
+      {
+        texture->decodeFailed();
+      }
+    }
+    if (imageData->buildMipmaps)
+    {
+      // no levels makes updateMipmaps() fall back to glGenerateMipmap()
+      std::vector<pxOffscreen*> noLevels;
+      texture->setMipmapLevels(decoded != NULL ? decoded->levels : noLevels);
+    }
+  }
+
+  if (imageData != NULL && imageData->textureOffscreen.getPtr() != NULL)
+  {
+    imageData->textureOffscreen->compressedDataReadComplete();
+  }
+
+  if (decoded != NULL)
+  {
+    delete decoded->offscreen;
+    for (size_t i = 0; i < decoded->levels.size(); i++)
+    {
+      delete decoded->levels[i];
+    }
+    delete decoded;
+    decoded = NULL;
+    data = NULL;
+  }
+
+  if (imageData != NULL)
+  {
+    delete imageData;
+    imageData = NULL;
+  }
+}
+
+void decodeTextureData(void* data)
+{
+  if (data != NULL)
+  {
+    DecodeImageData* imageData = (DecodeImageData*)data;
+    char *compressedImageData = imageData->downloadedData;
+    size_t compressedImageDataSize = imageData->downloadedDataSize;
+    if (compressedImageData == NULL)
+    {
+      imageData->textureOffscreen->compressedDataWeakReference(compressedImageData, compressedImageDataSize);
+    }
+    rtData reloadedData;
+    if (compressedImageData == NULL && imageData->textureOffscreen->reloadCompressedData(reloadedData) == PX_OK)
+    {
+      // released to stay within the CPU memory limit; decode without keeping a copy
+      compressedImageData = (char*)reloadedData.data();
+      compressedImageDataSize = reloadedData.length();
+    }
+    if (compressedImageData != NULL)
+    {
+      DecodedTextureData *decoded = new DecodedTextureData();
+      decoded->offscreen = new pxOffscreen();
+      if (pxLoadImage(compressedImageData, compressedImageDataSize, *decoded->offscreen) != RT_OK)
+      {
+        delete decoded->offscreen;
+        decoded->offscreen = NULL;
+      }
+      else if (imageData->buildMipmaps)
+      {
+        buildMipmapLevels(*decoded->offscreen, decoded->levels);
+      }
+      if (imageData->buildMipmapsOnly)
+      {
+        delete decoded->offscreen;
+        decoded->offscreen = NULL;
+      }
+      if (gUIThreadQueue)
+      {
+        gUIThreadQueue->addTask(onDecodeComplete, data, decoded);
+      }
+    }
+    else if (imageData->textureOffscreen->downloadCompressedData(imageData) == PX_OK)
+    {
+      // decoded once the download completes
+      return;
+    }
+    else
+    {
+      if (gUIThreadQueue)
+      {
+        gUIThreadQueue->addTask(onDecodeComplete, data, NULL);
+      }
+    }
+  }
+}
+
+// Runs on the download thread; the decode goes back to the worker pool
+void onCompressedDataDownloaded(rtFileDownloadRequest* downloadRequest)
+{
+  DecodeImageData* imageData = (DecodeImageData*)downloadRequest->callbackData();
+  if (downloadRequest->downloadStatusCode() == 0 &&
+      downloadRequest->httpStatusCode() == 200 &&
+      downloadRequest->downloadedData() != NULL)
+  {
+    char* data = NULL;
+    size_t dataSize = 0;
+    if (!downloadRequest->takeDownloadedData(data, dataSize))
+    {
+      // served from the cache after all; the cache keeps its data
+      dataSize = downloadRequest->downloadedDataSize();
+      data = (char*)malloc(dataSize);
+      if (data != NULL)
+      {
+        memcpy(data, downloadRequest->downloadedData(), dataSize);
+      }
+    }
+    imageData->downloadedData = data;
+    imageData->downloadedDataSize = (data != NULL) ? dataSize : 0;
+  }
+  else
+  {
+    rtLogWarn("reloading image data for %s failed", downloadRequest->fileUrl().cString());
+  }
+
+  if (imageData->downloadedData != NULL)
+  {
+    rtThreadTask *task = new rtThreadTask(decodeTextureData, imageData, "");
+    rtThreadPool::globalInstance()->executeTask(task);
+  }
+  else if (gUIThreadQueue)
+  {
+    gUIThreadQueue->addTask(onDecodeComplete, imageData, NULL);
+  }
+}
+
+// Builds levels 1..n from a decoded image with a 2x2 box filter, in the same
+// flipped and premultiplied layout createTexture() uploads.  Leaves levels
+// empty when the uploaded base level will not match the decoded size.
+bool buildMipmapLevels(pxOffscreen& decoded, std::vector<pxOffscreen*>& levels)
+{
+  if (decoded.width() <= 0 || decoded.height() <= 0)
+  {
+    return false;
+  }
+#ifdef ENABLE_MAX_TEXTURE_SIZE
+  if (decoded.width() > MAX_TEXTURE_WIDTH || decoded.height() > MAX_TEXTURE_HEIGHT)
+  {
+    // createTexture() scales these down; let the driver build the chain
+    return false;
+  }
+#endif //ENABLE_MAX_TEXTURE_SIZE
+
+  pxOffscreen base;
+  base.init(decoded.width(), decoded.height());
+  base.setUpsideDown(true);
+  decoded.blit(base);
+
+  for (int y = 0; y < base.height(); y++)
+  {
+    pxPixel* d = base.scanline(y);
+    pxPixel* de = d + base.width();
+    while (d < de)
+    {
+      d->r = (d->r * d->a)/255;
+      d->g = (d->g * d->a)/255;
+      d->b = (d->b * d->a)/255;
+      d++;
+    }
+  }
+
+  pxOffscreen* src = &base;
+  while (src->width() > 1 || src->height() > 1)
+  {
+    int w = (src->width() > 1) ? src->width()/2 : 1;
+    int h = (src->height() > 1) ? src->height()/2 : 1;
+    pxOffscreen* level = new pxOffscreen();
+    level->init(w, h);
+    level->setUpsideDown(true);
+    for (int y = 0; y < h; y++)
+    {
+      // rows are addressed in memory (GL) order regardless of upsideDown
+      pxPixel* s0 = (pxPixel*)((char*)src->base() + (y*2) * src->stride());
+      pxPixel* s1 = (pxPixel*)((char*)src->base() + pxMin<int>(y*2+1, src->height()-1) * src->stride());
+      pxPixel* d = (pxPixel*)((char*)level->base() + y * level->stride());
+      for (int x = 0; x < w; x++)
+      {
+        int x0 = x*2;
+        int x1 = pxMin<int>(x*2+1, src->width()-1);
+        d[x].r = (s0[x0].r + s0[x1].r + s1[x0].r + s1[x1].r + 2) >> 2;
+        d[x].g = (s0[x0].g + s0[x1].g + s1[x0].g + s1[x1].g + 2) >> 2;
+        d[x].b = (s0[x0].b + s0[x1].b + s1[x0].b + s1[x1].b + 2) >> 2;
+        d[x].a = (s0[x0].a + s0[x1].a + s1[x0].a + s1[x1].a + 2) >> 2;
+      }
+    }
+    levels.push_back(level);
+    src = level;
+  }
+  return true;
+}
+
+void onOffscreenCleanupComplete(void* context, void*)
+{
+  DecodeImageData* imageData = (DecodeImageData*)context;
+  if (imageData != NULL)
+  {
+    delete imageData;
+    imageData = NULL;
+  }
+}
+
+void cleanupOffscreen(void* data)
+{
+  if (data != NULL)
+  {
+    DecodeImageData* imageData = (DecodeImageData*)data;
+    if (data != NULL && imageData->textureOffscreen.getPtr() != NULL)
+    {
+      imageData->textureOffscreen->freeOffscreenData();
+      if (gUIThreadQueue)
+      {
+        gUIThreadQueue->addTask(onOffscreenCleanupComplete, data, NULL);
+      }
+    }
+    else
+    {
+      if (gUIThreadQueue)
+      {
+        gUIThreadQueue->addTask(onOffscreenCleanupComplete, data, NULL);
+      }
+    }
+  }
+}
+
+//====================================================================================================================================================================================
+
+#ifdef PXSCENE_IMAGE_ATLAS
+// Small images are packed into shared RGBA pages so that screens full of icons
+// can be drawn without a texture bind per image.  Pages are shelf packed and
+// every slot carries a one pixel gutter with the image edges extruded into it
+// so linear filtering does not pick up neighbouring images.
+#define PXSCENE_IMAGE_ATLAS_DIM 1024
+#define PXSCENE_IMAGE_ATLAS_MAX_PAGES 4
+#define PXSCENE_IMAGE_ATLAS_DEFAULT_MAX_IMAGE_SIZE 64
+
+static uint32_t gImageAtlasMaxImageSize = PXSCENE_IMAGE_ATLAS_DEFAULT_MAX_IMAGE_SIZE;
+
+class pxTextureAtlasEntry;
+
+class pxImageAtlasPage : public pxTexture
+{
+public:
+  struct slot
+  {
+    int32_t x;
+    int32_t w;
+    pxTextureAtlasEntry* entry;
+  };
+
+  struct shelf
+  {
+    int32_t top;
+    int32_t height;
+    int32_t fence;
+    std::vector<slot> slots;
+  };
+
+  pxImageAtlasPage() : mTextureName(0), mFence(0), mEntryCount(0)
+  {
+    mTextureType = PX_TEXTURE_OFFSCREEN;
+  }
+
+  ~pxImageAtlasPage() { deleteTexture(); }
+
+  pxError createGLTexture()
+  {
+    glActiveTexture(GL_TEXTURE1);
+    glGenTextures(1, &mTextureName);
+    glBindTexture(GL_TEXTURE_2D, mTextureName);   TRACK_TEX_CALLS();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, PX_TEXTURE_MIN_FILTER);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, PX_TEXTURE_MAG_FILTER);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, PXSCENE_IMAGE_ATLAS_DIM, PXSCENE_IMAGE_ATLAS_DIM,
+                 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    context.adjustCurrentTextureMemorySize(PXSCENE_IMAGE_ATLAS_DIM*PXSCENE_IMAGE_ATLAS_DIM*4);
+    return PX_OK;
+  }
+
+  virtual pxError deleteTexture()
+  {
+    if (mTextureName)
+    {
+      glDeleteTextures(1, &mTextureName);
+      mTextureName = 0;
+      context.adjustCurrentTextureMemorySize(-1 * PXSCENE_IMAGE_ATLAS_DIM * PXSCENE_IMAGE_ATLAS_DIM * 4);
+    }
+    return PX_OK;
+  }
+
+  // Finds room for a w x h slot (gutter included) and returns its location
+  bool allocate(int32_t w, int32_t h, int32_t& shelfIndex, int32_t& slotIndex)
+  {
+    int32_t h2 = (h+7)&~7;
+    for (int32_t i = 0; i < (int32_t)mShelves.size(); i++)
+    {
+      shelf& s = mShelves[i];
+      if (s.height != h2)
+        continue;
+      // reuse a slot released by an evicted entry
+      for (int32_t j = 0; j < (int32_t)s.slots.size(); j++)
+      {
+        if (s.slots[j].entry == NULL && s.slots[j].w >= w)
+        {
+          shelfIndex = i;
+          slotIndex = j;
+          return true;
+        }
+      }
+      if (s.fence + w <= PXSCENE_IMAGE_ATLAS_DIM)
+      {
+        slot n;
+        n.x = s.fence;
+        n.w = w;
+        n.entry = NULL;
+        s.slots.push_back(n);
+        s.fence += w;
+        shelfIndex = i;
+        slotIndex = (int32_t)s.slots.size()-1;
+        return true;
+      }
+    }
+
+    if (mFence + h2 > PXSCENE_IMAGE_ATLAS_DIM)
+    {
+      return false;
+    }
+
+    shelf ns;
+    ns.top = mFence;
+    ns.height = h2;
+    ns.fence = w;
+    slot n;
+    n.x = 0;
+    n.w = w;
+    n.entry = NULL;
+    ns.slots.push_back(n);
+    mShelves.push_back(ns);
+    mFence += h2;
+    shelfIndex = (int32_t)mShelves.size()-1;
+    slotIndex = 0;
+    return true;
+  }
+
+  // Least recently drawn entry whose slot could hold a w x h image
+  pxTextureAtlasEntry* leastRecentlyUsed(int32_t w, int32_t h, uint32_t& oldestTick,
+                                         int32_t& shelfIndex, int32_t& slotIndex);
+
+  void setEntry(int32_t shelfIndex, int32_t slotIndex, pxTextureAtlasEntry* e)
+  {
+    slot& sl = mShelves[shelfIndex].slots[slotIndex];
+    if (sl.entry == NULL && e != NULL)
+      mEntryCount++;
+    else if (sl.entry != NULL && e == NULL)
+      mEntryCount--;
+    sl.entry = e;
+  }
+
+  void slotOrigin(int32_t shelfIndex, int32_t slotIndex, int32_t& x, int32_t& y)
+  {
+    x = mShelves[shelfIndex].slots[slotIndex].x;
+    y = mShelves[shelfIndex].top;
+  }
+
+  pxError upload(int32_t x, int32_t y, pxOffscreen& o)
+  {
+    int32_t w = o.width();
+    int32_t h = o.height();
+    int32_t pw = w+2;
+
+    // copy the image into a padded buffer, extruding the edge pixels into the gutter.
+    // rows are taken in memory order so the slot keeps the GL layout of the offscreen
+    std::vector<uint32_t> padded(pw*(h+2));
+    for (int32_t row = 0; row < h; row++)
+    {
+      uint32_t* src = (uint32_t*)((uint8_t*)o.base() + row * o.stride());
+      uint32_t* dst = &padded[(row+1)*pw];
+      memcpy(dst+1, src, w*4);
+      dst[0] = src[0];
+      dst[w+1] = src[w-1];
+    }
+    memcpy(&padded[0], &padded[pw], pw*4);
+    memcpy(&padded[(h+1)*pw], &padded[h*pw], pw*4);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, mTextureName);   TRACK_TEX_CALLS();
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, pw, h+2, GL_RGBA, GL_UNSIGNED_BYTE, &padded[0]);
+    return PX_OK;
+  }
+
+  virtual pxError bindGLTexture(int tLoc)
+  {
+    if (mTextureName == 0)
+    {
+      return PX_NOTINITIALIZED;
+    }
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, mTextureName);   TRACK_TEX_CALLS();
+    glUniform1i(tLoc, 1);
+    return PX_OK;
+  }
+
+  virtual pxError bindGLTextureAsMask(int /*mLoc*/) { return PX_FAIL; }
+  virtual pxError getOffscreen(pxOffscreen& /*o*/) { return PX_FAIL; }
+  virtual int width()  { return PXSCENE_IMAGE_ATLAS_DIM; }
+  virtual int height() { return PXSCENE_IMAGE_ATLAS_DIM; }
+
+  uint32_t entryCount() { return mEntryCount; }
+
+private:
+  GLuint mTextureName;
+  int32_t mFence;
+  uint32_t mEntryCount;
+  std::vector<shelf> mShelves;
+};
+
+typedef rtRef<pxImageAtlasPage> pxImageAtlasPageRef;
+
+class pxImageAtlas
+{
+public:
+  pxError insert(pxTextureAtlasEntry* e, pxOffscreen& o);
+  void release(pxImageAtlasPageRef page, int32_t shelfIndex, int32_t slotIndex);
+
+private:
+  std::vector<pxImageAtlasPageRef> mPages;
+};
+
+static pxImageAtlas gImageAtlas;
+
+// An image small enough to share an atlas page.  It is still a complete
+// pxTextureOffscreen: draws that cannot sample a sub-rectangle (masks, nine
+// slice, repeat, mipmapped downscale) use a texture of its own, and an entry
+// whose slot was evicted reloads from its compressed data via loadTextureData()
+// like any other ejected texture.
+class pxTextureAtlasEntry : public pxTextureOffscreen
+{
+public:
+  pxTextureAtlasEntry(pxOffscreen& o, const char *compressedData, size_t compressedDataSize)
+    : pxTextureOffscreen(o, compressedData, compressedDataSize), mAtlasPage(),
+      mAtlasShelf(-1), mAtlasSlot(-1), mAtlasX(0), mAtlasY(0)
+  {
+  }
 
-    glUniform1i(mLoc, 2);
+  ~pxTextureAtlasEntry()
+  {
+    unloadTextureData();
+  }
 
+  virtual pxError prepareForRendering()
+  {
+    // uploaded into a page on first draw
     return PX_OK;
   }
 
-  virtual pxError getOffscreen(pxOffscreen& o)
+  virtual pxError atlasRect(pxTextureRef& page, float& u1, float& v1, float& u2, float& v2)
   {
-    if (!mInitialized)
+    if (mMipmapRequested || mDownscaleSmooth)
     {
-      return PX_NOTINITIALIZED;
+      // the page has no mip chain; downscaled draws use a texture of their own
+      releaseAtlasSlot();
+      return PX_FAIL;
     }
 
-    if (mCompressedData != NULL)
+    if (!mAtlasPage)
     {
-      pxLoadImage(mCompressedData, mCompressedDataSize, o);
+      if (!mInitialized)
+      {
+        loadTextureData();
+        return PX_NOTINITIALIZED;
+      }
+      mOffscreenMutex.lock();
+      bool hasOffscreen = (mOffscreen.base() != NULL);
+      pxError e = hasOffscreen ? gImageAtlas.insert(this, mOffscreen) : PX_FAIL;
+      mOffscreenMutex.unlock();
+      if (!hasOffscreen)
+      {
+        // pixels were released after an earlier upload
+        if (!mTextureUploaded)
+        {
+          mInitialized = false;
+        }
+        loadTextureData();
+        return PX_NOTINITIALIZED;
+      }
+      if (e != PX_OK)
+      {
+        return e;
+      }
+      // the slot holds the pixels now; reloads go through loadTextureData()
+      if (!mTextureUploaded)
+      {
+        mInitialized = false;
+      }
+      freeOffscreenDataInBackground();
     }
 
+    float dim = static_cast<float>(PXSCENE_IMAGE_ATLAS_DIM);
+    u1 = (mAtlasX+1)/dim;
+    v1 = (mAtlasY+1)/dim;
+    u2 = (mAtlasX+1+mWidth)/dim;
+    v2 = (mAtlasY+1+mHeight)/dim;
+    page = mAtlasPage.getPtr();
     return PX_OK;
   }
 
-  virtual int width()  { return mWidth;  }
-  virtual int height() { return mHeight; }
-
-  pxError compressedDataWeakReference(char*& data, size_t& dataSize)
+  virtual pxError unloadTextureData()
   {
-    data = mCompressedData;
-    dataSize = mCompressedDataSize;
-    return PX_OK;
+    releaseAtlasSlot();
+    if (!mInitialized && mTextureName)
+    {
+      // own texture outlived the offscreen data when the entry went into a page
+      glDeleteTextures(1, &mTextureName);
+      context.adjustCurrentTextureMemorySize(-1 * mWidth * mHeight * 4);
+      mTextureName = 0;
+      mTextureUploaded = false;
+    }
+    return pxTextureOffscreen::unloadTextureData();
   }
 
-private:
-
-  void freeOffscreenDataInBackground()
+  void setAtlasSlot(pxImageAtlasPageRef page, int32_t shelfIndex, int32_t slotIndex)
   {
-    mOffscreenMutex.lock();
-    mFreeOffscreenDataRequested = true;
-    mOffscreenMutex.unlock();
-    rtLogDebug("request to free offscreen data");
-    rtThreadPool *mainThreadPool = rtThreadPool::globalInstance();
-    DecodeImageData *imageData = new DecodeImageData(this);
-    rtThreadTask *task = new rtThreadTask(cleanupOffscreen, imageData, "");
-    mainThreadPool->executeTask(task);
+    mAtlasPage = page;
+    mAtlasShelf = shelfIndex;
+    mAtlasSlot = slotIndex;
+    page->slotOrigin(shelfIndex, slotIndex, mAtlasX, mAtlasY);
   }
 
-  void setCompressedData(const char* data, const size_t dataSize)
+  // called by the atlas when the slot is handed to another image
+  void atlasSlotEvicted()
   {
-    freeCompressedData();
-    if (data == NULL)
-    {
-      mCompressedData = NULL;
-      mCompressedDataSize = 0;
-    }
-    else
-    {
-      mCompressedData = new char[dataSize];
-      mCompressedDataSize = dataSize;
-      memcpy(mCompressedData, data, mCompressedDataSize);
-      mTextureDataAvailable = true;
-    }
+    mAtlasPage = NULL;
+    mAtlasShelf = -1;
+    mAtlasSlot = -1;
   }
 
-  pxError freeCompressedData()
+private:
+  void releaseAtlasSlot()
   {
-    if (mCompressedData != NULL)
+    if (mAtlasPage)
     {
-      delete [] mCompressedData;
-      mCompressedData = NULL;
+      pxImageAtlasPageRef page = mAtlasPage;
+      int32_t shelfIndex = mAtlasShelf;
+      int32_t slotIndex = mAtlasSlot;
+      atlasSlotEvicted();
+      gImageAtlas.release(page, shelfIndex, slotIndex);
     }
-    mCompressedDataSize = 0;
-    mTextureDataAvailable = false;
-    return PX_OK;
   }
 
-  pxOffscreen mOffscreen;
-
-  bool mInitialized;
-  GLuint mTextureName;
-  bool mTextureUploaded;
-  bool mTextureDataAvailable;
-  bool mLoadTextureRequested;
-  int mWidth;
-  int mHeight;
-  rtMutex mOffscreenMutex;
-  bool mFreeOffscreenDataRequested;
-  char* mCompressedData;
-  size_t mCompressedDataSize;
-  bool mMipmapCreated;
-  pxTextureListener* mTextureListener;
-  rtMutex mTextureListenerMutex;
-
-}; // CLASS - pxTextureOffscreen
+  pxImageAtlasPageRef mAtlasPage;
+  int32_t mAtlasShelf;
+  int32_t mAtlasSlot;
+  int32_t mAtlasX;
+  int32_t mAtlasY;
+};
 
-void onDecodeComplete(void* context, void* data)
+pxTextureAtlasEntry* pxImageAtlasPage::leastRecentlyUsed(int32_t w, int32_t h, uint32_t& oldestTick,
+                                                         int32_t& shelfIndex, int32_t& slotIndex)
 {
-  DecodeImageData* imageData = (DecodeImageData*)context;
-  pxOffscreen* decodedOffscreen = (pxOffscreen*)data;
-  if (imageData != NULL && decodedOffscreen != NULL)
-  {
-    pxTextureOffscreenRef texture = imageData->textureOffscreen;
-    if (texture.getPtr() != NULL)
+  pxTextureAtlasEntry* oldest = NULL;
+  int32_t h2 = (h+7)&~7;
+  for (size_t i = 0; i < mShelves.size(); i++)
+  {
+    shelf& s = mShelves[i];
+    if (s.height != h2)
+      continue;
+    for (size_t j = 0; j < s.slots.size(); j++)
     {
-      texture->createTexture(*decodedOffscreen);
+      pxTextureAtlasEntry* e = s.slots[j].entry;
+      // never evict something drawn this frame
+      if (e != NULL && s.slots[j].w >= w && e->lastRenderTick() != gRenderTick &&
+          (oldest == NULL || e->lastRenderTick() < oldestTick))
+      {
+        oldest = e;
+        oldestTick = e->lastRenderTick();
+        shelfIndex = (int32_t)i;
+        slotIndex = (int32_t)j;
+      }
     }
   }
+  return oldest;
+}
+
+pxError pxImageAtlas::insert(pxTextureAtlasEntry* e, pxOffscreen& o)
+{
+  int32_t w = o.width()+2;
+  int32_t h = o.height()+2;
+  int32_t shelfIndex = -1;
+  int32_t slotIndex = -1;
+  pxImageAtlasPageRef page;
 
-  if (decodedOffscreen != NULL)
+  for (size_t i = 0; i < mPages.size() && !page; i++)
   {
-    delete decodedOffscreen;
-    decodedOffscreen = NULL;
-    data = NULL;
+    if (mPages[i]->allocate(w, h, shelfIndex, slotIndex))
+      page = mPages[i];
   }
 
-  if (imageData != NULL)
+  if (!page && mPages.size() < PXSCENE_IMAGE_ATLAS_MAX_PAGES)
   {
-    delete imageData;
-    imageData = NULL;
+    // a new page has to fit the texture memory budget; otherwise recycle slots below
+    pxImageAtlasPageRef newPage = new pxImageAtlasPage();
+    if (context.isTextureSpaceAvailable(newPage.getPtr(), false) && newPage->allocate(w, h, shelfIndex, slotIndex))
+    {
+      newPage->createGLTexture();
+      mPages.push_back(newPage);
+      page = newPage;
+    }
   }
-}
 
-void decodeTextureData(void* data)
-{
-  if (data != NULL)
+  if (!page)
   {
-    DecodeImageData* imageData = (DecodeImageData*)data;
-    char *compressedImageData = NULL;
-    size_t compressedImageDataSize = 0;
-    imageData->textureOffscreen->compressedDataWeakReference(compressedImageData, compressedImageDataSize);
-    if (compressedImageData != NULL)
+    // out of pages; take the slot of the least recently drawn image that fits
+    pxTextureAtlasEntry* victim = NULL;
+    uint32_t oldestTick = 0;
+    for (size_t i = 0; i < mPages.size(); i++)
     {
-      pxOffscreen *decodedOffscreen = new pxOffscreen();
-      pxLoadImage(compressedImageData, compressedImageDataSize, *decodedOffscreen);
-      if (gUIThreadQueue)
+      uint32_t tick = 0;
+      int32_t si = -1, sj = -1;
+      pxTextureAtlasEntry* candidate = mPages[i]->leastRecentlyUsed(w, h, tick, si, sj);
+      if (candidate != NULL && (victim == NULL || tick < oldestTick))
       {
-        gUIThreadQueue->addTask(onDecodeComplete, data, decodedOffscreen);
+        victim = candidate;
+        oldestTick = tick;
+        page = mPages[i];
+        shelfIndex = si;
+        slotIndex = sj;
       }
     }
-    else
+    if (victim == NULL)
     {
-      if (gUIThreadQueue)
-      {
-        gUIThreadQueue->addTask(onDecodeComplete, data, NULL);
-      }
+      return PX_FAIL;
     }
+    // the victim reloads from its compressed data the next time it is drawn
+    victim->atlasSlotEvicted();
+    page->setEntry(shelfIndex, slotIndex, NULL);
   }
-}
 
-void onOffscreenCleanupComplete(void* context, void*)
-{
-  DecodeImageData* imageData = (DecodeImageData*)context;
-  if (imageData != NULL)
-  {
-    delete imageData;
-    imageData = NULL;
-  }
+  page->setEntry(shelfIndex, slotIndex, e);
+  e->setAtlasSlot(page, shelfIndex, slotIndex);
+  int32_t x, y;
+  page->slotOrigin(shelfIndex, slotIndex, x, y);
+  return page->upload(x, y, o);
 }
 
-void cleanupOffscreen(void* data)
+void pxImageAtlas::release(pxImageAtlasPageRef page, int32_t shelfIndex, int32_t slotIndex)
 {
-  if (data != NULL)
+  page->setEntry(shelfIndex, slotIndex, NULL);
+  if (page->entryCount() == 0)
   {
-    DecodeImageData* imageData = (DecodeImageData*)data;
-    if (data != NULL && imageData->textureOffscreen.getPtr() != NULL)
-    {
-      imageData->textureOffscreen->freeOffscreenData();
-      if (gUIThreadQueue)
-      {
-        gUIThreadQueue->addTask(onOffscreenCleanupComplete, data, NULL);
-      }
-    }
-    else
+    // give the page memory back once nothing lives in it
+    for (std::vector<pxImageAtlasPageRef>::iterator it = mPages.begin(); it != mPages.end(); ++it)
     {
-      if (gUIThreadQueue)
+      if ((*it) == page)
       {
-        gUIThreadQueue->addTask(onOffscreenCleanupComplete, data, NULL);
+        mPages.erase(it);
+        break;
       }
     }
+    page->deleteTexture();
   }
 }
+#endif //PXSCENE_IMAGE_ATLAS
 
 //====================================================================================================================================================================================
 
@@ -1492,6 +2628,9 @@ solidShaderProgram *gSolidShader = NULL;
 
 class aTextureShaderProgram: public shaderProgram
 {
+public:
+  aTextureShaderProgram(pxCurrentGLProgram programId = PROGRAM_A_TEXTURE_SHADER): mProgramId(programId) {}
+
 protected:
   virtual void prelink()
   {
@@ -1517,12 +2656,13 @@ public:
             const void* pos,
             const void* uv,
             pxTextureRef texture,
-            const float* color)
+            const float* color,
+            GLsizei stride = 0)
   {
-    if (currentGLProgram != PROGRAM_A_TEXTURE_SHADER)
+    if (currentGLProgram != mProgramId)
     {
       use();
-      currentGLProgram = PROGRAM_A_TEXTURE_SHADER;
+      currentGLProgram = mProgramId;
     }
     glUniform2f(mResolutionLoc, static_cast<GLfloat>(resW), static_cast<GLfloat>(resH));
     glUniformMatrix4fv(mMatrixLoc, 1, GL_FALSE, matrix);
@@ -1534,8 +2674,8 @@ public:
       return PX_FAIL;
     }
 
-    glVertexAttribPointer(mPosLoc, 2, GL_FLOAT, GL_FALSE, 0, pos);
-    glVertexAttribPointer(mUVLoc, 2, GL_FLOAT, GL_FALSE, 0, uv);
+    glVertexAttribPointer(mPosLoc, 2, GL_FLOAT, GL_FALSE, stride, pos);
+    glVertexAttribPointer(mUVLoc, 2, GL_FLOAT, GL_FALSE, stride, uv);
     glEnableVertexAttribArray(mPosLoc);
     glEnableVertexAttribArray(mUVLoc);
     glDrawArrays(mode, 0, count);  TRACK_DRAW_CALLS();
@@ -1557,9 +2697,14 @@ private:
 
   GLint mTextureLoc;
 
+  pxCurrentGLProgram mProgramId;
+
 }; //CLASS - aTextureShaderProgram
 
 aTextureShaderProgram *gATextureShader = NULL;
+#ifdef PXSCENE_FONT_ATLAS
+aTextureShaderProgram *gSdfTextureShader = NULL;
+#endif
 
 //====================================================================================================================================================================================
 
@@ -1879,6 +3024,27 @@ static void drawImageTexture(float x, float y, float w, float h, pxTextureRef te
       h = ih;
   }
 
+  if (gAutoMipmapEnabled && !texture->mipmapRequested() && !texture->downscaleSmooth() &&
+      texture->getType() == PX_TEXTURE_OFFSCREEN &&
+      xStretch == pxConstantsStretch::STRETCH && yStretch == pxConstantsStretch::STRETCH &&
+      iw > 1 && ih > 1)
+  {
+    // on-screen size from the column scale factors of the current matrix
+    const float* m = gMatrix.data();
+    float sx = sqrtf(m[0]*m[0] + m[1]*m[1]);
+    float sy = sqrtf(m[4]*m[4] + m[5]*m[5]);
+    if ((w*sx)/iw < PXSCENE_AUTO_MIPMAP_SCALE_THRESHOLD &&
+        (h*sy)/ih < PXSCENE_AUTO_MIPMAP_SCALE_THRESHOLD)
+    {
+#if defined(PX_PLATFORM_WAYLAND_EGL) || defined(PX_PLATFORM_GENERIC_EGL)
+      // GLES2 only allows mipmaps on power of two textures
+      int pw = texture->width(), ph = texture->height();
+      if ((pw & (pw-1)) == 0 && (ph & (ph-1)) == 0)
+#endif
+      texture->setMipmapRequested(true);
+    }
+  }
+
    const float verts[4][2] =
    {
      { x,     y },
@@ -1923,12 +3089,31 @@ static void drawImageTexture(float x, float y, float w, float h, pxTextureRef te
   float firstTextureY  = 1.0;
   float secondTextureY = static_cast<float>(1.0-th);
 
+  // atlased images sample a sub-rectangle of a shared page
+  float u1 = 0, v1 = 0, u2 = 1, v2 = 1;
+  if (mask.getPtr() == NULL && xStretch == pxConstantsStretch::STRETCH &&
+      yStretch == pxConstantsStretch::STRETCH)
+  {
+    pxTextureRef page;
+    if (texture->atlasRect(page, u1, v1, u2, v2) == PX_OK && page.getPtr() != NULL)
+    {
+      texture = page;
+    }
+    else
+    {
+      u1 = v1 = 0;
+      u2 = v2 = 1;
+    }
+  }
+  float du = u2-u1;
+  float dv = v2-v1;
+
   const float uv[4][2] =
   {
-    { 0,  firstTextureY  },
-    { tw, firstTextureY  },
-    { 0,  secondTextureY },
-    { tw, secondTextureY }
+    { u1,       v1+firstTextureY*dv  },
+    { u1+tw*du, v1+firstTextureY*dv  },
+    { u1,       v1+secondTextureY*dv },
+    { u1+tw*du, v1+secondTextureY*dv }
   };
 
 
@@ -2199,6 +3384,9 @@ pxContext::~pxContext()
 {
   SAFE_DELETE(gSolidShader);
   SAFE_DELETE(gATextureShader);
+#ifdef PXSCENE_FONT_ATLAS
+  SAFE_DELETE(gSdfTextureShader);
+#endif
   SAFE_DELETE(gTextureShader);
   SAFE_DELETE(gTextureBorderShader);
   SAFE_DELETE(gTextureMaskedShader);
@@ -2217,6 +3405,9 @@ void pxContext::init()
 
   SAFE_DELETE(gSolidShader);
   SAFE_DELETE(gATextureShader);
+#ifdef PXSCENE_FONT_ATLAS
+  SAFE_DELETE(gSdfTextureShader);
+#endif
   SAFE_DELETE(gTextureShader);
   SAFE_DELETE(gTextureBorderShader);
   SAFE_DELETE(gTextureMaskedShader);
@@ -2227,6 +3418,11 @@ void pxContext::init()
   gATextureShader = new aTextureShaderProgram();
   gATextureShader->init(vShaderText,fATextureShaderText);
 
+#ifdef PXSCENE_FONT_ATLAS
+  gSdfTextureShader = new aTextureShaderProgram(PROGRAM_SDF_TEXTURE_SHADER);
+  gSdfTextureShader->init(vShaderText,fSdfTextureShaderText);
+#endif
+
   gTextureShader = new textureShaderProgram();
   gTextureShader->init(vShaderText,fTextureShaderText);
 
@@ -2257,6 +3453,20 @@ void pxContext::init()
   {
     setTextureMemoryLimit((int64_t)val.toInt32() * (int64_t)1024 * (int64_t)1024);
   }
+  if (RT_OK == rtSettings::instance()->value("cpuMemoryLimitInMb", val))
+  {
+    setCpuMemoryLimit((int64_t)val.toInt32() * (int64_t)1024 * (int64_t)1024);
+  }
+  if (RT_OK == rtSettings::instance()->value("enableAutoMipmap", val))
+  {
+    gAutoMipmapEnabled = val.toBool();
+  }
+#ifdef PXSCENE_IMAGE_ATLAS
+  if (RT_OK == rtSettings::instance()->value("imageAtlasMaxImageSize", val))
+  {
+    gImageAtlasMaxImageSize = val.toUInt32();
+  }
+#endif //PXSCENE_IMAGE_ATLAS
   if (mEnableTextureMemoryMonitoring)
   {
     rtLogInfo("texture memory limit set to %" PRId64 " bytes, threshold padding %" PRId64 " bytes",
@@ -2273,6 +3483,22 @@ void pxContext::init()
 
 void pxContext::term()  // clean up statics 
 {
+#ifdef PX_SNAPSHOT_PBO_SUPPORT
+  for (int i = 0; i < PX_SNAPSHOT_PBO_COUNT; i++)
+  {
+    if (gSnapshotPBOs[i].pbo != 0 && !gSnapshotPBOs[i].inUse)
+    {
+      glDeleteBuffers(1, &gSnapshotPBOs[i].pbo);
+      gSnapshotPBOs[i].pbo = 0;
+      gSnapshotPBOs[i].width = gSnapshotPBOs[i].height = 0;
+    }
+  }
+#endif //PX_SNAPSHOT_PBO_SUPPORT
+}
+
+void pxContext::beginFrame()
+{
+  gRenderTick++;
 }
 
 void pxContext::setSize(int w, int h)
@@ -2656,7 +3882,41 @@ void pxContext::drawTexturedQuads(int numQuads, const void *verts, const void* u
 
   float colorPM[4];
   premultiply(colorPM,color);
-  gATextureShader->draw(gResW,gResH,gMatrix.data(),gAlpha,GL_TRIANGLES,6*numQuads,verts,uvs,t,colorPM);
+  aTextureShaderProgram* shader = t->distanceField() ? gSdfTextureShader : gATextureShader;
+  shader->draw(gResW,gResH,gMatrix.data(),gAlpha,GL_TRIANGLES,6*numQuads,verts,uvs,t,colorPM);
+}
+
+void pxContext::drawTexturedQuads(int numQuads, const void *vertices,
+                          pxTextureRef t, float* color, float x, float y)
+{
+#ifdef DEBUG_SKIP_IMAGE
+#warning "DEBUG_SKIP_IMAGE enabled ... Skipping "
+  return;
+#endif
+
+  // TRANSPARENT
+  if(gAlpha == 0.0)
+  {
+    return;
+  }
+
+  // TEXTURELESS
+  if (t.getPtr() == NULL)
+  {
+    return;
+  }
+
+  t->setLastRenderTick(gRenderTick);
+
+  pxMatrix4f m(gMatrix);
+  if (x != 0 || y != 0)
+    m.translate(x, y);
+
+  float colorPM[4];
+  premultiply(colorPM,color);
+  const float* v = (const float*)vertices;
+  aTextureShaderProgram* shader = t->distanceField() ? gSdfTextureShader : gATextureShader;
+  shader->draw(gResW,gResH,m.data(),gAlpha,GL_TRIANGLES,6*numQuads,v,v+2,t,colorPM,4*sizeof(float));
 }
 #endif
 
@@ -2743,6 +4003,15 @@ pxTextureRef pxContext::createTexture(pxOffscreen& o)
 
 pxTextureRef pxContext::createTexture(pxOffscreen& o, const char *compressedData, size_t compressedDataSize)
 {
+#ifdef PXSCENE_IMAGE_ATLAS
+  if (compressedData != NULL && gImageAtlasMaxImageSize > 0 &&
+      o.width() > 0 && o.height() > 0 &&
+      (uint32_t)o.width() <= gImageAtlasMaxImageSize && (uint32_t)o.height() <= gImageAtlasMaxImageSize)
+  {
+    pxTextureAtlasEntry* atlasTexture = new pxTextureAtlasEntry(o, compressedData, compressedDataSize);
+    return atlasTexture;
+  }
+#endif //PXSCENE_IMAGE_ATLAS
   pxTextureOffscreen* offscreenTexture = new pxTextureOffscreen(o, compressedData, compressedDataSize);
   return offscreenTexture;
 }
@@ -2780,6 +4049,82 @@ void pxContext::snapshot(pxOffscreen& o)
   o.setUpsideDown(true);
 }
 
+pxError pxContext::beginSnapshot(uint32_t& readbackId)
+{
+  readbackId = ++gSnapshotReadbackId;
+
+  pxSnapshotReadback readback;
+  readback.width = gResW;
+  readback.height = gResH;
+  readback.pboIndex = -1;
+  readback.offscreen = NULL;
+
+#ifdef PX_SNAPSHOT_PBO_SUPPORT
+  if (snapshotPBOSupported())
+  {
+    readback.pboIndex = acquireSnapshotPBO(gResW, gResH);
+    if (readback.pboIndex >= 0)
+    {
+      // returns immediately; the copy completes while later frames are drawn
+      glReadPixels(0,0,gResW,gResH,GL_RGBA,GL_UNSIGNED_BYTE,0);
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+  }
+#endif //PX_SNAPSHOT_PBO_SUPPORT
+
+  if (readback.pboIndex < 0)
+  {
+    // no pixel buffer available... read synchronously
+    readback.offscreen = new pxOffscreen();
+    snapshot(*readback.offscreen);
+  }
+
+  gSnapshotReadbacks[readbackId] = readback;
+  return PX_OK;
+}
+
+pxError pxContext::finishSnapshot(uint32_t readbackId, pxOffscreen*& o)
+{
+  o = NULL;
+  std::map<uint32_t, pxSnapshotReadback>::iterator it = gSnapshotReadbacks.find(readbackId);
+  if (it == gSnapshotReadbacks.end())
+  {
+    return PX_FAIL;
+  }
+
+  pxSnapshotReadback readback = it->second;
+  gSnapshotReadbacks.erase(it);
+
+#ifdef PX_SNAPSHOT_PBO_SUPPORT
+  if (readback.pboIndex >= 0)
+  {
+    pxSnapshotPBO& buffer = gSnapshotPBOs[readback.pboIndex];
+    pxError e = PX_FAIL;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.pbo);
+    void* pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    if (pixels != NULL)
+    {
+      o = new pxOffscreen();
+      o->init(readback.width, readback.height);
+      memcpy(o->base(), pixels, readback.width*readback.height*4);
+      o->setUpsideDown(true);
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+      e = PX_OK;
+    }
+    else
+    {
+      rtLogError("unable to map snapshot pixel buffer");
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    buffer.inUse = false;
+    return e;
+  }
+#endif //PX_SNAPSHOT_PBO_SUPPORT
+
+  o = readback.offscreen;
+  return (o != NULL) ? PX_OK : PX_FAIL;
+}
+
 void pxContext::mapToScreenCoordinates(float inX, float inY, int &outX, int &outY)
 {
   pxVector4f positionVector(inX, inY, 0, 1);
@@ -2875,6 +4220,15 @@ bool pxContext::isTextureSpaceAvailable(pxTextureRef texture, bool allowGarbageC
     return true;
 
   int64_t textureSize = ((int64_t)(texture->width())*(int64_t)(texture->height())*(int64_t)bytesPerPixel);
+  textureSize += texture->mipmapMemoryUsage();
+  return isTextureSpaceAvailable(textureSize, allowGarbageCollect);
+}
+
+bool pxContext::isTextureSpaceAvailable(int64_t textureSize, bool allowGarbageCollect)
+{
+  if (!mEnableTextureMemoryMonitoring)
+    return true;
+
   lockContext();
   int64_t currentTextureMemorySize = mCurrentTextureMemorySizeInBytes;
   int64_t maxTextureMemoryInBytes = mTextureMemoryLimitInBytes;
@@ -2912,6 +4266,12 @@ int64_t pxContext::currentTextureMemoryUsageInBytes()
 int64_t pxContext::textureMemoryOverflow(pxTextureRef texture)
 {
   int64_t textureSize = (((int64_t)texture->width())*((int64_t)texture->height())*4);
+  textureSize += texture->mipmapMemoryUsage();
+  return textureMemoryOverflow(textureSize);
+}
+
+int64_t pxContext::textureMemoryOverflow(int64_t textureSize)
+{
   int64_t currentTextureMemorySize = mCurrentTextureMemorySizeInBytes;
   int64_t availableBytes = mTextureMemoryLimitInBytes - currentTextureMemorySize;
   if (textureSize > availableBytes)
@@ -2921,6 +4281,16 @@ int64_t pxContext::textureMemoryOverflow(pxTextureRef texture)
   return 0;
 }
 
+int64_t pxContext::ejectCpuMemory(int64_t bytesRequested)
+{
+  int64_t bytesFreed = pxTextureOffscreen::releaseLeastRecentlyDrawn(bytesRequested);
+  if (bytesFreed > 0)
+  {
+    rtLogInfo("released %" PRId64 " bytes of compressed image data", bytesFreed);
+  }
+  return bytesFreed;
+}
+
 int64_t pxContext::ejectTextureMemory(int64_t bytesRequested, bool forceEject)
 {
 #ifdef ENABLE_LRU_TEXTURE_EJECTION
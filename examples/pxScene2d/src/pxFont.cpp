@@ -23,39 +23,22 @@
 #include "pxFont.h"
 #include "pxTimer.h"
 #include "pxText.h"
+#include "rtSettings.h"
+#include "rtThreadPool.h"
+#include "rtThreadTask.h"
+#include "pxUtil.h"
 
 #include <math.h>
 #include <map>
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
-struct GlyphKey 
-{
-  uint32_t mFontId;
-  uint32_t mPixelSize;
-  uint32_t mCodePoint;
-
-  // Provide a "<" operator that orders keys.
-  // The way it orders them doesn't matter, all that matters is that
-  // it orders them consistently.
-  bool operator<(GlyphKey const& other) const {
-    if (mFontId < other.mFontId) return true; else
-      if (mFontId == other.mFontId) {
-        if (mPixelSize < other.mPixelSize) return true; else
-          if (mPixelSize == other.mPixelSize) {
-            if (mCodePoint < other.mCodePoint) return true;
-          }
-      }
-    return false;
-  }
-};
-
-typedef map<GlyphKey,GlyphCacheEntry*> GlyphCache;
-typedef map<GlyphKey,GlyphTextureEntry> GlyphTextureCache;
-
-GlyphCache gGlyphCache;
-GlyphTextureCache gGlyphTextureCache;
-
 #include "pxContext.h"
 
 extern pxContext context;
@@ -70,6 +53,23 @@ extern "C" {
 FT_Library ft;
 uint32_t gFontId = 1;
 
+// rasterises glyphs for fonts that just became ready
+static rtThreadPool fontWarmupThreadPool(1);
+
+// state handed to the warm-up worker; the font is referenced until the
+// completion task runs on the UI thread and merges glyphs into its cache
+struct pxFontWarmup
+{
+  pxFontWarmup(): font(NULL), face(), distanceField(false), pixelSizes(), codePoints(),
+                  glyphs() {}
+  pxFont* font;
+  pxFontFaceRef face;
+  bool distanceField;
+  vector<uint32_t> pixelSizes;
+  vector<uint32_t> codePoints;
+  vector<pxWarmupGlyph> glyphs;
+};
+
 // TODO move out to rt* utility
 uint32_t npot(uint32_t i)
 {
@@ -81,10 +81,281 @@ uint32_t npot(uint32_t i)
 
 #ifdef PXSCENE_FONT_ATLAS
 pxFontAtlas gFontAtlas;
+extern uint32_t gRenderTick;
+#endif
+
+pxGlyphFace::pxGlyphFace(): mSlots(), mSize(0), mProbedSize(0)
+{
+}
+
+pxGlyphSlot* pxGlyphFace::find(uint32_t codePoint)
+{
+  if (codePoint < directSize)
+    return (mDirect[codePoint].codePoint == codePoint) ? &mDirect[codePoint] : NULL;
+
+  if (mSlots.empty())
+    return NULL;
+
+  uint32_t mask = (uint32_t)mSlots.size() - 1;
+  for (uint32_t i = hashIndex(codePoint);; i = (i + 1) & mask)
+  {
+    if (mSlots[i].codePoint == codePoint)
+      return &mSlots[i];
+    if (mSlots[i].codePoint == PX_GLYPH_SLOT_EMPTY)
+      return NULL;
+  }
+}
+
+pxGlyphSlot* pxGlyphFace::insert(uint32_t codePoint)
+{
+  if (codePoint == PX_GLYPH_SLOT_EMPTY)
+    return NULL;
+
+  if (codePoint < directSize)
+  {
+    pxGlyphSlot& slot = mDirect[codePoint];
+    if (slot.codePoint != codePoint)
+    {
+      slot.codePoint = codePoint;
+      mSize++;
+    }
+    return &slot;
+  }
+
+  pxGlyphSlot* slot = find(codePoint);
+  if (slot)
+    return slot;
+
+  // keep the load factor of the probed table under 70%
+  if (mSlots.empty() || (mProbedSize + 1) * 10 > mSlots.size() * 7)
+    grow();
+
+  uint32_t mask = (uint32_t)mSlots.size() - 1;
+  uint32_t i = hashIndex(codePoint);
+  while (mSlots[i].codePoint != PX_GLYPH_SLOT_EMPTY)
+    i = (i + 1) & mask;
+
+  mSlots[i].codePoint = codePoint;
+  mSize++;
+  mProbedSize++;
+  return &mSlots[i];
+}
+
+void pxGlyphFace::grow()
+{
+  vector<pxGlyphSlot> old;
+  old.swap(mSlots);
+  mSlots.resize(old.empty() ? initialSlots : old.size() * 2);
+
+  uint32_t mask = (uint32_t)mSlots.size() - 1;
+  for (vector<pxGlyphSlot>::iterator it = old.begin(); it != old.end(); ++it)
+  {
+    if (it->codePoint == PX_GLYPH_SLOT_EMPTY)
+      continue;
+    uint32_t i = hashIndex(it->codePoint);
+    while (mSlots[i].codePoint != PX_GLYPH_SLOT_EMPTY)
+      i = (i + 1) & mask;
+    mSlots[i] = *it;
+  }
+}
+
+void pxGlyphFace::clear()
+{
+  for (uint32_t i = 0; i < directSize; i++)
+    mDirect[i] = pxGlyphSlot();
+  mSlots.clear();
+  mSize = 0;
+  mProbedSize = 0;
+}
+
+std::map<rtString, pxFontFace*> pxFontFace::mFaces;
+rtMutex pxFontFace::mFacesMutex;
+
+pxFontFace::pxFontFace(char* data, size_t size, bool mapped, const rtString& key):
+  mRef(0), mFace(NULL), mData(data), mSize(size), mMapped(mapped), mPixelSize(0), mKey(key)
+{
+  if (!mMapped)
+    context.adjustCurrentCpuMemorySize(PX_CPU_MEMORY_FONT, (int64_t)mSize);
+}
+
+pxFontFace::~pxFontFace()
+{
+  if (mFace)
+    FT_Done_Face(mFace);
+  mFace = NULL;
+  if (!mMapped)
+    context.adjustCurrentCpuMemorySize(PX_CPU_MEMORY_FONT, -(int64_t)mSize);
+  freeData(mData, mSize, mMapped);
+}
+
+unsigned long pxFontFace::Release()
+{
+  // lookups take the same lock, so a face cannot be found while dying
+  mFacesMutex.lock();
+  unsigned long l = rtAtomicDec(&mRef);
+  if (l == 0)
+  {
+    std::map<rtString, pxFontFace*>::iterator it = mFaces.find(mKey);
+    if (it != mFaces.end() && it->second == this)
+      mFaces.erase(it);
+  }
+  mFacesMutex.unlock();
+  if (l == 0)
+    delete this;
+  return l;
+}
+
+pxFontFaceRef pxFontFace::fromFile(const char* path)
+{
+  char* data = NULL;
+  size_t size = 0;
+  bool mapped = false;
+  rtString key;
+#ifndef WIN32
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+  {
+    // mapped files are keyed by identity rather than hashed, so opening a
+    // large font again costs a stat instead of a pass over every byte
+    char identity[128];
+    snprintf(identity, sizeof(identity), "file:%llu:%llu:%llu:%lld",
+             (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+             (unsigned long long)st.st_size, (long long)st.st_mtime);
+    key = identity;
+    pxFontFaceRef face = find(key);
+    if (face)
+    {
+      close(fd);
+      return face;
+    }
+
+    void* mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping != MAP_FAILED)
+    {
+      data = (char*)mapping;
+      size = (size_t)st.st_size;
+      mapped = true;
+    }
+  }
+  close(fd);
+#else
+  rtData d;
+  if (rtLoadFile(path, d) == RT_OK && d.length() > 0)
+  {
+    size = d.length();
+    data = (char*)malloc(size);
+    if (data)
+      memcpy(data, d.data(), size);
+  }
+#endif
+  if (!data)
+    return NULL;
+  if (!mapped)
+    return fromHeapData(data, size);
+  return open(data, size, mapped, key);
+}
+
+pxFontFaceRef pxFontFace::fromData(const FT_Byte* data, size_t size)
+{
+  if (!data || !size)
+    return NULL;
+
+  rtString key = sha256sum((const uint8_t*)data, size);
+  pxFontFaceRef face = find(key);
+  if (face)
+    return face;
+
+  char* copy = (char*)malloc(size);
+  if (!copy)
+    return NULL;
+  memcpy(copy, data, size);
+  return open(copy, size, false, key);
+}
+
+pxFontFaceRef pxFontFace::fromHeapData(char* data, size_t size)
+{
+  if (!data || !size)
+  {
+    free(data);
+    return NULL;
+  }
+
+  rtString key = sha256sum((const uint8_t*)data, size);
+  pxFontFaceRef face = find(key);
+  if (face)
+  {
+    free(data);
+    return face;
+  }
+  return open(data, size, false, key);
+}
+
+void pxFontFace::setPixelSize(uint32_t s)
+{
+  if (mPixelSize != s)
+  {
+    FT_Set_Pixel_Sizes(mFace, 0, s);
+    mPixelSize = s;
+  }
+}
+
+uint32_t pxFontFace::faceCount()
+{
+  rtMutexLockGuard lock(mFacesMutex);
+  return (uint32_t)mFaces.size();
+}
+
+pxFontFaceRef pxFontFace::find(const rtString& key)
+{
+  rtMutexLockGuard lock(mFacesMutex);
+  std::map<rtString, pxFontFace*>::iterator it = mFaces.find(key);
+  if (it == mFaces.end())
+    return NULL;
+  rtLogDebug("sharing font face %s", key.cString());
+  return it->second;
+}
+
+pxFontFaceRef pxFontFace::open(char* data, size_t size, bool mapped, const rtString& key)
+{
+  pxFontFace* face = new pxFontFace(data, size, mapped, key);
+  if (FT_New_Memory_Face(ft, (const FT_Byte*)data, (FT_Long)size, 0, &face->mFace))
+  {
+    face->mFace = NULL;
+    delete face;
+    return NULL;
+  }
+
+  pxFontFaceRef ref = face;
+  mFacesMutex.lock();
+  mFaces[key] = face;
+  mFacesMutex.unlock();
+  return ref;
+}
+
+void pxFontFace::freeData(char* data, size_t size, bool mapped)
+{
+  if (!data)
+    return;
+#ifndef WIN32
+  if (mapped)
+  {
+    munmap(data, size);
+    return;
+  }
+#else
+  (void)size;
+  (void)mapped;
 #endif
+  free(data);
+}
 
-pxFont::pxFont(rtString fontUrl, uint32_t id, rtString proxyUrl):pxResource(),mFace(NULL),mPixelSize(0), mFontData(0), mFontDataSize(0),
-             mFontMutex(), mFontDataMutex(), mFontDownloadedData(NULL), mFontDownloadedDataSize(0), mFontDataUrl()
+pxFont::pxFont(rtString fontUrl, uint32_t id, rtString proxyUrl):pxResource(),mFontFace(),mFace(NULL),mPixelSize(0),
+             mFontMutex(), mFontDataMutex(), mFontDownloadedData(NULL), mFontDownloadedDataSize(0), mFontDataUrl(),
+             mGlyphFaces(), mCurrentGlyphFace(NULL), mCurrentGlyphFaceSize(0), mSdfGlyphFace(NULL),
+             mWarmupStarted(false), mWarmup(NULL), mWarmupSizes(), mWarmupCodePoints(), mCodePoints()
 {  
   mFontId = id; 
   mUrl = fontUrl;
@@ -106,30 +377,46 @@ pxFont::~pxFont()
   //}  
    
   pxFontManager::removeFont( mFontId);
+  clearGlyphCache();
  
-  if( mInitialized) 
-  {
-    FT_Done_Face(mFace);
-  }
+  // the face and its bytes go away with the last font sharing them
+  mFontFace = NULL;
   mFace = 0;
-  
-  if(mFontData) {
-    free(mFontData);
-    mFontData = 0;
-    mFontDataSize = 0;
-  }
 
   clearDownloadedData();
 }
 
+uint64_t pxFont::cpuMemoryUsage()
+{
+  mFontDataMutex.lock();
+  uint64_t cpuMemory = mFontDownloadedDataSize;
+  if (mFontFace)
+    cpuMemory += mFontFace->heapMemoryUsage();
+  mFontDataMutex.unlock();
+  return cpuMemory;
+}
+
 void pxFont::setFontData(const FT_Byte*  fontData, FT_Long size, const char* n)
+{
+  char* data = NULL;
+  if (fontData != NULL)
+  {
+    // malloc'ed so the shared face can take the buffer over
+    data = (char*)malloc(size);
+    memcpy(data, fontData, size);
+  }
+  adoptFontData(data, size, n);
+}
+
+void pxFont::adoptFontData(char* fontData, FT_Long size, const char* n)
 {
   mFontDataMutex.lock();
   mFontDataUrl = n;
   if (mFontDownloadedData != NULL)
   {
-    delete [] mFontDownloadedData;
+    free(mFontDownloadedData);
     mFontDownloadedData = NULL;
+    context.adjustCurrentCpuMemorySize(PX_CPU_MEMORY_FONT, -(int64_t)mFontDownloadedDataSize);
     mFontDownloadedDataSize = 0;
   }
   if (fontData == NULL)
@@ -139,9 +426,9 @@ void pxFont::setFontData(const FT_Byte*  fontData, FT_Long size, const char* n)
   }
   else
   {
-    mFontDownloadedData = new char[size];
+    mFontDownloadedData = fontData;
     mFontDownloadedDataSize = size;
-    memcpy(mFontDownloadedData, fontData, mFontDownloadedDataSize);
+    context.adjustCurrentCpuMemorySize(PX_CPU_MEMORY_FONT, (int64_t)mFontDownloadedDataSize);
   }
   mFontDataMutex.unlock();
 }
@@ -151,8 +438,9 @@ void pxFont::clearDownloadedData()
   mFontDataMutex.lock();
   if (mFontDownloadedData != NULL)
   {
-    delete [] mFontDownloadedData;
+    free(mFontDownloadedData);
     mFontDownloadedData = NULL;
+    context.adjustCurrentCpuMemorySize(PX_CPU_MEMORY_FONT, -(int64_t)mFontDownloadedDataSize);
   }
   mFontDownloadedDataSize = 0;
   mFontDataMutex.unlock();
@@ -165,23 +453,36 @@ void pxFont::setupResource()
     mFontDataMutex.lock();
     if (mFontDownloadedData != NULL)
     {
-      init( (FT_Byte*)mFontDownloadedData,
-            (FT_Long)mFontDownloadedDataSize,
-            mFontDataUrl.cString());
-      delete [] mFontDownloadedData;
+      // the downloaded buffer is handed to the face rather than copied
+      context.adjustCurrentCpuMemorySize(PX_CPU_MEMORY_FONT, -(int64_t)mFontDownloadedDataSize);
+      mFontMutex.lock();
+      mUrl = mFontDataUrl;
+      mFontFace = pxFontFace::fromHeapData(mFontDownloadedData, mFontDownloadedDataSize);
+      initFace();
+      mFontMutex.unlock();
       mFontDownloadedData = NULL;
       mFontDownloadedDataSize = 0;
     }
     mFontDataMutex.unlock();
   }
+  startWarmup();
 }
 
 uint32_t pxFont::loadResourceData(rtFileDownloadRequest* fileDownloadRequest)
 {
-      // Load the font data
-    setFontData( (FT_Byte*)fileDownloadRequest->downloadedData(),
-            (FT_Long)fileDownloadRequest->downloadedDataSize(),
-            fileDownloadRequest->fileUrl().cString());
+      // Load the font data, taking the download buffer over when possible
+    char* data = NULL;
+    size_t dataSize = 0;
+    if (fileDownloadRequest->takeDownloadedData(data, dataSize))
+    {
+      adoptFontData(data, (FT_Long)dataSize, fileDownloadRequest->fileUrl().cString());
+    }
+    else
+    {
+      setFontData( (FT_Byte*)fileDownloadRequest->downloadedData(),
+              (FT_Long)fileDownloadRequest->downloadedDataSize(),
+              fileDownloadRequest->fileUrl().cString());
+    }
             
       return PX_RESOURCE_LOAD_SUCCESS;
 }
@@ -258,7 +559,8 @@ rtError pxFont::init(const char* n)
   rtError loadFontStatus = RT_FAIL;
 
   do {
-    if (FT_New_Face(ft, n, 0, &mFace) == 0)
+    mFontFace = pxFontFace::fromFile(n);
+    if (mFontFace)
     {
       loadFontStatus = RT_OK;
       break;
@@ -271,7 +573,8 @@ rtError pxFont::init(const char* n)
 
     for (rtModuleDirs::iter it = dirs->iterator(); it.first != it.second; it.first++)
     {
-      if (FT_New_Face(ft, rtConcatenatePath(*it.first, n).c_str(), 0, &mFace) == 0)
+      mFontFace = pxFontFace::fromFile(rtConcatenatePath(*it.first, n).c_str());
+      if (mFontFace)
       {
         loadFontStatus = RT_OK;
         break;
@@ -280,10 +583,7 @@ rtError pxFont::init(const char* n)
   } while (0);
 
   if(loadFontStatus == RT_OK)
-  {
-    mInitialized = true;
-    setPixelSize(defaultPixelSize);
-  }
+    initFace();
 
   mFontMutex.unlock();
   return loadFontStatus;
@@ -292,31 +592,34 @@ rtError pxFont::init(const char* n)
 rtError pxFont::init(const FT_Byte*  fontData, FT_Long size, const char* n)
 {
   mFontMutex.lock();
-  // We need to keep a copy of fontData since the download will be deleted.
-  mFontData = (char *)malloc(size);
-  memcpy(mFontData, fontData, size);
-  mFontDataSize = size;
+  // fontData is copied unless a face with the same bytes is already open,
+  // since the download will be deleted.
   mUrl = n;
-  if(FT_New_Memory_Face(ft, (const FT_Byte*)mFontData, mFontDataSize, 0, &mFace))
-  {
-    mFontMutex.unlock();
+  mFontFace = pxFontFace::fromData(fontData, size);
+  rtError e = initFace();
+  mFontMutex.unlock();
+  
+  return e;
+}
+
+rtError pxFont::initFace()
+{
+  if (!mFontFace)
     return RT_FAIL;
-  }
 
+  mFace = mFontFace->face();
   mInitialized = true;
   setPixelSize(defaultPixelSize);
-
-  mFontMutex.unlock();
-  
   return RT_OK;
 }
 
 void pxFont::setPixelSize(uint32_t s)
 {
-  if (mPixelSize != s && mInitialized)
+  // the face may be shared, so its size can differ from mPixelSize
+  if (mInitialized && (mPixelSize != s || mFontFace->pixelSize() != s))
   {
     //rtLogDebug("pxFont::setPixelSize size=%d mPixelSize=%d mInitialized=%d and mFace=%d\n", s,mPixelSize,mInitialized, mFace);
-    FT_Set_Pixel_Sizes(mFace, 0, s);
+    mFontFace->setPixelSize(s);
     mPixelSize = s;
   }
 }
@@ -385,18 +688,19 @@ GlyphTextureEntry pxFont::getGlyphTexture(uint32_t codePoint, float sx, float sy
 #endif
   
   
-  GlyphKey key; 
-  key.mFontId = mFontId; 
-  key.mPixelSize = pixelSize; 
-  key.mCodePoint = codePoint;
-  GlyphTextureCache::iterator it = gGlyphTextureCache.find(key);
-  if (it != gGlyphTextureCache.end())
-    return it->second;
+  pxGlyphFace* face = glyphFace(pixelSize);
+  pxGlyphSlot* slot = face->find(codePoint);
+#ifdef PXSCENE_FONT_ATLAS
+  if (slot && slot->hasTexture && gFontAtlas.isValid(slot->texture))
+#else
+  if (slot && slot->hasTexture)
+#endif
+    return slot->texture;
   else
   {
     // temporarily set pixel size to more optimal size for
     // rendering texture 
-    FT_Set_Pixel_Sizes(mFace, 0, pixelSize);
+    mFontFace->setPixelSize(pixelSize);
     // TODO only need to render glyph here
     if(!FT_Load_Char(mFace, codePoint, FT_LOAD_RENDER))
     {
@@ -421,27 +725,29 @@ GlyphTextureEntry pxFont::getGlyphTexture(uint32_t codePoint, float sx, float sy
       }
 #endif
       
-      gGlyphTextureCache.insert(make_pair(key,result));
+      slot = face->insert(codePoint);
+      if (slot)
+      {
+        slot->texture = result;
+        slot->hasTexture = true;
+      }
 
       // restore current pixelSize
-      FT_Set_Pixel_Sizes(mFace, 0, mPixelSize);
+      mFontFace->setPixelSize(mPixelSize);
       return result;  
     }
     // restore current pixelSize
-    FT_Set_Pixel_Sizes(mFace, 0, mPixelSize);
+    mFontFace->setPixelSize(mPixelSize);
   }
   return result;  
 }
   
 const GlyphCacheEntry* pxFont::getGlyph(uint32_t codePoint)
 {
-  GlyphKey key; 
-  key.mFontId = mFontId; 
-  key.mPixelSize = mPixelSize; 
-  key.mCodePoint = codePoint;
-  GlyphCache::iterator it = gGlyphCache.find(key);
-  if (it != gGlyphCache.end())
-    return it->second;
+  pxGlyphFace* face = glyphFace(mPixelSize);
+  pxGlyphSlot* slot = face->find(codePoint);
+  if (slot && slot->hasGlyph)
+    return &slot->glyph;
   else
   {
     // TODO should not need to render here !
@@ -450,7 +756,10 @@ const GlyphCacheEntry* pxFont::getGlyph(uint32_t codePoint)
     else
     {
       rtLogDebug("glyph cache miss");
-      GlyphCacheEntry *entry = new GlyphCacheEntry;
+      slot = face->insert(codePoint);
+      if (!slot)
+        return NULL;
+      GlyphCacheEntry *entry = &slot->glyph;
       FT_GlyphSlot g = mFace->glyph;
       
       entry->bitmap_left = g->bitmap_left;
@@ -461,7 +770,7 @@ const GlyphCacheEntry* pxFont::getGlyph(uint32_t codePoint)
       entry->advancedoty = (int32_t) g->advance.y;
       entry->vertAdvance = (int32_t) g->metrics.vertAdvance; // !CLF: Why vertAdvance? SHould only be valid for vert layout of text.
 
-      gGlyphCache.insert(make_pair(key,entry));
+      slot->hasGlyph = true;
 
       return entry;
     }
@@ -469,6 +778,363 @@ const GlyphCacheEntry* pxFont::getGlyph(uint32_t codePoint)
   return NULL;
 }
 
+#ifdef PXSCENE_FONT_ATLAS
+// 1D squared euclidean distance transform (Felzenszwalb and Huttenlocher)
+static void distanceTransform1d(const double* f, double* d, int* v, double* z, int n)
+{
+  int k = 0;
+  v[0] = 0;
+  z[0] = -1e20;
+  z[1] = 1e20;
+  for (int q = 1; q < n; q++)
+  {
+    double s = ((f[q] + q*q) - (f[v[k]] + v[k]*v[k])) / (2*q - 2*v[k]);
+    while (s <= z[k])
+    {
+      k--;
+      s = ((f[q] + q*q) - (f[v[k]] + v[k]*v[k])) / (2*q - 2*v[k]);
+    }
+    k++;
+    v[k] = q;
+    z[k] = s;
+    z[k+1] = 1e20;
+  }
+  k = 0;
+  for (int q = 0; q < n; q++)
+  {
+    while (z[k+1] < q)
+      k++;
+    d[q] = (q - v[k])*(q - v[k]) + f[v[k]];
+  }
+}
+
+static void distanceTransform2d(vector<double>& grid, int w, int h)
+{
+  int n = (w > h) ? w : h;
+  vector<double> f(n), d(n), z(n+1);
+  vector<int> v(n);
+
+  for (int x = 0; x < w; x++)
+  {
+    for (int y = 0; y < h; y++)
+      f[y] = grid[y*w+x];
+    distanceTransform1d(&f[0], &d[0], &v[0], &z[0], h);
+    for (int y = 0; y < h; y++)
+      grid[y*w+x] = d[y];
+  }
+  for (int y = 0; y < h; y++)
+  {
+    distanceTransform1d(&grid[y*w], &d[0], &v[0], &z[0], w);
+    for (int x = 0; x < w; x++)
+      grid[y*w+x] = d[x];
+  }
+}
+
+// Converts a coverage bitmap into a signed distance field padded by spread
+// pixels on each side.  128 is the outline, larger values are inside.
+void pxBuildDistanceField(const uint8_t* src, int w, int h, int pitch, int spread,
+                          vector<uint8_t>& field, int& fw, int& fh)
+{
+  fw = w + 2*spread;
+  fh = h + 2*spread;
+  vector<double> outside(fw*fh), inside(fw*fh);
+  vector<bool> in(fw*fh);
+
+  for (int y = 0; y < fh; y++)
+  {
+    for (int x = 0; x < fw; x++)
+    {
+      int sx = x - spread, sy = y - spread;
+      bool i = (sx >= 0 && sy >= 0 && sx < w && sy < h && src[sy*pitch+sx] >= 128);
+      in[y*fw+x] = i;
+      outside[y*fw+x] = i ? 0 : 1e20;
+      inside[y*fw+x] = i ? 1e20 : 0;
+    }
+  }
+  distanceTransform2d(outside, fw, fh);
+  distanceTransform2d(inside, fw, fh);
+
+  field.resize(fw*fh);
+  for (int i = 0; i < fw*fh; i++)
+  {
+    double d = in[i] ? (sqrt(inside[i]) - 0.5) : -(sqrt(outside[i]) - 0.5);
+    double a = 0.5 + d/(2.0*spread);
+    a = (a < 0) ? 0 : ((a > 1) ? 1 : a);
+    field[i] = (uint8_t)(a*255.0 + 0.5);
+  }
+}
+
+GlyphTextureEntry pxFont::getSdfGlyphTexture(uint32_t codePoint, const GlyphCacheEntry*& metrics)
+{
+  GlyphTextureEntry result;
+  metrics = NULL;
+
+  if (!mSdfGlyphFace)
+    mSdfGlyphFace = new pxGlyphFace();
+
+  pxGlyphSlot* slot = mSdfGlyphFace->find(codePoint);
+  if (slot && slot->hasTexture && gFontAtlas.isValid(slot->texture))
+  {
+    metrics = &slot->glyph;
+    return slot->texture;
+  }
+
+  mFontFace->setPixelSize(PXSCENE_FONT_SDF_REFERENCE_SIZE);
+  if(!FT_Load_Char(mFace, codePoint, FT_LOAD_RENDER))
+  {
+    rtLogDebug("distance field glyph cache miss");
+    FT_GlyphSlot g = mFace->glyph;
+    slot = mSdfGlyphFace->insert(codePoint);
+    if (slot)
+    {
+      slot->glyph.bitmap_left = g->bitmap_left;
+      slot->glyph.bitmap_top = g->bitmap_top;
+      slot->glyph.bitmapdotwidth = g->bitmap.width;
+      slot->glyph.bitmapdotrows = g->bitmap.rows;
+      slot->glyph.advancedotx = (int32_t) g->advance.x;
+      slot->glyph.advancedoty = (int32_t) g->advance.y;
+      slot->glyph.vertAdvance = (int32_t) g->metrics.vertAdvance;
+      slot->hasGlyph = true;
+
+      vector<uint8_t> field;
+      int fw = 0, fh = 0;
+      int pitch = g->bitmap.pitch < 0 ? -g->bitmap.pitch : g->bitmap.pitch;
+      pxBuildDistanceField(g->bitmap.buffer, g->bitmap.width, g->bitmap.rows, pitch,
+                           PXSCENE_FONT_SDF_SPREAD, field, fw, fh);
+      if (gFontAtlas.addGlyph(fw, fh, &field[0], result, true))
+      {
+        slot->texture = result;
+        slot->hasTexture = true;
+        metrics = &slot->glyph;
+      }
+      else
+        rtLogWarn("Distance field glyph not in atlas");
+    }
+  }
+  // restore current pixelSize
+  mFontFace->setPixelSize(mPixelSize);
+  return result;
+}
+#endif //PXSCENE_FONT_ATLAS
+
+pxGlyphFace* pxFont::glyphFace(uint32_t pixelSize)
+{
+  if (mCurrentGlyphFace && mCurrentGlyphFaceSize == pixelSize)
+    return mCurrentGlyphFace;
+
+  pxGlyphFace*& face = mGlyphFaces[pixelSize];
+  if (!face)
+    face = new pxGlyphFace();
+
+  mCurrentGlyphFace = face;
+  mCurrentGlyphFaceSize = pixelSize;
+  return face;
+}
+
+void pxRasterizeGlyphs(FT_Face face, const vector<uint32_t>& pixelSizes,
+                       const vector<uint32_t>& codePoints, bool distanceField,
+                       vector<pxWarmupGlyph>& glyphs)
+{
+  vector<uint32_t> sizes(pixelSizes);
+#ifdef PXSCENE_FONT_ATLAS
+  // distance field glyphs serve every size from the reference size
+  if (distanceField)
+    sizes.assign(1, PXSCENE_FONT_SDF_REFERENCE_SIZE);
+#else
+  distanceField = false;
+#endif
+
+  glyphs.reserve(glyphs.size() + sizes.size()*codePoints.size());
+  for (uint32_t i = 0; i < sizes.size(); i++)
+  {
+    FT_Set_Pixel_Sizes(face, 0, sizes[i]);
+    for (uint32_t j = 0; j < codePoints.size(); j++)
+    {
+      if (FT_Load_Char(face, codePoints[j], FT_LOAD_RENDER))
+        continue;
+
+      FT_GlyphSlot g = face->glyph;
+      glyphs.push_back(pxWarmupGlyph());
+      pxWarmupGlyph& glyph = glyphs.back();
+      glyph.pixelSize = sizes[i];
+      glyph.codePoint = codePoints[j];
+      glyph.distanceField = distanceField;
+      glyph.metrics.bitmap_left = g->bitmap_left;
+      glyph.metrics.bitmap_top = g->bitmap_top;
+      glyph.metrics.bitmapdotwidth = g->bitmap.width;
+      glyph.metrics.bitmapdotrows = g->bitmap.rows;
+      glyph.metrics.advancedotx = (int32_t) g->advance.x;
+      glyph.metrics.advancedoty = (int32_t) g->advance.y;
+      glyph.metrics.vertAdvance = (int32_t) g->metrics.vertAdvance;
+
+      int pitch = g->bitmap.pitch < 0 ? -g->bitmap.pitch : g->bitmap.pitch;
+#ifdef PXSCENE_FONT_ATLAS
+      if (distanceField)
+      {
+        int fw = 0, fh = 0;
+        pxBuildDistanceField(g->bitmap.buffer, g->bitmap.width, g->bitmap.rows, pitch,
+                             PXSCENE_FONT_SDF_SPREAD, glyph.bitmap, fw, fh);
+        glyph.width = fw;
+        glyph.rows = fh;
+        continue;
+      }
+#endif
+      glyph.width = g->bitmap.width;
+      glyph.rows = g->bitmap.rows;
+      glyph.bitmap.resize(glyph.width*glyph.rows);
+      for (uint32_t row = 0; row < glyph.rows; row++)
+        memcpy(&glyph.bitmap[row*glyph.width], g->bitmap.buffer + row*pitch, glyph.width);
+    }
+  }
+}
+
+void pxFont::addWarmupText(uint32_t pixelSize, const char* text)
+{
+  if (mWarmupStarted || !text)
+    return;
+
+  mWarmupSizes.insert(pixelSize);
+  int i = 0;
+  u_int32_t codePoint;
+  while ((codePoint = u8_nextchar((char*)text, &i)) != 0)
+    mWarmupCodePoints.insert(codePoint);
+}
+
+void pxFont::startWarmup()
+{
+#ifdef PXSCENE_FONT_ATLAS
+  if (mWarmupStarted || !mInitialized || !pxFontManager::warmupEnabled() || !gUIThreadQueue)
+    return;
+  mWarmupStarted = true;
+
+  pxFontWarmup* warmup = new pxFontWarmup();
+  warmup->font = this;
+  warmup->face = mFontFace;
+#ifdef PXSCENE_FONT_ATLAS
+  warmup->distanceField = pxFontManager::sdfTextEnabled();
+#else
+  warmup->distanceField = false;
+#endif
+
+  // pending text decides what to warm up, the configured set otherwise
+  if (mWarmupCodePoints.empty())
+    pxFontManager::warmupCodePoints(warmup->codePoints);
+  else
+    warmup->codePoints.assign(mWarmupCodePoints.begin(), mWarmupCodePoints.end());
+  if (mWarmupSizes.empty())
+    warmup->pixelSizes.push_back(defaultPixelSize);
+  else
+    warmup->pixelSizes.assign(mWarmupSizes.begin(), mWarmupSizes.end());
+  mWarmupSizes.clear();
+  mWarmupCodePoints.clear();
+
+  if (warmup->codePoints.empty())
+  {
+    delete warmup;
+    return;
+  }
+
+  // Released in onWarmupCompleteUI
+  AddRef();
+  mWarmup = warmup;
+  fontWarmupThreadPool.executeTask(new rtThreadTask(warmupGlyphs, warmup, ""));
+#else
+  // without the atlas every glyph is its own texture, so there is nothing
+  // to pack ahead of time and rasterising twice only costs memory
+  mWarmupSizes.clear();
+  mWarmupCodePoints.clear();
+#endif
+}
+
+void pxFont::warmupGlyphs(void* data)
+{
+  pxFontWarmup* warmup = (pxFontWarmup*)data;
+
+  // FreeType objects are not thread safe, so the worker opens the font
+  // bytes again with a library and face of its own
+  FT_Library library;
+  if (FT_Init_FreeType(&library) == 0)
+  {
+    FT_Face face;
+    if (FT_New_Memory_Face(library, (const FT_Byte*)warmup->face->data(), (FT_Long)warmup->face->size(), 0, &face) == 0)
+    {
+      double start = pxMilliseconds();
+      pxRasterizeGlyphs(face, warmup->pixelSizes, warmup->codePoints, warmup->distanceField, warmup->glyphs);
+      rtLogDebug("warmed up %u glyphs in %.1f ms", (uint32_t)warmup->glyphs.size(), pxMilliseconds()-start);
+      FT_Done_Face(face);
+    }
+    FT_Done_FreeType(library);
+  }
+
+  gUIThreadQueue->addTask(onWarmupCompleteUI, warmup->font, warmup);
+}
+
+void pxFont::onWarmupCompleteUI(void* context, void* data)
+{
+  pxFont* font = (pxFont*)context;
+  pxFontWarmup* warmup = (pxFontWarmup*)data;
+
+  // glyphs looked up while the worker was busy were rasterised on the spot;
+  // the batch only fills in the rest
+  font->mWarmup = NULL;
+  font->addWarmupGlyphs(warmup->glyphs);
+  delete warmup;
+
+  // Release here since we had to addRef when starting the warm-up
+  font->Release();
+}
+
+void pxFont::addWarmupGlyphs(const vector<pxWarmupGlyph>& glyphs)
+{
+  for (uint32_t i = 0; i < glyphs.size(); i++)
+  {
+    const pxWarmupGlyph& g = glyphs[i];
+    pxGlyphFace* face = NULL;
+#ifdef PXSCENE_FONT_ATLAS
+    if (g.distanceField)
+    {
+      if (!mSdfGlyphFace)
+        mSdfGlyphFace = new pxGlyphFace();
+      face = mSdfGlyphFace;
+    }
+    else
+#endif
+      face = glyphFace(g.pixelSize);
+
+    // glyphs drawn while the worker was busy are already cached
+    pxGlyphSlot* slot = face->insert(g.codePoint);
+    if (!slot)
+      continue;
+    if (!slot->hasGlyph)
+    {
+      slot->glyph = g.metrics;
+      slot->hasGlyph = true;
+    }
+
+#ifdef PXSCENE_FONT_ATLAS
+    if (slot->hasTexture && gFontAtlas.isValid(slot->texture))
+      continue;
+    GlyphTextureEntry e;
+    if (gFontAtlas.addGlyph(g.width, g.rows, g.bitmap.empty() ? NULL : (void*)&g.bitmap[0], e, g.distanceField))
+    {
+      slot->texture = e;
+      slot->hasTexture = true;
+    }
+#endif
+  }
+}
+
+void pxFont::clearGlyphCache()
+{
+  for (std::map<uint32_t, pxGlyphFace*>::iterator it = mGlyphFaces.begin(); it != mGlyphFaces.end(); ++it)
+    delete it->second;
+  mGlyphFaces.clear();
+  mCurrentGlyphFace = NULL;
+  mCurrentGlyphFaceSize = 0;
+  delete mSdfGlyphFace;
+  mSdfGlyphFace = NULL;
+}
+
 void pxFont::measureTextInternal(const char* text, uint32_t size,  float sx, float sy, 
                          float& w, float& h) 
 {
@@ -488,15 +1154,15 @@ void pxFont::measureTextInternal(const char* text, uint32_t size,  float sx, flo
   if (!text) 
     return;
     
-  int i = 0;
-  u_int32_t codePoint;
-  
   FT_Size_Metrics* metrics = &mFace->size->metrics;
   
   h = static_cast<float>(metrics->height>>6);
   float lw = 0;
-  while((codePoint = u8_nextchar((char*)text, &i)) != 0) 
+  int count;
+  const u_int32_t* codePoints = decodeText(text, count);
+  for (int i = 0; i < count; i++)
   {
+    u_int32_t codePoint = codePoints[i];
     const GlyphCacheEntry* entry = getGlyph(codePoint);
     if (!entry) 
       continue;
@@ -517,6 +1183,72 @@ void pxFont::measureTextInternal(const char* text, uint32_t size,  float sx, flo
   h *= sy;
 }
 
+const u_int32_t* pxFont::decodeText(const char* text, int& count, vector<int>* offsets)
+{
+  int len = text ? (int)strlen(text) : 0;
+  // a code point takes at least one byte
+  pxReserveDecodeBuffer(mCodePoints, len);
+  if (offsets)
+    pxReserveDecodeBuffer(*offsets, len);
+  count = len ? u8_decode(&mCodePoints[0], offsets ? &(*offsets)[0] : NULL, len, text, len) : 0;
+  if (offsets)
+    offsets->resize(count);
+  return mCodePoints.empty() ? NULL : &mCodePoints[0];
+}
+
+void pxFont::measureTextRun(const char* text, uint32_t size, vector<int>& offsets,
+                            vector<float>& widths, vector<float>& heights)
+{
+  offsets.assign(1, 0);
+  widths.assign(1, 0);
+  heights.assign(1, 0);
+
+  if( !mInitialized)
+  {
+    rtLogWarn("measureTextRun called TOO EARLY -- not initialized or font not loaded!\n");
+    return;
+  }
+
+  setPixelSize(size);
+
+  FT_Size_Metrics* metrics = &mFace->size->metrics;
+  float lineHeight = static_cast<float>(metrics->height>>6);
+  heights[0] = lineHeight;
+
+  if (!text)
+    return;
+
+  int count;
+  vector<int> starts;
+  const u_int32_t* codePoints = decodeText(text, count, &starts);
+  starts.push_back((int)strlen(text));
+  offsets.reserve(count + 1);
+  widths.reserve(count + 1);
+  heights.reserve(count + 1);
+  float w = 0, lw = 0, h = lineHeight;
+  for (int k = 0; k < count; k++)
+  {
+    u_int32_t codePoint = codePoints[k];
+    const GlyphCacheEntry* entry = getGlyph(codePoint);
+    if (entry)
+    {
+      if (codePoint != '\n')
+      {
+        lw += (entry->advancedotx >> 6);
+      }
+      else
+      {
+        h += lineHeight;
+        lw = 0;
+      }
+      w = pxMax<float>(w, lw);
+    }
+    offsets.push_back(starts[k+1]);
+    widths.push_back(w);
+    heights.push_back(h);
+  }
+}
+
 #ifndef PXSCENE_FONT_ATLAS
 void pxFont::renderText(const char *text, uint32_t size, float x, float y, 
                         float nsx, float nsy, 
@@ -528,14 +1260,15 @@ void pxFont::renderText(const char *text, uint32_t size, float x, float y,
     return;
   }
 
-  int i = 0;
-  u_int32_t codePoint;
+  int count;
+  const u_int32_t* codePoints = decodeText(text, count);
 
   setPixelSize(size);
   FT_Size_Metrics* metrics = &mFace->size->metrics;
   
-  while((codePoint = u8_nextchar((char*)text, &i)) != 0) 
+  for (int i = 0; i < count; i++)
   {
+    u_int32_t codePoint = codePoints[i];
     const GlyphCacheEntry* entry = getGlyph(codePoint);
     if (!entry) 
       continue;
@@ -607,15 +1340,16 @@ void pxFont::renderTextToQuads(const char *text, uint32_t size,
     rtLogWarn("renderText called on font before it is initialized\n");
     return;
   }
-
-  int i = 0;
-  u_int32_t codePoint;
+  int count;
+  const u_int32_t* codePoints = decodeText(text, count);
+  quads.reserve(count);
 
   setPixelSize(size);
   FT_Size_Metrics* metrics = &mFace->size->metrics;
   
-  while((codePoint = u8_nextchar((char*)text, &i)) != 0) 
+  for (int i = 0; i < count; i++)
   {
+    u_int32_t codePoint = codePoints[i];
     GlyphCacheEntry* entry = (GlyphCacheEntry*)getGlyph(codePoint);
 
     if (!entry) 
@@ -629,12 +1363,27 @@ void pxFont::renderTextToQuads(const char *text, uint32_t size,
     
     if (codePoint != '\n')
     {
-      
-      GlyphTextureEntry t = getGlyphTexture(codePoint, nsx, nsy);
-
-      pxTextureRef nullImage;
+      const GlyphCacheEntry* sdfEntry = NULL;
+      GlyphTextureEntry t;
+      if (pxFontManager::sdfTextEnabled())
+        t = getSdfGlyphTexture(codePoint, sdfEntry);
 
-      quads.addQuad(x2,y2,x2+w,y2+h,t.u1,t.v1,t.u2,t.v2,t.t);
+      if (sdfEntry)
+      {
+        // scale the reference size glyph, spread included, to this size
+        float scale = (float)mPixelSize/(float)PXSCENE_FONT_SDF_REFERENCE_SIZE;
+        float sx1 = x + (sdfEntry->bitmap_left - PXSCENE_FONT_SDF_SPREAD)*scale;
+        float sy1 = (y - (sdfEntry->bitmap_top + PXSCENE_FONT_SDF_SPREAD)*scale) + (metrics->ascender>>6);
+        float sw = (sdfEntry->bitmapdotwidth + 2*PXSCENE_FONT_SDF_SPREAD)*scale;
+        float sh = (sdfEntry->bitmapdotrows + 2*PXSCENE_FONT_SDF_SPREAD)*scale;
+        if (sdfEntry->bitmapdotwidth > 0 && sdfEntry->bitmapdotrows > 0)
+          quads.addQuad(sx1,sy1,sx1+sw,sy1+sh,t);
+      }
+      else
+      {
+        t = getGlyphTexture(codePoint, nsx, nsy);
+        quads.addQuad(x2,y2,x2+w,y2+h,t);
+      }
 
       x += (entry->advancedotx >> 6);
       // no change to y because we are not moving to next line yet
@@ -746,6 +1495,9 @@ rtError pxFont::measureText(uint32_t pixelSize, rtString stringToMeasure, rtObje
 FontMap pxFontManager::mFontMap;
 FontIdMap pxFontManager::mFontIdMap;
 bool pxFontManager::init = false;
+bool pxFontManager::mSdfTextEnabled = false;
+bool pxFontManager::mWarmupEnabled = true;
+rtString pxFontManager::mWarmupGlyphs = "latin1";
 void pxFontManager::initFT() 
 {
   if (init) 
@@ -754,6 +1506,22 @@ void pxFontManager::initFT()
     return;
   }
   init = true;
+
+  rtValue val;
+#ifdef PXSCENE_FONT_ATLAS
+  if (RT_OK == rtSettings::instance()->value("enableSdfText", val))
+  {
+    mSdfTextEnabled = val.toBool();
+  }
+#endif
+  if (RT_OK == rtSettings::instance()->value("enableFontWarmup", val))
+  {
+    mWarmupEnabled = val.toBool();
+  }
+  if (RT_OK == rtSettings::instance()->value("fontWarmupGlyphs", val))
+  {
+    mWarmupGlyphs = val.toString();
+  }
   
   if(FT_Init_FreeType(&ft)) 
   {
@@ -819,6 +1587,31 @@ rtRef<pxFont> pxFontManager::getFont(const char* url, const char* proxy, const r
   return pFont;
 }
 
+void pxFontManager::warmupCodePoints(vector<uint32_t>& codePoints)
+{
+  codePoints.clear();
+  if (mWarmupGlyphs.isEmpty())
+    return;
+  if (mWarmupGlyphs.compare("latin1") == 0)
+  {
+    // printable Latin-1
+    for (uint32_t c = 0x20; c < 0x7f; c++)
+      codePoints.push_back(c);
+    for (uint32_t c = 0xa0; c <= 0xff; c++)
+      codePoints.push_back(c);
+    return;
+  }
+
+  std::set<uint32_t> unique;
+  int i = 0;
+  u_int32_t codePoint;
+  while ((codePoint = u8_nextchar((char*)mWarmupGlyphs.cString(), &i)) != 0)
+  {
+    if (unique.insert(codePoint).second)
+      codePoints.push_back(codePoint);
+  }
+}
+
 void pxFontManager::removeFont(uint32_t fontId)
 {
   FontMap::iterator it = mFontMap.find(fontId);
@@ -830,12 +1623,9 @@ void pxFontManager::removeFont(uint32_t fontId)
 
 void pxFontManager::clearAllFonts()
 {
-  for (GlyphCache::iterator it =  gGlyphCache.begin(); it != gGlyphCache.end(); it++)
-    delete it->second;
-
+  for (FontMap::iterator it = mFontMap.begin(); it != mFontMap.end(); it++)
+    it->second->clearGlyphCache();
 
-  gGlyphCache.clear();
-  gGlyphTextureCache.clear();
   mFontIdMap.clear();
 #ifdef PXSCENE_FONT_ATLAS
   gFontAtlas.clearTexture();
@@ -860,101 +1650,268 @@ rtDefineProperty(pxTextSimpleMeasurements, w);
 rtDefineProperty(pxTextSimpleMeasurements, h);
 
 #ifdef PXSCENE_FONT_ATLAS
-#define PXSCENE_FONT_ATLAS_DIM 2048
-pxFontAtlas::pxFontAtlas(): fence(0)
+pxFontAtlas::pxFontAtlas(): mPages(), mGeneration(0), mLruHead(PX_FONT_ATLAS_NO_PAGE), mLruTail(PX_FONT_ATLAS_NO_PAGE)
 {
-  mTexture = context.createTexture(PXSCENE_FONT_ATLAS_DIM,PXSCENE_FONT_ATLAS_DIM,PXSCENE_FONT_ATLAS_DIM,PXSCENE_FONT_ATLAS_DIM, NULL);
 }
 
 void pxFontAtlas::clearTexture() 
 {
-  if( mTexture) {
-    mTexture->deleteTexture();
-    mTexture = 0;
+  for (uint32_t i = 0; i < mPages.size(); i++)
+  {
+    if (mPages[i].texture)
+      mPages[i].texture->deleteTexture();
   }
+  mPages.clear();
+  mLruHead = PX_FONT_ATLAS_NO_PAGE;
+  mLruTail = PX_FONT_ATLAS_NO_PAGE;
 }
-bool pxFontAtlas::addGlyph(uint32_t w, uint32_t h, void* buffer, GlyphTextureEntry& e)
+
+bool pxFontAtlas::addGlyph(uint32_t w, uint32_t h, void* buffer, GlyphTextureEntry& e, bool distanceField)
 {
-  if (!mTexture)
+  // leave a one pixel gap between glyphs so filtering does not bleed
+  uint32_t pw = w+1;
+  uint32_t ph = h+1;
+  if (pw > PXSCENE_FONT_ATLAS_MAX_GLYPH_SIZE || ph > PXSCENE_FONT_ATLAS_MAX_GLYPH_SIZE)
+    return false;
+
+  uint32_t pageIndex = PX_FONT_ATLAS_NO_PAGE;
+  uint32_t nodeIndex = 0, x = 0, y = 0;
+  for (uint32_t i = 0; i < mPages.size(); i++)
   {
-    mTexture = context.createTexture(PXSCENE_FONT_ATLAS_DIM,PXSCENE_FONT_ATLAS_DIM,PXSCENE_FONT_ATLAS_DIM,PXSCENE_FONT_ATLAS_DIM, NULL);
+    if (mPages[i].distanceField == distanceField && findPosition(mPages[i], pw, ph, nodeIndex, x, y))
+    {
+      pageIndex = i;
+      break;
+    }
   }
-  //return false;
-  // bail on biggish glyphs
-  if (h < 128)
+
+  if (pageIndex == PX_FONT_ATLAS_NO_PAGE)
   {
-    uint32_t h2 = (h+8)&~7;
-    // look for a row that fits
-    uint32_t i;
-    for (i = 0; i < mRows.size(); i++)
+    if (mPages.size() < PXSCENE_FONT_ATLAS_MAX_PAGES)
     {
-      row& r = mRows[i];
-      if ((h2 == r.height) && (r.rFence+w < (uint32_t)mTexture->width()))
-      {
-        e.t = mTexture;
-        e.u1 = (float)r.rFence/(float)mTexture->width();
-        e.u2 = (float)(r.rFence+w)/(float)mTexture->width();
-        e.v1 = (float)r.top/(float)mTexture->height();
-        e.v2 = (float)(r.top+h)/(float)mTexture->height();
-        
-        mTexture->updateTexture(r.rFence,r.top,w,h,buffer);
+      addPage(distanceField);
+      pageIndex = (uint32_t)mPages.size()-1;
+    }
+    else
+    {
+      // reuse the page that was drawn least recently, unless text drawn
+      // this frame still uses it
+      pageIndex = mLruHead;
+      if (pageIndex == PX_FONT_ATLAS_NO_PAGE || mPages[pageIndex].lastUsedTick == gRenderTick)
+        return false;
+      evictPage(pageIndex);
+      mPages[pageIndex].distanceField = distanceField;
+      mPages[pageIndex].texture->setDistanceField(distanceField);
+    }
+    if (!findPosition(mPages[pageIndex], pw, ph, nodeIndex, x, y))
+      return false;
+  }
 
-        r.rFence += w+1;
+  page& p = mPages[pageIndex];
+  placeGlyph(p, nodeIndex, x, y, pw, ph);
+  // the quads being built with it are drawn this frame
+  touch(pageIndex);
 
-        return true;
-      }
-    }
+  e.t = p.texture;
+  e.u1 = (float)x/(float)PXSCENE_FONT_ATLAS_DIM;
+  e.u2 = (float)(x+w)/(float)PXSCENE_FONT_ATLAS_DIM;
+  e.v1 = (float)y/(float)PXSCENE_FONT_ATLAS_DIM;
+  e.v2 = (float)(y+h)/(float)PXSCENE_FONT_ATLAS_DIM;
+  e.page = pageIndex;
+  e.generation = p.generation;
 
-    if ((i >= mRows.size()) && (fence+h < (uint32_t)mTexture->height()))
-    {
-      // Didn't find a row that matched... try adding another row
-      row nr;
-      nr.top = fence;
-      nr.height = h2;
-      nr.rFence = 0;
-      fence += h2;
+  if (w > 0 && h > 0)
+    p.texture->updateTexture(x,y,w,h,buffer);
 
+  return true;
+}
 
-      if ((h2 == nr.height) && (nr.rFence+w < (uint32_t)mTexture->width()))
-      {
-        e.t = mTexture;
-        e.u1 = (float)nr.rFence/(float)mTexture->width();
-        e.u2 = (float)(nr.rFence+w)/(float)mTexture->width();
-        e.v1 = (float)nr.top/(float)mTexture->height();
-        e.v2 = (float)(nr.top+h)/(float)mTexture->height(); 
+bool pxFontAtlas::isValid(const GlyphTextureEntry& e) const
+{
+  return isCurrent(e.page, e.generation);
+}
+
+bool pxFontAtlas::isCurrent(uint32_t page, uint32_t generation) const
+{
+  if (page == PX_FONT_ATLAS_NO_PAGE)
+    return true;
+  return page < mPages.size() && mPages[page].generation == generation;
+}
+
+void pxFontAtlas::touch(uint32_t index)
+{
+  if (index >= mPages.size())
+    return;
+  mPages[index].lastUsedTick = gRenderTick;
+  if (index != mLruTail)
+  {
+    unlink(index);
+    linkTail(index);
+  }
+}
+
+void pxFontAtlas::unlink(uint32_t index)
+{
+  page& p = mPages[index];
+  if (p.prev != PX_FONT_ATLAS_NO_PAGE)
+    mPages[p.prev].next = p.next;
+  else
+    mLruHead = p.next;
+  if (p.next != PX_FONT_ATLAS_NO_PAGE)
+    mPages[p.next].prev = p.prev;
+  else
+    mLruTail = p.prev;
+  p.prev = PX_FONT_ATLAS_NO_PAGE;
+  p.next = PX_FONT_ATLAS_NO_PAGE;
+}
+
+void pxFontAtlas::linkTail(uint32_t index)
+{
+  page& p = mPages[index];
+  p.prev = mLruTail;
+  p.next = PX_FONT_ATLAS_NO_PAGE;
+  if (mLruTail != PX_FONT_ATLAS_NO_PAGE)
+    mPages[mLruTail].next = index;
+  else
+    mLruHead = index;
+  mLruTail = index;
+}
 
-        mTexture->updateTexture(nr.rFence,nr.top,w,h,buffer);
+uint64_t pxFontAtlas::textureMemoryUsage() const
+{
+  // pages are single channel alpha textures
+  return (uint64_t)mPages.size() * PXSCENE_FONT_ATLAS_DIM * PXSCENE_FONT_ATLAS_DIM;
+}
 
-        nr.rFence += w+1;
+// Bottom-left skyline fit; picks the node that leaves the lowest top edge
+bool pxFontAtlas::findPosition(const page& p, uint32_t w, uint32_t h, uint32_t& index, uint32_t& x, uint32_t& y) const
+{
+  uint32_t bestTop = PXSCENE_FONT_ATLAS_DIM+1;
+  uint32_t bestWidth = PXSCENE_FONT_ATLAS_DIM+1;
+  bool found = false;
 
-        mRows.push_back(nr);
-        return true;
-      }        
+  for (uint32_t i = 0; i < p.skyline.size(); i++)
+  {
+    uint32_t nodeX = p.skyline[i].x;
+    if (nodeX + w > PXSCENE_FONT_ATLAS_DIM)
+      break;
+
+    // the glyph rests on the highest node it spans
+    uint32_t top = 0;
+    uint32_t remaining = w;
+    for (uint32_t j = i; remaining > 0 && j < p.skyline.size(); j++)
+    {
+      if (p.skyline[j].y > top)
+        top = p.skyline[j].y;
+      remaining = (p.skyline[j].width >= remaining) ? 0 : remaining - p.skyline[j].width;
+    }
+    if (top + h > PXSCENE_FONT_ATLAS_DIM)
+      continue;
+
+    if (top + h < bestTop || (top + h == bestTop && p.skyline[i].width < bestWidth))
+    {
+      bestTop = top + h;
+      bestWidth = p.skyline[i].width;
+      index = i;
+      x = nodeX;
+      y = top;
+      found = true;
     }
   }
-  return false;
+  return found;
 }
 
-
-void pxTexturedQuads::draw(float x, float y, float* color)
+void pxFontAtlas::placeGlyph(page& p, uint32_t index, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
 {
-  for (uint32_t i = 0; i < mQuads.size(); i++)
+  skylineNode node;
+  node.x = x;
+  node.y = y+h;
+  node.width = w;
+  p.skyline.insert(p.skyline.begin()+index, node);
+
+  // trim the nodes now covered by the new one
+  for (uint32_t i = index+1; i < p.skyline.size();)
   {
-    quads& q = mQuads[i];
-    vector<float> verts(q.verts);
+    skylineNode& n = p.skyline[i];
+    skylineNode& prev = p.skyline[i-1];
+    if (n.x >= prev.x + prev.width)
+      break;
 
-    if (x!= 0 || y != 0)
+    uint32_t shrink = prev.x + prev.width - n.x;
+    if (n.width <= shrink)
     {
-      for (uint32_t j = 0; j < verts.size()/2; j++)
-      {
-        // offset x coords
-        verts[(j*2)] += x;
-        // offset y coords
-        verts[(j*2)+1] += y;
-      }
+      p.skyline.erase(p.skyline.begin()+i);
+      continue;
+    }
+    n.x += shrink;
+    n.width -= shrink;
+    break;
+  }
+
+  // merge neighbours at the same height
+  for (uint32_t i = 0; i+1 < p.skyline.size();)
+  {
+    if (p.skyline[i].y == p.skyline[i+1].y)
+    {
+      p.skyline[i].width += p.skyline[i+1].width;
+      p.skyline.erase(p.skyline.begin()+i+1);
     }
+    else
+      i++;
+  }
+}
+
+void pxFontAtlas::addPage(bool distanceField)
+{
+  page p;
+  p.texture = context.createTexture(PXSCENE_FONT_ATLAS_DIM,PXSCENE_FONT_ATLAS_DIM,PXSCENE_FONT_ATLAS_DIM,PXSCENE_FONT_ATLAS_DIM, NULL);
+  p.texture->setDistanceField(distanceField);
+  p.distanceField = distanceField;
+  skylineNode n;
+  n.x = 0;
+  n.y = 0;
+  n.width = PXSCENE_FONT_ATLAS_DIM;
+  p.skyline.push_back(n);
+  p.generation = ++mGeneration;
+  p.lastUsedTick = gRenderTick;
+  p.prev = PX_FONT_ATLAS_NO_PAGE;
+  p.next = PX_FONT_ATLAS_NO_PAGE;
+  mPages.push_back(p);
+  linkTail((uint32_t)mPages.size()-1);
+}
 
-    context.drawTexturedQuads(q.verts.size()/12, &verts[0], &q.uvs[0], q.t, color);
+void pxFontAtlas::evictPage(uint32_t index)
+{
+  rtLogInfo("font atlas full, evicting page %u", index);
+  page& p = mPages[index];
+
+  // clear the old glyphs so gaps between new glyphs stay transparent
+  void* zero = calloc(PXSCENE_FONT_ATLAS_DIM*PXSCENE_FONT_ATLAS_DIM, 1);
+  if (zero)
+  {
+    p.texture->updateTexture(0,0,PXSCENE_FONT_ATLAS_DIM,PXSCENE_FONT_ATLAS_DIM,zero);
+    free(zero);
+  }
+
+  skylineNode n;
+  n.x = 0;
+  n.y = 0;
+  n.width = PXSCENE_FONT_ATLAS_DIM;
+  p.skyline.clear();
+  p.skyline.push_back(n);
+
+  // cached glyph entries and built quads referencing the page are now stale
+  p.generation = ++mGeneration;
+}
+
+void pxTexturedQuads::draw(float x, float y, float* color)
+{
+  for (uint32_t i = 0; i < mQuads.size(); i++)
+  {
+    quads& q = mQuads[i];
+    gFontAtlas.touch(q.page);
+    // the x,y offset goes through the matrix so the vertices are not copied
+    context.drawTexturedQuads(q.vertices.size()/floatsPerQuad, &q.vertices[0], q.t, color, x, y);
   }
 }
 #endif
@@ -24,6 +24,8 @@
 #include "rtString.h"
 #include "rtRef.h"
 #include "rtCORS.h"
+#include "rtAtomic.h"
+#include "rtMutex.h"
 
 // TODO it would be nice to push this back into implemention
 #include <ft2build.h>
@@ -31,6 +33,7 @@
 
 #include "pxScene2d.h"
 #include <map>
+#include <set>
 #include <vector>
 
 using std::vector;
@@ -59,109 +62,266 @@ struct GlyphCacheEntry
   int32_t vertAdvance;
 };
 
+#define PX_FONT_ATLAS_NO_PAGE 0xffffffff
+
 struct GlyphTextureEntry
 {
   pxTextureRef t;
   float u1, v1, u2, v2;
-  GlyphTextureEntry(): u1(0),v1(0),u2(0),v2(0){}
+  // atlas page holding the glyph and the page generation it was packed in
+  uint32_t page, generation;
+  GlyphTextureEntry(): u1(0),v1(0),u2(0),v2(0),page(PX_FONT_ATLAS_NO_PAGE),generation(0){}
+};
+
+#define PX_GLYPH_SLOT_EMPTY 0xffffffff
+
+// Glyph metrics and texture for one code point, stored inline in a pxGlyphFace
+struct pxGlyphSlot
+{
+  uint32_t codePoint;
+  bool hasGlyph;
+  bool hasTexture;
+  GlyphCacheEntry glyph;
+  GlyphTextureEntry texture;
+  pxGlyphSlot(): codePoint(PX_GLYPH_SLOT_EMPTY), hasGlyph(false), hasTexture(false), glyph() {}
 };
 
+/**********************************************************************
+ *
+ * pxGlyphFace
+ *
+ * Glyph cache for a single font at a single pixel size.  Code points in
+ * the Latin-1 range are looked up directly by index; everything else
+ * lives in an open addressing table with linear probing.  Slot pointers
+ * stay valid until a different code point is inserted.
+ *
+ **********************************************************************/
+class pxGlyphFace
+{
+public:
+  pxGlyphFace();
+
+  pxGlyphSlot* find(uint32_t codePoint);
+  pxGlyphSlot* insert(uint32_t codePoint);
+  void clear();
+  uint32_t size() const { return mSize; }
+
+private:
+  static const uint32_t directSize = 256;
+  static const uint32_t initialSlots = 64;
+
+  uint32_t hashIndex(uint32_t codePoint) const { return (codePoint * 2654435761u) & (mSlots.size() - 1); }
+  void grow();
+
+  pxGlyphSlot mDirect[directSize];
+  vector<pxGlyphSlot> mSlots;
+  uint32_t mSize;
+  // entries in mSlots; the direct array does not load the probed table
+  uint32_t mProbedSize;
+};
+
+// A glyph rasterised ahead of first use by the warm-up worker.  bitmap
+// holds width*rows coverage bytes with no row padding.
+struct pxWarmupGlyph
+{
+  uint32_t pixelSize;
+  uint32_t codePoint;
+  bool distanceField;
+  GlyphCacheEntry metrics;
+  uint32_t width;
+  uint32_t rows;
+  vector<uint8_t> bitmap;
+};
+
+struct pxFontWarmup;
+
+#ifndef PXSCENE_DECODE_BUFFER_KEEP
+#define PXSCENE_DECODE_BUFFER_KEEP 4096
+#endif
+
+// Sizes a reused decode buffer to n elements.  A buffer grown past
+// PXSCENE_DECODE_BUFFER_KEEP by one long string is given back once the
+// text it holds is much shorter, instead of keeping its peak forever.
+template <typename T>
+inline void pxReserveDecodeBuffer(vector<T>& buffer, size_t n)
+{
+  if (buffer.capacity() > PXSCENE_DECODE_BUFFER_KEEP && buffer.capacity() > n*4)
+    vector<T>().swap(buffer);
+  buffer.resize(n);
+}
+
+// Rasterises codePoints at each of pixelSizes, or once as distance field
+// glyphs at the reference size, appending the results to glyphs.  Only
+// touches face, so it can run on any thread that owns face.
+void pxRasterizeGlyphs(FT_Face face, const vector<uint32_t>& pixelSizes,
+                       const vector<uint32_t>& codePoints, bool distanceField,
+                       vector<pxWarmupGlyph>& glyphs);
+
 #ifdef PXSCENE_FONT_ATLAS
+#ifndef PXSCENE_FONT_ATLAS_DIM
+#define PXSCENE_FONT_ATLAS_DIM 2048
+#endif
+#ifndef PXSCENE_FONT_ATLAS_MAX_PAGES
+#define PXSCENE_FONT_ATLAS_MAX_PAGES 4
+#endif
+// glyphs larger than this in either dimension get a texture of their own
+#ifndef PXSCENE_FONT_ATLAS_MAX_GLYPH_SIZE
+#define PXSCENE_FONT_ATLAS_MAX_GLYPH_SIZE (PXSCENE_FONT_ATLAS_DIM/4)
+#endif
+// distance field glyphs are rasterised once at this pixel size and scaled
+// to every other size; the field extends this many pixels past the outline
+#ifndef PXSCENE_FONT_SDF_REFERENCE_SIZE
+#define PXSCENE_FONT_SDF_REFERENCE_SIZE 48
+#endif
+#ifndef PXSCENE_FONT_SDF_SPREAD
+#define PXSCENE_FONT_SDF_SPREAD 6
+#endif
+
+// Glyph atlas made of up to PXSCENE_FONT_ATLAS_MAX_PAGES textures packed
+// with a skyline allocator.  When every page is full the least recently
+// drawn page is cleared and reused.  Each page has a generation that changes
+// when it is reused, so only quads built from that page need rebuilding.
+// Pages drawn or filled in the current frame are never evicted.
 class pxFontAtlas
 {
 public:
 
-
-  struct row
+  struct skylineNode
   {
-    uint32_t top;
-    uint32_t height;
-    uint32_t rFence;
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
   };
 
+  struct page
+  {
+    pxTextureRef texture;
+    vector<skylineNode> skyline;
+    uint32_t generation;
+    // frame the page was last drawn or filled in
+    uint32_t lastUsedTick;
+    // neighbours in least recently used order
+    uint32_t prev;
+    uint32_t next;
+    bool distanceField;
+  };
 
   pxFontAtlas();
 
-  bool addGlyph(uint32_t w, uint32_t h, void* buffer, GlyphTextureEntry& e);
+  // distance field glyphs are kept on pages of their own
+  bool addGlyph(uint32_t w, uint32_t h, void* buffer, GlyphTextureEntry& e, bool distanceField=false);
+  bool isValid(const GlyphTextureEntry& e) const;
+  bool isCurrent(uint32_t page, uint32_t generation) const;
+  // marks the page as drawn in this frame
+  void touch(uint32_t page);
   void clearTexture();
 
+  uint32_t pageCount() const { return (uint32_t)mPages.size(); }
+  uint64_t textureMemoryUsage() const;
 
   private:
 
-  uint32_t fence;
-  pxTextureRef mTexture;
-  vector<row> mRows;
+  bool findPosition(const page& p, uint32_t w, uint32_t h, uint32_t& index, uint32_t& x, uint32_t& y) const;
+  void placeGlyph(page& p, uint32_t index, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+  void addPage(bool distanceField);
+  void evictPage(uint32_t index);
+  void unlink(uint32_t index);
+  void linkTail(uint32_t index);
+
+  vector<page> mPages;
+  uint32_t mGeneration;
+  uint32_t mLruHead;
+  uint32_t mLruTail;
 };
 
+extern pxFontAtlas gFontAtlas;
+
+// Signed distance field of a coverage bitmap, padded by spread on each side
+void pxBuildDistanceField(const uint8_t* src, int w, int h, int pitch, int spread,
+                          vector<uint8_t>& field, int& fw, int& fh);
+
 class pxTexturedQuads
 {
-  // limit the size of vectors per quad to prevent memory
+  // limit the number of quads per batch to prevent memory
   // issues when rendering
-  static const int maxVectorSize = 60000;
+  static const uint32_t maxQuadsPerBatch = 5000;
   public:
 
+  // two triangles of interleaved x,y,u,v vertices per quad
+  static const uint32_t floatsPerQuad = 24;
+
   struct quads
   {
-    vector<float> verts;
-    vector<float> uvs;
+    vector<float> vertices;
     pxTextureRef t;
+    // atlas page of t and its generation when the quads were built
+    uint32_t page;
+    uint32_t generation;
   };
 
-  pxTexturedQuads() {}
+  pxTexturedQuads(): mReserveQuads(0) {}
 
-  void addQuad(float x1,float y1,float x2,float y2, float u1, float v1, float u2, float v2, pxTextureRef t)
+  // expected number of quads, used to size vertex storage up front
+  void reserve(uint32_t numQuads) { mReserveQuads = numQuads; }
+
+  void addQuad(float x1,float y1,float x2,float y2, const GlyphTextureEntry& e)
   {
-    if (mQuads.empty() || mQuads[mQuads.size()-1].t != t || mQuads[mQuads.size()-1].verts.size() >= maxVectorSize)
+    float u1 = e.u1, v1 = e.v1, u2 = e.u2, v2 = e.v2;
+    if (mQuads.empty() || mQuads.back().t != e.t || mQuads.back().generation != e.generation ||
+        mQuads.back().vertices.size() >= maxQuadsPerBatch*floatsPerQuad)
     {
-      quads q;
-      q.t = t;
-      mQuads.push_back(q);
+      mQuads.push_back(quads());
+      mQuads.back().t = e.t;
+      mQuads.back().page = e.page;
+      mQuads.back().generation = e.generation;
+      mQuads.back().vertices.reserve(pxMin<uint32_t>(pxMax<uint32_t>(mReserveQuads, 1), maxQuadsPerBatch)*floatsPerQuad);
     }
 
-    quads& q = mQuads[mQuads.size()-1];
-    vector<float>& v = q.verts;
-    vector<float>& u = q.uvs;
+    vector<float>& vertices = mQuads.back().vertices;
+    size_t n = vertices.size();
+    vertices.resize(n+floatsPerQuad);
+    float* d = &vertices[n];
 
     // triangle 1
-    v.push_back(x1);
-    v.push_back(y1);
-    v.push_back(x2);
-    v.push_back(y1);
-    v.push_back(x1);
-    v.push_back(y2);
+    d[0]  = x1; d[1]  = y1; d[2]  = u1; d[3]  = v1;
+    d[4]  = x2; d[5]  = y1; d[6]  = u2; d[7]  = v1;
+    d[8]  = x1; d[9]  = y2; d[10] = u1; d[11] = v2;
     // triangle 2
-    v.push_back(x2);
-    v.push_back(y1);
-    v.push_back(x1);
-    v.push_back(y2);
-    v.push_back(x2);
-    v.push_back(y2);
-
-    // triangle 1 uvs
-    u.push_back(u1);
-    u.push_back(v1);
-    u.push_back(u2);
-    u.push_back(v1);
-    u.push_back(u1);
-    u.push_back(v2);
-    // triangle 2 uvs
-    u.push_back(u2);
-    u.push_back(v1);
-    u.push_back(u1);
-    u.push_back(v2);
-    u.push_back(u2);
-    u.push_back(v2);
+    d[12] = x2; d[13] = y1; d[14] = u2; d[15] = v1;
+    d[16] = x1; d[17] = y2; d[18] = u1; d[19] = v2;
+    d[20] = x2; d[21] = y2; d[22] = u2; d[23] = v2;
   }
 
   void draw(float x, float y, float* color);
 
+  // bytes held by the vertices
+  size_t memoryUsage() const
+  {
+    size_t bytes = 0;
+    for (uint32_t i = 0; i < mQuads.size(); i++)
+      bytes += mQuads[i].vertices.capacity()*sizeof(float);
+    return bytes;
+  }
+
   void clear()
   {
     mQuads.clear();
   }
 
+  // true when a page the quads were built from has been evicted since
+  bool isStale() const
+  {
+    for (uint32_t i = 0; i < mQuads.size(); i++)
+    {
+      if (!gFontAtlas.isCurrent(mQuads[i].page, mQuads[i].generation))
+        return true;
+    }
+    return false;
+  }
+
 private:
   vector<quads> mQuads;
+  uint32_t mReserveQuads;
 };
 
 #endif
@@ -241,6 +401,64 @@ protected:
   int32_t mh;
 };
 
+/**********************************************************************
+ *
+ * pxFontFace
+ *
+ * Font file bytes and the FreeType face opened over them.  Local files
+ * are memory mapped instead of read into the heap, and faces are shared
+ * no matter which url or scene a pxFont was loaded for: mapped files by
+ * device, inode, size and modification time, heap buffers by a hash of
+ * their bytes.  Faces are only used from the UI thread.
+ *
+ **********************************************************************/
+class pxFontFace
+{
+public:
+  // Return the face for the file or bytes, opening a new one only when no
+  // face for the same file or content exists.  fromData copies data if it has to
+  // keep it; fromHeapData takes ownership of malloc'ed data either way.
+  static rtRef<pxFontFace> fromFile(const char* path);
+  static rtRef<pxFontFace> fromData(const FT_Byte* data, size_t size);
+  static rtRef<pxFontFace> fromHeapData(char* data, size_t size);
+
+  unsigned long AddRef() { return rtAtomicInc(&mRef); }
+  unsigned long Release();
+
+  FT_Face face() const { return mFace; }
+  const char* data() const { return mData; }
+  size_t size() const { return mSize; }
+  bool isMapped() const { return mMapped; }
+  uint64_t heapMemoryUsage() const { return mMapped ? 0 : mSize; }
+
+  // the FreeType face holds one pixel size at a time for all the fonts
+  // sharing it, so the size is tracked here rather than per pxFont
+  void setPixelSize(uint32_t s);
+  uint32_t pixelSize() const { return mPixelSize; }
+
+  static uint32_t faceCount();
+
+private:
+  pxFontFace(char* data, size_t size, bool mapped, const rtString& key);
+  ~pxFontFace();
+  static rtRef<pxFontFace> find(const rtString& key);
+  static rtRef<pxFontFace> open(char* data, size_t size, bool mapped, const rtString& key);
+  static void freeData(char* data, size_t size, bool mapped);
+
+  rtAtomic mRef;
+  FT_Face mFace;
+  char* mData;
+  size_t mSize;
+  bool mMapped;
+  uint32_t mPixelSize;
+  rtString mKey;
+
+  static std::map<rtString, pxFontFace*> mFaces;
+  static rtMutex mFacesMutex;
+};
+
+typedef rtRef<pxFontFace> pxFontFaceRef;
+
 /**********************************************************************
  * 
  * pxFont
@@ -264,6 +482,11 @@ public:
   void setPixelSize(uint32_t s);  
   const GlyphCacheEntry* getGlyph(uint32_t codePoint);
   GlyphTextureEntry getGlyphTexture(uint32_t codePoint, float sx, float sy);  
+#ifdef PXSCENE_FONT_ATLAS
+  // metrics is set to the glyph placement at the reference size, or NULL
+  // if no distance field glyph could be made
+  GlyphTextureEntry getSdfGlyphTexture(uint32_t codePoint, const GlyphCacheEntry*& metrics);
+#endif
   void getMetrics(uint32_t size, float& height, float& ascender, float& descender, float& naturalLeading);
   void getHeight(uint32_t size, float& height);
   void measureText(const char* text, uint32_t size, float& w, float& h);
@@ -271,6 +494,16 @@ public:
                    float& w, float& h);
   void measureTextChar(u_int32_t codePoint, uint32_t size,  float sx, float sy, 
                          float& w, float& h);
+  // Decodes text in bulk into a buffer owned by the font that stays valid
+  // until the next call.  offsets, if given, gets the byte offset of each
+  // code point.
+  const u_int32_t* decodeText(const char* text, int& count, vector<int>* offsets = NULL);
+  // Decodes text once.  offsets[k] is the byte offset of the k-th code point
+  // (offsets[n] is the terminator) and widths[k]/heights[k] are what
+  // measureTextInternal returns for the first k code points, so both are
+  // non-decreasing and can be binary searched.
+  void measureTextRun(const char* text, uint32_t size, vector<int>& offsets,
+                      vector<float>& widths, vector<float>& heights);
   #ifndef PXSCENE_FONT_ATLAS
   void renderText(const char *text, uint32_t size, float x, float y, 
                   float sx, float sy, 
@@ -288,9 +521,20 @@ public:
   bool isFontLoaded() { return mInitialized;}
 
 	void setFontData(const FT_Byte*  fontData, FT_Long size, const char* n);
+  // Takes over a malloc'ed buffer instead of copying it
+  void adoptFontData(char* fontData, FT_Long size, const char* n);
 	virtual void setupResource();
+  virtual uint64_t cpuMemoryUsage();
   void clearDownloadedData();
   uint32_t getFontId() { return mFontId;}
+  void clearGlyphCache();
+  // Glyph warm-up.  Text added before the font is ready picks the sizes and
+  // code points rasterised in the background once it is; addWarmupGlyphs()
+  // moves a finished batch into the glyph caches and the atlas.  The first
+  // glyph lookup after that waits for the batch rather than rasterising the
+  // same glyphs again.
+  void addWarmupText(uint32_t pixelSize, const char* text);
+  void addWarmupGlyphs(const vector<pxWarmupGlyph>& glyphs);
    
 protected:
   // Implementation for pxResource virtuals
@@ -301,19 +545,31 @@ private:
   void loadResourceFromArchive(rtObjectRef archiveRef);
   rtError init(const char* n);
   rtError init(const FT_Byte*  fontData, FT_Long size, const char* n); 
+  rtError initFace();
+  pxGlyphFace* glyphFace(uint32_t pixelSize);
+  void startWarmup();
+  static void warmupGlyphs(void* data);
+  static void onWarmupCompleteUI(void* context, void* data);
 
   // FreeType font info
   uint32_t mFontId;
-  FT_Face mFace;
+  pxFontFaceRef mFontFace;
+  FT_Face mFace; // mFontFace->face()
   uint32_t mPixelSize;
-  char* mFontData; // for remote fonts loaded into memory
-  size_t mFontDataSize;
   rtMutex mFontMutex;
 	rtMutex mFontDataMutex;
 	char* mFontDownloadedData;
 	size_t mFontDownloadedDataSize;
 	rtString mFontDataUrl;
-
+  std::map<uint32_t, pxGlyphFace*> mGlyphFaces;
+  pxGlyphFace* mCurrentGlyphFace;
+  uint32_t mCurrentGlyphFaceSize;
+  pxGlyphFace* mSdfGlyphFace;
+  bool mWarmupStarted;
+  pxFontWarmup* mWarmup; // in flight until onWarmupCompleteUI
+  std::set<uint32_t> mWarmupSizes;
+  std::set<uint32_t> mWarmupCodePoints;
+  vector<u_int32_t> mCodePoints;
 };
 
 // Weak Map
@@ -327,12 +583,26 @@ class pxFontManager
     static rtRef<pxFont> getFont(const char* url, const char* proxy = NULL, const rtCORSRef& cors = NULL, rtObjectRef archive = NULL);
     static void removeFont(uint32_t fontId);
     static void clearAllFonts();
+    // render atlas text from distance field glyphs ("enableSdfText" setting)
+    static bool sdfTextEnabled() { return mSdfTextEnabled; }
+    static void setSdfTextEnabled(bool enabled) { mSdfTextEnabled = enabled; }
+    // rasterise glyphs on a worker thread when a font becomes ready
+    // ("enableFontWarmup" setting, atlas builds only).  When no text is
+    // waiting on the font the code points come from "fontWarmupGlyphs",
+    // either the characters themselves or "latin1" (the default); an empty
+    // value warms up nothing
+    static bool warmupEnabled() { return mWarmupEnabled; }
+    static void setWarmupEnabled(bool enabled) { mWarmupEnabled = enabled; }
+    static void warmupCodePoints(vector<uint32_t>& codePoints);
     
   protected: 
     static void initFT();  
     static FontMap mFontMap;
     static FontIdMap mFontIdMap;
     static bool init;
+    static bool mSdfTextEnabled;
+    static bool mWarmupEnabled;
+    static rtString mWarmupGlyphs;
     
 };
 #endif
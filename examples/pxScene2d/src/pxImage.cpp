@@ -211,11 +211,20 @@ void pxImage::draw() {
                       getImageResource()->getTexture(), nullMaskRef,
                       false, NULL, mStretchX, mStretchY, mDownscaleSmooth, mMaskOp);
   }
-  // Raise the priority if we're still waiting on the image download    
-#if 0
-  if (!imageLoaded && getImageResource() != NULL && getImageResource()->isDownloadInProgress())
-    getImageResource()->raiseDownloadPriority();
-#endif
+  else if (getImageResource() != NULL && !mSceneSuspended)
+  {
+    getImageResource()->hintDownloadPriority(this, getOnscreenWidth(), getOnscreenHeight());
+    // the part of the image that has arrived so far
+    pxTextureRef partialTexture = getImageResource()->getPartialTexture();
+    if (partialTexture.getPtr() != NULL)
+    {
+      context.drawImage(0, 0,
+                        getOnscreenWidth(),
+                        getOnscreenHeight(),
+                        partialTexture, nullMaskRef,
+                        false, NULL, mStretchX, mStretchY, mDownscaleSmooth, mMaskOp);
+    }
+  }
 }
 void pxImage::resourceReady(rtString readyResolution)
 {
@@ -368,6 +377,17 @@ uint64_t pxImage::textureMemoryUsage()
   return textureMemory;
 }
 
+uint64_t pxImage::cpuMemoryUsage()
+{
+  uint64_t cpuMemory = 0;
+  if (getImageResource())
+  {
+    cpuMemory += getImageResource()->cpuMemoryUsage();
+  }
+  cpuMemory += pxObject::cpuMemoryUsage();
+  return cpuMemory;
+}
+
 rtDefineObject(pxImage,pxObject);
 rtDefineProperty(pxImage, url);
 rtDefineProperty(pxImage, resource);
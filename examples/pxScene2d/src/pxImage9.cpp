@@ -163,6 +163,10 @@ void pxImage9::draw() {
   {
     context.drawImage9(mw, mh, mInsetLeft, mInsetTop, mInsetRight, mInsetBottom, getImageResource()->getTexture());
   }
+  else if (getImageResource() != NULL && !mSceneSuspended)
+  {
+    getImageResource()->hintDownloadPriority(this, mw, mh);
+  }
 }
 
 void pxImage9::resourceReady(rtString readyResolution)
@@ -243,6 +247,17 @@ uint64_t pxImage9::textureMemoryUsage()
   return textureMemory;
 }
 
+uint64_t pxImage9::cpuMemoryUsage()
+{
+  uint64_t cpuMemory = 0;
+  if (getImageResource())
+  {
+    cpuMemory += getImageResource()->cpuMemoryUsage();
+  }
+  cpuMemory += pxObject::cpuMemoryUsage();
+  return cpuMemory;
+}
+
 rtDefineObject(pxImage9, pxObject);
 rtDefineProperty(pxImage9, url);
 rtDefineProperty(pxImage9, insetLeft);
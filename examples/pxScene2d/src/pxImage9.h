@@ -73,6 +73,7 @@ public:
   virtual void releaseData(bool sceneSuspended);
   virtual void reloadData(bool sceneSuspended);
   virtual uint64_t textureMemoryUsage();
+  virtual uint64_t cpuMemoryUsage();
   
 protected:
   virtual void draw();
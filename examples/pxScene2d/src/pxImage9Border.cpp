@@ -45,6 +45,10 @@ void pxImage9Border::draw() {
     context.drawImage9Border(mw, mh, mBorderLeft, mBorderTop, mBorderRight, mBorderBottom, mInsetLeft, mInsetTop, mInsetRight, mInsetBottom,
                              mDrawCenter, mMaskColor, getImageResource()->getTexture());
   }
+  else if (getImageResource() != NULL && !mSceneSuspended)
+  {
+    getImageResource()->hintDownloadPriority(this, mw, mh);
+  }
 }
 
 rtDefineObject(pxImage9Border, pxImage9);
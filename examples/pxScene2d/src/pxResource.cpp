@@ -28,6 +28,10 @@
 #include "pxUtil.h"
 #include "rtThreadPool.h"
 #include "rtPathUtils.h"
+#include "pxTimer.h"
+
+#include <algorithm>
+#include <float.h>
 
 
 using namespace std;
@@ -35,7 +39,12 @@ using namespace std;
 extern rtThreadQueue* gUIThreadQueue;
 extern pxContext context;
 
+// least time between two partial images of the same download
+#define PX_PARTIAL_IMAGE_INTERVAL_MS 250
+
 rtThreadPool textureCreateThreadPool(1);
+// decodes image downloads as they arrive, off the download I/O thread
+static rtThreadPool imageStreamDecodeThreadPool(2);
 
 pxResource::~pxResource()
 {
@@ -281,7 +290,10 @@ void pxResource::raiseDownloadPriority()
 
 
 rtImageResource::rtImageResource()
-: pxResource(), mTexture(), mDownloadedTexture(), mTextureMutex(), mDownloadComplete(false), init_w(0), init_h(0), init_sx(0.0f), init_sy(0.0f), mData()
+: pxResource(), mTexture(), mDownloadedTexture(), mTextureMutex(), mDownloadComplete(false), init_w(0), init_h(0), init_sx(0.0f), init_sy(0.0f), mData(),
+  mStreamChunksMutex(), mStreamChunksCondition(), mStreamChunks(), mStreamChunksRequest(NULL), mStreamDecodeScheduled(false),
+  mStreamDecoderMutex(), mStreamDecoder(NULL), mStreamRequest(NULL), mPartialRows(0), mPartialImageTime(0),
+  mPartialTexture(), mPartialWidth(0), mPartialHeight(0), mDownloadPriorityHint(RT_DOWNLOAD_PRIORITY_PREFETCH)
 {
   // empty
 }
@@ -289,7 +301,10 @@ rtImageResource::rtImageResource()
 rtImageResource::rtImageResource(const char* url, const char* proxy, int32_t iw /* = 0 */,  int32_t ih /* = 0 */,
                                                                        float sx /* = 1.0f*/,  float sy /* = 1.0f*/ )
     : pxResource(), mTexture(), mDownloadedTexture(), mTextureMutex(), mDownloadComplete(false),
-      init_w(iw), init_h(ih), init_sx(sx), init_sy(sy), mData()
+      init_w(iw), init_h(ih), init_sx(sx), init_sy(sy), mData(),
+      mStreamChunksMutex(), mStreamChunksCondition(), mStreamChunks(), mStreamChunksRequest(NULL), mStreamDecodeScheduled(false),
+      mStreamDecoderMutex(), mStreamDecoder(NULL), mStreamRequest(NULL), mPartialRows(0), mPartialImageTime(0),
+      mPartialTexture(), mPartialWidth(0), mPartialHeight(0), mDownloadPriorityHint(RT_DOWNLOAD_PRIORITY_PREFETCH)
 {
   setUrl(url, proxy);
 }
@@ -298,10 +313,17 @@ rtImageResource::~rtImageResource()
 {
   //rtLogDebug("destructor for rtImageResource for %s\n",mUrl.cString());
   //pxImageManager::removeImage( mUrl);
-  if (mTexture.getPtr())
+  if (!mContentHash.isEmpty())
+  {
+    pxImageManager::removeContentTexture(mContentHash, this);
+  }
+  else if (mTexture.getPtr())
   {
     mTexture->setTextureListener(NULL);
   }
+  pxImageManager::removePendingDownload(this, NULL);
+  waitForStreamChunks();
+  delete mStreamDecoder;
 }
 
 unsigned long rtImageResource::Release()
@@ -337,6 +359,7 @@ void rtImageResource::releaseData()
     }
     mTextureMutex.unlock();
   }
+  mPartialTexture = NULL;
   pxResource::releaseData();
 }
 
@@ -364,6 +387,22 @@ uint64_t rtImageResource::textureMemoryUsage()
   return textureMemory;
 }
 
+uint64_t rtImageResource::cpuMemoryUsage()
+{
+  uint64_t cpuMemory = 0;
+  mTextureMutex.lock();
+  if (mTexture.getPtr() != NULL)
+  {
+    cpuMemory += mTexture->cpuMemoryUsage();
+  }
+  if (mDownloadedTexture.getPtr() != NULL && mDownloadedTexture != mTexture)
+  {
+    cpuMemory += mDownloadedTexture->cpuMemoryUsage();
+  }
+  mTextureMutex.unlock();
+  return cpuMemory;
+}
+
 void rtImageResource::textureReady()
 {
   if (gUIThreadQueue)
@@ -379,7 +418,7 @@ int32_t rtImageResource::w() const
   if(mTexture.getPtr())
     return mTexture->width();
   else
-    return 0;
+    return mPartialWidth;
 }
 rtError rtImageResource::w(int32_t& v) const
 {
@@ -387,7 +426,7 @@ rtError rtImageResource::w(int32_t& v) const
   if(mTexture.getPtr())
     v = mTexture->width();
   else
-    v = 0;
+    v = mPartialWidth;
   return RT_OK;
 }
 int32_t rtImageResource::h() const
@@ -396,7 +435,7 @@ int32_t rtImageResource::h() const
   if(mTexture.getPtr())
     return mTexture->height();
   else
-    return 0;
+    return mPartialHeight;
 }
 rtError rtImageResource::h(int32_t& v) const
 {
@@ -404,7 +443,7 @@ rtError rtImageResource::h(int32_t& v) const
   if(mTexture.getPtr())
     v = mTexture->height();
   else
-    v = 0;
+    v = mPartialHeight;
   return RT_OK;
 }
 
@@ -417,7 +456,8 @@ pxTextureRef rtImageResource::getTexture(bool initializing)
     {
       mTexture = mDownloadedTexture;
       mDownloadedTexture = NULL;
-      if (mTexture.getPtr())
+      mPartialTexture = NULL;
+      if (mTexture.getPtr() && mContentHash.isEmpty())
       {
         mTexture->setTextureListener(this);
       }
@@ -427,6 +467,11 @@ pxTextureRef rtImageResource::getTexture(bool initializing)
   return mTexture;
 }
 
+pxTextureRef rtImageResource::getPartialTexture()
+{
+  return mPartialTexture;
+}
+
 void prepareImageResource(void* data)
 {
   rtImageResource* imageResource = (rtImageResource*)data;
@@ -457,27 +502,99 @@ void rtImageResource::prepare()
   }
 }
 
-void rtImageResource::setTextureData(pxOffscreen& imageOffscreen, const char* data, const size_t dataSize)
+// compressedDataUrl is where the texture can read data back from after releasing
+// it, or NULL if it has to keep its copy
+void rtImageResource::setTextureData(pxOffscreen& imageOffscreen, const char* data, const size_t dataSize,
+                                     const char* compressedDataUrl)
 {
   mTextureMutex.lock();
 #ifdef ENABLE_BACKGROUND_TEXTURE_CREATION
-  mDownloadedTexture = context.createTexture(imageOffscreen, data, dataSize);
+  if (createSharedTexture(imageOffscreen, data, dataSize, compressedDataUrl, mDownloadedTexture))
+  {
+    // another resource finished decoding the same bytes first; its texture is already prepared
+    mDownloadComplete = true;
+    mTextureMutex.unlock();
+    setLoadStatus("statusCode", 0);
+    if (gUIThreadQueue)
+    {
+      gUIThreadQueue->addTask(pxResource::onDownloadCompleteUI, this, (void*)"resolve");
+    }
+    return;
+  }
   mTextureMutex.unlock();
   rtThreadTask* task = new rtThreadTask(prepareImageResource, (void*)this, "");
   textureCreateThreadPool.executeTask(task);
 #else
-  mDownloadedTexture = context.createTexture(imageOffscreen, data, dataSize);
+  createSharedTexture(imageOffscreen, data, dataSize, compressedDataUrl, mDownloadedTexture);
   mDownloadComplete = true;
   mTextureMutex.unlock();
 #endif //ENABLE_BACKGROUND_TEXTURE_CREATION
 }
 
+// Computes the content key for the encoded image and returns an already decoded
+// texture with the same content if there is one
+bool rtImageResource::findSharedTexture(const uint8_t* data, size_t length, pxTextureRef& texture)
+{
+  if (!pxImageManager::contentDedupEnabled() || data == NULL || length == 0)
+  {
+    return false;
+  }
+
+  rtString key = sha256sum(data, length);
+  // decode parameters change the resulting bitmap (SVG)
+  if (init_sx != 1.0 || init_sy != 1.0)
+  {
+    rtValue xx = init_sx;
+    rtValue yy = init_sy;
+    key += "sx" + xx.toString() + "sy" + yy.toString();
+  }
+  if (init_w > 0 || init_h > 0)
+  {
+    rtValue ww = init_w;
+    rtValue hh = init_h;
+    key += ww.toString() + "x" + hh.toString();
+  }
+  mContentHash = key;
+
+  return pxImageManager::findContentTexture(mContentHash, this, texture);
+}
+
+// Creates the texture for decoded pixels and publishes it under mContentHash.
+// Returns true if an identical texture was published while the pixels were
+// decoded; texture then refers to it and no new texture is created.
+bool rtImageResource::createSharedTexture(pxOffscreen& o, const char* data, size_t dataSize,
+                                          const char* compressedDataUrl, pxTextureRef& texture)
+{
+  if (mContentHash.isEmpty())
+  {
+    texture = context.createTexture(o, data, dataSize);
+    if (compressedDataUrl != NULL)
+    {
+      texture->setCompressedDataUrl(compressedDataUrl);
+    }
+    return false;
+  }
+  return pxImageManager::addContentTexture(mContentHash, this, o, data, dataSize, compressedDataUrl, texture);
+}
+
 void rtImageResource::setupResource()
 {
   getTexture(true);
+  if (!mTexture.getPtr())
+  {
+    // the download failed
+    mPartialTexture = NULL;
+    mPartialWidth = mPartialHeight = 0;
+  }
   init();
 }
 
+void rtImageResource::downloadCanceled()
+{
+  mPartialTexture = NULL;
+  mPartialWidth = mPartialHeight = 0;
+}
+
 void pxResource::clearDownloadRequest()
 {
   mDownloadInProgressMutex.lock();
@@ -505,6 +622,11 @@ uint64_t pxResource::textureMemoryUsage()
   return 0;
 }
 
+uint64_t pxResource::cpuMemoryUsage()
+{
+  return 0;
+}
+
 /**
  * rtImageResource::loadResource()
  *
@@ -533,6 +655,7 @@ void pxResource::loadResource(rtObjectRef archive)
 #ifdef ENABLE_CORS_FOR_RESOURCES
       mDownloadRequest->setCORS(mCORS);
 #endif
+      prepareDownloadRequest(mDownloadRequest);
       mDownloadInProgressMutex.lock();
       mDownloadInProgress = true;
       mDownloadInProgressMutex.unlock();
@@ -568,6 +691,7 @@ void pxResource::onDownloadCanceledUI(void* context, void* data)
   (void)data;
   pxResource* res = (rtImageResource*)context;
 
+  res->downloadCanceled();
   res->Release();
 }
 
@@ -589,6 +713,8 @@ void rtImageResource::loadResourceFromFile()
   rtString status = "resolve";
 
   rtError loadImageSuccess = RT_FAIL;
+  // where the texture can read the file again if its copy is released
+  rtString filePath;
 
   do
   {
@@ -601,7 +727,10 @@ void rtImageResource::loadResourceFromFile()
 
     loadImageSuccess = rtLoadFile(mUrl, mData);
     if (loadImageSuccess == RT_OK)
+    {
+      filePath = mUrl;
       break;
+    }
 
     if (rtIsPathAbsolute(mUrl))
       break;
@@ -610,18 +739,25 @@ void rtImageResource::loadResourceFromFile()
 
     for (rtModuleDirs::iter it = dirs->iterator(); it.first != it.second; it.first++)
     {
-      if (rtLoadFile(rtConcatenatePath(*it.first, mUrl.cString()).c_str(), mData) == RT_OK)
+      std::string path = rtConcatenatePath(*it.first, mUrl.cString());
+      if (rtLoadFile(path.c_str(), mData) == RT_OK)
       {
         loadImageSuccess = RT_OK;
+        filePath = path.c_str();
         break;
       }
     }
   } while(0);
 
+  bool sharedTexture = false;
   if (loadImageSuccess == RT_OK)
   {
-    loadImageSuccess = pxLoadImage((const char *) mData.data(), mData.length(), imageOffscreen,
-                                      init_w, init_h, init_sx, init_sy);
+    sharedTexture = findSharedTexture(mData.data(), mData.length(), mTexture);
+    if (!sharedTexture)
+    {
+      loadImageSuccess = pxLoadImage((const char *) mData.data(), mData.length(), imageOffscreen,
+                                        init_w, init_h, init_sx, init_sy);
+    }
   }
   else
   {
@@ -654,8 +790,15 @@ void rtImageResource::loadResourceFromFile()
   else
   {
     // create offscreen texture for local image
-    mTexture = context.createTexture(imageOffscreen, (const char *) mData.data(), mData.length());
-    mTexture->setTextureListener(this);
+    if (!sharedTexture)
+    {
+      createSharedTexture(imageOffscreen, (const char *) mData.data(), mData.length(),
+                          filePath.isEmpty() ? NULL : filePath.cString(), mTexture);
+    }
+    if (mContentHash.isEmpty())
+    {
+      mTexture->setTextureListener(this);
+    }
 
     mData.term(); // Dump the source data...
 
@@ -701,10 +844,15 @@ void rtImageResource::loadResourceFromArchive(rtObjectRef archiveRef)
     loadImageSuccess = RT_OK;
   }
 
+  bool sharedTexture = false;
   if (loadImageSuccess == RT_OK)
   {
-    loadImageSuccess = pxLoadImage((const char *) mData.data(), mData.length(), imageOffscreen,
-                                      init_w, init_h, init_sx, init_sy);
+    sharedTexture = findSharedTexture(mData.data(), mData.length(), mTexture);
+    if (!sharedTexture)
+    {
+      loadImageSuccess = pxLoadImage((const char *) mData.data(), mData.length(), imageOffscreen,
+                                        init_w, init_h, init_sx, init_sy);
+    }
   }
   else
   {
@@ -737,8 +885,14 @@ void rtImageResource::loadResourceFromArchive(rtObjectRef archiveRef)
   else
   {
     // create offscreen texture for local image
-    mTexture = context.createTexture(imageOffscreen, (const char *) mData.data(), mData.length());
-    mTexture->setTextureListener(this);
+    if (!sharedTexture)
+    {
+      createSharedTexture(imageOffscreen, (const char *) mData.data(), mData.length(), NULL, mTexture);
+    }
+    if (mContentHash.isEmpty())
+    {
+      mTexture->setTextureListener(this);
+    }
 
     mData.term(); // Dump the source data...
 
@@ -774,21 +928,289 @@ void pxResource::onDownloadComplete(rtFileDownloadRequest* fileDownloadRequest)
 
 uint32_t rtImageResource::loadResourceData(rtFileDownloadRequest* fileDownloadRequest)
 {
+      pxTextureRef sharedTexture;
+      if (findSharedTexture((const uint8_t*)fileDownloadRequest->downloadedData(),
+                            fileDownloadRequest->downloadedDataSize(), sharedTexture))
+      {
+        mTextureMutex.lock();
+        mDownloadedTexture = sharedTexture;
+        mDownloadComplete = true;
+        mTextureMutex.unlock();
+        return PX_RESOURCE_LOAD_SUCCESS;
+      }
+
+      // every chunk has arrived; let the decode task finish with them
+      waitForStreamChunks();
+      pxImageStreamDecoder* streamDecoder = NULL;
+      mStreamDecoderMutex.lock();
+      if (mStreamRequest == fileDownloadRequest)
+      {
+        streamDecoder = mStreamDecoder;
+        mStreamDecoder = NULL;
+        mStreamRequest = NULL;
+      }
+      mStreamDecoderMutex.unlock();
+
+      uint32_t result = PX_RESOURCE_LOAD_FAIL;
       pxOffscreen imageOffscreen;
-      if (pxLoadImage(fileDownloadRequest->downloadedData(),
-                      fileDownloadRequest->downloadedDataSize(),
-                      imageOffscreen, init_w, init_h, init_sx, init_sy) == RT_OK)
+      pxOffscreen* decodedOffscreen = NULL;
+      if (streamDecoder != NULL && streamDecoder->finish() == RT_OK)
+      {
+        // decoded while it downloaded
+        decodedOffscreen = &streamDecoder->offscreen();
+      }
+      else if (pxLoadImage(fileDownloadRequest->downloadedData(),
+                           fileDownloadRequest->downloadedDataSize(),
+                           imageOffscreen, init_w, init_h, init_sx, init_sy) == RT_OK)
+      {
+        decodedOffscreen = &imageOffscreen;
+      }
+
+      if (decodedOffscreen != NULL)
       {
-        setTextureData(imageOffscreen, fileDownloadRequest->downloadedData(),
-                                         fileDownloadRequest->downloadedDataSize());
+        // decided once here: a released download is only ever read back from
+        // the cache, so it has to be there
+        const char* compressedDataUrl = mUrl.cString();
+        if (mUrl.beginsWith("http:") || mUrl.beginsWith("https:"))
+        {
+#ifdef ENABLE_HTTP_CACHE
+          if (!fileDownloadRequest->isDataCached() && !fileDownloadRequest->isDataQueuedForCache())
+          {
+            compressedDataUrl = NULL;
+          }
+#else
+          compressedDataUrl = NULL;
+#endif //ENABLE_HTTP_CACHE
+        }
+        setTextureData(*decodedOffscreen, fileDownloadRequest->downloadedData(),
+                                          fileDownloadRequest->downloadedDataSize(), compressedDataUrl);
 #ifdef ENABLE_BACKGROUND_TEXTURE_CREATION
-        return PX_RESOURCE_LOAD_WAIT;
+        result = PX_RESOURCE_LOAD_WAIT;
 #else
-        return PX_RESOURCE_LOAD_SUCCESS;
+        result = PX_RESOURCE_LOAD_SUCCESS;
 #endif  //ENABLE_BACKGROUND_TEXTURE_CREATION
       }
 
-      return PX_RESOURCE_LOAD_FAIL;
+      delete streamDecoder;
+      return result;
+}
+
+void rtImageResource::processDownloadedResource(rtFileDownloadRequest* fileDownloadRequest)
+{
+  pxImageManager::removePendingDownload(this, fileDownloadRequest);
+  pxResource::processDownloadedResource(fileDownloadRequest);
+  // failed, canceled and shared downloads leave the decoder behind
+  releaseStreamDecoder(fileDownloadRequest);
+}
+
+// The texture keeps the encoded bytes for reloading, so the body is still
+// collected; decoding it as it arrives saves the decode after the last byte
+void rtImageResource::prepareDownloadRequest(rtFileDownloadRequest* fileDownloadRequest)
+{
+  pxImageManager::addPendingDownload(this, fileDownloadRequest);
+  if (!pxImageManager::streamingDecodeEnabled())
+  {
+    return;
+  }
+  mStreamChunksMutex.lock();
+  // chunks of an earlier request are dropped by the decoder's request check
+  mStreamChunks.clear();
+  mStreamChunksRequest = fileDownloadRequest;
+  mStreamChunksMutex.unlock();
+  mStreamDecoderMutex.lock();
+  delete mStreamDecoder;
+  mStreamDecoder = new pxImageStreamDecoder();
+  mStreamRequest = fileDownloadRequest;
+  mPartialRows = 0;
+  mPartialImageTime = 0;
+  mStreamDecoderMutex.unlock();
+  fileDownloadRequest->setStreamConsumer(this);
+}
+
+void rtImageResource::releaseStreamDecoder(rtFileDownloadRequest* fileDownloadRequest)
+{
+  mStreamChunksMutex.lock();
+  if (mStreamChunksRequest == fileDownloadRequest)
+  {
+    mStreamChunksRequest = NULL;
+  }
+  mStreamChunksMutex.unlock();
+  waitForStreamChunks();
+  mStreamDecoderMutex.lock();
+  if (mStreamRequest == fileDownloadRequest)
+  {
+    delete mStreamDecoder;
+    mStreamDecoder = NULL;
+    mStreamRequest = NULL;
+  }
+  mStreamDecoderMutex.unlock();
+}
+
+// Called on the download thread with each chunk of the image.  Only copies
+// the chunk, so a slow decode never holds up the other transfers.
+void rtImageResource::onDownloadData(rtFileDownloadRequest* downloadRequest, const char* data, size_t size)
+{
+  bool schedule = false;
+  mStreamChunksMutex.lock();
+  if (mStreamChunksRequest == downloadRequest)
+  {
+    mStreamChunks.insert(mStreamChunks.end(), data, data + size);
+    schedule = !mStreamDecodeScheduled;
+    mStreamDecodeScheduled = true;
+  }
+  mStreamChunksMutex.unlock();
+  if (schedule)
+  {
+    imageStreamDecodeThreadPool.executeTask(new rtThreadTask(decodeStreamChunks, this, ""));
+  }
+}
+
+// Feeds the queued chunks to the decoder until none are left.  The
+// resource outlives the task since everything that ends a download or the
+// resource waits in waitForStreamChunks() first.
+void rtImageResource::decodeStreamChunks(void* data)
+{
+  rtImageResource* resource = (rtImageResource*)data;
+  std::vector<char> chunks;
+  while (true)
+  {
+    resource->mStreamChunksMutex.lock();
+    chunks.clear();
+    chunks.swap(resource->mStreamChunks);
+    if (chunks.empty())
+    {
+      resource->mStreamDecodeScheduled = false;
+      resource->mStreamChunksCondition.broadcast();
+      resource->mStreamChunksMutex.unlock();
+      return;
+    }
+    rtFileDownloadRequest* downloadRequest = resource->mStreamChunksRequest;
+    resource->mStreamChunksMutex.unlock();
+    resource->decodeStreamData(downloadRequest, &chunks[0], chunks.size());
+  }
+}
+
+void rtImageResource::waitForStreamChunks()
+{
+  mStreamChunksMutex.lock();
+  while (mStreamDecodeScheduled)
+  {
+    mStreamChunksCondition.wait(mStreamChunksMutex.getNativeMutexDescription());
+  }
+  mStreamChunksMutex.unlock();
+}
+
+void rtImageResource::decodeStreamData(rtFileDownloadRequest* downloadRequest, const char* data, size_t size)
+{
+  mStreamDecoderMutex.lock();
+  if (mStreamDecoder != NULL && mStreamRequest == downloadRequest && !mStreamDecoder->failed())
+  {
+    mStreamDecoder->write(data, size);
+    if (pxImageManager::partialImagesEnabled() &&
+        mStreamDecoder->hasImageSize() && !mStreamDecoder->isComplete() &&
+        mStreamDecoder->rowsDecoded() != mPartialRows &&
+        pxMilliseconds() - mPartialImageTime >= PX_PARTIAL_IMAGE_INTERVAL_MS)
+    {
+      publishPartialImage();
+    }
+  }
+  mStreamDecoderMutex.unlock();
+}
+
+// Hands a copy of the rows decoded so far to the UI thread, which turns it
+// into the texture shown until the complete image replaces it
+void rtImageResource::publishPartialImage()
+{
+  pxOffscreen* partialOffscreen = new pxOffscreen();
+  if (mStreamDecoder->snapshot(*partialOffscreen) != RT_OK || gUIThreadQueue == NULL)
+  {
+    delete partialOffscreen;
+    return;
+  }
+  mPartialRows = mStreamDecoder->rowsDecoded();
+  mPartialImageTime = pxMilliseconds();
+  AddRef();
+  gUIThreadQueue->addTask(rtImageResource::onPartialImageUI, this, partialOffscreen);
+}
+
+void rtImageResource::hintDownloadPriority(pxObject* o, float w, float h)
+{
+  // the context's matrix and size are those of an fbo while drawing into
+  // one, so place the object in the top scene instead.  A child scene is
+  // drawn at the origin of its container, so each container on the way up
+  // adds its own matrix in its parent scene.
+  pxScene2d* scene = o->getScene();
+  if (scene == NULL)
+  {
+    return;
+  }
+  pxMatrix4f m;
+  pxObject::getMatrixFromObjectToScene(o, m);
+  pxObject* container = dynamic_cast<pxObject*>(scene->viewContainer());
+  while (container != NULL && container->getScene() != NULL)
+  {
+    pxMatrix4f c;
+    pxObject::getMatrixFromObjectToScene(container, c);
+    c.multiply(m);
+    m = c;
+    scene = container->getScene();
+    container = dynamic_cast<pxObject*>(scene->viewContainer());
+  }
+  int screenW = scene->w(), screenH = scene->h();
+  const float corners[4][2] = { {0, 0}, {w, 0}, {0, h}, {w, h} };
+  float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+  for (int i = 0; i < 4; i++)
+  {
+    pxVector4f corner = m.multiply(pxVector4f(corners[i][0], corners[i][1], 0, 1));
+    minX = std::min(minX, corner.x());
+    minY = std::min(minY, corner.y());
+    maxX = std::max(maxX, corner.x());
+    maxY = std::max(maxY, corner.y());
+  }
+
+  // near means within a screen of the visible area
+  rtFileDownloadPriority priority = RT_DOWNLOAD_PRIORITY_PREFETCH;
+  if (maxX >= 0 && minX <= screenW && maxY >= 0 && minY <= screenH)
+  {
+    priority = RT_DOWNLOAD_PRIORITY_VISIBLE;
+  }
+  else if (maxX >= -screenW && minX <= 2 * screenW && maxY >= -screenH && minY <= 2 * screenH)
+  {
+    priority = RT_DOWNLOAD_PRIORITY_NEAR;
+  }
+  if (priority < mDownloadPriorityHint)
+  {
+    mDownloadPriorityHint = priority;
+  }
+}
+
+rtFileDownloadPriority rtImageResource::takeDownloadPriorityHint()
+{
+  rtFileDownloadPriority priority = mDownloadPriorityHint;
+  mDownloadPriorityHint = RT_DOWNLOAD_PRIORITY_PREFETCH;
+  return priority;
+}
+
+void rtImageResource::onPartialImageUI(void* resource, void* data)
+{
+  rtImageResource* res = (rtImageResource*)resource;
+  pxOffscreen* partialOffscreen = (pxOffscreen*)data;
+
+  res->mTextureMutex.lock();
+  bool downloadComplete = res->mDownloadComplete;
+  res->mTextureMutex.unlock();
+  if (!downloadComplete && res->mTexture.getPtr() == NULL)
+  {
+    res->mPartialTexture = context.createTexture(*partialOffscreen);
+    res->mPartialWidth = partialOffscreen->width();
+    res->mPartialHeight = partialOffscreen->height();
+    res->notifyListenersResourceDirty();
+  }
+  delete partialOffscreen;
+
+  // Release here since we had to addRef when setting up callback to
+  // this function
+  res->Release();
 }
 /** pxResource processDownloadedResource */
 void pxResource::processDownloadedResource(rtFileDownloadRequest* fileDownloadRequest)
@@ -1081,6 +1503,183 @@ void pxImageManager::removeImage(rtString name)
   }
 }
 
+ImageContentMap pxImageManager::mImageContentMap;
+rtMutex pxImageManager::mImageContentMutex;
+int32_t pxImageManager::mContentDedupEnabled = -1;
+uint32_t pxImageManager::mContentDedupHits = 0;
+rtMutex pxImageManager::mStreamingDecodeMutex;
+int32_t pxImageManager::mStreamingDecodeEnabled = -1;
+int32_t pxImageManager::mPartialImagesEnabled = -1;
+std::map<rtImageResource*, rtFileDownloadRequest*> pxImageManager::mPendingDownloads;
+rtMutex pxImageManager::mPendingDownloadsMutex;
+
+void pxImageManager::enableStreamingDecode(bool enable, bool partialImages)
+{
+  mStreamingDecodeMutex.lock();
+  mStreamingDecodeEnabled = enable ? 1 : 0;
+  mPartialImagesEnabled = (enable && partialImages) ? 1 : 0;
+  mStreamingDecodeMutex.unlock();
+}
+
+bool pxImageManager::streamingDecodeEnabled()
+{
+  mStreamingDecodeMutex.lock();
+  if (mStreamingDecodeEnabled < 0)
+  {
+    bool enabled = true;
+    rtSettings::instance()->boolValue("enableStreamingImageDecode", enabled);
+    mStreamingDecodeEnabled = enabled ? 1 : 0;
+  }
+  bool enabled = (mStreamingDecodeEnabled == 1);
+  mStreamingDecodeMutex.unlock();
+  return enabled;
+}
+
+void pxImageManager::addPendingDownload(rtImageResource* resource, rtFileDownloadRequest* request)
+{
+  mPendingDownloadsMutex.lock();
+  mPendingDownloads[resource] = request;
+  mPendingDownloadsMutex.unlock();
+}
+
+void pxImageManager::removePendingDownload(rtImageResource* resource, rtFileDownloadRequest* request)
+{
+  mPendingDownloadsMutex.lock();
+  std::map<rtImageResource*, rtFileDownloadRequest*>::iterator it = mPendingDownloads.find(resource);
+  // an older request completing does not remove a newer one
+  if (it != mPendingDownloads.end() && (request == NULL || it->second == request))
+  {
+    mPendingDownloads.erase(it);
+  }
+  mPendingDownloadsMutex.unlock();
+}
+
+// Holding the lock keeps each request alive, since a request is removed
+// from its completion callback before the downloader deletes it
+void pxImageManager::updateDownloadPriorities()
+{
+  mPendingDownloadsMutex.lock();
+  for (std::map<rtImageResource*, rtFileDownloadRequest*>::iterator it = mPendingDownloads.begin();
+       it != mPendingDownloads.end(); ++it)
+  {
+    rtFileDownloader::instance()->setDownloadPriority(it->second, it->first->takeDownloadPriorityHint());
+  }
+  mPendingDownloadsMutex.unlock();
+}
+
+bool pxImageManager::partialImagesEnabled()
+{
+  if (!streamingDecodeEnabled())
+  {
+    return false;
+  }
+  mStreamingDecodeMutex.lock();
+  if (mPartialImagesEnabled < 0)
+  {
+    bool enabled = false;
+    rtSettings::instance()->boolValue("enablePartialImages", enabled);
+    mPartialImagesEnabled = enabled ? 1 : 0;
+  }
+  bool enabled = (mPartialImagesEnabled == 1);
+  mStreamingDecodeMutex.unlock();
+  return enabled;
+}
+
+void pxImageManager::enableContentDedup(bool enable)
+{
+  mImageContentMutex.lock();
+  mContentDedupEnabled = enable ? 1 : 0;
+  mImageContentMutex.unlock();
+}
+
+bool pxImageManager::contentDedupEnabled()
+{
+  mImageContentMutex.lock();
+  if (mContentDedupEnabled < 0)
+  {
+    mContentDedupEnabled = 0;
+    rtValue val;
+    if (RT_OK == rtSettings::instance()->value("enableImageContentDedup", val))
+    {
+      mContentDedupEnabled = (val.toString().compare("true") == 0) ? 1 : 0;
+    }
+  }
+  bool enabled = (mContentDedupEnabled == 1);
+  mImageContentMutex.unlock();
+  return enabled;
+}
+
+bool pxImageManager::findContentTexture(const rtString& hash, rtImageResource* user, pxTextureRef& texture)
+{
+  bool found = false;
+  mImageContentMutex.lock();
+  ImageContentMap::iterator it = mImageContentMap.find(hash);
+  if (it != mImageContentMap.end())
+  {
+    it->second.users.push_back(user);
+    texture = it->second.texture;
+    texture->addTextureListener(user);
+    mContentDedupHits++;
+    found = true;
+  }
+  mImageContentMutex.unlock();
+  return found;
+}
+
+// Creates the texture for freshly decoded pixels unless an identical one was
+// published while they were decoded; returns true when texture refers to that
+bool pxImageManager::addContentTexture(const rtString& hash, rtImageResource* user, pxOffscreen& o,
+                                       const char* data, size_t dataSize, const char* compressedDataUrl,
+                                       pxTextureRef& texture)
+{
+  bool existing = false;
+  mImageContentMutex.lock();
+  ImageContentMap::iterator it = mImageContentMap.find(hash);
+  if (it != mImageContentMap.end())
+  {
+    // lost a race with another decode of the same bytes
+    it->second.users.push_back(user);
+    texture = it->second.texture;
+    mContentDedupHits++;
+    existing = true;
+  }
+  else
+  {
+    texture = context.createTexture(o, data, dataSize);
+    if (compressedDataUrl != NULL)
+    {
+      texture->setCompressedDataUrl(compressedDataUrl);
+    }
+    pxImageContentEntry& entry = mImageContentMap[hash];
+    entry.texture = texture;
+    entry.users.push_back(user);
+  }
+  texture->addTextureListener(user);
+  mImageContentMutex.unlock();
+  return existing;
+}
+
+void pxImageManager::removeContentTexture(const rtString& hash, rtImageResource* user)
+{
+  mImageContentMutex.lock();
+  ImageContentMap::iterator it = mImageContentMap.find(hash);
+  if (it != mImageContentMap.end())
+  {
+    std::vector<rtImageResource*>& users = it->second.users;
+    std::vector<rtImageResource*>::iterator u = std::find(users.begin(), users.end(), user);
+    if (u != users.end())
+    {
+      users.erase(u);
+      it->second.texture->removeTextureListener(user);
+      if (users.empty())
+      {
+        mImageContentMap.erase(it);
+      }
+    }
+  }
+  mImageContentMutex.unlock();
+}
+
 ImageAMap pxImageManager::mImageAMap;
 rtRef<rtImageAResource> pxImageManager::emptyUrlImageAResource = 0;
 /** static pxImageManager::getImage */
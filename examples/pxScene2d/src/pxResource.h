@@ -36,8 +36,8 @@
 #include "rtFileCache.h"
 #endif
 #include "rtCORS.h"
+#include "rtFileDownloader.h"
 #include <map>
-class rtFileDownloadRequest;
 
 #define PX_RESOURCE_STATUS_OK             0
 #define PX_RESOURCE_STATUS_DOWNLOADING    1
@@ -54,6 +54,8 @@ class rtFileDownloadRequest;
 #define PX_RESOURCE_LOAD_WAIT 2
 
 
+class pxObject;
+
 class pxResourceListener 
 {
 public: 
@@ -111,6 +113,7 @@ public:
   virtual void releaseData();
   virtual void reloadData();
   virtual uint64_t textureMemoryUsage();
+  virtual uint64_t cpuMemoryUsage();
   void setCORS(const rtCORSRef& cors) { mCORS = cors; }
   void setName(rtString name) { mName = name; }
 protected:   
@@ -120,6 +123,10 @@ protected:
   static void onResourceDirtyUI(void* context, void* data);
   virtual void processDownloadedResource(rtFileDownloadRequest* fileDownloadRequest);
   virtual uint32_t loadResourceData(rtFileDownloadRequest* fileDownloadRequest) = 0;
+  // Last chance to configure a network request before it is queued
+  virtual void prepareDownloadRequest(rtFileDownloadRequest* /*fileDownloadRequest*/) {}
+  // Called on the UI thread when a download was canceled
+  virtual void downloadCanceled() {}
   
   void notifyListeners(rtString readyResolution);
   void notifyListenersResourceDirty();
@@ -144,7 +151,7 @@ protected:
   rtString mName;
 };
 
-class rtImageResource : public pxResource, public pxTextureListener
+class rtImageResource : public pxResource, public pxTextureListener, public rtFileDownloadStreamConsumer
 {
 public:
   rtImageResource();
@@ -167,7 +174,11 @@ public:
   virtual rtError h(int32_t& v) const; 
 
   pxTextureRef getTexture(bool initializing = false);
-  void setTextureData(pxOffscreen& imageOffscreen, const char* data, const size_t dataSize);
+  // What has been decoded of an image that is still downloading, when
+  // partial images are enabled
+  pxTextureRef getPartialTexture();
+  void setTextureData(pxOffscreen& imageOffscreen, const char* data, const size_t dataSize,
+                      const char* compressedDataUrl);
   virtual void setupResource();
   virtual void prepare();
 
@@ -186,15 +197,36 @@ public:
   virtual void releaseData();
   virtual void reloadData();
   virtual uint64_t textureMemoryUsage();
+  virtual uint64_t cpuMemoryUsage();
   virtual void textureReady();
+
+  virtual void onDownloadData(rtFileDownloadRequest* downloadRequest, const char* data, size_t size);
+
+  // Called from o's draw() while the image is downloading; ranks the
+  // download by how close o's w x h is to its scene's visible area.
+  // The best hint of a frame is applied by updateDownloadPriorities().
+  void hintDownloadPriority(pxObject* o, float w, float h);
+  rtFileDownloadPriority takeDownloadPriorityHint();
   
 protected:
   virtual uint32_t loadResourceData(rtFileDownloadRequest* fileDownloadRequest);
+  virtual void processDownloadedResource(rtFileDownloadRequest* fileDownloadRequest);
+  virtual void prepareDownloadRequest(rtFileDownloadRequest* fileDownloadRequest);
+  virtual void downloadCanceled();
 
 private:
 
   void loadResourceFromFile();
   void loadResourceFromArchive(rtObjectRef archiveRef);
+  bool findSharedTexture(const uint8_t* data, size_t length, pxTextureRef& texture);
+  bool createSharedTexture(pxOffscreen& o, const char* data, size_t dataSize,
+                           const char* compressedDataUrl, pxTextureRef& texture);
+  void publishPartialImage();
+  void releaseStreamDecoder(rtFileDownloadRequest* fileDownloadRequest);
+  void decodeStreamData(rtFileDownloadRequest* downloadRequest, const char* data, size_t size);
+  void waitForStreamChunks();
+  static void decodeStreamChunks(void* data);
+  static void onPartialImageUI(void* context, void* data);
 
   pxTextureRef mTexture;
   pxTextureRef mDownloadedTexture;
@@ -206,6 +238,30 @@ private:
   float     init_sx, init_sy;
 
   rtData    mData;
+  // key into the content-addressed texture table, empty when not shared
+  rtString  mContentHash;
+
+  // The download thread only appends to mStreamChunks and schedules at
+  // most one decodeStreamChunks task at a time, which feeds them to the
+  // decoder in order.  mStreamChunksCondition is signalled when that task
+  // is done so the download's completion and the destructor can wait on it.
+  rtMutex   mStreamChunksMutex;
+  rtThreadCondition mStreamChunksCondition;
+  std::vector<char> mStreamChunks;
+  rtFileDownloadRequest* mStreamChunksRequest;
+  bool      mStreamDecodeScheduled;
+  // decodes http downloads as they arrive; a canceled request can still
+  // be delivering data when the next one starts, hence mStreamRequest
+  rtMutex   mStreamDecoderMutex;
+  pxImageStreamDecoder* mStreamDecoder;
+  rtFileDownloadRequest* mStreamRequest;
+  uint32_t  mPartialRows;
+  double    mPartialImageTime;
+  // only used on the UI thread, which owns the textures
+  pxTextureRef mPartialTexture;
+  int32_t   mPartialWidth, mPartialHeight;
+  // only used on the UI thread
+  rtFileDownloadPriority mDownloadPriorityHint;
 };
 
 class rtImageAResource : public pxResource
@@ -236,6 +292,16 @@ private:
 // Weak Map
 typedef std::map<rtString, rtImageResource*> ImageMap;
 typedef std::map<rtString, rtImageAResource*> ImageAMap;
+
+// Decoded textures keyed by a hash of the encoded bytes (and decode parameters)
+// so identical images reached through different urls share one texture.  The
+// first user in the list receives the texture's listener callbacks.
+struct pxImageContentEntry
+{
+  pxTextureRef texture;
+  std::vector<rtImageResource*> users;
+};
+typedef std::map<rtString, pxImageContentEntry> ImageContentMap;
 class pxImageManager
 {  
   public: 
@@ -246,6 +312,31 @@ class pxImageManager
 
     static rtRef<rtImageAResource> getImageA(const char* url, const char* proxy = NULL, const rtCORSRef& cors = NULL, rtObjectRef archive = NULL);
     static void removeImageA(rtString name);
+
+    static void enableContentDedup(bool enable);
+    static bool contentDedupEnabled();
+    static uint32_t contentDedupHits() { return mContentDedupHits; }
+
+    // rtSettings enableStreamingImageDecode (default true) decodes http
+    // images while they download; enablePartialImages (default false)
+    // also shows them as their rows arrive, at the cost of a texture
+    // upload for every partial image
+    static void enableStreamingDecode(bool enable, bool partialImages);
+    static bool streamingDecodeEnabled();
+    static bool partialImagesEnabled();
+    static bool findContentTexture(const rtString& hash, rtImageResource* user, pxTextureRef& texture);
+    static bool addContentTexture(const rtString& hash, rtImageResource* user, pxOffscreen& o,
+                                  const char* data, size_t dataSize, const char* compressedDataUrl,
+                                  pxTextureRef& texture);
+    static void removeContentTexture(const rtString& hash, rtImageResource* user);
+
+    // http images waiting for their download.  updateDownloadPriorities()
+    // runs once per frame on the UI thread after the scene is drawn and
+    // moves each download to the priority its image was drawn at; images
+    // that were not drawn become prefetches.  A NULL request removes any.
+    static void addPendingDownload(rtImageResource* resource, rtFileDownloadRequest* request);
+    static void removePendingDownload(rtImageResource* resource, rtFileDownloadRequest* request);
+    static void updateDownloadPriorities();
     
   private: 
     static ImageMap mImageMap;
@@ -253,6 +344,18 @@ class pxImageManager
 
     static ImageAMap mImageAMap;
     static rtRef<rtImageAResource> emptyUrlImageAResource;
+
+    static ImageContentMap mImageContentMap;
+    static rtMutex mImageContentMutex;
+    static int32_t mContentDedupEnabled;
+    static uint32_t mContentDedupHits;
+
+    static rtMutex mStreamingDecodeMutex;
+    static int32_t mStreamingDecodeEnabled;
+    static int32_t mPartialImagesEnabled;
+
+    static std::map<rtImageResource*, rtFileDownloadRequest*> mPendingDownloads;
+    static rtMutex mPendingDownloadsMutex;
 };
 
 #endif // PX_RESOURCE
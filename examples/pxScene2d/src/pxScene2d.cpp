@@ -60,6 +60,7 @@
 #include "pxContext.h"
 #include "rtFileDownloader.h"
 #include "rtMutex.h"
+#include "rtThreadPool.h"
 
 #include "pxIView.h"
 
@@ -435,6 +436,119 @@ private:
 
 rtDefineObject(pxObjectChildren, rtObject);
 
+// Result object handed to screenshotAsync() promises.  data is a read-only
+// view of the encoded image; toDataURL() is only needed for <img>-style urls.
+class pxScreenshot: public rtObject {
+public:
+
+  rtDeclareObject(pxScreenshot, rtObject);
+  rtReadOnlyProperty(type, type, rtString);
+  rtReadOnlyProperty(width, width, int32_t);
+  rtReadOnlyProperty(height, height, int32_t);
+  rtReadOnlyProperty(length, length, uint32_t);
+  rtReadOnlyProperty(data, data, rtObjectRef);
+  rtMethodNoArgAndReturn("toDataURL", toDataURL, rtString);
+
+  pxScreenshot(rtString type, int32_t w, int32_t h): mType(type), mWidth(w), mHeight(h), mBuffer(new rtBufferObject) {}
+
+  rtError type(rtString& v) const { v = mType; return RT_OK; }
+  rtError width(int32_t& v) const { v = mWidth; return RT_OK; }
+  rtError height(int32_t& v) const { v = mHeight; return RT_OK; }
+  rtError length(uint32_t& v) const { return mBuffer->length(v); }
+  rtError data(rtObjectRef& v) const { v = mBuffer.getPtr(); return RT_OK; }
+
+  rtError toDataURL(rtString& url)
+  {
+    rtString base64coded;
+    if (base64_encode(buffer(), base64coded) != RT_OK)
+      return RT_FAIL;
+    url = "data:";
+    url += mType;
+    url += ";base64,";
+    url += base64coded;
+    return RT_OK;
+  }
+
+  rtData& buffer() { return mBuffer->data(); }
+
+private:
+  rtString mType;
+  int32_t mWidth;
+  int32_t mHeight;
+  rtRef<rtBufferObject> mBuffer;
+};
+
+rtDefineObject(pxScreenshot, rtObject);
+rtDefineProperty(pxScreenshot, type);
+rtDefineProperty(pxScreenshot, width);
+rtDefineProperty(pxScreenshot, height);
+rtDefineProperty(pxScreenshot, length);
+rtDefineProperty(pxScreenshot, data);
+rtDefineMethod(pxScreenshot, toDataURL);
+
+struct pxScreenshotEncodeRequest
+{
+  pxOffscreen* offscreen;
+  rtRef<pxScreenshot> screenshot;
+  rtObjectRef promise;
+  bool png;
+  int32_t compressionLevel;
+  rtError result;
+};
+
+static void onScreenshotEncodedUI(void* context, void* /*data*/)
+{
+  pxScreenshotEncodeRequest* request = (pxScreenshotEncodeRequest*)context;
+  if (request->result == RT_OK)
+    request->promise.send("resolve", rtObjectRef(request->screenshot.getPtr()));
+  else
+    request->promise.send("reject", rtValue());
+  delete request;
+}
+
+// Runs on a worker thread; only touches the offscreen and the result buffer
+static void encodeScreenshot(void* data)
+{
+  pxScreenshotEncodeRequest* request = (pxScreenshotEncodeRequest*)data;
+  pxOffscreen& o = *request->offscreen;
+  rtData& out = request->screenshot->buffer();
+
+  if (request->png)
+  {
+    request->result = pxStorePNGImage(o, out, request->compressionLevel);
+  }
+  else
+  {
+    // raw rgba, top row first
+    size_t rowBytes = o.width() * 4;
+    request->result = out.init(rowBytes * o.height());
+    if (request->result == RT_OK)
+    {
+      for (int32_t y = 0; y < o.height(); y++)
+      {
+        uint8_t* dst = out.data() + y * rowBytes;
+        pxPixel* src = o.scanline(y);
+        for (int32_t x = 0; x < o.width(); x++, src++)
+        {
+          *dst++ = src->r;
+          *dst++ = src->g;
+          *dst++ = src->b;
+          *dst++ = src->a;
+        }
+      }
+    }
+  }
+
+  delete request->offscreen;
+  request->offscreen = NULL;
+
+  if (gUIThreadQueue)
+    gUIThreadQueue->addTask(onScreenshotEncodedUI, request, NULL);
+  else
+    delete request;
+}
+
+
 
 // pxObject methods
 pxObject::pxObject(pxScene2d* scene): rtObject(), mParent(NULL), mpx(0), mpy(0), mcx(0), mcy(0), mx(0), my(0), ma(1.0), mr(0),
@@ -1221,6 +1335,16 @@ uint64_t pxObject::textureMemoryUsage()
   return textureMemory;
 }
 
+uint64_t pxObject::cpuMemoryUsage()
+{
+  uint64_t cpuMemory = 0;
+  for(vector<rtRef<pxObject> >::iterator it = mChildren.begin(); it != mChildren.end(); ++it)
+  {
+    cpuMemory += (*it)->cpuMemoryUsage();
+  }
+  return cpuMemory;
+}
+
 #ifdef PX_DIRTY_RECTANGLES
 void pxObject::setDirtyRect(pxRect *r)
 {
@@ -2025,6 +2149,7 @@ pxScene2d::pxScene2d(bool top, pxScriptView* scriptView)
 rtError pxScene2d::dispose()
 {
     mDisposed = true;
+    processPendingScreenshots(true);
     rtObjectRef e = new rtMapObject;
     // pass false to make onClose asynchronous
     mEmit.send("onClose", e);
@@ -2324,6 +2449,7 @@ rtError pxScene2d::logDebugMetrics()
 #else
       rtLogInfo("texture memory usage is [%ld]",context.currentTextureMemoryUsageInBytes());
 #endif
+    rtLogInfo("image content dedup hits [%u]", pxImageManager::contentDedupHits());
 #else
     rtLogWarn("logDebugMetrics is disabled");
 #endif
@@ -2390,10 +2516,28 @@ rtError pxScene2d::textureMemoryUsage(rtValue &v)
 {
   uint64_t textureMemory = 0;
   textureMemory += mRoot->textureMemoryUsage();
+#ifdef PXSCENE_FONT_ATLAS
+  // glyph atlas pages are shared by every scene, report them once
+  if (mTop)
+    textureMemory += gFontAtlas.textureMemoryUsage();
+#endif
   v.setUInt64(textureMemory);
   return RT_OK;
 }
 
+rtError pxScene2d::cpuMemoryUsage(rtValue &v)
+{
+  uint64_t cpuMemory = 0;
+  cpuMemory += mRoot->cpuMemoryUsage();
+  pxArchive* archive = (pxArchive*)mArchive.getPtr();
+  if (archive != NULL)
+  {
+    cpuMemory += archive->cpuMemoryUsage();
+  }
+  v.setUInt64(cpuMemory);
+  return RT_OK;
+}
+
 rtError pxScene2d::clock(double & time)
 {
   time = pxMilliseconds();
@@ -2582,6 +2726,22 @@ void pxScene2d::onUpdate(double t)
     gUIThreadQueue->process(0.01);
   }
 
+  if (!mPendingScreenshots.empty())
+  {
+    processPendingScreenshots();
+  }
+
+  if (mTop)
+  {
+    // stay within the CPU memory limit by dropping compressed copies of
+    // uploaded images; they are fetched again if the texture is ejected
+    int64_t cpuMemoryOverflow = context.cpuMemoryOverflow();
+    if (cpuMemoryOverflow > 0)
+    {
+      context.ejectCpuMemory(cpuMemoryOverflow);
+    }
+  }
+
   if (start == 0)
   {
     start = pxSeconds();
@@ -2697,6 +2857,7 @@ void pxScene2d::onDraw()
     #ifdef ENABLE_RT_NODE
     rtWrapperSceneUpdateEnter();
     #endif //ENABLE_RT_NODE
+    context.beginFrame();
     context.setSize(mWidth, mHeight);
   }
 #if 1
@@ -2707,6 +2868,18 @@ void pxScene2d::onDraw()
 
   draw();
 
+  for (std::vector<pxPendingScreenshot>::iterator it = mPendingScreenshots.begin();
+       it != mPendingScreenshots.end(); ++it)
+  {
+    it->drawn = true;
+  }
+
+  if (mTop)
+  {
+    // the draw traversal has ranked the images still downloading
+    pxImageManager::updateDownloadPriorities();
+  }
+
 #ifdef USE_RENDER_STATS
   sigma_draw += (pxSeconds() - start_draw); //##
 #endif //USE_RENDER_STATS
@@ -3517,6 +3690,88 @@ rtError pxScene2d::clipboardSet(rtString type, rtString clipString)
     return RT_OK;
 }
 
+rtError pxScene2d::screenshotAsync(rtString type, rtObjectRef options, rtObjectRef& promise)
+{
+#ifdef ENABLE_PERMISSIONS_CHECK
+  if (RT_OK != mPermissions->allows("screenshot", rtPermissions::FEATURE))
+    return RT_ERROR_NOT_ALLOWED;
+#endif
+
+  if (type != "image/png" && type != "image/raw;rgba")
+  {
+    return RT_FAIL;
+  }
+
+  // favour speed over size by default; callers can ask for more
+  int32_t compressionLevel = 1;
+  if (options)
+  {
+    rtValue v;
+    if (options->Get("compressionLevel", &v) == RT_OK)
+      compressionLevel = v.toInt32();
+  }
+
+  pxContextFramebufferRef previousRenderSurface = context.getCurrentFramebuffer();
+  pxContextFramebufferRef newFBO;
+  mRoot->createSnapshot(newFBO, false, false);
+  context.setFramebuffer(newFBO);
+  uint32_t readbackId = 0;
+  pxError e = context.beginSnapshot(readbackId);
+  context.setFramebuffer(previousRenderSurface);
+
+  if (e != PX_OK)
+  {
+    return RT_FAIL;
+  }
+
+  pxPendingScreenshot pending;
+  pending.readbackId = readbackId;
+  pending.promise = new rtPromise;
+  pending.type = type;
+  pending.compressionLevel = compressionLevel;
+  pending.drawn = false;
+  mPendingScreenshots.push_back(pending);
+
+  promise = pending.promise;
+  return RT_OK;
+}
+
+// Collects readbacks that were queued before the last draw and hands them to
+// the thread pool for encoding.  With cancel set every pending readback is
+// dropped and its promise rejected.
+void pxScene2d::processPendingScreenshots(bool cancel)
+{
+  std::vector<pxPendingScreenshot>::iterator it = mPendingScreenshots.begin();
+  while (it != mPendingScreenshots.end())
+  {
+    if (!cancel && !it->drawn)
+    {
+      ++it;
+      continue;
+    }
+
+    pxOffscreen* o = NULL;
+    pxError e = context.finishSnapshot(it->readbackId, o);
+    if (cancel || e != PX_OK || !o)
+    {
+      delete o;
+      it->promise.send("reject", rtValue());
+    }
+    else
+    {
+      pxScreenshotEncodeRequest* request = new pxScreenshotEncodeRequest;
+      request->offscreen = o;
+      request->screenshot = new pxScreenshot(it->type, o->width(), o->height());
+      request->promise = it->promise;
+      request->png = (it->type == "image/png");
+      request->compressionLevel = it->compressionLevel;
+      request->result = RT_FAIL;
+      rtThreadPool::globalInstance()->executeTask(new rtThreadTask(encodeScreenshot, request, ""));
+    }
+    it = mPendingScreenshots.erase(it);
+  }
+}
+
 rtError pxScene2d::clipboardGet(rtString type, rtString &retString)
 {
 //    rtLogDebug("\n ##########   clipboardGet()  >> %s ", type.cString() ); fflush(stdout);
@@ -3703,12 +3958,14 @@ rtDefineMethod(pxScene2d, suspend);
 rtDefineMethod(pxScene2d, resume);
 rtDefineMethod(pxScene2d, suspended);
 rtDefineMethod(pxScene2d, textureMemoryUsage);
+rtDefineMethod(pxScene2d, cpuMemoryUsage);
 //rtDefineMethod(pxScene2d, createWayland);
 rtDefineMethod(pxScene2d, addListener);
 rtDefineMethod(pxScene2d, delListener);
 rtDefineMethod(pxScene2d, getFocus);
 //rtDefineMethod(pxScene2d, stopPropagation);
 rtDefineMethod(pxScene2d, screenshot);
+rtDefineMethod(pxScene2d, screenshotAsync);
 
 rtDefineMethod(pxScene2d, clipboardGet);
 rtDefineMethod(pxScene2d, clipboardSet);
@@ -4022,6 +4279,19 @@ uint64_t pxSceneContainer::textureMemoryUsage()
   return textureMemory;
 }
 
+uint64_t pxSceneContainer::cpuMemoryUsage()
+{
+  uint64_t cpuMemory = 0;
+  if (mScriptView.getPtr())
+  {
+    rtValue v;
+    mScriptView->cpuMemoryUsage(v);
+    cpuMemory += v.toUInt64();
+  }
+  cpuMemory += pxObject::cpuMemoryUsage();
+  return cpuMemory;
+}
+
 #ifdef ENABLE_PERMISSIONS_CHECK
 rtError pxSceneContainer::permissions(rtObjectRef& v) const
 {
@@ -4203,6 +4473,16 @@ rtError pxScriptView::textureMemoryUsage(rtValue& v)
   return RT_OK;
 }
 
+rtError pxScriptView::cpuMemoryUsage(rtValue& v)
+{
+  v = 0;
+  if (mScene)
+  {
+    mScene.sendReturns("cpuMemoryUsage",v);
+  }
+  return RT_OK;
+}
+
 rtError pxScriptView::getScene(int numArgs, const rtValue* args, rtValue* result, void* ctx)
 {
   rtLogDebug(__FUNCTION__);
@@ -445,6 +445,7 @@ public:
   virtual void releaseData(bool sceneSuspended);
   virtual void reloadData(bool sceneSuspended);
   virtual uint64_t textureMemoryUsage();
+  virtual uint64_t cpuMemoryUsage();
 
   // non-destructive applies transform on top of of provided matrix
   virtual void applyMatrix(pxMatrix4f& m)
@@ -1091,6 +1092,7 @@ public:
   virtual void releaseData(bool sceneSuspended);
   virtual void reloadData(bool sceneSuspended);
   virtual uint64_t textureMemoryUsage();
+  virtual uint64_t cpuMemoryUsage();
   
 private:
   rtRef<pxScriptView> mScriptView;
@@ -1201,6 +1203,7 @@ public:
   rtError suspend(const rtValue& v, bool& b);
   rtError resume(const rtValue& v, bool& b);
   rtError textureMemoryUsage(rtValue& v);
+  rtError cpuMemoryUsage(rtValue& v);
   
 protected:
 
@@ -1368,6 +1371,7 @@ public:
   rtMethod1ArgAndReturn("resume", resume, rtValue, bool);
   rtMethodNoArgAndReturn("suspended", suspended, bool);
   rtMethodNoArgAndReturn("textureMemoryUsage", textureMemoryUsage, rtValue);
+  rtMethodNoArgAndReturn("cpuMemoryUsage", cpuMemoryUsage, rtValue);
 /*
   rtMethod1ArgAndReturn("createExternal", createExternal, rtObjectRef,
                         rtObjectRef);
@@ -1386,6 +1390,7 @@ public:
 //  rtMethodNoArgAndNoReturn("stopPropagation",stopPropagation);
   
   rtMethod1ArgAndReturn("screenshot", screenshot, rtString, rtString);
+  rtMethod2ArgAndReturn("screenshotAsync", screenshotAsync, rtString, rtObjectRef, rtObjectRef);
 
   rtMethod1ArgAndReturn("clipboardGet", clipboardGet, rtString, rtString);
   rtMethod2ArgAndNoReturn("clipboardSet", clipboardSet, rtString, rtString);
@@ -1518,6 +1523,7 @@ public:
   rtError resume(const rtValue& v, bool& b);
   rtError suspended(bool &b);
   rtError textureMemoryUsage(rtValue &v);
+  rtError cpuMemoryUsage(rtValue &v);
 
   rtError addListener(rtString eventName, const rtFunctionRef& f)
   {
@@ -1690,6 +1696,10 @@ public:
 
   // Note: Only type currently supported is "image/png;base64"
   rtError screenshot(rtString type, rtString& pngData);
+  // Supported types are "image/png" and "image/raw;rgba".  The returned promise
+  // resolves with a screenshot object once the framebuffer readback and the
+  // encode (done on a worker thread) have completed.
+  rtError screenshotAsync(rtString type, rtObjectRef options, rtObjectRef& promise);
   rtError clipboardGet(rtString type, rtString& retString);
   rtError clipboardSet(rtString type, rtString clipString);
   rtError getService(rtString name, rtObjectRef& returnObject);
@@ -1707,6 +1717,7 @@ private:
   bool bubbleEventOnBlur(rtObjectRef e, rtRef<pxObject> t, rtRef<pxObject> o);
 
   void draw();
+  void processPendingScreenshots(bool cancel = false);
   // Does not draw updates scene to time t
   // t is assumed to be monotonically increasing
   void update(double t);
@@ -1760,6 +1771,15 @@ private:
   bool mSuspended;
   rtCORSRef mCORS;
   rtObjectRef mArchive;
+  struct pxPendingScreenshot
+  {
+    uint32_t readbackId;
+    rtObjectRef promise;
+    rtString type;
+    int32_t compressionLevel;
+    bool drawn;
+  };
+  std::vector<pxPendingScreenshot> mPendingScreenshots;
 public:
   void hidePointer( bool hide )
   {
@@ -73,6 +73,8 @@ rtError pxText::setText(const char* s)
     createNewPromise();
     getFontResource()->measureTextInternal(s, mPixelSize, 1.0, 1.0, mw, mh);
   }
+  else
+    addWarmupText();
   return RT_OK; 
 }
 
@@ -85,9 +87,17 @@ rtError pxText::setPixelSize(uint32_t v)
     createNewPromise();
     getFontResource()->measureTextInternal(mText, mPixelSize, 1.0, 1.0, mw, mh);
   }
+  else
+    addWarmupText();
   return RT_OK; 
 }
 
+void pxText::addWarmupText()
+{
+  if (getFontResource() != NULL && !getFontResource()->isFontLoaded())
+    getFontResource()->addWarmupText(mPixelSize, mText.cString());
+}
+
 void pxText::resourceReady(rtString readyResolution)
 {
   if( !readyResolution.compare("resolve"))
@@ -151,7 +161,7 @@ void pxText::draw()
       }
     }
 #ifdef PXSCENE_FONT_ATLAS
-    if (mDirty)
+    if (mDirty || mQuads.isStale())
     {
       getFontResource()->renderTextToQuads(mText,mPixelSize,msx,msy,mQuads);
       mDirty = false;
@@ -192,6 +202,7 @@ rtError pxText::setFontUrl(const char* s)
   {
     getFontResource()->addListener(this);
   }
+  addWarmupText();
   
   return RT_OK;
 }
@@ -209,6 +220,7 @@ rtError pxText::setFont(rtObjectRef o)
   if (getFontResource() != NULL) {
     getFontResource()->addListener(this);
   }
+  addWarmupText();
     
   return RT_OK; 
 }
@@ -287,6 +299,17 @@ uint64_t pxText::textureMemoryUsage()
   return textureMemory;
 }
 
+uint64_t pxText::cpuMemoryUsage()
+{
+  uint64_t cpuMemory = 0;
+  if (getFontResource() != NULL)
+  {
+    cpuMemory += getFontResource()->cpuMemoryUsage();
+  }
+  cpuMemory += pxObject::cpuMemoryUsage();
+  return cpuMemory;
+}
+
 
 rtDefineObject(pxText, pxObject);
 rtDefineProperty(pxText, text);
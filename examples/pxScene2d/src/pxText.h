@@ -123,12 +123,15 @@ public:
   virtual void createNewPromise();
   virtual void dispose(bool pumpJavascript);
   virtual uint64_t textureMemoryUsage();
+  virtual uint64_t cpuMemoryUsage();
   
  protected:
   virtual void draw();
   // !CLF ToDo: Could mFont.send(...) be used in places where mFont is needed, instead
   // of this getFontResource?
   inline pxFont* getFontResource() const { return (pxFont*)mFont.getPtr(); }  
+  // lets a font that is still loading warm up the glyphs for this text
+  void addWarmupText();
   
   rtString mText;
 // TODO should we just use a font object instead of Urls
@@ -28,6 +28,7 @@
 extern pxContext context;
 #include <math.h>
 #include <map>
+#include <algorithm>
 #include <stdlib.h>
 
 static const char      isNewline_chars[] = "\n\v\f\r";
@@ -50,7 +51,11 @@ pxTextBox::pxTextBox(pxScene2d* s): pxText(s),
                                     mAlignHorizontal(pxConstantsAlignHorizontal::LEFT),
                                     mXStartPos(0),  mXStopPos(0), mLeading(0), 
                                     mWordWrap(false), mEllipsis(false), mInitialized(false), mNeedsRecalc(true),
-                                    lineNumber(0), lastLineNumber(0),
+                                    mLayoutReads(0),
+#ifdef PXSCENE_FONT_ATLAS
+                                    mMeasurePass(), mRenderPass(), mRecordPass(NULL), mReplayLine(NULL), mPreviousQuads(NULL),
+#endif
+                                    lineNumber(0), lastLineNumber(0), mCodePoints(), mCodePointOffsets(),
                                     noClipX(0), noClipY(0), noClipW(0), noClipH(0), startY(0)
 {
   measurements= new pxTextMeasurements();
@@ -133,10 +138,27 @@ void pxTextBox::recalc()
   if( mNeedsRecalc && mInitialized && mFontLoaded) {
     
      clearMeasurements();
-    
+
 #ifdef PXSCENE_FONT_ATLAS
-    mQuadsVector.clear();
+    // a box laid out the same way before has both passes in the cache
+    pxTextLayoutKey key;
+    pxTextLayout* layout = mText.isEmpty() ? NULL : cachedLayout(key);
+    if (layout)
+    {
+      mMeasurePass.valid = false;
+      mRenderPass.valid = false;
+      applyLayout(key, *layout);
+      setNeedsRecalc(false);
+      if(clip()) {
+        pxObject::onTextureReady();
+      }
+      mDirty = false;
+      return;
+    }
 #endif
+    // the render pass builds on startY from the measure pass, so the reads
+    // of both go into the cache key
+    mLayoutReads = 0;
     renderText(false);
 
     setNeedsRecalc(false);
@@ -149,9 +171,6 @@ void pxTextBox::recalc()
     // waiting for draw() call so that even when the 
     // textBox or its parent has draw=false, the measurements
     // get calculated and the promise gets resolved.
-#ifdef PXSCENE_FONT_ATLAS
-      mQuadsVector.clear();
-#endif
       renderText(true);
       mDirty = false;
 
@@ -195,6 +214,7 @@ rtError pxTextBox::setText(const char* s) {
   }
   mText = s;
   setNeedsRecalc(true);
+  addWarmupText();
   return RT_OK;
 }
 
@@ -203,6 +223,7 @@ rtError pxTextBox::setPixelSize(uint32_t v)
   //rtLogDebug("pxTextBox::setPixelSize %s\n",mText.cString());
   mPixelSize = v;
   setNeedsRecalc(true);
+  addWarmupText();
   return RT_OK;
 }
 rtError pxTextBox::setFontUrl(const char* s)
@@ -224,13 +245,24 @@ rtError pxTextBox::setFont(rtObjectRef o)
   return pxText::setFont(o);
 }
 
+#ifdef PXSCENE_FONT_ATLAS
+// The glyph atlas evicted a page that some of our quads may point into
+bool pxTextBox::quadsStale()
+{
+  for (std::vector<pxTextLineQuadsRef>::iterator it = mQuadsVector.begin() ; it != mQuadsVector.end(); ++it)
+  {
+    if ((*it)->quads.isStale())
+      return true;
+  }
+  return false;
+}
+#endif
 
 void pxTextBox::draw() 
 {
 #ifdef PXSCENE_FONT_ATLAS
-  if (mDirty)
+  if (mDirty || quadsStale())
   {
-    mQuadsVector.clear();
     renderText(true);
     mDirty = false;
   
@@ -241,8 +273,8 @@ void pxTextBox::draw()
     y = roundf(noClipY); 
   }
 
-  for (std::vector<pxTexturedQuads>::iterator it = mQuadsVector.begin() ; it != mQuadsVector.end(); ++it)
-    (*it).draw(x, y, mTextColor);
+  for (std::vector<pxTextLineQuadsRef>::iterator it = mQuadsVector.begin() ; it != mQuadsVector.end(); ++it)
+    (*it)->quads.draw(x, y, mTextColor);
 
 
 #else
@@ -297,10 +329,257 @@ void pxTextBox::clearMeasurements()
     getMeasurements()->clear();
 }
 
+#ifdef PXSCENE_FONT_ATLAS
+pxTextLayoutCache::LayoutMap pxTextLayoutCache::mLayouts;
+pxTextLayoutCache::LayoutList pxTextLayoutCache::mLru;
+size_t pxTextLayoutCache::mBytes = 0;
+
+#define PX_LAYOUT_KEY_FIELDS(F) \
+  F(textHash) F(fontId) F(pixelSize) F(distanceField) F(positionReads) \
+  F(x) F(y) F(w) F(h) F(xStartPos) F(xStopPos) F(leading) \
+  F(truncation) F(alignVertical) F(alignHorizontal) F(wordWrap) F(ellipsis) F(clip)
+
+bool pxTextLayoutKey::operator<(const pxTextLayoutKey& other) const
+{
+  // cheap fields first; the full text only decides between hash collisions
+#define PX_LAYOUT_KEY_COMPARE(f) if (f != other.f) return f < other.f;
+  PX_LAYOUT_KEY_FIELDS(PX_LAYOUT_KEY_COMPARE)
+#undef PX_LAYOUT_KEY_COMPARE
+  return strcmp(text.cString(), other.text.cString()) < 0;
+}
+
+bool pxTextLayoutKey::operator==(const pxTextLayoutKey& other) const
+{
+#define PX_LAYOUT_KEY_EQUAL(f) if (f != other.f) return false;
+  PX_LAYOUT_KEY_FIELDS(PX_LAYOUT_KEY_EQUAL)
+#undef PX_LAYOUT_KEY_EQUAL
+  return strcmp(text.cString(), other.text.cString()) == 0;
+}
+
+size_t pxTextLayoutKeyHash::operator()(const pxTextLayoutKey& key) const
+{
+  // the text hash does most of the work; boxes with the same text differ
+  // in size or font
+  size_t h = key.textHash;
+  h = h * 31 + key.fontId;
+  h = h * 31 + key.pixelSize;
+  h = h * 31 + (size_t)key.w;
+  h = h * 31 + (size_t)key.h;
+  h = h * 31 + (size_t)key.x;
+  h = h * 31 + (size_t)key.y;
+  return h;
+}
+
+pxTextLayout* pxTextLayoutCache::find(const pxTextLayoutKey& key)
+{
+  LayoutMap::iterator it = mLayouts.find(key);
+  if (it == mLayouts.end())
+    return NULL;
+
+  std::vector<pxTextLineQuadsRef>& quads = it->second.layout.quads;
+  for (std::vector<pxTextLineQuadsRef>::iterator q = quads.begin(); q != quads.end(); ++q)
+  {
+    if ((*q)->quads.isStale())
+    {
+      erase(it);
+      return NULL;
+    }
+  }
+  mLru.splice(mLru.begin(), mLru, it->second.lru);
+  return &it->second.layout;
+}
+
+void pxTextLayoutCache::insert(const pxTextLayoutKey& key, const pxTextLayout& layout)
+{
+  LayoutMap::iterator it = mLayouts.find(key);
+  if (it != mLayouts.end())
+    erase(it);
+
+  // shared line quads are counted by every layout that holds them
+  size_t bytes = sizeof(entry) + sizeof(pxTextLayoutKey) + key.text.byteLength();
+  for (std::vector<pxTextLineQuadsRef>::const_iterator q = layout.quads.begin(); q != layout.quads.end(); ++q)
+    bytes += sizeof(pxTextLineQuads) + (*q)->quads.memoryUsage();
+  if (bytes > PXSCENE_TEXT_LAYOUT_CACHE_BYTES)
+    return;
+
+  while (!mLru.empty() && mBytes + bytes > PXSCENE_TEXT_LAYOUT_CACHE_BYTES)
+    erase(mLayouts.find(*mLru.back()));
+
+  it = mLayouts.insert(std::make_pair(key, entry())).first;
+  it->second.layout = layout;
+  it->second.bytes = bytes;
+  mLru.push_front(&it->first);
+  it->second.lru = mLru.begin();
+  mBytes += bytes;
+}
+
+void pxTextLayoutCache::erase(LayoutMap::iterator it)
+{
+  mBytes -= it->second.bytes;
+  mLru.erase(it->second.lru);
+  mLayouts.erase(it);
+}
+
+void pxTextLayoutCache::clear()
+{
+  mLayouts.clear();
+  mLru.clear();
+  mBytes = 0;
+}
+
+void pxTextBox::layoutKey(pxTextLayoutKey& key)
+{
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (const char* c = mText.cString(); *c; c++)
+    hash = (hash ^ (uint8_t)*c) * 16777619u;
+
+  layoutProperties(key);
+  key.text = mText;
+  key.textHash = hash;
+}
+
+void pxTextBox::layoutProperties(pxTextLayoutKey& key)
+{
+  key.text = "";
+  key.textHash = 0;
+  key.fontId = getFontResource()->getFontId();
+  key.pixelSize = mPixelSize;
+  key.distanceField = pxFontManager::sdfTextEnabled();
+  key.positionReads = PX_TEXT_LAYOUT_READS_XY;
+  key.x = mx;
+  key.y = my;
+  key.w = mw;
+  key.h = mh;
+  key.xStartPos = mXStartPos;
+  key.xStopPos = mXStopPos;
+  key.leading = mLeading;
+  key.truncation = mTruncation;
+  key.alignVertical = mAlignVertical;
+  key.alignHorizontal = mAlignHorizontal;
+  key.wordWrap = mWordWrap;
+  key.ellipsis = mEllipsis;
+  key.clip = clip();
+}
+
+// Looks for a layout of this box stored for any position that agrees with
+// ours on the coordinates the layout read
+pxTextLayout* pxTextBox::cachedLayout(pxTextLayoutKey& key)
+{
+  layoutKey(key);
+  for (uint32_t reads = 0; reads <= PX_TEXT_LAYOUT_READS_XY; reads++)
+  {
+    key.positionReads = reads;
+    key.x = (reads & PX_TEXT_LAYOUT_READS_X) ? mx : 0;
+    key.y = (reads & PX_TEXT_LAYOUT_READS_Y) ? my : 0;
+    pxTextLayout* layout = pxTextLayoutCache::find(key);
+    if (layout)
+      return layout;
+  }
+  return NULL;
+}
+
+void pxTextBox::storeLayout(pxTextLayoutKey& key)
+{
+  key.positionReads = mLayoutReads;
+  key.x = (mLayoutReads & PX_TEXT_LAYOUT_READS_X) ? mx : 0;
+  key.y = (mLayoutReads & PX_TEXT_LAYOUT_READS_Y) ? my : 0;
+
+  pxTextMeasurements* m = getMeasurements();
+  pxTextLayout layout;
+  layout.quads = mQuadsVector;
+  layout.boundsX1 = m->getBounds()->x1();
+  layout.boundsY1 = m->getBounds()->y1();
+  layout.boundsX2 = m->getBounds()->x2();
+  layout.boundsY2 = m->getBounds()->y2();
+  layout.charFirstX = m->getCharFirst()->x();
+  layout.charFirstY = m->getCharFirst()->y();
+  layout.charLastX = m->getCharLast()->x();
+  layout.charLastY = m->getCharLast()->y();
+  layout.lineNumber = lineNumber;
+  layout.lastLineNumber = lastLineNumber;
+  layout.noClipX = noClipX;
+  layout.noClipY = noClipY;
+  layout.noClipW = noClipW;
+  layout.noClipH = noClipH;
+  layout.startY = startY;
+  pxTextLayoutCache::insert(key, layout);
+}
+
+void pxTextBox::applyLayout(const pxTextLayoutKey& key, const pxTextLayout& layout)
+{
+  mLayoutReads = key.positionReads;
+  pxTextMeasurements* m = getMeasurements();
+  mQuadsVector = layout.quads;
+  m->getBounds()->setX1(layout.boundsX1);
+  m->getBounds()->setY1(layout.boundsY1);
+  m->getBounds()->setX2(layout.boundsX2);
+  m->getBounds()->setY2(layout.boundsY2);
+  m->getCharFirst()->setX(layout.charFirstX);
+  m->getCharFirst()->setY(layout.charFirstY);
+  m->getCharLast()->setX(layout.charLastX);
+  m->getCharLast()->setY(layout.charLastY);
+  lineNumber = layout.lineNumber;
+  lastLineNumber = layout.lastLineNumber;
+  noClipX = layout.noClipX;
+  noClipY = layout.noClipY;
+  noClipW = layout.noClipW;
+  noClipH = layout.noClipH;
+  startY = layout.startY;
+}
+
+const pxTextLineStart* pxTextBox::resumePoint(pxTextPass& pass, const char* text, bool render)
+{
+  if (!pass.valid || pass.starts.empty())
+    return NULL;
+
+  pxTextLayoutKey key;
+  layoutProperties(key);
+  if (key < pass.key || pass.key < key)
+    return NULL;
+
+  // replayed lines keep their quads, so those must still be drawable
+  if (render)
+  {
+    if (!mPreviousQuads || pass.startY != startY || mPreviousQuads->size() < pass.lines.size())
+      return NULL;
+    for (std::vector<pxTextLineQuadsRef>::iterator it = mPreviousQuads->begin(); it != mPreviousQuads->end(); ++it)
+    {
+      if ((*it)->quads.isStale())
+        return NULL;
+    }
+  }
+
+  const char* previous = pass.text.cString();
+  int common = 0;
+  while (previous[common] && previous[common] == text[common])
+    common++;
+
+  for (size_t s = pass.starts.size(); s > 0; s--)
+  {
+    if (pass.starts[s-1].offset <= common)
+      return &pass.starts[s-1];
+  }
+  return NULL;
+}
+#endif //PXSCENE_FONT_ATLAS
+
 void pxTextBox::renderText(bool render)
 {
   //rtLogDebug("pxTextBox::renderText render=%d initialized=%d fontLoaded=%d\n",render,mInitialized,mFontLoaded);
 
+#ifdef PXSCENE_FONT_ATLAS
+  // Rendering starts from no quads; a word wrapped layout may take over
+  // the lines of the previous quads that appended text left alone.  Any
+  // other layout path leaves the recorded pass out of date.
+  std::vector<pxTextLineQuadsRef> previousQuads;
+  if (render)
+    previousQuads.swap(mQuadsVector);
+  pxTextPass& pass = render ? mRenderPass : mMeasurePass;
+  bool resumable = pass.valid;
+  pass.valid = false;
+#endif
+
   if( !mInitialized || !mFontLoaded) 
   {
     return;
@@ -315,11 +594,24 @@ void pxTextBox::renderText(bool render)
   if (!mText || !strcmp(mText.cString(),""))
   {
      clearMeasurements();
-     setMeasurementBounds(mx, 0, my, 0);
+     setMeasurementBounds(layoutX(), 0, layoutY(), 0);
      return;
   }
 
 
+#ifdef PXSCENE_FONT_ATLAS
+  pxTextLayoutKey key;
+  if (render)
+  {
+    pxTextLayout* layout = cachedLayout(key);
+    if (layout)
+    {
+      applyLayout(key, *layout);
+      return;
+    }
+  }
+#endif
+
   if( !mWordWrap)
   {
     rtLogDebug("calling renderTextNoWordWrap\n");
@@ -329,8 +621,20 @@ void pxTextBox::renderText(bool render)
   }
   else
   {
+#ifdef PXSCENE_FONT_ATLAS
+    pass.valid = resumable;
+    mPreviousQuads = &previousQuads;
+#endif
     renderTextWithWordWrap(mText, sx, sy, tempX, mPixelSize, render);
+#ifdef PXSCENE_FONT_ATLAS
+    mPreviousQuads = NULL;
+#endif
   }
+
+#ifdef PXSCENE_FONT_ATLAS
+  if (render)
+    storeLayout(key);
+#endif
 }
 
 void pxTextBox::renderTextWithWordWrap(const char *text, float sx, float sy, float tempX, uint32_t size, bool render)
@@ -388,10 +692,85 @@ void pxTextBox::measureTextWithWrapOrNewLine(const char *text, float sx, float s
     int i = 0;
     int lasti = 0;
     int numbytes = 1;
-    while((charToMeasure = u8_nextchar((char*)text, &i)) != 0)
+
+    // decode up front; the byte offset past the last code point ends the list
+    int len = (int)strlen(text);
+    pxReserveDecodeBuffer(mCodePoints, len + 1);
+    pxReserveDecodeBuffer(mCodePointOffsets, len + 1);
+    int count = u8_decode(&mCodePoints[0], &mCodePointOffsets[0], len, text, len);
+    mCodePointOffsets[count] = len;
+    int codePoint = 0;  // index into mCodePoints of the next character
+
+#ifdef PXSCENE_FONT_ATLAS
+    // Without truncation a line only depends on the text before it, so the
+    // lines of a previous pass that lie within the unchanged start of the
+    // text are replayed and layout carries on from the first line after.
+    pxTextPass& pass = render ? mRenderPass : mMeasurePass;
+    bool recordable = mWordWrap && mTruncation == pxConstantsTruncation::NONE;
+    const pxTextLineStart* start = recordable ? resumePoint(pass, text, render) : NULL;
+    if (start)
+    {
+      for (uint32_t l = 0; l < start->lines; l++)
+      {
+        const pxTextLine& line = pass.lines[l];
+        lineNumber = line.lineNumber;
+        mReplayLine = &line;
+        renderOneLine(line.text.c_str(), line.x, line.y, sx, sy, size, line.width, false);
+      }
+      mReplayLine = NULL;
+      if (render)
+      {
+        mQuadsVector.swap(*mPreviousQuads);
+        mQuadsVector.resize(start->lines);
+      }
+
+      i = lasti = start->offset;
+      tempX = start->tempX;
+      tempY = start->tempY;
+      lineNumber = start->lineNumber;
+      accString = start->accString.c_str();
+      charW = start->charW;
+      charH = start->charH;
+      pass.lines.resize(start->lines);
+      pass.starts.resize(start - &pass.starts[0] + 1);
+      codePoint = std::lower_bound(mCodePointOffsets.begin(), mCodePointOffsets.begin() + count, i) - mCodePointOffsets.begin();
+    }
+    else
     {
+      pass.lines.clear();
+      pass.starts.clear();
+    }
+    pass.valid = recordable;
+    pass.text = text;
+    layoutProperties(pass.key);
+    pass.startY = startY;
+    mRecordPass = recordable ? &pass : NULL;
+    uint32_t recordedLine = lineNumber;
+#endif
+
+    while (codePoint < count)
+    {
+      charToMeasure = mCodePoints[codePoint];
+      i = mCodePointOffsets[++codePoint];
       // Determine if the character is multibyte
       numbytes = i-lasti;
+
+#ifdef PXSCENE_FONT_ATLAS
+      if (mRecordPass && lineNumber != recordedLine)
+      {
+        pxTextLineStart s;
+        s.offset = lasti;
+        s.tempX = tempX;
+        s.tempY = tempY;
+        s.lineNumber = lineNumber;
+        s.accString = accString.cString();
+        s.charW = charW;
+        s.charH = charH;
+        s.lines = (uint32_t)pass.lines.size();
+        pass.starts.push_back(s);
+        recordedLine = lineNumber;
+      }
+#endif
         
       std::string tempChar = std::string (&text[lasti], numbytes);
         
@@ -443,7 +822,7 @@ void pxTextBox::measureTextWithWrapOrNewLine(const char *text, float sx, float s
             lastLineNumber = lineNumber;
             //rtLogDebug("!!!!CLF: calling renderTextRowWithTruncation! %s\n",accString.cString());
             if( mTruncation != pxConstantsTruncation::NONE) {
-              renderTextRowWithTruncation(accString, mw, mx, tempY, sx, sy, size, render);
+              renderTextRowWithTruncation(accString, mw, layoutX(), tempY, sx, sy, size, render);
               accString = "";
               break;
             }
@@ -536,7 +915,7 @@ void pxTextBox::measureTextWithWrapOrNewLine(const char *text, float sx, float s
             lastLine = true;
             if(mXStopPos != 0 && mAlignHorizontal == pxConstantsAlignHorizontal::LEFT)
             {
-                lineWidth = mXStopPos - mx;
+                lineWidth = mXStopPos - layoutX();
             }
           }
         }
@@ -553,7 +932,7 @@ void pxTextBox::measureTextWithWrapOrNewLine(const char *text, float sx, float s
         if( !lastLine && mXStopPos != 0 && mAlignHorizontal == pxConstantsAlignHorizontal::LEFT
             && mTruncation != pxConstantsTruncation::NONE && mXStopPos > mXStartPos
             && tempX > mw) {
-          renderTextRowWithTruncation(accString, mXStopPos - mx, mx, tempY, sx, sy, size, render);
+          renderTextRowWithTruncation(accString, mXStopPos - layoutX(), layoutX(), tempY, sx, sy, size, render);
         }
         else
         {
@@ -562,6 +941,9 @@ void pxTextBox::measureTextWithWrapOrNewLine(const char *text, float sx, float s
       }
 
     }
+#ifdef PXSCENE_FONT_ATLAS
+    mRecordPass = NULL;
+#endif
 
 
   if( !render) {
@@ -584,19 +966,19 @@ void pxTextBox::measureTextWithWrapOrNewLine(const char *text, float sx, float s
       {
         if(!mWordWrap )
         {
-          startY = my + (mh - textHeight); // could be negative
+          startY = layoutY() + (mh - textHeight); // could be negative
           if(!clip() && mTruncation == pxConstantsTruncation::NONE)
           {
-            noClipY = my;
+            noClipY = layoutY();
             noClipH = textHeight;//mh;
           }
         }
         else
         {
-          startY = my + (mh - textHeight); // could be negative
+          startY = layoutY() + (mh - textHeight); // could be negative
           if(!clip())
           {
-            noClipY = my-(textHeight-mh);
+            noClipY = layoutY()-(textHeight-mh);
             if(mTruncation == pxConstantsTruncation::NONE) {
               noClipH = textHeight;
               startY = 0;//my;
@@ -608,19 +990,19 @@ void pxTextBox::measureTextWithWrapOrNewLine(const char *text, float sx, float s
       {
         if(!mWordWrap )
         {
-          startY = my + (mh - textHeight)/2;
+          startY = layoutY() + (mh - textHeight)/2;
           if(!clip() && mTruncation == pxConstantsTruncation::NONE)
           {
-            noClipY = my;
+            noClipY = layoutY();
             noClipH = textHeight;
           }
         }
         else
         {
-          startY = my + (mh - textHeight)/2;
+          startY = layoutY() + (mh - textHeight)/2;
           if(!clip())
           {
-            noClipY = my + (mh - textHeight)/2;
+            noClipY = layoutY() + (mh - textHeight)/2;
             if(mTruncation == pxConstantsTruncation::NONE)
             {
               startY = 0;//my;
@@ -656,8 +1038,8 @@ void pxTextBox::measureTextWithWrapOrNewLine(const char *text, float sx, float s
       else
       {
         //rtLogDebug("!CLF: Setting bounds: startY=%f, my=%f, textHeight=%f\n",startY, my, textHeight);
-        if(startY < my) {
-          setMeasurementBoundsY(true, my);
+        if(startY < layoutY()) {
+          setMeasurementBoundsY(true, layoutY());
           setMeasurementBoundsY(false, textHeight>mh?mh:textHeight);
         }
         else {
@@ -679,10 +1061,32 @@ void pxTextBox::renderOneLine(const char * tempStr, float tempX, float tempY, fl
 
   //rtLogDebug("pxTextBox::renderOneLine tempY=%f noClipY=%f tempStr=%s\n",tempY,noClipY, tempStr);
   float xPos = tempX;
+#ifdef PXSCENE_FONT_ATLAS
+  if (mReplayLine)
+  {
+    charW = mReplayLine->charW;
+    charH = mReplayLine->charH;
+  }
+  else
+#endif
   if (getFontResource() != NULL)
   {
     getFontResource()->measureTextInternal(tempStr, size, sx, sy, charW, charH);
   }
+#ifdef PXSCENE_FONT_ATLAS
+  if (mRecordPass)
+  {
+    pxTextLine line;
+    line.text = tempStr;
+    line.x = tempX;
+    line.y = tempY;
+    line.width = lineWidth;
+    line.lineNumber = lineNumber;
+    line.charW = charW;
+    line.charH = charH;
+    mRecordPass->lines.push_back(line);
+  }
+#endif
 
   if( !clip() && mTruncation == pxConstantsTruncation::NONE)
   {
@@ -823,7 +1227,7 @@ void pxTextBox::renderOneLine(const char * tempStr, float tempX, float tempY, fl
     }
     else
     {
-      setMeasurementBoundsX(true, xPos<mx?mx:xPos);
+      setMeasurementBoundsX(true, xPos<layoutX()?layoutX():xPos);
       if( mWordWrap) {
         //rtLogDebug("!CLF: wordWrap true: tempY=%f, mh=%f, charH=%f\n",tempY, mh, charH);
         if( tempY + charH <= mh) {
@@ -876,8 +1280,8 @@ void pxTextBox::renderOneLine(const char * tempStr, float tempX, float tempY, fl
        }
 
         if( xPos != tempX) {
-          setLineMeasurements(true, xPos<mx?mx:xPos, tempY);
-          setMeasurementBoundsX(true, xPos<mx?mx:xPos);
+          setLineMeasurements(true, xPos<layoutX()?layoutX():xPos, tempY);
+          setMeasurementBoundsX(true, xPos<layoutX()?layoutX():xPos);
           setMeasurementBounds(false, (xPos+width) > mw? mw:width, charH);
         }
         else {
@@ -893,7 +1297,7 @@ void pxTextBox::renderOneLine(const char * tempStr, float tempX, float tempY, fl
         if( !clip())
           setLineMeasurements(false, width > mw? mw:width, tempY);
         else {
-          float tmpX = xPos<mx?mx:xPos;
+          float tmpX = xPos<layoutX()?layoutX():xPos;
           setLineMeasurements(false, (tmpX+width) > mw? mw:tmpX+width, tempY);
         }
       }
@@ -921,8 +1325,8 @@ void pxTextBox::renderOneLine(const char * tempStr, float tempX, float tempY, fl
       else
       {
         //rtLogDebug("!CLF: Here we go: xPos=%f mx=%f, tempX=%f, lineWidth=%f, charW=%f mw=%f\n",xPos,mx, tempX,lineWidth, charW, mw);
-        setMeasurementBoundsX(true, xPos<mx?mx:xPos);
-        setLineMeasurements(true, xPos<mx?mx:xPos, tempY< my?my:tempY);
+        setMeasurementBoundsX(true, xPos<layoutX()?layoutX():xPos);
+        setLineMeasurements(true, xPos<layoutX()?layoutX():xPos, tempY< layoutY()?layoutY():tempY);
         if( charW > mw && (xPos+lineWidth) > mw) {
           setMeasurementBoundsX(false, mw-xPos );
         }
@@ -938,9 +1342,9 @@ void pxTextBox::renderOneLine(const char * tempStr, float tempX, float tempY, fl
   if( render && getFontResource() != NULL)
   {
  #ifdef PXSCENE_FONT_ATLAS
-     pxTexturedQuads quads;
-     getFontResource()->renderTextToQuads(tempStr, size, sx, sy, quads, roundf(xPos), roundf(tempY));
-     mQuadsVector.push_back(quads);
+     pxTextLineQuadsRef line = new pxTextLineQuads();
+     getFontResource()->renderTextToQuads(tempStr, size, sx, sy, line->quads, roundf(xPos), roundf(tempY));
+     mQuadsVector.push_back(line);
  #else
    getFontResource()->renderText(tempStr, size, xPos, tempY, sx, sy, mTextColor,lineWidth);
 #endif
@@ -1088,7 +1492,7 @@ void pxTextBox::renderTextNoWordWrap(float sx, float sy, float tempX, bool rende
     {
       if( mAlignVertical == pxConstantsAlignVertical::BOTTOM )
       {
-        tempY = my + (mh - charH); // could be negative    // BOTTOM
+        tempY = layoutY() + (mh - charH); // could be negative    // BOTTOM
       }
       else
       {
@@ -1167,17 +1571,33 @@ void pxTextBox::renderTextRowWithTruncation(rtString & accString, float lineWidt
   }
 
  
-    // TODO this looks pretty inefficient... We should revisit...
-  for(int i = length; i > 0; i--)
+  // Measure every prefix in one pass, then binary search for the longest
+  // one that still fits together with the ellipsis
+  std::vector<int> offsets;
+  std::vector<float> widths, heights;
+  if (getFontResource() != NULL)
   {
-    // eliminate a utf8 character to see if new string width fits
-    tempStr[u8_offset(tempStr,i)] = '\0';
-    charW = 0;
-    charH = 0;
-    if (getFontResource() != NULL)
-    {
-      getFontResource()->measureTextInternal(tempStr, pixelSize, sx, sy, charW, charH);
-    }
+    getFontResource()->measureTextRun(tempStr, pixelSize, offsets, widths, heights);
+  }
+  int lo = 0;
+  int hi = (int)offsets.size()-1;
+  if (hi > length)
+    hi = length;
+  while (lo < hi)
+  {
+    int mid = (lo+hi+1)/2;
+    if( (tempX + widths[mid] + ellipsisW) <= lineWidth)
+      lo = mid;
+    else
+      hi = mid-1;
+  }
+
+  int i = lo;
+  if (i > 0)
+  {
+    tempStr[offsets[i]] = '\0';
+    charW = widths[i];
+    charH = heights[i];
 	
     if( (tempX + charW + ellipsisW) <= lineWidth)
     {
@@ -1202,9 +1622,9 @@ void pxTextBox::renderTextRowWithTruncation(rtString & accString, float lineWidt
 
         if( render && getFontResource() != NULL) {
 #ifdef PXSCENE_FONT_ATLAS
-          pxTexturedQuads quads;
-          getFontResource()->renderTextToQuads(tempStr, pixelSize, sx, sy, quads, roundf(xPos), roundf(tempY));
-          mQuadsVector.push_back(quads);
+          pxTextLineQuadsRef line = new pxTextLineQuads();
+          getFontResource()->renderTextToQuads(tempStr, pixelSize, sx, sy, line->quads, roundf(xPos), roundf(tempY));
+          mQuadsVector.push_back(line);
 #else
           getFontResource()->renderText(tempStr, pixelSize, xPos, tempY, 1.0, 1.0, mTextColor,lineWidth);
 #endif       
@@ -1214,9 +1634,9 @@ void pxTextBox::renderTextRowWithTruncation(rtString & accString, float lineWidt
           //rtLogDebug("rendering truncated text with ellipsis\n");
           if( render && getFontResource() != NULL) {
 #ifdef PXSCENE_FONT_ATLAS
-            pxTexturedQuads quads;  
-            getFontResource()->renderTextToQuads(ELLIPSIS_STR, pixelSize, sx, sy, quads, roundf(xPos+charW), roundf(tempY));
-            mQuadsVector.push_back(quads);
+            pxTextLineQuadsRef line = new pxTextLineQuads();
+            getFontResource()->renderTextToQuads(ELLIPSIS_STR, pixelSize, sx, sy, line->quads, roundf(xPos+charW), roundf(tempY));
+            mQuadsVector.push_back(line);
 #else
             getFontResource()->renderText(ELLIPSIS_STR, pixelSize, xPos+charW, tempY, 1.0, 1.0, mTextColor,lineWidth);
 #endif          
@@ -1225,7 +1645,6 @@ void pxTextBox::renderTextRowWithTruncation(rtString & accString, float lineWidt
           else { setMeasurementBoundsX(false, charW+ellipsisW);}
           setLineMeasurements(false, xPos+charW+ellipsisW, tempY);
         }
-        break;
       }
       else if( mTruncation == pxConstantsTruncation::TRUNCATE_AT_WORD)
       {
@@ -1270,9 +1689,9 @@ void pxTextBox::renderTextRowWithTruncation(rtString & accString, float lineWidt
           if( render && getFontResource() != NULL)
           {
 #ifdef PXSCENE_FONT_ATLAS
-            pxTexturedQuads quads;
-            getFontResource()->renderTextToQuads(tempStr, pixelSize, sx, sy, quads, roundf(xPos), roundf(tempY));
-            mQuadsVector.push_back(quads);
+            pxTextLineQuadsRef line = new pxTextLineQuads();
+            getFontResource()->renderTextToQuads(tempStr, pixelSize, sx, sy, line->quads, roundf(xPos), roundf(tempY));
+            mQuadsVector.push_back(line);
 #else
             getFontResource()->renderText(tempStr, pixelSize, xPos, tempY, 1.0, 1.0, mTextColor,lineWidth);
 #endif          
@@ -1283,9 +1702,9 @@ void pxTextBox::renderTextRowWithTruncation(rtString & accString, float lineWidt
           //rtLogDebug("rendering  text on word boundary with ellipsis\n");
           if( render && getFontResource() != NULL) {
 #ifdef PXSCENE_FONT_ATLAS
-            pxTexturedQuads quads;
-            getFontResource()->renderTextToQuads(ELLIPSIS_STR, pixelSize, sx, sy, quads, roundf(xPos+charW), roundf(tempY));
-            mQuadsVector.push_back(quads);
+            pxTextLineQuadsRef line = new pxTextLineQuads();
+            getFontResource()->renderTextToQuads(ELLIPSIS_STR, pixelSize, sx, sy, line->quads, roundf(xPos+charW), roundf(tempY));
+            mQuadsVector.push_back(line);
 #else
             getFontResource()->renderText(ELLIPSIS_STR, pixelSize, xPos+charW, tempY, 1.0, 1.0, mTextColor,lineWidth);
 #endif         
@@ -1294,10 +1713,9 @@ void pxTextBox::renderTextRowWithTruncation(rtString & accString, float lineWidt
           else { setMeasurementBoundsX(false, charW+ellipsisW);}
           setLineMeasurements(false, xPos+charW+ellipsisW, tempY);
         }
-        break;
       }
     }
-  }//FOR
+  }
 
   if(tempStr)
     free(tempStr);
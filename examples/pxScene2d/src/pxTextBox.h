@@ -25,8 +25,12 @@
 #include <ft2build.h>
 #include FT_FREETYPE_H
 
+#include <list>
+#include <unordered_map>
+
 #include "rtString.h"
 #include "rtRef.h"
+#include "rtAtomic.h"
 #include "pxScene2d.h"
 #include "pxText.h"
 
@@ -168,6 +172,152 @@ public:
     
 };
 
+// which coordinates of the box a layout depends on
+#define PX_TEXT_LAYOUT_READS_X  1
+#define PX_TEXT_LAYOUT_READS_Y  2
+#define PX_TEXT_LAYOUT_READS_XY 3
+
+#ifdef PXSCENE_FONT_ATLAS
+/**********************************************************************
+ * 
+ * pxTextLayoutCache
+ * 
+ * Laid out quads and measurements of text boxes, keyed by everything
+ * that affects layout so that identical text boxes share one layout.
+ * The position of a box is only part of the key when the layout read it;
+ * most layouts do not, so boxes that differ only in x and y share one.
+ * 
+ **********************************************************************/
+#ifndef PXSCENE_TEXT_LAYOUT_CACHE_BYTES
+#define PXSCENE_TEXT_LAYOUT_CACHE_BYTES (4*1024*1024)
+#endif
+
+struct pxTextLayoutKey
+{
+  rtString text;
+  uint32_t textHash;
+  uint32_t fontId;
+  uint32_t pixelSize;
+  bool distanceField;
+  uint32_t positionReads; // x and y are 0 unless read
+  float x, y, w, h;
+  float xStartPos, xStopPos, leading;
+  uint32_t truncation, alignVertical, alignHorizontal;
+  bool wordWrap, ellipsis, clip;
+
+  bool operator<(const pxTextLayoutKey& other) const;
+  bool operator==(const pxTextLayoutKey& other) const;
+};
+
+struct pxTextLayoutKeyHash
+{
+  size_t operator()(const pxTextLayoutKey& key) const;
+};
+
+// Quads of one laid out line.  Lines do not change once built, so a text
+// box and the layout cache share them; copying a layout copies references
+// rather than vertices.
+class pxTextLineQuads
+{
+public:
+  pxTextLineQuads(): quads(), mRef(0) {}
+
+  unsigned long AddRef() { return rtAtomicInc(&mRef); }
+  unsigned long Release()
+  {
+    unsigned long l = rtAtomicDec(&mRef);
+    if (l == 0)
+      delete this;
+    return l;
+  }
+
+  pxTexturedQuads quads;
+
+private:
+  rtAtomic mRef;
+};
+
+typedef rtRef<pxTextLineQuads> pxTextLineQuadsRef;
+
+struct pxTextLayout
+{
+  std::vector<pxTextLineQuadsRef> quads;
+  float boundsX1, boundsY1, boundsX2, boundsY2;
+  float charFirstX, charFirstY, charLastX, charLastY;
+  uint32_t lineNumber, lastLineNumber;
+  float noClipX, noClipY, noClipW, noClipH;
+  float startY;
+};
+
+// Least recently used layouts are dropped once the cache holds more than
+// PXSCENE_TEXT_LAYOUT_CACHE_BYTES
+class pxTextLayoutCache
+{
+public:
+  // returns NULL on a miss or when the glyph atlas has moved on since the
+  // layout was stored
+  static pxTextLayout* find(const pxTextLayoutKey& key);
+  static void insert(const pxTextLayoutKey& key, const pxTextLayout& layout);
+  static void clear();
+  static uint32_t size() { return (uint32_t)mLayouts.size(); }
+  static size_t bytes() { return mBytes; }
+
+private:
+  // most recently used first; points at the keys held by mLayouts
+  typedef std::list<const pxTextLayoutKey*> LayoutList;
+  struct entry
+  {
+    pxTextLayout layout;
+    LayoutList::iterator lru;
+    size_t bytes;
+  };
+  typedef std::unordered_map<pxTextLayoutKey, entry, pxTextLayoutKeyHash> LayoutMap;
+
+  static void erase(LayoutMap::iterator it);
+
+  static LayoutMap mLayouts;
+  static LayoutList mLru;
+  static size_t mBytes;
+};
+
+// One line of a word wrapped layout pass: the arguments it was laid out
+// with and its measured size
+struct pxTextLine
+{
+  std::string text;
+  float x, y, width;
+  uint32_t lineNumber;
+  float charW, charH;
+};
+
+// Layout loop state at the first character of a line.  It only depends on
+// the text before offset.
+struct pxTextLineStart
+{
+  int offset;
+  float tempX, tempY;
+  uint32_t lineNumber;
+  std::string accString;
+  float charW, charH;
+  uint32_t lines; // lines finished before this one
+};
+
+// Record of the last word wrapped measure or render pass.  When text is
+// appended, the lines that lie entirely within the unchanged prefix are
+// replayed from here (with their quads, for the render pass) and only the
+// rest of the text is laid out.
+struct pxTextPass
+{
+  pxTextPass(): valid(false), startY(0) {}
+  bool valid;
+  rtString text;
+  pxTextLayoutKey key; // layout properties; text is left empty
+  float startY;
+  std::vector<pxTextLine> lines;
+  std::vector<pxTextLineStart> starts;
+};
+#endif //PXSCENE_FONT_ATLAS
+
 /**********************************************************************
  * 
  * pxTextBox
@@ -231,6 +381,9 @@ public:
   virtual rtError setFont(rtObjectRef o);
   
   void renderText(bool render);
+#ifdef PXSCENE_FONT_ATLAS
+  bool quadsStale();
+#endif
 
   virtual void resourceReady(rtString readyResolution);
   virtual void sendPromise();
@@ -292,13 +445,32 @@ public:
   bool mInitialized;
   bool mNeedsRecalc;
 
+  // position of the box as seen by layout; notes that the layout read it
+  float layoutX() { mLayoutReads |= PX_TEXT_LAYOUT_READS_X; return mx; }
+  float layoutY() { mLayoutReads |= PX_TEXT_LAYOUT_READS_Y; return my; }
+  uint32_t mLayoutReads;
+
   #ifdef PXSCENE_FONT_ATLAS
-  std::vector<pxTexturedQuads> mQuadsVector;
+  std::vector<pxTextLineQuadsRef> mQuadsVector;
+  void layoutKey(pxTextLayoutKey& key);
+  void layoutProperties(pxTextLayoutKey& key);
+  pxTextLayout* cachedLayout(pxTextLayoutKey& key);
+  void storeLayout(pxTextLayoutKey& key);
+  void applyLayout(const pxTextLayoutKey& key, const pxTextLayout& layout);
+
+  const pxTextLineStart* resumePoint(pxTextPass& pass, const char* text, bool render);
+  pxTextPass mMeasurePass;
+  pxTextPass mRenderPass;
+  pxTextPass* mRecordPass;       // pass being recorded by renderOneLine
+  const pxTextLine* mReplayLine; // line being replayed by renderOneLine
+  std::vector<pxTextLineQuadsRef>* mPreviousQuads; // quads of the last render pass
   #endif
 
   rtObjectRef measurements;
   uint32_t lineNumber;
   uint32_t lastLineNumber;
+  std::vector<u_int32_t> mCodePoints;  // text being laid out, decoded once
+  std::vector<int> mCodePointOffsets;  // byte offset of each code point
   float noClipX, noClipY, noClipW, noClipH;
 //  float startX;
   float startY;
@@ -51,7 +51,7 @@ class pxTexture: public pxTextureNative
 {
 public:
   pxTexture() : mRef(0), mTextureType(PX_TEXTURE_UNKNOWN), mPremultipliedAlpha(false), mLastRenderTick(0),
-                mDownscaleSmooth(false)
+                mDownscaleSmooth(false), mMipmapRequested(false), mDistanceField(false)
   { }
   virtual ~pxTexture() {}
 
@@ -82,7 +82,20 @@ public:
   virtual pxError loadTextureData() { return PX_OK; }
   virtual pxError unloadTextureData() { return PX_OK; }
   virtual pxError freeOffscreenData() { return PX_OK; }
+  // Textures packed into a shared atlas return the page to bind and the
+  // sub-rectangle they occupy in it
+  virtual pxError atlasRect(rtRef<pxTexture>& /*page*/, float& /*u1*/, float& /*v1*/, float& /*u2*/, float& /*v2*/) { return PX_FAIL; }
   virtual pxError setTextureListener(pxTextureListener* /*textureListener*/) { return PX_OK; }
+  // Textures shared by several resources notify each of them
+  virtual pxError addTextureListener(pxTextureListener* /*textureListener*/) { return PX_OK; }
+  virtual pxError removeTextureListener(pxTextureListener* /*textureListener*/) { return PX_OK; }
+  // Where the compressed data can be fetched again (rtFileCache or a local
+  // file) if it is released to stay within the CPU memory limit
+  virtual pxError setCompressedDataUrl(const char* /*url*/) { return PX_FAIL; }
+  // Releases the compressed copy of an uploaded texture, returns bytes freed
+  virtual int64_t releaseCompressedData() { return 0; }
+  // CPU-side bytes held for this texture (compressed and decoded copies)
+  virtual int64_t cpuMemoryUsage() { return 0; }
   bool premultipliedAlpha() { return mPremultipliedAlpha; }
   void enablePremultipliedAlpha(bool enable) { mPremultipliedAlpha = enable; }
   virtual void* getSurface() { return NULL; }
@@ -90,6 +103,15 @@ public:
   void setLastRenderTick(uint32_t renderTick) { mLastRenderTick = renderTick; }
   void setDownscaleSmooth(bool downscaleSmooth) { mDownscaleSmooth = downscaleSmooth; }
   bool downscaleSmooth() { return mDownscaleSmooth; }
+  // set by the renderer once the texture has been drawn minified; sticky so
+  // that the mip chain is only built once
+  void setMipmapRequested(bool mipmapRequested) { mMipmapRequested = mipmapRequested; }
+  bool mipmapRequested() { return mMipmapRequested; }
+  // bytes used (or about to be used) by mip levels above the base level
+  virtual int64_t mipmapMemoryUsage() { return 0; }
+  // alpha textures holding signed distance fields rather than coverage
+  void setDistanceField(bool distanceField) { mDistanceField = distanceField; }
+  bool distanceField() { return mDistanceField; }
   bool initialized() { return true; }
 protected:
   rtAtomic mRef;
@@ -97,6 +119,8 @@ protected:
   bool mPremultipliedAlpha;
   uint32_t mLastRenderTick;
   bool mDownscaleSmooth;
+  bool mMipmapRequested;
+  bool mDistanceField;
 };
 
 typedef rtRef<pxTexture> pxTextureRef;
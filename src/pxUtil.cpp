@@ -34,6 +34,7 @@
 #include "pxUtil.h"
 
 #include <openssl/md5.h>
+#include <openssl/sha.h>
 
 #define SUPPORT_PNG
 #define SUPPORT_JPG
@@ -220,6 +221,7 @@ struct mem_encode
 {
   char *buffer;
   size_t size;
+  size_t capacity;
 };
 
 // TODO change this to using rtData more directly
@@ -229,14 +231,20 @@ void my_png_write_data(png_structp png_ptr, png_bytep data, png_size_t length)
   struct mem_encode *p = (struct mem_encode *)png_get_io_ptr(png_ptr); /* was png_ptr->io_ptr */
   size_t nsize = p->size + length;
 
-  /* allocate or grow buffer */
-  if (p->buffer)
-    p->buffer = (char *)realloc(p->buffer, nsize);
-  else
-    p->buffer = (char *)malloc(nsize);
+  /* allocate or grow buffer geometrically so large images are not copied per chunk */
+  if (nsize > p->capacity)
+  {
+    size_t ncapacity = p->capacity ? p->capacity : 64 * 1024;
+    while (ncapacity < nsize)
+      ncapacity *= 2;
 
-  if (!p->buffer)
-    png_error(png_ptr, "Write Error");
+    char *nbuffer = (char *)realloc(p->buffer, ncapacity);
+    if (!nbuffer)
+      png_error(png_ptr, "Write Error");
+
+    p->buffer = nbuffer;
+    p->capacity = ncapacity;
+  }
 
   /* copy new bytes to end of buffer */
   memcpy(p->buffer + p->size, data, length);
@@ -244,7 +252,7 @@ void my_png_write_data(png_structp png_ptr, png_bytep data, png_size_t length)
 }
 
 // TODO rewrite this...
-rtError pxStorePNGImage(pxOffscreen &b, rtData &pngData)
+rtError pxStorePNGImage(pxOffscreen &b, rtData &pngData, int compressionLevel)
 {
   if (b.mPixelFormat != RT_PIX_RGBA)
   {
@@ -260,6 +268,7 @@ rtError pxStorePNGImage(pxOffscreen &b, rtData &pngData)
   struct mem_encode state;
   state.buffer = NULL;
   state.size = 0;
+  state.capacity = 0;
 
   {
     // initialize stuff
@@ -283,6 +292,10 @@ rtError pxStorePNGImage(pxOffscreen &b, rtData &pngData)
     if (!setjmp(png_jmpbuf(png_ptr)))
     {
       png_set_write_fn(png_ptr, &state, my_png_write_data, NULL);
+      if (compressionLevel >= 0)
+      {
+        png_set_compression_level(png_ptr, compressionLevel);
+      }
       // write header
       if (!setjmp(png_jmpbuf(png_ptr)))
       {
@@ -1249,6 +1262,458 @@ rtError pxLoadPNGImage(const char *imageData, size_t imageDataSize,
   return e;
 }
 
+// Enough bytes for getImageType() to tell the format
+#define PX_IMAGE_SIGNATURE_SIZE 16
+
+struct pxPngStreamState
+{
+  pxPngStreamState() : png_ptr(NULL), info_ptr(NULL) {}
+
+  static void infoCallback(png_structp png_ptr, png_infop info_ptr)
+  {
+    pxImageStreamDecoder* decoder = (pxImageStreamDecoder*)png_get_progressive_ptr(png_ptr);
+
+    int width = png_get_image_width(png_ptr, info_ptr);
+    int height = png_get_image_height(png_ptr, info_ptr);
+
+    png_byte color_type = png_get_color_type(png_ptr, info_ptr);
+    png_byte bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+
+    // same transforms as pxLoadPNGImage()
+    if (bit_depth == 16)
+    {
+      png_set_strip_16(png_ptr);
+    }
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+    {
+      png_set_palette_to_rgb(png_ptr);
+    }
+    if (color_type == PNG_COLOR_TYPE_GRAY ||
+        color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+    {
+      png_set_gray_to_rgb(png_ptr);
+    }
+    if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+    {
+      png_set_tRNS_to_alpha(png_ptr);
+    }
+    png_set_add_alpha(png_ptr, 0xff, PNG_FILLER_AFTER);
+    png_set_interlace_handling(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
+
+    if (decoder->mOffscreen.initWithColor(width, height, pxClear) != PX_OK)
+    {
+      png_error(png_ptr, "out of memory");
+    }
+    decoder->mOffscreen.mPixelFormat = RT_PIX_RGBA;
+    decoder->mHasImageSize = true;
+  }
+
+  static void rowCallback(png_structp png_ptr, png_bytep new_row, png_uint_32 row_num, int /*pass*/)
+  {
+    pxImageStreamDecoder* decoder = (pxImageStreamDecoder*)png_get_progressive_ptr(png_ptr);
+
+    // NULL for rows an interlace pass leaves unchanged
+    if (new_row == NULL || (int)row_num >= decoder->mOffscreen.height())
+    {
+      return;
+    }
+    png_progressive_combine_row(png_ptr, (png_bytep)decoder->mOffscreen.scanline(row_num), new_row);
+    decoder->mRowsDecoded++;
+  }
+
+  static void endCallback(png_structp png_ptr, png_infop /*info_ptr*/)
+  {
+    pxImageStreamDecoder* decoder = (pxImageStreamDecoder*)png_get_progressive_ptr(png_ptr);
+    decoder->mComplete = true;
+  }
+
+  png_structp png_ptr;
+  png_infop info_ptr;
+};
+
+// Stages of the suspending JPEG decode; the buffered image stages are only
+// used for progressive JPEGs, which are output once per arrived scan
+enum pxJpegStreamStage
+{
+  PX_JPEG_STREAM_HEADER,
+  PX_JPEG_STREAM_START,
+  PX_JPEG_STREAM_START_OUTPUT,
+  PX_JPEG_STREAM_SCANLINES,
+  PX_JPEG_STREAM_FINISH_OUTPUT,
+  PX_JPEG_STREAM_FINISH,
+  PX_JPEG_STREAM_DONE
+};
+
+// The source manager hands libjpeg the unread bytes and suspends it when
+// they run out.  libjpeg rewinds next_input_byte to the start of whatever
+// it could not finish, so only the bytes from there on are kept.
+struct pxJpegStreamState
+{
+  pxJpegStreamState()
+    : buffer(NULL), bufferCapacity(0), skipBytes(0), row(NULL),
+      stage(PX_JPEG_STREAM_HEADER), outputScan(0), created(false)
+  {
+    memset(&cinfo, 0, sizeof(cinfo));
+    memset(&source, 0, sizeof(source));
+  }
+
+  ~pxJpegStreamState()
+  {
+    if (created)
+    {
+      jpeg_destroy_decompress(&cinfo);
+    }
+    if (buffer != NULL)
+    {
+      free(buffer);
+    }
+  }
+
+  static void initSource(j_decompress_ptr /*cinfo*/)
+  {
+  }
+
+  static boolean fillInputBuffer(j_decompress_ptr /*cinfo*/)
+  {
+    // suspend until write() brings more data
+    return FALSE;
+  }
+
+  static void skipInputData(j_decompress_ptr cinfo, long num_bytes)
+  {
+    pxJpegStreamState* state = (pxJpegStreamState*)cinfo->client_data;
+    if (num_bytes <= 0)
+    {
+      return;
+    }
+    if ((size_t)num_bytes > cinfo->src->bytes_in_buffer)
+    {
+      // the rest is skipped as it arrives
+      state->skipBytes += (size_t)num_bytes - cinfo->src->bytes_in_buffer;
+      cinfo->src->next_input_byte += cinfo->src->bytes_in_buffer;
+      cinfo->src->bytes_in_buffer = 0;
+    }
+    else
+    {
+      cinfo->src->next_input_byte += num_bytes;
+      cinfo->src->bytes_in_buffer -= num_bytes;
+    }
+  }
+
+  static void termSource(j_decompress_ptr /*cinfo*/)
+  {
+  }
+
+  bool append(const char* data, size_t size)
+  {
+    size_t skip = (skipBytes < size) ? skipBytes : size;
+    data += skip;
+    size -= skip;
+    skipBytes -= skip;
+
+    size_t unread = source.bytes_in_buffer;
+    if (unread > 0 && source.next_input_byte != buffer)
+    {
+      memmove(buffer, source.next_input_byte, unread);
+    }
+    if (unread + size > bufferCapacity)
+    {
+      size_t capacity = (bufferCapacity * 2 > unread + size) ? bufferCapacity * 2 : unread + size;
+      JOCTET* newBuffer = (JOCTET*)realloc(buffer, capacity);
+      if (newBuffer == NULL)
+      {
+        return false;
+      }
+      buffer = newBuffer;
+      bufferCapacity = capacity;
+    }
+    if (size > 0)
+    {
+      memcpy(buffer + unread, data, size);
+    }
+    source.next_input_byte = buffer;
+    source.bytes_in_buffer = unread + size;
+    return true;
+  }
+
+  struct jpeg_decompress_struct cinfo;
+  struct my_error_mgr jerr;
+  struct jpeg_source_mgr source;
+  JOCTET* buffer;
+  size_t bufferCapacity;
+  size_t skipBytes;
+  JSAMPARRAY row;
+  pxJpegStreamStage stage;
+  int outputScan;
+  bool created;
+};
+
+pxImageStreamDecoder::pxImageStreamDecoder()
+  : mType(PX_IMAGE_INVALID), mSignature(), mPng(NULL), mJpeg(NULL), mOffscreen(),
+    mFailed(false), mHasImageSize(false), mComplete(false), mRowsDecoded(0)
+{
+}
+
+pxImageStreamDecoder::~pxImageStreamDecoder()
+{
+  if (mPng != NULL)
+  {
+    png_destroy_read_struct(&mPng->png_ptr, &mPng->info_ptr, NULL);
+    delete mPng;
+  }
+  delete mJpeg;
+}
+
+rtError pxImageStreamDecoder::write(const char* data, size_t size)
+{
+  if (mFailed)
+  {
+    return RT_FAIL;
+  }
+  if (mComplete || size == 0)
+  {
+    return RT_OK;
+  }
+
+  if (mType == PX_IMAGE_INVALID)
+  {
+    // collect enough of the start to tell the format
+    size_t needed = PX_IMAGE_SIGNATURE_SIZE - mSignature.size();
+    size_t taken = (size < needed) ? size : needed;
+    mSignature.insert(mSignature.end(), data, data + taken);
+    if (mSignature.size() < PX_IMAGE_SIGNATURE_SIZE)
+    {
+      return RT_OK;
+    }
+    mType = getImageType((const uint8_t*)&mSignature[0], mSignature.size());
+    if (mType != PX_IMAGE_PNG && mType != PX_IMAGE_JPG)
+    {
+      mFailed = true;
+      return RT_FAIL;
+    }
+    rtError e = (mType == PX_IMAGE_PNG) ? decodePng(&mSignature[0], mSignature.size()) :
+                                          decodeJpeg(&mSignature[0], mSignature.size());
+    std::vector<char>().swap(mSignature);
+    data += taken;
+    size -= taken;
+    if (e != RT_OK || size == 0)
+    {
+      return e;
+    }
+  }
+
+  return (mType == PX_IMAGE_PNG) ? decodePng(data, size) : decodeJpeg(data, size);
+}
+
+rtError pxImageStreamDecoder::decodePng(const char* data, size_t size)
+{
+  if (mPng == NULL)
+  {
+    mPng = new pxPngStreamState();
+    mPng->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (mPng->png_ptr != NULL)
+    {
+      mPng->info_ptr = png_create_info_struct(mPng->png_ptr);
+    }
+    if (mPng->info_ptr == NULL)
+    {
+      rtLogError("pxImageStreamDecoder: failed to create the png read struct");
+      mFailed = true;
+      return RT_FAIL;
+    }
+    png_set_progressive_read_fn(mPng->png_ptr, (png_voidp)this,
+                                pxPngStreamState::infoCallback,
+                                pxPngStreamState::rowCallback,
+                                pxPngStreamState::endCallback);
+  }
+
+  if (setjmp(png_jmpbuf(mPng->png_ptr)))
+  {
+    mFailed = true;
+    return RT_FAIL;
+  }
+  png_process_data(mPng->png_ptr, mPng->info_ptr, (png_bytep)data, size);
+  return RT_OK;
+}
+
+rtError pxImageStreamDecoder::decodeJpeg(const char* data, size_t size)
+{
+  if (mJpeg == NULL)
+  {
+    mJpeg = new pxJpegStreamState();
+    mJpeg->cinfo.err = jpeg_std_error(&mJpeg->jerr.pub);
+    mJpeg->jerr.pub.error_exit = my_error_exit;
+    if (setjmp(mJpeg->jerr.setjmp_buffer))
+    {
+      mFailed = true;
+      return RT_FAIL;
+    }
+    jpeg_create_decompress(&mJpeg->cinfo);
+    mJpeg->created = true;
+    mJpeg->cinfo.client_data = mJpeg;
+    mJpeg->source.init_source = pxJpegStreamState::initSource;
+    mJpeg->source.fill_input_buffer = pxJpegStreamState::fillInputBuffer;
+    mJpeg->source.skip_input_data = pxJpegStreamState::skipInputData;
+    mJpeg->source.resync_to_restart = jpeg_resync_to_restart;
+    mJpeg->source.term_source = pxJpegStreamState::termSource;
+    mJpeg->cinfo.src = &mJpeg->source;
+  }
+
+  if (!mJpeg->append(data, size))
+  {
+    rtLogError("pxImageStreamDecoder: out of memory");
+    mFailed = true;
+    return RT_FAIL;
+  }
+
+  j_decompress_ptr cinfo = &mJpeg->cinfo;
+  if (setjmp(mJpeg->jerr.setjmp_buffer))
+  {
+    mFailed = true;
+    return RT_FAIL;
+  }
+
+  // every libjpeg call below returns early, keeping its stage, when it
+  // runs out of data
+  for (;;)
+  {
+    switch (mJpeg->stage)
+    {
+      case PX_JPEG_STREAM_HEADER:
+        if (jpeg_read_header(cinfo, TRUE) == JPEG_SUSPENDED)
+        {
+          return RT_OK;
+        }
+        cinfo->out_color_space = JCS_RGB;
+        cinfo->buffered_image = jpeg_has_multiple_scans(cinfo);
+        jpeg_calc_output_dimensions(cinfo);
+        if (mOffscreen.initWithColor(cinfo->output_width, cinfo->output_height, pxClear) != PX_OK)
+        {
+          mFailed = true;
+          return RT_FAIL;
+        }
+        mOffscreen.mPixelFormat = RT_PIX_ARGB;
+        mHasImageSize = true;
+        mJpeg->stage = PX_JPEG_STREAM_START;
+        break;
+
+      case PX_JPEG_STREAM_START:
+        if (!jpeg_start_decompress(cinfo))
+        {
+          return RT_OK;
+        }
+        mJpeg->row = (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo, JPOOL_IMAGE,
+                                                 cinfo->output_width * cinfo->output_components, 1);
+        mJpeg->stage = cinfo->buffered_image ? PX_JPEG_STREAM_START_OUTPUT : PX_JPEG_STREAM_SCANLINES;
+        break;
+
+      case PX_JPEG_STREAM_START_OUTPUT:
+      {
+        // take in what has arrived, then show the newest scan
+        int status;
+        do
+        {
+          status = jpeg_consume_input(cinfo);
+        } while (status != JPEG_SUSPENDED && status != JPEG_REACHED_EOI);
+
+        if (!jpeg_input_complete(cinfo) && cinfo->input_scan_number == mJpeg->outputScan)
+        {
+          return RT_OK;
+        }
+        if (!jpeg_start_output(cinfo, cinfo->input_scan_number))
+        {
+          return RT_OK;
+        }
+        mJpeg->outputScan = cinfo->output_scan_number;
+        mJpeg->stage = PX_JPEG_STREAM_SCANLINES;
+        break;
+      }
+
+      case PX_JPEG_STREAM_SCANLINES:
+        while (cinfo->output_scanline < cinfo->output_height)
+        {
+          int y = cinfo->output_scanline;
+          if (jpeg_read_scanlines(cinfo, mJpeg->row, 1) != 1)
+          {
+            return RT_OK;
+          }
+          pxPixel *p = mOffscreen.scanline(y);
+          unsigned char *b = (unsigned char *)mJpeg->row[0];
+          unsigned char *bend = b + (cinfo->output_width * 3);
+          while (b < bend)
+          {
+            p->r = b[0];
+            p->g = b[1];
+            p->b = b[2];
+            p->a = 255;
+            b += 3;
+            p++;
+          }
+          mRowsDecoded++;
+        }
+        mJpeg->stage = cinfo->buffered_image ? PX_JPEG_STREAM_FINISH_OUTPUT : PX_JPEG_STREAM_FINISH;
+        break;
+
+      case PX_JPEG_STREAM_FINISH_OUTPUT:
+        if (!jpeg_finish_output(cinfo))
+        {
+          return RT_OK;
+        }
+        if (jpeg_input_complete(cinfo) && cinfo->output_scan_number == cinfo->input_scan_number)
+        {
+          mJpeg->stage = PX_JPEG_STREAM_FINISH;
+        }
+        else
+        {
+          mJpeg->stage = PX_JPEG_STREAM_START_OUTPUT;
+        }
+        break;
+
+      case PX_JPEG_STREAM_FINISH:
+        if (!jpeg_finish_decompress(cinfo))
+        {
+          return RT_OK;
+        }
+        mJpeg->stage = PX_JPEG_STREAM_DONE;
+        mComplete = true;
+        return RT_OK;
+
+      case PX_JPEG_STREAM_DONE:
+      default:
+        return RT_OK;
+    }
+  }
+}
+
+rtError pxImageStreamDecoder::snapshot(pxOffscreen& o)
+{
+  if (mFailed || !mHasImageSize)
+  {
+    return RT_FAIL;
+  }
+  o = mOffscreen;
+  o.mPixelFormat = mOffscreen.mPixelFormat;
+  if (o.mPixelFormat != RT_DEFAULT_PIX)
+  {
+    o.swizzleTo(RT_DEFAULT_PIX);
+  }
+  return RT_OK;
+}
+
+rtError pxImageStreamDecoder::finish()
+{
+  if (mFailed || !mComplete)
+  {
+    return RT_FAIL;
+  }
+  if (mOffscreen.mPixelFormat != RT_DEFAULT_PIX)
+  {
+    mOffscreen.swizzleTo(RT_DEFAULT_PIX);
+  }
+  return RT_OK;
+}
+
 void pxTimedOffscreenSequence::init()
 {
   mTotalTime = 0;
@@ -1786,3 +2251,18 @@ rtString md5sum(rtString &d)
   return rtString(  (char *) str_result);
 }
 
+rtString sha256sum(const uint8_t* data, size_t length)
+{
+  unsigned char sha_result[SHA256_DIGEST_LENGTH];        // binary
+  char str_result[SHA256_DIGEST_LENGTH*2 + 1];           // char string
+
+  SHA256(data, length, &sha_result[0]);
+
+  for(int i=0; i < SHA256_DIGEST_LENGTH; i++)
+  {
+    sprintf( &str_result[i*2], "%02X",  sha_result[i]); // sprintf() ... will null terminate
+  }
+
+  return rtString(str_result);
+}
+
@@ -31,6 +31,7 @@
 
 
 rtString md5sum(rtString &d); //fwd
+rtString sha256sum(const uint8_t* data, size_t length);
 
 void    base64_cleanup();
 
@@ -129,7 +130,8 @@ rtError pxLoadPNGImage(const char* filename, pxOffscreen& o);
 rtError pxStorePNGImage(const char* filename, pxOffscreen& b,
                         bool grayscale = false, bool alpha=true);
 
-rtError pxStorePNGImage(pxOffscreen& b, rtData& pngData);
+// compressionLevel is a zlib level (0-9); -1 uses the zlib default
+rtError pxStorePNGImage(pxOffscreen& b, rtData& pngData, int compressionLevel = -1);
 
 #if 0
 bool pxIsJPGImage(const char* imageData, size_t imageDataSize);
@@ -143,6 +145,55 @@ rtError pxLoadJPGImageTurbo(const char* buf, size_t buflen, pxOffscreen& o);
 rtError pxLoadJPGImage(const char* imageData, size_t imageDataSize, pxOffscreen& o);
 rtError pxLoadJPGImage(const char* filename, pxOffscreen& o);
 
+struct pxPngStreamState;
+struct pxJpegStreamState;
+
+// Decodes a PNG or JPEG while its bytes arrive.  write() takes the encoded
+// data in chunks of any size and decodes as far as the data allows, so the
+// image is complete as soon as its last byte has been written.  Rows land
+// in offscreen() as they are decoded; interlaced PNGs and progressive JPEGs
+// refine the whole image with each pass.
+class pxImageStreamDecoder
+{
+public:
+  pxImageStreamDecoder();
+  ~pxImageStreamDecoder();
+
+  // Fails, and keeps failing, once the data turns out not to be a PNG or
+  // JPEG or cannot be decoded
+  rtError write(const char* data, size_t size);
+
+  bool failed() const { return mFailed; }
+  // The header has been read and offscreen() has the image's size
+  bool hasImageSize() const { return mHasImageSize; }
+  bool isComplete() const { return mComplete; }
+  // Number of rows decoded so far, counting every pass
+  uint32_t rowsDecoded() const { return mRowsDecoded; }
+
+  // Copies the pixels decoded so far in RT_DEFAULT_PIX order
+  rtError snapshot(pxOffscreen& o);
+  // Converts the complete image in offscreen() to RT_DEFAULT_PIX order
+  rtError finish();
+  pxOffscreen& offscreen() { return mOffscreen; }
+
+private:
+  friend struct pxPngStreamState;
+  friend struct pxJpegStreamState;
+
+  rtError decodePng(const char* data, size_t size);
+  rtError decodeJpeg(const char* data, size_t size);
+
+  pxImageType mType;
+  std::vector<char> mSignature;
+  pxPngStreamState* mPng;
+  pxJpegStreamState* mJpeg;
+  pxOffscreen mOffscreen;
+  bool mFailed;
+  bool mHasImageSize;
+  bool mComplete;
+  uint32_t mRowsDecoded;
+};
+
 
 rtError pxLoadSVGImage(const char* buf, size_t buflen, pxOffscreen& o, int w = 0, int h = 0, float sx = 1.0f, float sy = 1.0f);
 rtError pxLoadSVGImage(const char* filename,           pxOffscreen& o, int w = 0, int h = 0, float sx = 1.0f, float sy = 1.0f);
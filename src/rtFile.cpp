@@ -25,17 +25,25 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 // required by std::numeric_limits
 #include <limits>
 #include "rtFile.h"
 // remove unused headers
 
-rtData::rtData(): mData(NULL), mLength(0) {}
+rtData::rtData(): mData(NULL), mLength(0), mOwner(NULL) {}
 rtData::~rtData() { term(); }
 
 
-rtData::rtData(rtData &d) : mData(d.data()), mLength(d.length())                   {};
-rtData::rtData(const uint8_t* data, size_t length) : mData( (uint8_t* ) data), mLength( (uint32_t) length)  {};
+rtData::rtData(rtData &d) : mData(d.data()), mLength(d.length()), mOwner(d.mOwner)
+{
+  if (mOwner)
+    mOwner->AddRef();
+}
+rtData::rtData(const uint8_t* data, size_t length) : mData( (uint8_t* ) data), mLength( (uint32_t) length), mOwner(NULL)  {};
 
 
 rtError rtData::init(size_t length) {
@@ -58,9 +66,42 @@ rtError rtData::init(const uint8_t* data, size_t length) {
   return e;
 }
 
-rtError rtData::term() { delete [] mData; mData=NULL; mLength = 0; return RT_OK; }
+rtError rtData::initView(uint8_t* data, size_t length, rtDataOwner* owner)
+{
+  if (owner == NULL)
+    return RT_FAIL;
+  // taken first in case owner is the one being released
+  owner->AddRef();
+  term();
+  mData = data;
+  mLength = (uint32_t) length;
+  mOwner = owner;
+  return RT_OK;
+}
+
+rtError rtData::initView(rtData& d, size_t offset, size_t length)
+{
+  if (offset + length > d.length())
+    return RT_FAIL;
+  if (d.mOwner == NULL)
+    return init(d.data() + offset, length);
+  return initView(d.data() + offset, length, d.mOwner);
+}
+
+rtError rtData::term()
+{
+  if (mOwner)
+    mOwner->Release();
+  else
+    delete [] mData;
+  mData = NULL;
+  mLength = 0;
+  mOwner = NULL;
+  return RT_OK;
+}
 uint8_t* rtData::data() { return mData; }
-uint32_t rtData::length() { return mLength; }
+const uint8_t* rtData::data() const { return mData; }
+uint32_t rtData::length() const { return mLength; }
 
 rtError rtStoreFile(const char* f, rtData& data)
 {
@@ -78,6 +119,42 @@ rtError rtStoreFile(const char* f, rtData& data)
 	return e;
 }
 
+#ifndef WIN32
+class rtMappedFile : public rtDataOwner
+{
+public:
+  rtMappedFile(void* address, size_t length) : mAddress(address), mLength(length) {}
+  virtual ~rtMappedFile() { munmap(mAddress, mLength); }
+
+private:
+  void* mAddress;
+  size_t mLength;
+};
+#endif
+
+rtError rtMapFile(const char* f, rtData& data)
+{
+#ifndef WIN32
+  int fd = open(f, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return RT_FAIL;
+  struct stat buf;
+  if (fstat(fd, &buf) != 0 || buf.st_size <= 0 || buf.st_size >= std::numeric_limits<uint32_t>::max())
+  {
+    close(fd);
+    return RT_FAIL;
+  }
+  size_t length = (size_t)buf.st_size;
+  void* address = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED)
+    return RT_FAIL;
+  return data.initView((uint8_t*)address, length, new rtMappedFile(address, length));
+#else
+  return rtLoadFile(f, data);
+#endif
+}
+
 rtError rtLoadFile(const char* f, rtData& data)
 {
 	rtError e = RT_FAIL;
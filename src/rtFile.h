@@ -24,9 +24,34 @@
 #include <assert.h>
 #include <rtCore.h>
 #include <stdio.h> //TODO - needed for FILE, fopen, etc
+#include <atomic>
+
+/**
+rtDataOwner keeps memory that rtData views point into alive, such as a mapped file.
+It is reference counted by the views and deleted with the last one.
+*/
+class rtDataOwner
+{
+ public:
+  rtDataOwner() : mRefCount(0) {}
+  virtual ~rtDataOwner() {}
+
+  unsigned long AddRef() { return ++mRefCount; }
+  unsigned long Release()
+  {
+    unsigned long l = --mRefCount;
+    if (l == 0)
+      delete this;
+    return l;
+  }
+
+ private:
+  std::atomic<unsigned long> mRefCount;
+};
 
 /**
 rtData is a wrapper that encapsulated an allocated buffer of bytes and owns the lifetime of those bytes.
+A view instead points into memory held by an rtDataOwner, so it can be handed around without copying.
 */
 class rtData
 {
@@ -43,19 +68,29 @@ class rtData
   rtError init(size_t length);
   rtError init(const uint8_t* data, size_t length);
 
+  // Points at memory kept alive by owner rather than copying it
+  rtError initView(uint8_t* data, size_t length, rtDataOwner* owner);
+  // Shares length bytes of d from offset; copies them if d is not a view
+  rtError initView(rtData& d, size_t offset, size_t length);
+  bool isView() const { return mOwner != NULL; }
+
   rtError term();
 
   uint8_t* data();
-  uint32_t length();
+  const uint8_t* data() const;
+  uint32_t length() const;
 
  private:
   uint8_t* mData;
   uint32_t mLength;
+  rtDataOwner* mOwner;
 };
 
 // Load or Store a file using an rtData managed buffer
 rtError rtLoadFile(const char* f, rtData& data);
 rtError rtStoreFile(const char* f, rtData& data);
+// Map a file read-only into a view; files are loaded where mapping is not supported
+rtError rtMapFile(const char* f, rtData& data);
 
 class rtFilePointer
 {
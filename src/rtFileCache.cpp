@@ -22,19 +22,111 @@
 #include <pxOffscreen.h>
 #include <pxUtil.h>
 #include <string.h>
-#include <sstream>
+#include <stddef.h>
+#include <ctype.h>
+#include <vector>
+#include <unordered_set>
+#include <algorithm>
 #include <dirent.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <openssl/evp.h>
 #include "rtSettings.h"
 
 #define DEFAULT_MAX_CACHE_SIZE 20971520
 
+// eviction frees space down to this share of the maximum size
+#define RT_FILE_CACHE_LOW_WATER_PERCENT 90
+
+#define RT_FILE_CACHE_INDEX "index"
+// present while the cache is open, so a crash is noticed at the next start
+#define RT_FILE_CACHE_OPEN_MARKER "index.open"
+#define RT_FILE_CACHE_INDEX_VERSION 1
+#define RT_FILE_CACHE_DIGEST_LENGTH 16 // MD5
+#define RT_FILE_CACHE_ETAG_LENGTH 64
+#define RT_FILE_CACHE_FILE_VERSION 1
+
+// stale records allowed in the index before it is compacted
+#define RT_FILE_CACHE_MIN_COMPACTION_RECORDS 256
+
 using namespace std;
 
+struct rtFileCacheIndexHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t recordSize;
+};
+
+// The newest record for a digest wins; a negative size removes the entry.
+// An etag that does not fit is not recorded.
+struct rtFileCacheIndexRecord
+{
+  uint8_t digest[RT_FILE_CACHE_DIGEST_LENGTH];
+  int64_t size;
+  int64_t expirationDate;
+  int64_t lastAccess;
+  char etag[RT_FILE_CACHE_ETAG_LENGTH];
+  uint32_t checksum;
+  uint32_t reserved;
+};
+
+static const char kIndexMagic[8] = { 'r', 't', 'C', 'a', 'c', 'h', 'e', 0 };
+static const char kFileMagic[8] = { 'r', 't', 'C', 'F', 'i', 'l', 'e', 0 };
+
+static uint32_t indexRecordChecksum(const rtFileCacheIndexRecord& record)
+{
+  // FNV-1a over everything before the checksum
+  const uint8_t* bytes = (const uint8_t*)&record;
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < offsetof(rtFileCacheIndexRecord, checksum); i++)
+  {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static rtString digestToFileName(const uint8_t* digest)
+{
+  char name[RT_FILE_CACHE_DIGEST_LENGTH * 2 + 1];
+  for (int i = 0; i < RT_FILE_CACHE_DIGEST_LENGTH; i++)
+  {
+    sprintf(&name[i * 2], "%02x", digest[i]);
+  }
+  return rtString(name);
+}
+
+// Returns false for names that are not a digest
+static bool fileNameToDigest(const char* name, uint8_t* digest)
+{
+  if (strlen(name) != RT_FILE_CACHE_DIGEST_LENGTH * 2)
+  {
+    return false;
+  }
+  for (int i = 0; i < RT_FILE_CACHE_DIGEST_LENGTH; i++)
+  {
+    unsigned int value = 0;
+    if (!isxdigit((unsigned char)name[i * 2]) || !isxdigit((unsigned char)name[i * 2 + 1]) ||
+        sscanf(&name[i * 2], "%2x", &value) != 1)
+    {
+      return false;
+    }
+    digest[i] = (uint8_t)value;
+  }
+  return true;
+}
+
+static bool olderAccess(const rtFileCacheEntry* a, const rtFileCacheEntry* b)
+{
+  return a->lastAccess < b->lastAccess;
+}
+
 rtFileCache* rtFileCache::instance()
 {
   if (NULL == mCache)
@@ -54,7 +146,9 @@ void rtFileCache::destroy()
 }
 
 rtFileCache* rtFileCache::mCache = NULL;
-rtFileCache::rtFileCache():mMaxSize(DEFAULT_MAX_CACHE_SIZE),mCurrentSize(0),mDirectory("/tmp/cache"),mCacheMutex()
+rtFileCache::rtFileCache():mMaxSize(DEFAULT_MAX_CACHE_SIZE),mCurrentSize(0),mDirectory("/tmp/cache"),mEntries(),
+  mLruOldest(NULL),mLruNewest(NULL),mIndexFd(-1),mIndexRecords(0),mIndexGeneration(0),mCompactionPending(false),
+  mCompacting(false),mCompactionBacklog(),mOpenMarker(),mCacheMutex()
 {
   char const *s = getenv("SPARK_CACHE_DIRECTORY");
   if (s)
@@ -71,18 +165,19 @@ rtFileCache::rtFileCache():mMaxSize(DEFAULT_MAX_CACHE_SIZE),mCurrentSize(0),mDir
     mDirectory = cacheDirectory.toString();
   }
   rtLogInfo("The cache directory is set to %s", mDirectory.cString());
-  mFileSizeMap.clear();
-  mFileTimeMap.clear();
   initCache();
 }
 
 rtFileCache::~rtFileCache()
 {
+  closeIndex();
+  markClosed();
   mMaxSize = 0;
   mCurrentSize = 0;
   mDirectory = "";
-  mFileSizeMap.clear();
-  mFileTimeMap.clear();
+  mEntries.clear();
+  mLruOldest = NULL;
+  mLruNewest = NULL;
 }
 
 void  rtFileCache::initCache()
@@ -100,43 +195,480 @@ void  rtFileCache::initCache()
 
 void rtFileCache::populateExistingFiles()
 {
-  mFileTimeMap.clear();
-  mFileSizeMap.clear();
-  DIR *directory;
-  struct dirent *direntry;
+  mCacheMutex.lock();
+  closeIndex();
+  markClosed();
+  mIndexGeneration++;
+  mCompactionPending = false;
+  mEntries.clear();
+  mLruOldest = NULL;
+  mLruNewest = NULL;
+  mCurrentSize = 0;
+  mIndexRecords = 0;
+  rtString markerName(RT_FILE_CACHE_OPEN_MARKER);
   struct stat buf;
-  int exists = 0;
-  directory = opendir(mDirectory.cString());
+  bool crashed = (0 == stat(absPath(markerName).cString(), &buf));
+  if (loadIndex())
+  {
+    openIndex();
+    if (crashed)
+    {
+      reconcileFiles();
+    }
+  }
+  else
+  {
+    rebuildIndex();
+  }
+  markOpen();
+
+  // the access times kept in the index give the LRU order back
+  vector<rtFileCacheEntry*> entries;
+  entries.reserve(mEntries.size());
+  for (unordered_map<rtString,rtFileCacheEntry,rtFileCacheNameHash>::iterator it = mEntries.begin(); it != mEntries.end(); ++it)
+  {
+    it->second.filename = it->first;
+    mCurrentSize += it->second.size;
+    entries.push_back(&it->second);
+  }
+  sort(entries.begin(), entries.end(), olderAccess);
+  for (size_t i = 0; i < entries.size(); i++)
+  {
+    lruAppend(entries[i]);
+  }
+  mCacheMutex.unlock();
+}
+
+void rtFileCache::lruAppend(rtFileCacheEntry* entry)
+{
+  entry->lruPrev = mLruNewest;
+  entry->lruNext = NULL;
+  if (NULL != mLruNewest)
+    mLruNewest->lruNext = entry;
+  else
+    mLruOldest = entry;
+  mLruNewest = entry;
+}
+
+void rtFileCache::lruRemove(rtFileCacheEntry* entry)
+{
+  if (NULL != entry->lruPrev)
+    entry->lruPrev->lruNext = entry->lruNext;
+  else
+    mLruOldest = entry->lruNext;
+  if (NULL != entry->lruNext)
+    entry->lruNext->lruPrev = entry->lruPrev;
+  else
+    mLruNewest = entry->lruPrev;
+  entry->lruPrev = NULL;
+  entry->lruNext = NULL;
+}
 
-  if (NULL == directory) {
+bool rtFileCache::loadIndex()
+{
+  rtString indexName(RT_FILE_CACHE_INDEX);
+  rtString indexPath = absPath(indexName);
+  int fd = open(indexPath.cString(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    return false;
+  }
+  struct stat buf;
+  if (fstat(fd, &buf) != 0 || buf.st_size < (off_t)sizeof(rtFileCacheIndexHeader))
+  {
+    close(fd);
+    return false;
+  }
+  size_t indexSize = (size_t)buf.st_size;
+  void* map = mmap(NULL, indexSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (MAP_FAILED == map)
+  {
+    rtLogWarn("mapping the cache index failed");
+    return false;
+  }
+
+  const uint8_t* bytes = (const uint8_t*)map;
+  const rtFileCacheIndexHeader* header = (const rtFileCacheIndexHeader*)map;
+  if (memcmp(header->magic, kIndexMagic, sizeof(kIndexMagic)) != 0 ||
+      header->version != RT_FILE_CACHE_INDEX_VERSION ||
+      header->recordSize != sizeof(rtFileCacheIndexRecord))
+  {
+    rtLogWarn("the cache index has an unknown format");
+    munmap(map, indexSize);
+    return false;
+  }
+
+  size_t offset = sizeof(rtFileCacheIndexHeader);
+  int64_t records = 0;
+  rtFileCacheIndexRecord record;
+  while (offset + sizeof(record) <= indexSize)
+  {
+    memcpy(&record, bytes + offset, sizeof(record));
+    if (record.checksum != indexRecordChecksum(record))
+    {
+      break;
+    }
+    rtString filename = digestToFileName(record.digest);
+    if (record.size < 0)
+    {
+      mEntries.erase(filename);
+    }
+    else
+    {
+      rtFileCacheEntry& entry = mEntries[filename];
+      entry.size = record.size;
+      entry.expirationDate = (time_t)record.expirationDate;
+      entry.lastAccess = (time_t)record.lastAccess;
+      record.etag[RT_FILE_CACHE_ETAG_LENGTH - 1] = 0;
+      entry.etag = record.etag;
+    }
+    offset += sizeof(record);
+    records++;
+  }
+  munmap(map, indexSize);
+
+  // a record cut short by a crash, and anything after it, is dropped so
+  // new records are appended after the last good one
+  if (offset < indexSize)
+  {
+    rtLogWarn("dropping %ld bytes at the end of the cache index", (long)(indexSize - offset));
+    if (0 != truncate(indexPath.cString(), (off_t)offset))
+    {
+      rtLogWarn("truncating the cache index failed");
+      return false;
+    }
+  }
+  mIndexRecords = records;
+  return true;
+}
+
+void rtFileCache::rebuildIndex()
+{
+  DIR *directory = opendir(mDirectory.cString());
+  if (NULL == directory)
+  {
     return;
   }
 
+  struct dirent *direntry;
+  struct stat buf;
+  uint8_t digest[RT_FILE_CACHE_DIGEST_LENGTH];
   for (direntry = readdir(directory); direntry != NULL; direntry = readdir(directory))
   {
-    if ((strcmp(direntry->d_name,".") !=0 ) && (strcmp(direntry->d_name,"..") != 0))
+    rtString filename = direntry->d_name;
+    rtString absPathString = absPath(filename);
+    if (!fileNameToDigest(direntry->d_name, digest))
     {
-      rtString filename = mDirectory;
-      filename.append("/");
-      filename.append(direntry->d_name);
-      exists = stat(filename.cString(), &buf);
-      if (exists < 0)
+      // older releases named the files by a decimal hash of the url, which
+      // is never looked up again, and a crash can leave a file half written
+      const char* c = direntry->d_name;
+      if (*c == '-')
+        c++;
+      if ((*c != 0 && strspn(c, "0123456789") == strlen(c)) || filename.endsWith(".tmp"))
       {
-        rtLogWarn("Reading the cache directory is failed for file(%s)",filename.cString());
-        continue;
+        unlink(absPathString.cString());
       }
-#if defined(PX_PLATFORM_MAC)
-       mFileTimeMap.insert(make_pair(buf.st_atimespec.tv_sec,direntry->d_name));
-#elif !(defined(WIN32) || defined(_WIN32) || defined (WINDOWS) || defined (_WINDOWS))
-       mFileTimeMap.insert(make_pair(buf.st_atim.tv_sec,direntry->d_name));
-#else
-       rtLogWarn("Platform not supported. Cache will not get cleared after cache limit is reached");
-#endif
-      mFileSizeMap[direntry->d_name] = buf.st_size;
-      mCurrentSize += buf.st_size;
+      continue;
+    }
+    if (stat(absPathString.cString(), &buf) != 0 || !S_ISREG(buf.st_mode))
+    {
+      continue;
+    }
+    // the expiration date is in the file and is read again on a hit
+    rtFileCacheEntry& entry = mEntries[filename];
+    entry.size = buf.st_size;
+    entry.lastAccess = buf.st_mtime;
+  }
+  closedir(directory);
+
+  rtLogInfo("rebuilt the cache index with %d files", (int)mEntries.size());
+  if (!compactIndex())
+  {
+    openIndex();
+  }
+}
+
+void rtFileCache::reconcileFiles()
+{
+  DIR *directory = opendir(mDirectory.cString());
+  if (NULL == directory)
+  {
+    return;
+  }
+
+  // a crash can leave temp files behind, and a cache file renamed into
+  // place after its index record was appended but before that record
+  // reached the disk
+  unordered_set<rtString,rtFileCacheNameHash> present;
+  struct dirent *direntry;
+  uint8_t digest[RT_FILE_CACHE_DIGEST_LENGTH];
+  int removed = 0;
+  for (direntry = readdir(directory); direntry != NULL; direntry = readdir(directory))
+  {
+    rtString filename = direntry->d_name;
+    if (fileNameToDigest(direntry->d_name, digest) && mEntries.find(filename) != mEntries.end())
+    {
+      present.insert(filename);
+    }
+    else if (filename.endsWith(".tmp") || fileNameToDigest(direntry->d_name, digest))
+    {
+      rtString absPathString = absPath(filename);
+      unlink(absPathString.cString());
+      removed++;
     }
   }
   closedir(directory);
+
+  // and entries whose file never made it
+  vector<rtString> missing;
+  for (unordered_map<rtString,rtFileCacheEntry,rtFileCacheNameHash>::iterator it = mEntries.begin(); it != mEntries.end(); ++it)
+  {
+    if (present.find(it->first) == present.end())
+    {
+      missing.push_back(it->first);
+    }
+  }
+  for (size_t i = 0; i < missing.size(); i++)
+  {
+    mEntries.erase(missing[i]);
+    appendIndexRecord(missing[i], NULL);
+  }
+  rtLogWarn("the cache was not closed cleanly; removed %d stray files and %d missing entries", removed, (int)missing.size());
+}
+
+void rtFileCache::markOpen()
+{
+  rtString markerName(RT_FILE_CACHE_OPEN_MARKER);
+  mOpenMarker = absPath(markerName);
+  int fd = open(mOpenMarker.cString(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0)
+  {
+    mOpenMarker = "";
+    return;
+  }
+  close(fd);
+}
+
+void rtFileCache::markClosed()
+{
+  if (!mOpenMarker.isEmpty())
+  {
+    unlink(mOpenMarker.cString());
+    mOpenMarker = "";
+  }
+}
+
+void rtFileCache::openIndex()
+{
+  closeIndex();
+  if (mDirectory.isEmpty())
+  {
+    return;
+  }
+  rtString indexName(RT_FILE_CACHE_INDEX);
+  rtString indexPath = absPath(indexName);
+  mIndexFd = open(indexPath.cString(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+  if (mIndexFd < 0)
+  {
+    rtLogWarn("opening the cache index %s failed", indexPath.cString());
+    return;
+  }
+  struct stat buf;
+  if (fstat(mIndexFd, &buf) == 0 && buf.st_size == 0)
+  {
+    rtFileCacheIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kIndexMagic, sizeof(kIndexMagic));
+    header.version = RT_FILE_CACHE_INDEX_VERSION;
+    header.recordSize = sizeof(rtFileCacheIndexRecord);
+    if (write(mIndexFd, &header, sizeof(header)) != (ssize_t)sizeof(header))
+    {
+      rtLogWarn("writing the cache index header failed");
+    }
+  }
+}
+
+void rtFileCache::closeIndex()
+{
+  if (mIndexFd >= 0)
+  {
+    close(mIndexFd);
+    mIndexFd = -1;
+  }
+}
+
+static void fillIndexRecord(rtFileCacheIndexRecord& record, const uint8_t* digest, const rtFileCacheEntry* entry)
+{
+  memset(&record, 0, sizeof(record));
+  memcpy(record.digest, digest, RT_FILE_CACHE_DIGEST_LENGTH);
+  record.size = -1;
+  if (NULL != entry)
+  {
+    record.size = entry->size;
+    record.expirationDate = entry->expirationDate;
+    record.lastAccess = entry->lastAccess;
+    if (entry->etag.byteLength() < RT_FILE_CACHE_ETAG_LENGTH)
+    {
+      memcpy(record.etag, entry->etag.cString(), entry->etag.byteLength());
+    }
+  }
+  record.checksum = indexRecordChecksum(record);
+}
+
+void rtFileCache::appendIndexRecord(const rtString& filename, const rtFileCacheEntry* entry)
+{
+  uint8_t digest[RT_FILE_CACHE_DIGEST_LENGTH];
+  if (mIndexFd < 0 || !fileNameToDigest(filename.cString(), digest))
+  {
+    return;
+  }
+  rtFileCacheIndexRecord record;
+  fillIndexRecord(record, digest, entry);
+  if (write(mIndexFd, &record, sizeof(record)) != (ssize_t)sizeof(record))
+  {
+    rtLogWarn("writing to the cache index failed");
+  }
+  mIndexRecords++;
+  if (mCompacting)
+  {
+    // the compacted index is written from a snapshot, so it gets these too
+    const uint8_t* bytes = (const uint8_t*)&record;
+    mCompactionBacklog.insert(mCompactionBacklog.end(), bytes, bytes + sizeof(record));
+  }
+  else if (mIndexRecords > 2 * (int64_t)mEntries.size() + RT_FILE_CACHE_MIN_COMPACTION_RECORDS)
+  {
+    mCompactionPending = true;
+  }
+}
+
+void rtFileCache::indexSnapshot(vector<uint8_t>& buffer)
+{
+  buffer.resize(sizeof(rtFileCacheIndexHeader) + mEntries.size() * sizeof(rtFileCacheIndexRecord));
+  rtFileCacheIndexHeader* header = (rtFileCacheIndexHeader*)&buffer[0];
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, kIndexMagic, sizeof(kIndexMagic));
+  header->version = RT_FILE_CACHE_INDEX_VERSION;
+  header->recordSize = sizeof(rtFileCacheIndexRecord);
+  size_t offset = sizeof(rtFileCacheIndexHeader);
+  uint8_t digest[RT_FILE_CACHE_DIGEST_LENGTH];
+  for (unordered_map<rtString,rtFileCacheEntry,rtFileCacheNameHash>::iterator it = mEntries.begin(); it != mEntries.end(); ++it)
+  {
+    if (fileNameToDigest(it->first.cString(), digest))
+    {
+      rtFileCacheIndexRecord record;
+      fillIndexRecord(record, digest, &it->second);
+      memcpy(&buffer[offset], &record, sizeof(record));
+      offset += sizeof(record);
+    }
+  }
+  buffer.resize(offset);
+}
+
+// Each compaction writes a temp file of its own, so one abandoned by a
+// change of directory never collides with the next
+rtString rtFileCache::indexTempPath(const rtString& directory, uint32_t generation)
+{
+  char name[32];
+  sprintf(name, "index.%u.tmp", generation);
+  rtString path = directory;
+  path.append("/");
+  path.append(name);
+  return path;
+}
+
+static bool writeAll(int fd, const void* data, size_t length);
+
+// the new index only replaces the old one once it is complete on disk
+static int writeIndexFile(const rtString& path, const vector<uint8_t>& buffer)
+{
+  int fd = open(path.cString(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  if (!writeAll(fd, &buffer[0], buffer.size()) || fsync(fd) != 0)
+  {
+    close(fd);
+    unlink(path.cString());
+    return -1;
+  }
+  return fd;
+}
+
+bool rtFileCache::replaceIndex(int fd, const rtString& tempPath, size_t indexSize)
+{
+  rtString indexName(RT_FILE_CACHE_INDEX);
+  rtString indexPath = absPath(indexName);
+  close(fd);
+  if (0 != rename(tempPath.cString(), indexPath.cString()))
+  {
+    rtLogWarn("compacting the cache index failed");
+    unlink(tempPath.cString());
+    return false;
+  }
+  mIndexRecords = (int64_t)((indexSize - sizeof(rtFileCacheIndexHeader)) / sizeof(rtFileCacheIndexRecord));
+  openIndex();
+  return true;
+}
+
+bool rtFileCache::compactIndex()
+{
+  vector<uint8_t> buffer;
+  indexSnapshot(buffer);
+  rtString tempPath = indexTempPath(mDirectory, ++mIndexGeneration);
+  int fd = writeIndexFile(tempPath, buffer);
+  if (fd < 0)
+  {
+    rtLogWarn("compacting the cache index failed");
+    return false;
+  }
+  return replaceIndex(fd, tempPath, buffer.size());
+}
+
+void rtFileCache::compactIndexIfNeeded()
+{
+  mCacheMutex.lock();
+  if (!mCompactionPending || mCompacting)
+  {
+    mCacheMutex.unlock();
+    return;
+  }
+  mCompactionPending = false;
+  mCompacting = true;
+  mCompactionBacklog.clear();
+  vector<uint8_t> buffer;
+  indexSnapshot(buffer);
+  uint32_t generation = mIndexGeneration;
+  rtString tempPath = indexTempPath(mDirectory, generation);
+  mCacheMutex.unlock();
+
+  // the snapshot is written and synced without holding up the cache
+  int fd = writeIndexFile(tempPath, buffer);
+
+  mCacheMutex.lock();
+  if (fd >= 0)
+  {
+    // records appended since the snapshot go in too; the old index did not
+    // sync them either.  A cleared or moved cache abandons the compaction.
+    if (generation != mIndexGeneration ||
+        (!mCompactionBacklog.empty() && !writeAll(fd, &mCompactionBacklog[0], mCompactionBacklog.size())))
+    {
+      close(fd);
+      unlink(tempPath.cString());
+    }
+    else
+    {
+      replaceIndex(fd, tempPath, buffer.size() + mCompactionBacklog.size());
+    }
+  }
+  else
+  {
+    rtLogWarn("compacting the cache index failed");
+  }
+  mCompacting = false;
+  mCompactionBacklog.clear();
+  mCacheMutex.unlock();
 }
 
 rtError rtFileCache::setMaxCacheSize(int64_t bytes)
@@ -187,21 +719,15 @@ void rtFileCache::eraseData(rtString& filename)
 {
   if (! filename.isEmpty())
   {
-    mCacheMutex.lock();
-    mCurrentSize = mCurrentSize - mFileSizeMap[filename];
-    mFileSizeMap.erase(filename);
-    multimap<time_t,rtString>::iterator iter = mFileTimeMap.begin();
-    while (iter != mFileTimeMap.end())
+    unordered_map<rtString,rtFileCacheEntry,rtFileCacheNameHash>::iterator entry = mEntries.find(filename);
+    if (entry == mEntries.end())
     {
-      if (iter->second == filename.cString())
-      {
-        break;
-      }
-      iter++;
+      return;
     }
-    if (iter != mFileTimeMap.end())
-      mFileTimeMap.erase(iter);
-    mCacheMutex.unlock();
+    mCurrentSize = mCurrentSize - entry->second.size;
+    lruRemove(&entry->second);
+    mEntries.erase(entry);
+    appendIndexRecord(filename, NULL);
   }
 }
 
@@ -214,12 +740,17 @@ rtError rtFileCache::removeData(const char* url)
   rtString filename = hashedFileName(urlToRemove);
   if (! filename.isEmpty())
   {
-    if (false == deleteFile(filename))
+    mCacheMutex.lock();
+    bool cached = (mEntries.find(filename) != mEntries.end());
+    if (cached && false == deleteFile(filename))
     {
+      mCacheMutex.unlock();
       rtLogWarn("!!! deletion of cache failed for url(%s)",url);
       return RT_ERROR;
     }
     eraseData(filename);
+    mCacheMutex.unlock();
+    compactIndexIfNeeded();
   }
   else
   {
@@ -245,32 +776,63 @@ rtError rtFileCache::addToCache(const rtHttpCacheData& data)
     rtLogWarn("Problem in getting hash from the url(%s) while adding to cache ",url.cString());
     return RT_ERROR;
   }
-  else
-  {
-    // If the file was already cached and got deleted manually, then we should clean up the corresponding data.
-    if(mFileSizeMap[filename])
-    {
-      if ( !mFileTimeMap.empty() )
-      {
-        eraseData(filename);
-      }
-    }
-  }
 
-  bool ret = writeFile(filename,data);
+  int64_t fileSize = 0;
+  rtString tempPathString;
+  bool ret = writeFile(filename,data,fileSize,tempPathString);
   if (true != ret)
      return RT_ERROR;
-  setFileSizeAndTime(filename);
-
+  rtString etag;
+  const_cast<rtHttpCacheData&>(data).etag(etag);
 
   mCacheMutex.lock();
-  mCurrentSize += mFileSizeMap[filename];
+  // replaces what was cached for the url before
+  eraseData(filename);
+  rtFileCacheEntry& entry = mEntries[filename];
+  entry.size = fileSize;
+  entry.expirationDate = data.expirationDateUnix();
+  entry.lastAccess = time(NULL);
+  entry.etag = etag;
+  entry.filename = filename;
+  lruAppend(&entry);
+  mCurrentSize += fileSize;
+  // the record goes first: a crash before the rename leaves an entry whose
+  // file is missing or the wrong size, which a lookup drops, rather than a
+  // file nothing refers to
+  appendIndexRecord(filename, &entry);
+  rtString absPathString = absPath(filename);
+  if (0 != rename(tempPathString.cString(), absPathString.cString()))
+  {
+    unlink(tempPathString.cString());
+    eraseData(filename);
+    mCacheMutex.unlock();
+    compactIndexIfNeeded();
+    return RT_ERROR;
+  }
   int64_t size = cleanup();
   mCacheMutex.unlock();
-  rtLogInfo("addToCache url(%s) filename(%s) size(%ld) Cache expiration(%s) total cache size (%ld)", url.cString(), filename.cString(), (long) mFileSizeMap[filename], data.expirationDate().cString(), (long) size);
+  compactIndexIfNeeded();
+  rtLogInfo("addToCache url(%s) filename(%s) size(%ld) Cache expiration(%s) total cache size (%ld)", url.cString(), filename.cString(), (long) fileSize, data.expirationDate().cString(), (long) size);
   return RT_OK;
 }
 
+bool rtFileCache::contains(const char* url)
+{
+  if (NULL == url)
+    return false;
+
+  rtString urlToQuery = url;
+  rtString filename = hashedFileName(urlToQuery);
+  if (filename.isEmpty())
+    return false;
+
+  // entries are only added once their file has been renamed into place
+  mCacheMutex.lock();
+  bool found = (mEntries.find(filename) != mEntries.end());
+  mCacheMutex.unlock();
+  return found;
+}
+
 rtError rtFileCache::httpCacheData(const char* url, rtHttpCacheData& cacheData)
 {
   rtString urlToQuery = url;
@@ -280,121 +842,182 @@ rtError rtFileCache::httpCacheData(const char* url, rtHttpCacheData& cacheData)
     rtLogWarn("Problem in getting hash from the url(%s) while read from cache",url);
     return RT_ERROR;
   }
-  if (false == readFileHeader(filename,cacheData))
+
+  // a miss is answered by the index alone
+  mCacheMutex.lock();
+  unordered_map<rtString,rtFileCacheEntry,rtFileCacheNameHash>::iterator cached = mEntries.find(filename);
+  int64_t size = (cached != mEntries.end()) ? cached->second.size : -1;
+  mCacheMutex.unlock();
+  if (size < 0)
     return RT_ERROR;
-  return RT_OK;
+
+  bool found = readFileHeader(filename,urlToQuery,size,cacheData);
+
+  mCacheMutex.lock();
+  unordered_map<rtString,rtFileCacheEntry,rtFileCacheNameHash>::iterator entry = mEntries.find(filename);
+  if (entry != mEntries.end())
+  {
+    if (found)
+    {
+      entry->second.lastAccess = time(NULL);
+      lruRemove(&entry->second);
+      lruAppend(&entry->second);
+      appendIndexRecord(filename, &entry->second);
+    }
+    else if (entry->second.size == size)
+    {
+      // the file has gone, is damaged or belongs to another url, and was
+      // not replaced while it was being read
+      deleteFile(filename);
+      eraseData(filename);
+    }
+  }
+  mCacheMutex.unlock();
+  compactIndexIfNeeded();
+  return found ? RT_OK : RT_ERROR;
 }
 
 void rtFileCache::clearCache()
 {
   if (! mDirectory.isEmpty())
   {
-    rtString buff("rm -rf ");
-    buff.append(mDirectory.cString());
-    buff.append("/*");
-    int retVal = system(buff.cString());
-
-    if(retVal == -1)
+    mCacheMutex.lock();
+    closeIndex();
+    mIndexGeneration++;
+    mCompactionPending = false;
+    DIR *directory = opendir(mDirectory.cString());
+    if (NULL != directory)
     {
-      // The system method failed
+      struct dirent *direntry;
+      for (direntry = readdir(directory); direntry != NULL; direntry = readdir(directory))
+      {
+        if (0 == strcmp(direntry->d_name, ".") || 0 == strcmp(direntry->d_name, ".."))
+          continue;
+        rtString filename = direntry->d_name;
+        rtString absPathString = absPath(filename);
+        if (0 != unlink(absPathString.cString()))
+          rtLogWarn("removal of cache file %s failed", absPathString.cString());
+      }
+      closedir(directory);
     }
 
-    mFileSizeMap.clear();
-    mCacheMutex.lock();
+    mEntries.clear();
+    mLruOldest = NULL;
+    mLruNewest = NULL;
     mCurrentSize = 0;
+    mIndexRecords = 0;
+    openIndex();
+    markOpen();
     mCacheMutex.unlock();
   }
 }
 
 int64_t rtFileCache::cleanup()
 {
-  if ( (mCurrentSize > mMaxSize) && !(mFileTimeMap.empty()))
+  if (mCurrentSize > mMaxSize)
   {
-    multimap<time_t,rtString>::iterator iter = mFileTimeMap.begin();
-    vector <multimap<time_t,rtString>::iterator> timeMapIters;
-    do
+    int64_t lowWater = mMaxSize * RT_FILE_CACHE_LOW_WATER_PERCENT / 100;
+    int evicted = 0;
+    rtLogInfo("Storage capacity exceeded" );
+    while ((mCurrentSize > lowWater) && (NULL != mLruOldest))
     {
-      rtString filename = iter->second;
-      if (! filename.isEmpty())
+      rtString filename = mLruOldest->filename;
+      if (false == deleteFile(filename))
       {
-          rtLogInfo("Storage capacity exceeded" );
-          if(false == deleteFile(filename))
-          {
-            rtLogWarn("!!! deletion of cache failed during cleanup for file(%s)",filename.cString());
-          }
-          else
-          {
-            mCurrentSize = mCurrentSize - mFileSizeMap[filename];
-            timeMapIters.push_back(iter);
-            mFileSizeMap.erase(filename);
-          }
+        rtLogWarn("!!! deletion of cache failed during cleanup for file(%s)",filename.cString());
       }
-      iter++;
-    } while ((mCurrentSize > mMaxSize) && (iter != mFileTimeMap.end()));
-
-    for (unsigned int count =0; count < timeMapIters.size(); count++)
-      mFileTimeMap.erase(timeMapIters[count]);
-    timeMapIters.clear();
+      eraseData(filename);
+      evicted++;
+    }
+    rtLogInfo("evicted %d files from the cache, size is now %ld", evicted, (long)mCurrentSize);
   }
   return mCurrentSize;
 }
 
 rtString rtFileCache::hashedFileName(const rtString& url)
 {
-  long int hash = hashFn(url.cString());
-  stringstream stream;
-  stream << hash;
-  return stream.str().c_str();
+  // through EVP, since the MD5() shortcut is deprecated in OpenSSL 3
+  uint8_t digest[EVP_MAX_MD_SIZE];
+  unsigned int digestLength = 0;
+  if (1 != EVP_Digest(url.cString(), url.byteLength(), digest, &digestLength, EVP_md5(), NULL) ||
+      digestLength != RT_FILE_CACHE_DIGEST_LENGTH)
+    return rtString();
+  return digestToFileName(digest);
 }
 
-void rtFileCache::setFileSizeAndTime(rtString& filename)
+static bool writeAll(int fd, const void* data, size_t length)
 {
-  if (!mDirectory.isEmpty())
+  const uint8_t* bytes = (const uint8_t*)data;
+  while (length > 0)
   {
-    struct stat statbuf;
-    rtString absPathString  = absPath(filename);
-    if (stat(absPathString.cString(), &statbuf) == 0)
-    {
-      mCacheMutex.lock();
-      mFileSizeMap[filename] = statbuf.st_size;
-#if defined(PX_PLATFORM_MAC)
-      mFileTimeMap.insert(make_pair(statbuf.st_atimespec.tv_sec,filename));
-#elif !(defined(WIN32) || defined(_WIN32) || defined (WINDOWS) || defined (_WINDOWS))
-      mFileTimeMap.insert(make_pair(statbuf.st_atim.tv_sec,filename));
-#else
-       rtLogWarn("Platform not supported. Cache will not get cleared after cache limit is reached");
-#endif
-      mCacheMutex.unlock();
-    }
+    ssize_t written = write(fd, bytes, length);
+    if (written < 0 && EINTR == errno)
+      continue;
+    if (written <= 0)
+      return false;
+    bytes += written;
+    length -= (size_t)written;
   }
+  return true;
 }
 
-bool rtFileCache::writeFile(rtString& filename,const rtHttpCacheData& constCacheData)
+bool rtFileCache::writeFile(rtString& filename,const rtHttpCacheData& constCacheData,int64_t& size,rtString& tempPathString)
 {
   rtHttpCacheData* cacheData = const_cast<rtHttpCacheData*>(&constCacheData);
-  rtData data;
-  stringstream stream;
-  stream << cacheData->expirationDateUnix();
-  string date = stream.str().c_str();
-  data.init(cacheData->headerData().length() + date.length() + 1 + cacheData->contentsData().length() + 1);
-  memcpy(data.data(),cacheData->headerData().data(),cacheData->headerData().length());
-  memset(data.data()+cacheData->headerData().length(),'|',1);
-  memcpy(data.data()+cacheData->headerData().length()+1,date.c_str(), date.length());
-  memset(data.data()+cacheData->headerData().length() + date.length() + 1,'|',1);
-  memcpy(data.data()+cacheData->headerData().length()+1+ date.length() + 1,cacheData->contentsData().data(),cacheData->contentsData().length());
-  rtString absPathString  = absPath(filename);
-  if (RT_OK != rtStoreFile(absPathString.cString(),data))
+  rtString url;
+  cacheData->url(url);
+  rtData& headers = cacheData->headerData();
+  rtData& contents = cacheData->contentsData();
+
+  // the small parts go out in one write and the body straight from the
+  // download buffer, so it is never copied to build the file
+  rtFileCacheFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kFileMagic, sizeof(kFileMagic));
+  header.version = RT_FILE_CACHE_FILE_VERSION;
+  header.headerSize = sizeof(header);
+  header.expirationDate = cacheData->expirationDateUnix();
+  header.urlOffset = sizeof(header);
+  header.urlLength = url.byteLength();
+  header.headersOffset = header.urlOffset + header.urlLength;
+  header.headersLength = headers.length();
+  header.contentsOffset = header.headersOffset + header.headersLength;
+  header.contentsLength = contents.length();
+
+  vector<uint8_t> prefix(header.contentsOffset);
+  memcpy(&prefix[0], &header, sizeof(header));
+  if (header.urlLength > 0)
+    memcpy(&prefix[header.urlOffset], url.cString(), header.urlLength);
+  if (header.headersLength > 0)
+    memcpy(&prefix[header.headersOffset], headers.data(), header.headersLength);
+
+  // written under another name first so a reader never sees half a file
+  tempPathString = absPath(filename);
+  tempPathString.append(".tmp");
+  int fd = open(tempPathString.cString(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0)
+  {
     return false;
+  }
+  const char terminator = 0;
+  bool written = writeAll(fd, &prefix[0], prefix.size()) &&
+                 writeAll(fd, contents.data(), contents.length()) &&
+                 writeAll(fd, &terminator, sizeof(terminator));
+  close(fd);
+  if (!written)
+  {
+    unlink(tempPathString.cString());
+    return false;
+  }
+  size = header.contentsOffset + header.contentsLength + sizeof(terminator);
   return true;
 }
 
 bool rtFileCache::deleteFile(rtString& filename)
 {
-  rtString cmd = "rm -rf ";
   rtString absPathString  = absPath(filename);
-  cmd.append(absPathString);
-  rtLogInfo("Deleting the file (%s)", absPathString.cString());
-  if (0 != system(cmd.cString()))
+  rtLogDebug("Deleting the file (%s)", absPathString.cString());
+  if ((0 != unlink(absPathString.cString())) && (ENOENT != errno))
   {
     rtLogWarn("removal of file failed");
     return false;
@@ -402,44 +1025,46 @@ bool rtFileCache::deleteFile(rtString& filename)
   return true;
 }
 
-bool rtFileCache::readFileHeader(rtString& filename,rtHttpCacheData& cacheData)
+bool rtFileCache::readFileHeader(rtString& filename, const rtString& url, int64_t size, rtHttpCacheData& cacheData)
 {
   rtString absPathString  = absPath(filename);
-  FILE* fp  = fopen(absPathString.cString(), "r");
-
-  if (NULL == fp)
+  rtData file;
+  if (RT_OK != rtMapFile(absPathString.cString(), file))
   {
     rtLogDebug("Reading the cache file \"%s\" Failed - does not EXIST or OPEN already", filename.cString());
     return false;
   }
 
-  bool reachedHeaderEnd = false;
-  int buffer;
-  string headerData;
-  while ( !feof(fp) && (reachedHeaderEnd == false))
+  rtFileCacheFileHeader header;
+  uint64_t fileLength = file.length();
+  if (fileLength < sizeof(header) || (int64_t)fileLength != size)
   {
-    buffer = fgetc(fp);
-    if (buffer == '|')
-    {
-      reachedHeaderEnd = true;
-      break;
-    }
-    headerData.append(1,(char)buffer);
+    rtLogWarn("the cache file %s is not the one indexed", filename.cString());
+    return false;
   }
-  if (true == reachedHeaderEnd)
+  memcpy(&header, file.data(), sizeof(header));
+  if (0 != memcmp(header.magic, kFileMagic, sizeof(kFileMagic)) ||
+      RT_FILE_CACHE_FILE_VERSION != header.version ||
+      sizeof(header) != header.headerSize ||
+      header.urlOffset > fileLength || header.urlLength > fileLength - header.urlOffset ||
+      header.headersOffset > fileLength || header.headersLength > fileLength - header.headersOffset ||
+      header.contentsOffset > fileLength || header.contentsLength > fileLength - header.contentsOffset)
   {
-    cacheData.setAttributes((char *)headerData.c_str());
+    rtLogWarn("the cache file %s has an unknown format", filename.cString());
+    return false;
   }
-  else
+
+  // two urls can share a digest; the file only answers for the one it was written for
+  if (header.urlLength != (uint64_t)url.byteLength() ||
+      0 != memcmp(file.data() + header.urlOffset, url.cString(), header.urlLength))
   {
-    rtLogWarn("Logfile is not proper");
-    int closeret = fclose(fp);
-    if (0 != closeret)
-      rtLogWarn("improper logfile close failed");
-    fp  =  NULL;
+    rtLogWarn("the cache file %s belongs to another url", filename.cString());
     return false;
   }
-  cacheData.setFilePointer(fp);
+
+  string headerData((const char*)file.data() + header.headersOffset, header.headersLength);
+  cacheData.setAttributes((char *)headerData.c_str());
+  cacheData.setCacheFile(file, header.contentsOffset, header.contentsLength, (time_t)header.expirationDate);
   cacheData.setFileName(filename);
   return true;
 }
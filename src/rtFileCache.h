@@ -29,9 +29,75 @@
 #include "rtMutex.h"
 
 #include <map>
+#include <unordered_map>
+#include <vector>
 // TODO elimate std::string from headers and impl
 #include <string>
 
+/* The fixed header at the start of each cache file.  The url, the response
+   headers and the body follow it at the offsets given, and the body is
+   followed by a NUL so a view of it reads like any other rtData. */
+struct rtFileCacheFileHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t headerSize;
+  int64_t expirationDate;
+  uint64_t urlOffset;
+  uint64_t urlLength;
+  uint64_t headersOffset;
+  uint64_t headersLength;
+  uint64_t contentsOffset;
+  uint64_t contentsLength;
+};
+
+/* what the index knows about a cached file.  Entries are also linked in
+   least recently used order, oldest first. */
+struct rtFileCacheEntry
+{
+  rtFileCacheEntry() : size(0), expirationDate(0), lastAccess(0), etag(), filename(),
+    lruPrev(NULL), lruNext(NULL) {}
+  int64_t size;
+  time_t expirationDate;
+  time_t lastAccess;
+  rtString etag;
+  rtString filename;
+  rtFileCacheEntry* lruPrev;
+  rtFileCacheEntry* lruNext;
+};
+
+struct rtFileCacheNameHash
+{
+  size_t operator()(const rtString& name) const
+  {
+    // FNV-1a; the names are hex digests already
+    size_t hash = 2166136261u;
+    for (const char* c = name.cString(); c != NULL && *c != 0; c++)
+    {
+      hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash;
+  }
+};
+
+/* The cached files are named by the 128 bit MD5 digest of their url and
+   described by an index in the cache directory, so lookups and startup
+   do not touch the files themselves.  The index is an append-only log of
+   fixed size records, each with a checksum so a record torn by a crash is
+   dropped on load, and it is compacted into a new file that replaces the
+   old one with rename() once most of its records are stale.  A file's
+   record is appended before the file is renamed into place, and a marker
+   present while the cache is open makes the next start after a crash
+   remove temp files and files the index does not know.
+
+   Every hit moves the entry to the recent end of the LRU list.  When the
+   cache grows past its maximum size the oldest entries are unlinked until
+   it is back under a low water mark, so evictions come in batches rather
+   than one per insert.
+
+   Hits map the file, check that it was written for the url asked for, and
+   hand the contents on as a view of the mapping.  Files are only replaced
+   with rename(), never rewritten in place, so those views stay valid. */
 class rtFileCache
 {
   public:
@@ -59,6 +125,9 @@ class rtFileCache
     /* get the header,image data corresponding to a url from file cache. Returns RT_OK on success and RT_ERROR on failure */
     rtError httpCacheData(const char* url, rtHttpCacheData& cacheData);
 
+    /* returns true if a completed file is cached for the url. Answered from the index, without touching the file */
+    bool contains(const char* url);
+
     /* clear the complete cache */
     void clearCache();
 
@@ -73,40 +142,83 @@ class rtFileCache
     /* initialize the cache */
     void initCache();
 
-    /* cleans the cache till the size is more than cache data size and return the new size */
+    /* evicts the least recently used files once the cache is over its maximum size, down to the
+       low water mark, and returns the new size */
     int64_t cleanup(); 
 
-    /* set the file size and time associated with the file */
-    void setFileSizeAndTime(rtString& filename);
-
     /* calculates and returns the hash value of the url */
     rtString hashedFileName(const rtString& url);
 
-    /* write the cache data to a file. Returns true on success and false on failure */
-    bool writeFile(rtString& filename, const rtHttpCacheData& cacheData);
+    /* write the cache data to a temp file beside filename, to be renamed into place, and return its
+       size and path. Returns true on success and false on failure */
+    bool writeFile(rtString& filename, const rtHttpCacheData& cacheData, int64_t& size, rtString& tempPath);
 
     /* delete the file from cache */
     bool deleteFile(rtString& filename);
 
-    /* read the file and populate the header data only */
-    bool readFileHeader(rtString& filename,rtHttpCacheData& cacheData);
+    /* map the file of the indexed size written for url and populate the header data, leaving the
+       contents mapped in cacheData */
+    bool readFileHeader(rtString& filename, const rtString& url, int64_t size, rtHttpCacheData& cacheData);
 
     /* returns the filename in absolute path format */
     rtString absPath(rtString& filename);
 
-    /* populate the existing files in cache along with size in mFileSizeMap */
+    /* load the index of the cached files, rebuilding it from the directory if there is none */
     void populateExistingFiles();
 
     /* erase the map data of the cached file */
     void eraseData(rtString& filename);
 
+    /* maintain the LRU list; the entry must be in mEntries */
+    void lruAppend(rtFileCacheEntry* entry);
+    void lruRemove(rtFileCacheEntry* entry);
+
+    /* read the index log into mEntries. Returns false if there is no usable index */
+    bool loadIndex();
+
+    /* adopt the cache files found in the directory when there is no index, and write a new one */
+    void rebuildIndex();
+
+    /* after a crash, remove temp files and files not in the index, and entries without a file */
+    void reconcileFiles();
+
+    /* create and remove the marker that tells the next start whether the cache was closed cleanly */
+    void markOpen();
+    void markClosed();
+
+    /* open the index for appending, creating it if needed */
+    void openIndex();
+    void closeIndex();
+
+    /* append the state of the entry for filename to the index; a NULL entry records its removal */
+    void appendIndexRecord(const rtString& filename, const rtFileCacheEntry* entry);
+
+    /* rewrite the index with one record per entry, holding mCacheMutex throughout */
+    bool compactIndex();
+
+    /* compact the index if appends asked for it.  The records are copied under mCacheMutex and
+       written and synced without it; records appended meanwhile are added before the rename */
+    void compactIndexIfNeeded();
+
+    void indexSnapshot(std::vector<uint8_t>& buffer);
+    bool replaceIndex(int fd, const rtString& tempPath, size_t indexSize);
+    static rtString indexTempPath(const rtString& directory, uint32_t generation);
+
     /* member variables */
     int64_t mMaxSize;
     int64_t mCurrentSize;
     rtString mDirectory;
-    std::hash<std::string> hashFn;
-    std::multimap<time_t,rtString> mFileTimeMap;
-    std::map<rtString,int64_t> mFileSizeMap;
+    std::unordered_map<rtString,rtFileCacheEntry,rtFileCacheNameHash> mEntries;
+    rtFileCacheEntry* mLruOldest;
+    rtFileCacheEntry* mLruNewest;
+    int mIndexFd;
+    int64_t mIndexRecords;
+    // bumped whenever the entries are reloaded or cleared, which abandons a compaction under way
+    uint32_t mIndexGeneration;
+    bool mCompactionPending;
+    bool mCompacting;
+    std::vector<uint8_t> mCompactionBacklog;
+    rtString mOpenMarker;
     rtMutex mCacheMutex;
     static rtFileCache* mCache;
 };
@@ -26,12 +26,24 @@
 #include "rtThreadPool.h"
 #include "pxTimer.h"
 #include "rtLog.h"
+#include "rtSettings.h"
 #include <sstream>
 #include <iostream>
 #include <thread>
+#include <algorithm>
+#include <deque>
 #ifndef WIN32
 #include <signal.h>
+#include <strings.h>
+#else
+#define strncasecmp _strnicmp
 #endif //!WIN32
+#ifdef PX_MULTI_DOWNLOADS
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif //PX_MULTI_DOWNLOADS
 using namespace std;
 
 #define CA_CERTIFICATE "cacert.pem"
@@ -42,6 +54,16 @@ const int kMaxDownloadHandles = 6;
 #endif //PX_REUSE_DOWNLOAD_HANDLES
 const double kDefaultDownloadHandleExpiresTime = 5 * 60;
 const int kDownloadHandleTimerIntervalInMilliSeconds = 30 * 1000;
+const size_t kMinDownloadBufferSize = 16 * 1024;
+// larger Content-Length values are not trusted for sizing the buffer up front
+const size_t kMaxPresizedDownloadBufferSize = 64 * 1024 * 1024;
+#ifdef PX_MULTI_DOWNLOADS
+const long kDefaultMaxHostConnections = 6;
+const long kDefaultMaxTotalConnections = 24;
+const int kDownloadEngineMaxEvents = 32;
+const int kDownloadEngineCancelCheckIntervalInMilliSeconds = 100;
+const size_t kDownloadEngineMaxIdleHandles = 16;
+#endif //PX_MULTI_DOWNLOADS
 
 std::thread* downloadHandleExpiresCheckThread = NULL;
 bool continueDownloadHandleCheck = true;
@@ -49,114 +71,1086 @@ rtMutex downloadHandleMutex;
 
 #define HTTP_DOWNLOAD_CANCELED 499
 
-struct MemoryStruct
-{
-    MemoryStruct()
-        : headerSize(0)
-        , headerBuffer(NULL)
-        , contentsSize(0)
-        , contentsBuffer(NULL)
-        , downloadRequest(NULL)
-        , readSize(0)
+struct MemoryStruct
+{
+    MemoryStruct()
+        : headerSize(0)
+        , headerBuffer(NULL)
+        , contentsSize(0)
+        , contentsBuffer(NULL)
+        , downloadRequest(NULL)
+        , readSize(0)
+        , headerCapacity(1)
+        , contentsCapacity(1)
+        , bytesCopied(0)
+    {
+        headerBuffer = (char*)malloc(1);
+        contentsBuffer = (char*)malloc(1);
+    }
+
+    ~MemoryStruct()
+    {
+      if (headerBuffer != NULL)
+      {
+        free(headerBuffer);
+        headerBuffer = NULL;
+      }
+      if (contentsBuffer != NULL)
+      {
+        free(contentsBuffer);
+        contentsBuffer = NULL;
+      }
+    }
+
+  size_t headerSize;
+  char* headerBuffer;
+  size_t contentsSize;
+  char* contentsBuffer;
+  rtFileDownloadRequest *downloadRequest;
+  size_t readSize;
+  size_t headerCapacity;
+  size_t contentsCapacity;
+  // bytes written into the buffers, including those moved when one grows
+  size_t bytesCopied;
+};
+
+// Buffers grow geometrically, so a transfer arriving in many small chunks
+// is not copied again for every chunk.  On failure the buffer is left as
+// it was.
+static bool reserveDownloadBuffer(char*& buffer, size_t& capacity, size_t used, size_t needed, size_t& bytesCopied)
+{
+  if (needed <= capacity)
+  {
+    return true;
+  }
+  size_t newCapacity = capacity * 2;
+  if (newCapacity < kMinDownloadBufferSize)
+  {
+    newCapacity = kMinDownloadBufferSize;
+  }
+  if (newCapacity < needed)
+  {
+    newCapacity = needed;
+  }
+  char* newBuffer = (char*)realloc(buffer, newCapacity);
+  if (newBuffer == NULL)
+  {
+    return false;
+  }
+  if (newBuffer != buffer)
+  {
+    bytesCopied += used;
+  }
+  buffer = newBuffer;
+  capacity = newCapacity;
+  return true;
+}
+
+static size_t HeaderCallback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+  size_t downloadSize = size * nmemb;
+  struct MemoryStruct *mem = (struct MemoryStruct *)userp;
+
+  if (!reserveDownloadBuffer(mem->headerBuffer, mem->headerCapacity, mem->headerSize,
+                             mem->headerSize + downloadSize + 1, mem->bytesCopied))
+  {
+    /* out of memory! */
+    cout << "out of memory when downloading image\n";
+    return 0;
+  }
+
+  char* header = &(mem->headerBuffer[mem->headerSize]);
+  memcpy(header, contents, downloadSize);
+  mem->headerSize += downloadSize;
+  mem->headerBuffer[mem->headerSize] = 0;
+  mem->bytesCopied += downloadSize;
+
+  // curl passes one header line at a time; size the contents buffer up
+  // front when the length is known
+  if (mem->downloadRequest != NULL && mem->downloadRequest->collectsDownloadedData() &&
+      strncasecmp(header, "Content-Length:", 15) == 0)
+  {
+    size_t contentLength = (size_t)strtoull(header + 15, NULL, 10);
+    if (contentLength > 0 && contentLength <= kMaxPresizedDownloadBufferSize)
+    {
+      reserveDownloadBuffer(mem->contentsBuffer, mem->contentsCapacity, mem->contentsSize,
+                            mem->contentsSize + contentLength + 1, mem->bytesCopied);
+    }
+  }
+
+  return downloadSize;
+}
+
+static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+  size_t downloadSize = size * nmemb;
+  size_t downloadCallbackSize = 0;
+  struct MemoryStruct *mem = (struct MemoryStruct *)userp;
+
+  downloadCallbackSize = mem->downloadRequest->executeDownloadProgressCallback(contents, size, nmemb );
+
+  rtFileDownloadStreamConsumer* streamConsumer = mem->downloadRequest->streamConsumer();
+  if (streamConsumer != NULL)
+  {
+    streamConsumer->onDownloadData(mem->downloadRequest, (const char*)contents, downloadSize);
+  }
+  if (!mem->downloadRequest->coalescingKey().isEmpty())
+  {
+    rtFileDownloader::instance()->streamToCoalescedRequests(mem->downloadRequest, (const char*)contents, downloadSize);
+  }
+
+  if (mem->downloadRequest->collectsDownloadedData())
+  {
+    if (!reserveDownloadBuffer(mem->contentsBuffer, mem->contentsCapacity, mem->contentsSize,
+                               mem->contentsSize + downloadSize + 1, mem->bytesCopied))
+    {
+      /* out of memory! */
+      cout << "out of memory when downloading image\n";
+      return 0;
+    }
+    memcpy(&(mem->contentsBuffer[mem->contentsSize]), contents, downloadSize);
+    mem->contentsSize += downloadSize;
+    mem->contentsBuffer[mem->contentsSize] = 0;
+    mem->bytesCopied += downloadSize;
+  }
+
+  if (mem->downloadRequest->useCallbackDataSize() == true)
+  {
+     return downloadCallbackSize;
+  }
+  else
+  {
+     return downloadSize;
+  }
+}
+
+static size_t ReadMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+  size_t bufferSize = size * nmemb;
+  struct MemoryStruct *mem = (struct MemoryStruct *)userp;
+
+  size_t sizeLeft = mem->downloadRequest->readData().byteLength() - mem->readSize;
+  if (sizeLeft > 0) {
+    size_t copyThisMuch = sizeLeft;
+    if (copyThisMuch > bufferSize)
+      copyThisMuch = bufferSize;
+    memcpy(contents, mem->downloadRequest->readData().cString() + mem->readSize, copyThisMuch);
+    mem->readSize += copyThisMuch;
+    return copyThisMuch;
+  }
+
+  return 0;
+}
+
+
+// State for one network transfer, whether it is performed on the calling
+// thread or by the download engine
+struct rtFileDownloadTransfer
+{
+  rtFileDownloadTransfer(rtFileDownloadRequest* request)
+    : downloadRequest(request)
+    , curlHandle(NULL)
+    , headerList(NULL)
+    , host()
+    , chunk()
+  {
+    memset(errorBuffer, 0, sizeof(errorBuffer));
+  }
+
+  ~rtFileDownloadTransfer()
+  {
+    if (headerList != NULL)
+    {
+      curl_slist_free_all(headerList);
+      headerList = NULL;
+    }
+  }
+
+  rtFileDownloadRequest* downloadRequest;
+  CURL* curlHandle;
+  struct curl_slist* headerList;
+  rtString host;
+  MemoryStruct chunk;
+  char errorBuffer[CURL_ERROR_SIZE];
+};
+
+static void setupTransfer(rtFileDownloadTransfer& transfer)
+{
+    rtFileDownloadRequest* downloadRequest = transfer.downloadRequest;
+    CURL *curl_handle = transfer.curlHandle;
+    MemoryStruct& chunk = transfer.chunk;
+
+    bool useProxy = !downloadRequest->proxy().isEmpty();
+    rtString proxyServer = downloadRequest->proxy();
+    bool headerOnly = downloadRequest->headerOnly();
+
+    rtString method = downloadRequest->method();
+    size_t readDataSize = downloadRequest->readData().byteLength();
+
+    /* specify URL to get */
+    curl_easy_setopt(curl_handle, CURLOPT_URL, downloadRequest->fileUrl().cString());
+    curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1); //when redirected, follow the redirections
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, HeaderCallback);
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)&chunk);
+    if (false == headerOnly)
+    {
+      chunk.downloadRequest = downloadRequest;
+      curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+      curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
+    }
+
+    if(downloadRequest->isCurlDefaultTimeoutSet() == false)
+    {
+    curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, kCurlTimeoutInSeconds);
+    }
+    curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1L);
+
+    if(downloadRequest->isProgressMeterSwitchOff())
+        curl_easy_setopt(curl_handle, CURLOPT_NOPROGRESS, 1);
+
+    if(downloadRequest->isHTTPFailOnError())
+    {
+        curl_easy_setopt(curl_handle, CURLOPT_FAILONERROR, 1);
+        curl_easy_setopt(curl_handle, CURLOPT_VERBOSE, 1);
+        curl_easy_setopt(curl_handle, CURLOPT_ERRORBUFFER, transfer.errorBuffer);
+    }
+#if !defined(PX_PLATFORM_GENERIC_DFB) && !defined(PX_PLATFORM_DFB_NON_X11)
+    curl_easy_setopt(curl_handle, CURLOPT_TCP_KEEPALIVE, 1);
+    curl_easy_setopt(curl_handle, CURLOPT_TCP_KEEPIDLE, 60);
+    curl_easy_setopt(curl_handle, CURLOPT_TCP_KEEPINTVL, 30);
+#endif //!PX_PLATFORM_GENERIC_DFB && !PX_PLATFORM_DFB_NON_X11
+
+    vector<rtString>& additionalHttpHeaders = downloadRequest->additionalHttpHeaders();
+    struct curl_slist *list = NULL;
+    for (unsigned int headerOption = 0;headerOption < additionalHttpHeaders.size();headerOption++)
+    {
+      list = curl_slist_append(list, additionalHttpHeaders[headerOption].cString());
+    }
+    if (downloadRequest->cors() != NULL)
+      downloadRequest->cors()->updateRequestForAccessControl(&list);
+    if (readDataSize > 0)
+    {
+      list = curl_slist_append(list, "Expect:");
+    }
+    curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, list);
+    transfer.headerList = list;
+    //CA certificates
+    // !CLF: Use system CA Cert rather than CA_CERTIFICATE fo now.  Revisit!
+    //curl_easy_setopt(curl_handle,CURLOPT_CAINFO,mCaCertFile.cString());
+    curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYHOST, 2);
+    curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYPEER, true);
+
+    /* some servers don't like requests that are made without a user-agent
+     field, so we provide one */
+    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+
+    if (useProxy)
+
+    {
+        curl_easy_setopt(curl_handle, CURLOPT_PROXY, proxyServer.cString());
+        curl_easy_setopt(curl_handle, CURLOPT_PROXYTYPE, CURLPROXY_HTTP);
+    }
+    else
+    {
+      curl_easy_setopt(curl_handle, CURLOPT_PROXY, "");
+    }
+
+    if (true == headerOnly)
+    {
+      curl_easy_setopt(curl_handle, CURLOPT_NOBODY, 1);
+    }
+
+    if (!method.isEmpty() && method.compare("GET") != 0)
+    {
+      if (method.compare("POST") == 0)
+        curl_easy_setopt(curl_handle, CURLOPT_POST, 1L);
+      else if (method.compare("PUT") == 0)
+        curl_easy_setopt(curl_handle, CURLOPT_UPLOAD, 1L);
+      else
+        curl_easy_setopt(curl_handle, CURLOPT_CUSTOMREQUEST, method.cString());
+    }
+
+    if (readDataSize > 0)
+    {
+      chunk.downloadRequest = downloadRequest;
+      curl_easy_setopt(curl_handle, CURLOPT_READFUNCTION, ReadMemoryCallback);
+      curl_easy_setopt(curl_handle, CURLOPT_READDATA, (void *)&chunk);
+      curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDSIZE, readDataSize);
+    }
+}
+
+// Hands the result of a finished transfer to its request.  The curl handle
+// is left to the caller to release.
+static bool completeTransfer(rtFileDownloadTransfer& transfer, CURLcode res)
+{
+    rtFileDownloadRequest* downloadRequest = transfer.downloadRequest;
+    MemoryStruct& chunk = transfer.chunk;
+    bool headerOnly = downloadRequest->headerOnly();
+
+    if (transfer.headerList != NULL)
+    {
+      curl_slist_free_all(transfer.headerList);
+      transfer.headerList = NULL;
+    }
+
+    downloadRequest->setDownloadStatusCode(res);
+    if(downloadRequest->isHTTPFailOnError())
+        downloadRequest->setHTTPError(transfer.errorBuffer);
+
+    /* check for errors */
+    if (res != CURLE_OK)
+    {
+        bool useProxy = !downloadRequest->proxy().isEmpty();
+        rtString proxyMessage("Using proxy:"); 
+        if (useProxy)
+        {
+          proxyMessage.append("true - ");
+          proxyMessage.append(downloadRequest->proxy().cString());
+        }
+        else
+        {
+          proxyMessage.append("false ");
+        }
+        char errorMessage[MAX_URL_SIZE+400];
+        memset(errorMessage, 0, sizeof(errorMessage));
+        sprintf(errorMessage, "Download error for:%s. Error code:%d. %s",downloadRequest->fileUrl().cString(), res, proxyMessage.cString());
+        downloadRequest->setErrorString(errorMessage);
+
+        //clean up contents on error
+        if (chunk.contentsBuffer != NULL)
+        {
+            free(chunk.contentsBuffer);
+            chunk.contentsBuffer = NULL;
+        }
+
+        if (chunk.headerBuffer != NULL)
+        {
+            free(chunk.headerBuffer);
+            chunk.headerBuffer = NULL;
+        }
+        downloadRequest->setDownloadedData(NULL, 0);
+        return false;
+    }
+
+    long httpCode = -1;
+    if (curl_easy_getinfo(transfer.curlHandle, CURLINFO_RESPONSE_CODE, &httpCode) == CURLE_OK)
+    {
+        downloadRequest->setHttpStatusCode(httpCode);
+    }
+
+    //todo read the header information before closing
+    if (chunk.headerBuffer != NULL)
+    {
+        downloadRequest->setHeaderData(chunk.headerBuffer, chunk.headerSize);
+    }
+
+    //don't free the downloaded data (contentsBuffer) because it will be used later
+    if (false == headerOnly)
+    {
+      // give back what geometric growth left unused
+      size_t slack = chunk.contentsCapacity - (chunk.contentsSize + 1);
+      if (slack > kMinDownloadBufferSize && slack > chunk.contentsSize / 4)
+      {
+        char* contents = (char*)realloc(chunk.contentsBuffer, chunk.contentsSize + 1);
+        if (contents != NULL)
+        {
+          if (contents != chunk.contentsBuffer)
+          {
+            chunk.bytesCopied += chunk.contentsSize;
+          }
+          chunk.contentsBuffer = contents;
+          chunk.contentsCapacity = chunk.contentsSize + 1;
+        }
+      }
+      downloadRequest->setDownloadedData(chunk.contentsBuffer, chunk.contentsSize);
+    }
+    else if (chunk.contentsBuffer != NULL)
+    {
+        free(chunk.contentsBuffer);
+        chunk.contentsBuffer = NULL;
+    }
+    chunk.headerBuffer = NULL;
+    chunk.contentsBuffer = NULL;
+    downloadRequest->setDownloadBytesCopied(chunk.bytesCopied);
+    rtLogDebug("downloaded %s: %lu bytes, %lu bytes copied", downloadRequest->fileUrl().cString(),
+               (unsigned long)(chunk.headerSize + chunk.contentsSize), (unsigned long)chunk.bytesCopied);
+    if (downloadRequest->cors() != NULL)
+      downloadRequest->cors()->updateResponseForAccessControl(downloadRequest);
+    return true;
+}
+
+static rtThreadPriority threadPriority(rtFileDownloadPriority priority)
+{
+  switch (priority)
+  {
+    case RT_DOWNLOAD_PRIORITY_VISIBLE:
+      return RT_THREAD_PRIORITY_HIGH;
+    case RT_DOWNLOAD_PRIORITY_PREFETCH:
+      return RT_THREAD_PRIORITY_LOW;
+    default:
+      return RT_THREAD_PRIORITY_NORMAL;
+  }
+}
+
+void startFileDownloadInBackground(void* data)
+{
+    rtFileDownloadRequest* downloadRequest = (rtFileDownloadRequest*)data;
+    rtFileDownloader::instance()->downloadFile(downloadRequest, true);
+}
+
+#ifdef PX_MULTI_DOWNLOADS
+void finishFileDownloadInBackground(void* data)
+{
+    rtFileDownloadRequest* downloadRequest = (rtFileDownloadRequest*)data;
+    rtFileDownloader::instance()->finishDownload(downloadRequest, downloadRequest->downloadStatusCode() == CURLE_OK);
+}
+
+// A queued request and its position in the order requests were queued
+struct rtFileDownloadPendingRequest
+{
+  rtFileDownloadPendingRequest(rtFileDownloadRequest* request, uint64_t order)
+    : downloadRequest(request), sequence(order) {}
+  rtFileDownloadRequest* downloadRequest;
+  uint64_t sequence;
+};
+
+// The requests waiting for and the transfers using one host's connections
+struct rtFileDownloadHostQueue
+{
+  rtFileDownloadHostQueue() : transfers(0) {}
+  bool empty() const
+  {
+    for (int i = 0; i < RT_DOWNLOAD_PRIORITY_COUNT; i++)
+    {
+      if (!pending[i].empty())
+        return false;
+    }
+    return true;
+  }
+  std::deque<rtFileDownloadPendingRequest> pending[RT_DOWNLOAD_PRIORITY_COUNT];
+  long transfers;
+};
+
+// Runs every network transfer of the background downloads on one I/O thread
+// with curl multi and epoll.  Transfers to the same host share the
+// connections cached by the multi handle, and the connection limits keep a
+// burst of requests from opening a socket each.  Finished requests are
+// handed back to the thread pool so callbacks never run on the I/O thread.
+//
+// Requests wait in one queue per rtFileDownloadPriority and are admitted
+// highest priority first.  The engine enforces the per host limit itself so
+// curl never queues a transfer internally, and each lower priority may only
+// start transfers while fewer than its share of the connections are busy,
+// which leaves room for what becomes visible next.
+//
+// The queues are kept per host, so admitting requests only looks at the
+// front of each host's queues, and only after something changed that could
+// let a request start: a new or reprioritized request, or a finished
+// transfer.  Requests canceled while still queued are swept up every
+// kDownloadEngineCancelCheckIntervalInMilliSeconds.
+class rtFileDownloadEngine
+{
+public:
+  rtFileDownloadEngine(rtFileDownloader* downloader);
+  ~rtFileDownloadEngine();
+
+  bool start(long maxHostConnections, long maxTotalConnections);
+  // Requests still queued or in flight complete as canceled, on the
+  // calling thread, before stop() returns.
+  void stop();
+
+  // Thread safe.  Returns false if the engine is not running, in which case
+  // the caller keeps ownership of the request.
+  bool addRequest(rtFileDownloadRequest* downloadRequest);
+  // Thread safe.  Sets the priority of the request and moves it to the
+  // matching queue if it is still pending.  Returns false if the request
+  // already had that priority.
+  bool reprioritize(rtFileDownloadRequest* downloadRequest, rtFileDownloadPriority priority);
+
+private:
+  static int socketCallback(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp);
+  static int timerCallback(CURLM* multi, long timeoutMs, void* userp);
+
+  void run();
+  void wakeup();
+  void startPendingTransfers();
+  void sweepCanceledRequests(std::vector<rtFileDownloadRequest*>& canceledRequests);
+  void removeHostQueueIfIdle(const rtString& host);
+  void cancelTransfers();
+  void completeTransfers();
+  void finishTransfer(rtFileDownloadTransfer* transfer, CURLcode res, bool canceled);
+  static void finishRequest(rtFileDownloadRequest* downloadRequest, bool canceled);
+  static rtString downloadHost(const rtString& url);
+
+  rtFileDownloader* mDownloader;
+  CURLM* mMultiHandle;
+  int mEpollFd;
+  int mWakeupFds[2];
+  std::thread* mThread;
+  bool mRunning;
+  double mTimeoutTime;
+  rtMutex mMutex;
+  // Guarded by mMutex.  mPendingChanged is set whenever a queued request
+  // might be able to start.
+  std::map<rtString, rtFileDownloadHostQueue> mHostQueues;
+  std::map<rtFileDownloadRequest*, rtString> mPendingHosts;
+  uint64_t mPendingSequence;
+  bool mPendingChanged;
+  long mMaxHostConnections;
+  long mMaxTransfers[RT_DOWNLOAD_PRIORITY_COUNT];
+  // Only touched on the I/O thread
+  double mCancelCheckTime;
+  std::vector<rtFileDownloadTransfer*> mTransfers;
+  std::vector<CURL*> mIdleHandles;
+};
+
+rtFileDownloadEngine::rtFileDownloadEngine(rtFileDownloader* downloader)
+  : mDownloader(downloader), mMultiHandle(NULL), mEpollFd(-1), mThread(NULL), mRunning(false), mTimeoutTime(-1),
+    mMutex(), mHostQueues(), mPendingHosts(), mPendingSequence(0), mPendingChanged(false),
+    mMaxHostConnections(kDefaultMaxHostConnections), mCancelCheckTime(0), mTransfers(), mIdleHandles()
+{
+  mWakeupFds[0] = -1;
+  mWakeupFds[1] = -1;
+  for (int i = 0; i < RT_DOWNLOAD_PRIORITY_COUNT; i++)
+  {
+    mMaxTransfers[i] = kDefaultMaxTotalConnections;
+  }
+}
+
+rtFileDownloadEngine::~rtFileDownloadEngine()
+{
+  stop();
+}
+
+bool rtFileDownloadEngine::start(long maxHostConnections, long maxTotalConnections)
+{
+  if (mThread != NULL)
+  {
+    return true;
+  }
+  mMultiHandle = curl_multi_init();
+  mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (mMultiHandle == NULL || mEpollFd < 0 || pipe2(mWakeupFds, O_NONBLOCK | O_CLOEXEC) != 0)
+  {
+    rtLogError("unable to start the download engine");
+    stop();
+    return false;
+  }
+
+  mMaxHostConnections = (maxHostConnections > 0) ? maxHostConnections : 1;
+  if (maxTotalConnections <= 0)
+    maxTotalConnections = 1;
+  mMaxTransfers[RT_DOWNLOAD_PRIORITY_VISIBLE] = maxTotalConnections;
+  mMaxTransfers[RT_DOWNLOAD_PRIORITY_NEAR] = std::max(1L, maxTotalConnections - maxTotalConnections / 4);
+  mMaxTransfers[RT_DOWNLOAD_PRIORITY_PREFETCH] = std::max(1L, maxTotalConnections / 4);
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = mWakeupFds[0];
+  epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mWakeupFds[0], &event);
+
+  curl_multi_setopt(mMultiHandle, CURLMOPT_SOCKETFUNCTION, socketCallback);
+  curl_multi_setopt(mMultiHandle, CURLMOPT_SOCKETDATA, this);
+  curl_multi_setopt(mMultiHandle, CURLMOPT_TIMERFUNCTION, timerCallback);
+  curl_multi_setopt(mMultiHandle, CURLMOPT_TIMERDATA, this);
+  curl_multi_setopt(mMultiHandle, CURLMOPT_MAX_HOST_CONNECTIONS, maxHostConnections);
+  curl_multi_setopt(mMultiHandle, CURLMOPT_MAX_TOTAL_CONNECTIONS, maxTotalConnections);
+  curl_multi_setopt(mMultiHandle, CURLMOPT_MAXCONNECTS, maxTotalConnections);
+#ifdef CURLPIPE_MULTIPLEX
+  curl_multi_setopt(mMultiHandle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif //CURLPIPE_MULTIPLEX
+
+  mRunning = true;
+  mThread = new std::thread(&rtFileDownloadEngine::run, this);
+  rtLogInfo("download engine started (%ld connections per host, %ld total)", maxHostConnections, maxTotalConnections);
+  return true;
+}
+
+void rtFileDownloadEngine::stop()
+{
+  mMutex.lock();
+  mRunning = false;
+  mMutex.unlock();
+  if (mThread != NULL)
+  {
+    wakeup();
+    mThread->join();
+    delete mThread;
+    mThread = NULL;
+  }
+
+  // the I/O thread is gone, so nothing else touches the queues now
+  std::vector<rtFileDownloadRequest*> outstanding;
+  for (std::map<rtString, rtFileDownloadHostQueue>::iterator host = mHostQueues.begin(); host != mHostQueues.end(); ++host)
+  {
+    for (int i = 0; i < RT_DOWNLOAD_PRIORITY_COUNT; i++)
+    {
+      std::deque<rtFileDownloadPendingRequest>& pending = host->second.pending[i];
+      for (std::deque<rtFileDownloadPendingRequest>::iterator it = pending.begin(); it != pending.end(); ++it)
+      {
+        outstanding.push_back(it->downloadRequest);
+      }
+    }
+  }
+  mHostQueues.clear();
+  mPendingHosts.clear();
+  mPendingChanged = false;
+  for (vector<rtFileDownloadTransfer*>::iterator it = mTransfers.begin(); it != mTransfers.end(); ++it)
+  {
+    outstanding.push_back((*it)->downloadRequest);
+    curl_multi_remove_handle(mMultiHandle, (*it)->curlHandle);
+    curl_easy_cleanup((*it)->curlHandle);
+    delete (*it);
+  }
+  mTransfers.clear();
+
+  // their owners are told now rather than through the thread pool, which
+  // may be shutting down along with the downloader
+  if (!outstanding.empty())
+  {
+    rtLogWarn("download engine stopped with %d requests outstanding", (int)outstanding.size());
+  }
+  for (vector<rtFileDownloadRequest*>::iterator it = outstanding.begin(); it != outstanding.end(); ++it)
+  {
+    (*it)->setDownloadedData(NULL, 0);
+    (*it)->setDownloadStatusCode(-1);
+    (*it)->setErrorString("canceled request");
+    mDownloader->finishDownload(*it, false);
+  }
+  for (vector<CURL*>::iterator it = mIdleHandles.begin(); it != mIdleHandles.end(); ++it)
+  {
+    curl_easy_cleanup(*it);
+  }
+  mIdleHandles.clear();
+
+  if (mMultiHandle != NULL)
+  {
+    curl_multi_cleanup(mMultiHandle);
+    mMultiHandle = NULL;
+  }
+  if (mEpollFd >= 0)
+  {
+    close(mEpollFd);
+    mEpollFd = -1;
+  }
+  for (int i = 0; i < 2; i++)
+  {
+    if (mWakeupFds[i] >= 0)
+    {
+      close(mWakeupFds[i]);
+      mWakeupFds[i] = -1;
+    }
+  }
+}
+
+bool rtFileDownloadEngine::addRequest(rtFileDownloadRequest* downloadRequest)
+{
+  mMutex.lock();
+  if (!mRunning)
+  {
+    mMutex.unlock();
+    return false;
+  }
+  rtString host = downloadHost(downloadRequest->fileUrl());
+  mHostQueues[host].pending[downloadRequest->downloadPriority()].push_back(
+    rtFileDownloadPendingRequest(downloadRequest, mPendingSequence++));
+  mPendingHosts[downloadRequest] = host;
+  mPendingChanged = true;
+  mMutex.unlock();
+  wakeup();
+  return true;
+}
+
+bool rtFileDownloadEngine::reprioritize(rtFileDownloadRequest* downloadRequest, rtFileDownloadPriority priority)
+{
+  // the priority is only changed under mMutex, so a pending request is
+  // always in the queue of the priority read here
+  bool moved = false;
+  mMutex.lock();
+  rtFileDownloadPriority previous = downloadRequest->downloadPriority();
+  if (previous == priority)
+  {
+    mMutex.unlock();
+    return false;
+  }
+  downloadRequest->setDownloadPriority(priority);
+  std::map<rtFileDownloadRequest*, rtString>::iterator host = mPendingHosts.find(downloadRequest);
+  if (host != mPendingHosts.end())
+  {
+    rtFileDownloadHostQueue& queue = mHostQueues[host->second];
+    std::deque<rtFileDownloadPendingRequest>& pending = queue.pending[previous];
+    for (std::deque<rtFileDownloadPendingRequest>::iterator it = pending.begin(); it != pending.end(); ++it)
+    {
+      if (it->downloadRequest == downloadRequest)
+      {
+        pending.erase(it);
+        queue.pending[priority].push_back(rtFileDownloadPendingRequest(downloadRequest, mPendingSequence++));
+        mPendingChanged = true;
+        moved = true;
+        break;
+      }
+    }
+  }
+  mMutex.unlock();
+  if (moved)
+  {
+    wakeup();
+  }
+  return true;
+}
+
+rtString rtFileDownloadEngine::downloadHost(const rtString& url)
+{
+  const char* s = url.cString();
+  const char* begin = strstr(s, "://");
+  begin = (begin != NULL) ? begin + 3 : s;
+  const char* end = begin;
+  while (*end != 0 && *end != '/' && *end != '?' && *end != '#')
+  {
+    end++;
+  }
+  return rtString(begin, (uint32_t)(end - begin));
+}
+
+int rtFileDownloadEngine::socketCallback(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp)
+{
+  (void)easy;
+  rtFileDownloadEngine* engine = (rtFileDownloadEngine*)userp;
+  if (what == CURL_POLL_REMOVE)
+  {
+    // the socket may already be closed, in which case epoll dropped it
+    epoll_ctl(engine->mEpollFd, EPOLL_CTL_DEL, s, NULL);
+    return 0;
+  }
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.data.fd = s;
+  if (what & CURL_POLL_IN)
+    event.events |= EPOLLIN;
+  if (what & CURL_POLL_OUT)
+    event.events |= EPOLLOUT;
+
+  if (socketp == NULL)
+  {
+    epoll_ctl(engine->mEpollFd, EPOLL_CTL_ADD, s, &event);
+    curl_multi_assign(engine->mMultiHandle, s, engine);
+  }
+  else
+  {
+    epoll_ctl(engine->mEpollFd, EPOLL_CTL_MOD, s, &event);
+  }
+  return 0;
+}
+
+int rtFileDownloadEngine::timerCallback(CURLM* multi, long timeoutMs, void* userp)
+{
+  (void)multi;
+  rtFileDownloadEngine* engine = (rtFileDownloadEngine*)userp;
+  engine->mTimeoutTime = (timeoutMs < 0) ? -1 : pxMilliseconds() + timeoutMs;
+  return 0;
+}
+
+void rtFileDownloadEngine::wakeup()
+{
+  char c = 1;
+  ssize_t ret = write(mWakeupFds[1], &c, 1);
+  (void)ret;
+}
+
+void rtFileDownloadEngine::run()
+{
+  struct epoll_event events[kDownloadEngineMaxEvents];
+  int runningHandles = 0;
+  while (true)
+  {
+    mMutex.lock();
+    bool running = mRunning;
+    mMutex.unlock();
+    if (!running)
+    {
+      break;
+    }
+
+    startPendingTransfers();
+    cancelTransfers();
+
+    // wake up for curl's timeouts, and periodically while transfers are
+    // active to notice canceled requests
+    int timeout = -1;
+    if (!mTransfers.empty())
+    {
+      timeout = kDownloadEngineCancelCheckIntervalInMilliSeconds;
+    }
+    if (mTimeoutTime >= 0)
+    {
+      double remaining = mTimeoutTime - pxMilliseconds();
+      if (remaining < 0)
+        remaining = 0;
+      if (timeout < 0 || remaining < timeout)
+        timeout = (int)remaining;
+    }
+
+    int eventCount = epoll_wait(mEpollFd, events, kDownloadEngineMaxEvents, timeout);
+    if (eventCount < 0 && errno != EINTR)
     {
-        headerBuffer = (char*)malloc(1);
-        contentsBuffer = (char*)malloc(1);
+      rtLogError("download engine epoll_wait failed (%d)", errno);
+      break;
     }
 
-    ~MemoryStruct()
+    for (int i = 0; i < eventCount; i++)
     {
-      if (headerBuffer != NULL)
-      {
-        free(headerBuffer);
-        headerBuffer = NULL;
-      }
-      if (contentsBuffer != NULL)
+      int fd = events[i].data.fd;
+      if (fd == mWakeupFds[0])
       {
-        free(contentsBuffer);
-        contentsBuffer = NULL;
+        char buffer[64];
+        while (read(fd, buffer, sizeof(buffer)) > 0)
+        {
+        }
+        continue;
       }
+      int action = 0;
+      if (events[i].events & EPOLLIN)
+        action |= CURL_CSELECT_IN;
+      if (events[i].events & EPOLLOUT)
+        action |= CURL_CSELECT_OUT;
+      if (events[i].events & (EPOLLERR | EPOLLHUP))
+        action |= CURL_CSELECT_ERR;
+      curl_multi_socket_action(mMultiHandle, fd, action, &runningHandles);
     }
 
-  size_t headerSize;
-  char* headerBuffer;
-  size_t contentsSize;
-  char* contentsBuffer;
-  rtFileDownloadRequest *downloadRequest;
-  size_t readSize;
-};
+    if (mTimeoutTime >= 0 && pxMilliseconds() >= mTimeoutTime)
+    {
+      mTimeoutTime = -1;
+      curl_multi_socket_action(mMultiHandle, CURL_SOCKET_TIMEOUT, 0, &runningHandles);
+    }
 
-static size_t HeaderCallback(void *contents, size_t size, size_t nmemb, void *userp)
+    completeTransfers();
+  }
+}
+
+void rtFileDownloadEngine::startPendingTransfers()
 {
-  size_t downloadSize = size * nmemb;
-  struct MemoryStruct *mem = (struct MemoryStruct *)userp;
+  std::vector<rtFileDownloadTransfer*> transfers;
+  std::vector<rtFileDownloadRequest*> canceledRequests;
+  long activeTransfers = (long)mTransfers.size();
+  bool sweep = pxMilliseconds() >= mCancelCheckTime;
+  mMutex.lock();
+  if (sweep)
+  {
+    mCancelCheckTime = pxMilliseconds() + kDownloadEngineCancelCheckIntervalInMilliSeconds;
+    sweepCanceledRequests(canceledRequests);
+  }
+  if (mPendingChanged)
+  {
+    mPendingChanged = false;
+    for (int priority = 0; priority < RT_DOWNLOAD_PRIORITY_COUNT; priority++)
+    {
+      // start the oldest request among the hosts with a free connection, so
+      // requests of one priority still start in the order they were queued
+      // and a host at its limit does not hold up requests to other hosts
+      while (activeTransfers < mMaxTransfers[priority])
+      {
+        std::map<rtString, rtFileDownloadHostQueue>::iterator next = mHostQueues.end();
+        for (std::map<rtString, rtFileDownloadHostQueue>::iterator host = mHostQueues.begin(); host != mHostQueues.end(); ++host)
+        {
+          std::deque<rtFileDownloadPendingRequest>& pending = host->second.pending[priority];
+          if (pending.empty() || host->second.transfers >= mMaxHostConnections)
+          {
+            continue;
+          }
+          if (next == mHostQueues.end() || pending.front().sequence < next->second.pending[priority].front().sequence)
+          {
+            next = host;
+          }
+        }
+        if (next == mHostQueues.end())
+        {
+          break;
+        }
+        rtFileDownloadRequest* downloadRequest = next->second.pending[priority].front().downloadRequest;
+        next->second.pending[priority].pop_front();
+        mPendingHosts.erase(downloadRequest);
+        if (downloadRequest->isCanceled())
+        {
+          canceledRequests.push_back(downloadRequest);
+          removeHostQueueIfIdle(next->first);
+          continue;
+        }
+        next->second.transfers++;
+        activeTransfers++;
+        rtFileDownloadTransfer* transfer = new rtFileDownloadTransfer(downloadRequest);
+        transfer->host = next->first;
+        transfers.push_back(transfer);
+      }
+    }
+  }
+  mMutex.unlock();
 
-  mem->headerBuffer = (char*)realloc(mem->headerBuffer, mem->headerSize + downloadSize + 1);
-  if(mem->headerBuffer == NULL) {
-    /* out of memory! */
-    cout << "out of memory when downloading image\n";
-    return 0;
+  for (vector<rtFileDownloadRequest*>::iterator it = canceledRequests.begin(); it != canceledRequests.end(); ++it)
+  {
+    finishRequest(*it, true);
   }
 
-  memcpy(&(mem->headerBuffer[mem->headerSize]), contents, downloadSize);
-  mem->headerSize += downloadSize;
-  mem->headerBuffer[mem->headerSize] = 0;
+  for (vector<rtFileDownloadTransfer*>::iterator it = transfers.begin(); it != transfers.end(); ++it)
+  {
+    rtFileDownloadTransfer* transfer = *it;
+    if (!mIdleHandles.empty())
+    {
+      transfer->curlHandle = mIdleHandles.back();
+      mIdleHandles.pop_back();
+      curl_easy_reset(transfer->curlHandle);
+    }
+    else
+    {
+      transfer->curlHandle = curl_easy_init();
+    }
+    setupTransfer(*transfer);
+    curl_easy_setopt(transfer->curlHandle, CURLOPT_PRIVATE, transfer);
+    // a request that does not want its handle reused gets its own connection
+    if (transfer->downloadRequest->downloadHandleExpiresTime() == 0)
+    {
+      curl_easy_setopt(transfer->curlHandle, CURLOPT_FORBID_REUSE, 1L);
+    }
+    mTransfers.push_back(transfer);
 
-  return downloadSize;
+    CURLMcode res = curl_multi_add_handle(mMultiHandle, transfer->curlHandle);
+    if (res != CURLM_OK)
+    {
+      rtLogError("unable to add download for %s (error code: %d)", transfer->downloadRequest->fileUrl().cString(), res);
+      finishTransfer(transfer, CURLE_FAILED_INIT, false);
+    }
+  }
 }
 
-static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
+// Called with mMutex held
+void rtFileDownloadEngine::sweepCanceledRequests(std::vector<rtFileDownloadRequest*>& canceledRequests)
 {
-  size_t downloadSize = size * nmemb;
-  size_t downloadCallbackSize = 0;
-  struct MemoryStruct *mem = (struct MemoryStruct *)userp;
-
-  downloadCallbackSize = mem->downloadRequest->executeDownloadProgressCallback(contents, size, nmemb );
-
-  mem->contentsBuffer = (char*)realloc(mem->contentsBuffer, mem->contentsSize + downloadSize + 1);
-  if(mem->contentsBuffer == NULL) {
-    /* out of memory! */
-    cout << "out of memory when downloading image\n";
-    return 0;
+  for (std::map<rtString, rtFileDownloadHostQueue>::iterator host = mHostQueues.begin(); host != mHostQueues.end();)
+  {
+    for (int i = 0; i < RT_DOWNLOAD_PRIORITY_COUNT; i++)
+    {
+      std::deque<rtFileDownloadPendingRequest>& pending = host->second.pending[i];
+      for (std::deque<rtFileDownloadPendingRequest>::iterator it = pending.begin(); it != pending.end();)
+      {
+        if (it->downloadRequest->isCanceled())
+        {
+          canceledRequests.push_back(it->downloadRequest);
+          mPendingHosts.erase(it->downloadRequest);
+          it = pending.erase(it);
+        }
+        else
+        {
+          ++it;
+        }
+      }
+    }
+    if (host->second.transfers <= 0 && host->second.empty())
+    {
+      mHostQueues.erase(host++);
+    }
+    else
+    {
+      ++host;
+    }
   }
+}
 
-  memcpy(&(mem->contentsBuffer[mem->contentsSize]), contents, downloadSize);
-  mem->contentsSize += downloadSize;
-  mem->contentsBuffer[mem->contentsSize] = 0;
+// Called with mMutex held
+void rtFileDownloadEngine::removeHostQueueIfIdle(const rtString& host)
+{
+  std::map<rtString, rtFileDownloadHostQueue>::iterator it = mHostQueues.find(host);
+  if (it != mHostQueues.end() && it->second.transfers <= 0 && it->second.empty())
+  {
+    mHostQueues.erase(it);
+  }
+}
 
-  if (mem->downloadRequest->useCallbackDataSize() == true)
+void rtFileDownloadEngine::cancelTransfers()
+{
+  for (size_t i = 0; i < mTransfers.size();)
   {
-     return downloadCallbackSize;
+    rtFileDownloadTransfer* transfer = mTransfers[i];
+    if (transfer->downloadRequest->isCanceled())
+    {
+      // finishTransfer removes it from mTransfers
+      finishTransfer(transfer, CURLE_ABORTED_BY_CALLBACK, true);
+    }
+    else
+    {
+      i++;
+    }
   }
-  else
+}
+
+void rtFileDownloadEngine::completeTransfers()
+{
+  CURLMsg* message = NULL;
+  int messagesLeft = 0;
+  while ((message = curl_multi_info_read(mMultiHandle, &messagesLeft)) != NULL)
   {
-     return downloadSize;
+    if (message->msg != CURLMSG_DONE)
+    {
+      continue;
+    }
+    rtFileDownloadTransfer* transfer = NULL;
+    curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char**)&transfer);
+    if (transfer != NULL)
+    {
+      finishTransfer(transfer, message->data.result, false);
+    }
   }
 }
 
-static size_t ReadMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
+void rtFileDownloadEngine::finishTransfer(rtFileDownloadTransfer* transfer, CURLcode res, bool canceled)
 {
-  size_t bufferSize = size * nmemb;
-  struct MemoryStruct *mem = (struct MemoryStruct *)userp;
+  rtFileDownloadRequest* downloadRequest = transfer->downloadRequest;
+  curl_multi_remove_handle(mMultiHandle, transfer->curlHandle);
 
-  size_t sizeLeft = mem->downloadRequest->readData().byteLength() - mem->readSize;
-  if (sizeLeft > 0) {
-    size_t copyThisMuch = sizeLeft;
-    if (copyThisMuch > bufferSize)
-      copyThisMuch = bufferSize;
-    memcpy(contents, mem->downloadRequest->readData().cString() + mem->readSize, copyThisMuch);
-    mem->readSize += copyThisMuch;
-    return copyThisMuch;
+  if (!canceled)
+  {
+    completeTransfer(*transfer, res);
   }
 
-  return 0;
-}
+  if (downloadRequest->downloadHandleExpiresTime() == 0 || mIdleHandles.size() >= kDownloadEngineMaxIdleHandles)
+  {
+    curl_easy_cleanup(transfer->curlHandle);
+  }
+  else
+  {
+    mIdleHandles.push_back(transfer->curlHandle);
+  }
 
+  mMutex.lock();
+  std::map<rtString, rtFileDownloadHostQueue>::iterator host = mHostQueues.find(transfer->host);
+  if (host != mHostQueues.end())
+  {
+    host->second.transfers--;
+    removeHostQueueIfIdle(transfer->host);
+  }
+  // a connection is free for whatever is queued
+  mPendingChanged = true;
+  mMutex.unlock();
 
-void startFileDownloadInBackground(void* data)
+  mTransfers.erase(std::find(mTransfers.begin(), mTransfers.end(), transfer));
+  delete transfer;
+
+  finishRequest(downloadRequest, canceled);
+}
+
+void rtFileDownloadEngine::finishRequest(rtFileDownloadRequest* downloadRequest, bool canceled)
 {
-    rtFileDownloadRequest* downloadRequest = (rtFileDownloadRequest*)data;
-    rtFileDownloader::instance()->downloadFile(downloadRequest);
+  if (canceled)
+  {
+    downloadRequest->setDownloadedData(NULL, 0);
+    downloadRequest->setDownloadStatusCode(-1);
+    downloadRequest->setErrorString("canceled request");
+  }
+  rtThreadTask* task = new rtThreadTask(finishFileDownloadInBackground, (void*)downloadRequest, "");
+  rtThreadPool::globalInstance()->executeTask(task);
 }
+#endif //PX_MULTI_DOWNLOADS
 
 rtFileDownloader* rtFileDownloader::mInstance = NULL;
 std::vector<rtFileDownloadRequest*>* rtFileDownloader::mDownloadRequestVector = new std::vector<rtFileDownloadRequest*>();
@@ -183,11 +1177,12 @@ rtFileDownloadRequest::rtFileDownloadRequest(const char* imageUrl, void* callbac
     mDownloadedData(0), mDownloadedDataSize(), mDownloadStatusCode(0) ,mCallbackData(callbackData),
     mCallbackFunctionMutex(), mHeaderData(0), mHeaderDataSize(0), mHeaderOnly(false), mDownloadHandleExpiresTime(-2)
 #ifdef ENABLE_HTTP_CACHE
-    , mCacheEnabled(true), mIsDataInCache(false), mDeferCacheRead(false), mCachedFileReadSize(0)
+    , mCacheEnabled(true), mIsDataInCache(false), mIsDataQueuedForCache(false), mDeferCacheRead(false), mCachedFileReadSize(0)
 #endif
     , mIsProgressMeterSwitchOff(false), mHTTPFailOnError(false), mDefaultTimeout(false)
     , mCORS(), mCanceled(false), mUseCallbackDataSize(false), mCanceledMutex()
-    , mMethod()
+    , mMethod(), mReadData(), mCoalescingKey(), mDownloadBytesCopied(0)
+    , mStreamConsumer(NULL), mCollectDownloadedData(true), mDownloadPriority(RT_DOWNLOAD_PRIORITY_NEAR)
 {
   mAdditionalHttpHeaders.clear();
 #ifdef ENABLE_HTTP_CACHE
@@ -397,6 +1392,16 @@ bool rtFileDownloadRequest::isDataCached()
   return mIsDataInCache;
 }
 
+void rtFileDownloadRequest::setDataQueuedForCache(bool val)
+{
+  mIsDataQueuedForCache = val;
+}
+
+bool rtFileDownloadRequest::isDataQueuedForCache()
+{
+  return mIsDataQueuedForCache;
+}
+
 size_t rtFileDownloadRequest::getCachedFileReadSize(void )
 {
   return mCachedFileReadSize;
@@ -417,18 +1422,21 @@ bool rtFileDownloadRequest::deferCacheRead()
   return mDeferCacheRead;
 }
 
-FILE* rtFileDownloadRequest::cacheFilePointer(void)
+bool rtFileDownloadRequest::cachedData(rtData& data)
 {
-  rtHttpCacheData cachedData(this->fileUrl().cString());
-
-  if (true == this->cacheEnabled())
+  if (!mCachedData.isView())
   {
-    if ((NULL != rtFileCache::instance()) && (RT_OK == rtFileCache::instance()->httpCacheData(this->fileUrl(), cachedData)))
-    {
-      return cachedData.filePointer();
-    }
+    return false;
   }
-  return NULL;
+  return data.initView(mCachedData, 0, mCachedData.length()) == RT_OK;
+}
+
+void rtFileDownloadRequest::setCachedData(rtData& data)
+{
+  if (data.isView())
+    mCachedData.initView(data, 0, data.length());
+  else
+    mCachedData.term();
 }
 #endif //ENABLE_HTTP_CACHE
 
@@ -532,9 +1540,77 @@ rtString rtFileDownloadRequest::readData() const
   return mReadData;
 }
 
+bool rtFileDownloadRequest::takeDownloadedData(char*& data, size_t& size)
+{
+#ifdef ENABLE_HTTP_CACHE
+  // data read from the cache belongs to the cache
+  if (mIsDataInCache)
+  {
+    return false;
+  }
+#endif
+  data = mDownloadedData;
+  size = mDownloadedDataSize;
+  mDownloadedData = NULL;
+  mDownloadedDataSize = 0;
+  return true;
+}
+
+void rtFileDownloadRequest::setDownloadBytesCopied(size_t bytesCopied)
+{
+  mDownloadBytesCopied = bytesCopied;
+}
+
+size_t rtFileDownloadRequest::downloadBytesCopied()
+{
+  return mDownloadBytesCopied;
+}
+
+bool rtFileDownloadRequest::hasDownloadProgressCallback()
+{
+  return mDownloadProgressCallbackFunction != NULL;
+}
+
+void rtFileDownloadRequest::setStreamConsumer(rtFileDownloadStreamConsumer* consumer, bool collectData)
+{
+  mStreamConsumer = consumer;
+  mCollectDownloadedData = (consumer == NULL) || collectData;
+}
+
+rtFileDownloadStreamConsumer* rtFileDownloadRequest::streamConsumer()
+{
+  return mStreamConsumer;
+}
+
+bool rtFileDownloadRequest::collectsDownloadedData()
+{
+  return mCollectDownloadedData;
+}
+
+void rtFileDownloadRequest::setCoalescingKey(const rtString& key)
+{
+  mCoalescingKey = key;
+}
+
+rtString rtFileDownloadRequest::coalescingKey() const
+{
+  return mCoalescingKey;
+}
+
+void rtFileDownloadRequest::setDownloadPriority(rtFileDownloadPriority priority)
+{
+  mDownloadPriority = priority;
+}
+
+rtFileDownloadPriority rtFileDownloadRequest::downloadPriority() const
+{
+  return (rtFileDownloadPriority)mDownloadPriority.load();
+}
+
 rtFileDownloader::rtFileDownloader()
     : mNumberOfCurrentDownloads(0), mDefaultCallbackFunction(NULL), mDownloadHandles(), mReuseDownloadHandles(false),
-      mCaCertFile(CA_CERTIFICATE), mFileCacheMutex()
+      mCaCertFile(CA_CERTIFICATE), mFileCacheMutex(), mDownloadEngine(NULL),
+      mCoalescedRequests(), mCoalescedRequestsMutex()
 {
   CURLcode rv = curl_global_init(CURL_GLOBAL_ALL);
   if (CURLE_OK != rv)
@@ -556,6 +1632,56 @@ rtFileDownloader::rtFileDownloader()
   {
     mCaCertFile = s;
   }
+  startDownloadEngine();
+}
+
+bool rtFileDownloader::startDownloadEngine()
+{
+#ifdef PX_MULTI_DOWNLOADS
+  bool enableDownloadEngine = true;
+  long maxHostConnections = kDefaultMaxHostConnections;
+  long maxTotalConnections = kDefaultMaxTotalConnections;
+  rtValue val;
+  rtSettings::instance()->boolValue("enableMultiDownloads", enableDownloadEngine);
+  if (RT_OK == rtSettings::instance()->value("maxDownloadConnectionsPerHost", val))
+  {
+    maxHostConnections = val.toInt32();
+  }
+  if (RT_OK == rtSettings::instance()->value("maxDownloadConnections", val))
+  {
+    maxTotalConnections = val.toInt32();
+  }
+  if (!enableDownloadEngine)
+  {
+    return false;
+  }
+  if (mDownloadEngine != NULL)
+  {
+    // a stopped engine stays allocated since other threads may still be
+    // handing it requests, which it refuses until it runs again
+    return mDownloadEngine->start(maxHostConnections, maxTotalConnections);
+  }
+  mDownloadEngine = new rtFileDownloadEngine(this);
+  if (!mDownloadEngine->start(maxHostConnections, maxTotalConnections))
+  {
+    delete mDownloadEngine;
+    mDownloadEngine = NULL;
+    return false;
+  }
+  return true;
+#else
+  return false;
+#endif //PX_MULTI_DOWNLOADS
+}
+
+void rtFileDownloader::stopDownloadEngine()
+{
+#ifdef PX_MULTI_DOWNLOADS
+  if (mDownloadEngine != NULL)
+  {
+    mDownloadEngine->stop();
+  }
+#endif //PX_MULTI_DOWNLOADS
 }
 
 rtFileDownloader::~rtFileDownloader()
@@ -589,6 +1715,13 @@ rtFileDownloader::~rtFileDownloader()
     }
   }
 #endif
+#ifdef PX_MULTI_DOWNLOADS
+  if (mDownloadEngine != NULL)
+  {
+    delete mDownloadEngine;
+    mDownloadEngine = NULL;
+  }
+#endif //PX_MULTI_DOWNLOADS
   mCaCertFile = "";
 }
 
@@ -613,6 +1746,11 @@ bool rtFileDownloader::addToDownloadQueue(rtFileDownloadRequest* downloadRequest
     //todo: check the download queue before starting download
     submitted = true;
     addFileDownloadRequest(downloadRequest);
+    if (coalesceDownloadRequest(downloadRequest))
+    {
+      // completes with the transfer already in flight
+      return submitted;
+    }
     downloadFileInBackground(downloadRequest);
     //startNextDownloadInBackground();
     return submitted;
@@ -625,11 +1763,77 @@ void rtFileDownloader::startNextDownloadInBackground()
 
 void rtFileDownloader::raiseDownloadPriority(rtFileDownloadRequest* downloadRequest)
 {
-  if (downloadRequest != NULL)
+  setDownloadPriority(downloadRequest, RT_DOWNLOAD_PRIORITY_VISIBLE);
+}
+
+// A coalesced waiter is in neither the engine queues nor the pool, so what
+// moves is the transfer it waits on, at the best priority any of its
+// requests asked for
+void rtFileDownloader::setDownloadPriority(rtFileDownloadRequest* downloadRequest, rtFileDownloadPriority priority)
+{
+  if (downloadRequest == NULL)
+  {
+    return;
+  }
+  rtFileDownloadRequest* transfer = downloadRequest;
+  mCoalescedRequestsMutex.lock();
+  rtString key = downloadRequest->coalescingKey();
+  std::map<rtString, rtFileDownloadCoalescedRequests>::iterator it =
+    key.isEmpty() ? mCoalescedRequests.end() : mCoalescedRequests.find(key);
+  if (it != mCoalescedRequests.end() && it->second.owner != NULL)
+  {
+    if (it->second.owner == downloadRequest)
+    {
+      it->second.ownerPriority = priority;
+    }
+    else
+    {
+      downloadRequest->setDownloadPriority(priority);
+    }
+    transfer = it->second.owner;
+    priority = coalescedPriority(it->second);
+  }
+  // under the lock: the owner is only freed after it has left the map
+  applyDownloadPriority(transfer, priority);
+  mCoalescedRequestsMutex.unlock();
+}
+
+// caller holds mCoalescedRequestsMutex
+rtFileDownloadPriority rtFileDownloader::coalescedPriority(const rtFileDownloadCoalescedRequests& coalesced)
+{
+  rtFileDownloadPriority priority = coalesced.ownerPriority;
+  for (std::vector<rtFileDownloadRequest*>::const_iterator it = coalesced.waiters.begin(); it != coalesced.waiters.end(); ++it)
+  {
+    if (!(*it)->isCanceled() && (*it)->downloadPriority() < priority)
+    {
+      priority = (*it)->downloadPriority();
+    }
+  }
+  return priority;
+}
+
+void rtFileDownloader::applyDownloadPriority(rtFileDownloadRequest* downloadRequest, rtFileDownloadPriority priority)
+{
+#ifdef PX_MULTI_DOWNLOADS
+  if (mDownloadEngine != NULL)
+  {
+    if (!mDownloadEngine->reprioritize(downloadRequest, priority))
+    {
+      return;
+    }
+  }
+  else
+#endif //PX_MULTI_DOWNLOADS
   {
-    rtThreadPool *mainThreadPool = rtThreadPool::globalInstance();
-    mainThreadPool->raisePriority(downloadRequest->fileUrl());
+    if (downloadRequest->downloadPriority() == priority)
+    {
+      return;
+    }
+    downloadRequest->setDownloadPriority(priority);
   }
+  // the pool task checks the cache before the transfer is queued
+  rtThreadPool *mainThreadPool = rtThreadPool::globalInstance();
+  mainThreadPool->setPriority(downloadRequest->fileUrl(), threadPriority(priority));
 }
 
 void rtFileDownloader::removeDownloadRequest(rtFileDownloadRequest* downloadRequest)
@@ -643,7 +1847,7 @@ void rtFileDownloader::clearFileCache()
     //todo
 }
 
-void rtFileDownloader::downloadFile(rtFileDownloadRequest* downloadRequest)
+void rtFileDownloader::downloadFile(rtFileDownloadRequest* downloadRequest, bool useDownloadEngine)
 {
   bool isRequestCanceled = downloadRequest->isCanceled();
   if (isRequestCanceled)
@@ -652,13 +1856,7 @@ void rtFileDownloader::downloadFile(rtFileDownloadRequest* downloadRequest)
     downloadRequest->setDownloadedData(NULL, 0);
     downloadRequest->setDownloadStatusCode(-1);
     downloadRequest->setErrorString("canceled request");
-    if (!downloadRequest->executeCallback(downloadRequest->downloadStatusCode()))
-    {
-      if (mDefaultCallbackFunction != NULL)
-      {
-        (*mDefaultCallbackFunction)(downloadRequest);
-      }
-    }
+    notifyDownloadComplete(downloadRequest);
     clearFileDownloadRequest(downloadRequest);
     return;
   }
@@ -683,77 +1881,44 @@ void rtFileDownloader::downloadFile(rtFileDownloadRequest* downloadRequest)
     {
         if(downloadRequest->deferCacheRead())
         {
-            mFileCacheMutex.lock();
-            FILE *fp = downloadRequest->cacheFilePointer();
-
-            if(fp != NULL)
+            // The contents are streamed to the progress callback straight
+            // from the mapped cache file, in the chunk size asked for
+            static char invalidData[8] = "Invalid";
+            rtData& contents = cachedData.contentsData();
+            size_t chunkSize = downloadRequest->getCachedFileReadSize();
+            if (chunkSize == 0)
+                chunkSize = contents.length();
+            for (size_t offset = 0; offset < contents.length(); offset += chunkSize)
             {
-                char* buffer = new char[downloadRequest->getCachedFileReadSize()];
-                size_t bytesCount = 0;
-                size_t dataSize = 0;                
-				char invalidData[8] = "Invalid";
-
-                // The cahced file has expiration value ends with | delimeter.
-                while ( !feof(fp) )
-                {
-                    dataSize++;
-                    if (fgetc(fp) == '|')
-                        break;
-                }
-                while (!feof(fp))
-                {
-                    memset(buffer, 0, downloadRequest->getCachedFileReadSize());
-                    bytesCount = fread(buffer, 1, downloadRequest->getCachedFileReadSize(), fp);
-                    dataSize += bytesCount;
-                    downloadRequest->executeDownloadProgressCallback((unsigned char*)buffer, bytesCount, 1 );
-                }
-                // For deferCacheRead, the user requires the downloadedDataSize but not the data.
-                downloadRequest->setDownloadedData( invalidData, dataSize);
-                delete [] buffer;
-                fclose(fp);
+                size_t bytesCount = std::min(chunkSize, (size_t)contents.length() - offset);
+                downloadRequest->executeDownloadProgressCallback(contents.data() + offset, bytesCount, 1 );
             }
-            mFileCacheMutex.unlock();
+            // For deferCacheRead, the user requires the downloadedDataSize but not the data.
+            downloadRequest->setDownloadedData( invalidData, contents.length());
         }
     }
     else
 #endif
     {
+#ifdef PX_MULTI_DOWNLOADS
+      if (useDownloadEngine && mDownloadEngine != NULL && mDownloadEngine->addRequest(downloadRequest))
+      {
+        return;
+      }
+#else
+      (void)useDownloadEngine;
+#endif //PX_MULTI_DOWNLOADS
       nwDownloadSuccess = downloadFromNetwork(downloadRequest);
     }    
     
-    if (!downloadRequest->executeCallback(downloadRequest->downloadStatusCode()))
-    {
-      if (mDefaultCallbackFunction != NULL)
-      {
-        (*mDefaultCallbackFunction)(downloadRequest);
-      }
-    }
+#ifdef ENABLE_HTTP_CACHE
+    rtHttpCacheData* downloadedData = nwDownloadSuccess ? cacheDataForDownload(downloadRequest) : NULL;
+#endif
+    notifyDownloadComplete(downloadRequest);
 
 #ifdef ENABLE_HTTP_CACHE
     // Store the network data in cache
-    if ((true == nwDownloadSuccess) &&
-        (true == downloadRequest->cacheEnabled())  &&
-        (downloadRequest->httpStatusCode() != 206) &&
-        (downloadRequest->httpStatusCode() != 302) &&
-        (downloadRequest->httpStatusCode() != 307))
-    {
-      rtHttpCacheData downloadedData(downloadRequest->fileUrl(),
-                                     downloadRequest->headerData(),
-                                     downloadRequest->downloadedData(),
-                                     downloadRequest->downloadedDataSize());
-
-      if (downloadedData.isWritableToCache())
-      {
-        mFileCacheMutex.lock();
-        if (NULL == rtFileCache::instance())
-          rtLogWarn("cache data not added");
-        else
-        {
-          rtFileCache::instance()->addToCache(downloadedData);
-        }
-        mFileCacheMutex.unlock();
-      }
-    }
+    addDownloadToCache(downloadedData);
 
     // Store the updated data in cache
     if ((true == isDataInCache) && (cachedData.isUpdated()))
@@ -766,206 +1931,300 @@ void rtFileDownloader::downloadFile(rtFileDownloadRequest* downloadRequest)
           rtLogWarn("Adding url to cache failed (%s) due to in-process memory issues", url.cString());
       rtFileCache::instance()->removeData(url);
       mFileCacheMutex.unlock();
-      if (cachedData.isWritableToCache())
-      {
-        mFileCacheMutex.lock();
-        rtError err = rtFileCache::instance()->addToCache(cachedData);
-        if (RT_OK != err)
-          rtLogWarn("Adding url to cache failed (%s)", url.cString());
-        
-        mFileCacheMutex.unlock();
-      }
+      const char* headerData = (const char*)cachedData.headerData().data();
+      rtHttpCacheData* updatedData = new rtHttpCacheData(url.cString(),
+                                                         (NULL != headerData) ? headerData : "",
+                                                         (const char*)cachedData.contentsData().data(),
+                                                         cachedData.contentsData().length());
+      if (updatedData->isWritableToCache())
+        addDownloadToCache(updatedData);
+      else
+        delete updatedData;
     }
 
     if (true == isDataInCache)
     {
+      rtData released;
       downloadRequest->setHeaderData(NULL,0);
       downloadRequest->setDownloadedData(NULL,0);
+      downloadRequest->setCachedData(released);
     }
 #endif
     clearFileDownloadRequest(downloadRequest);
 }
 
-bool rtFileDownloader::downloadFromNetwork(rtFileDownloadRequest* downloadRequest)
+void rtFileDownloader::finishDownload(rtFileDownloadRequest* downloadRequest, bool nwDownloadSuccess)
 {
-    CURL *curl_handle = NULL;
-    CURLcode res = CURLE_OK;
-    char errorBuffer[CURL_ERROR_SIZE];
-
-    bool useProxy = !downloadRequest->proxy().isEmpty();
-    rtString proxyServer = downloadRequest->proxy();
-    bool headerOnly = downloadRequest->headerOnly();
-    MemoryStruct chunk;
+#ifdef ENABLE_HTTP_CACHE
+  rtHttpCacheData* downloadedData = nwDownloadSuccess ? cacheDataForDownload(downloadRequest) : NULL;
+#else
+  (void)nwDownloadSuccess;
+#endif
+  notifyDownloadComplete(downloadRequest);
+#ifdef ENABLE_HTTP_CACHE
+  addDownloadToCache(downloadedData);
+#endif
+  clearFileDownloadRequest(downloadRequest);
+}
 
-    rtString method = downloadRequest->method();
-    size_t readDataSize = downloadRequest->readData().byteLength();
+void rtFileDownloader::notifyDownloadComplete(rtFileDownloadRequest* downloadRequest)
+{
+  // the waiters get their copies before the callback can take the data
+  std::vector<rtFileDownloadRequest*> waiters;
+  detachCoalescedRequests(downloadRequest, waiters);
 
-    curl_handle = rtFileDownloader::instance()->retrieveDownloadHandle();
-    curl_easy_reset(curl_handle);
-    /* specify URL to get */
-    curl_easy_setopt(curl_handle, CURLOPT_URL, downloadRequest->fileUrl().cString());
-    curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1); //when redirected, follow the redirections
-    curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, HeaderCallback);
-    curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)&chunk);
-    if (false == headerOnly)
+  if (!downloadRequest->executeCallback(downloadRequest->downloadStatusCode()))
+  {
+    if (mDefaultCallbackFunction != NULL)
     {
-      chunk.downloadRequest = downloadRequest;
-      curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-      curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
+      (*mDefaultCallbackFunction)(downloadRequest);
     }
+  }
 
-    if(downloadRequest->isCurlDefaultTimeoutSet() == false)
+  for (vector<rtFileDownloadRequest*>::iterator it = waiters.begin(); it != waiters.end(); ++it)
+  {
+    if (!(*it)->executeCallback((*it)->downloadStatusCode()))
     {
-    curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, kCurlTimeoutInSeconds);
+      if (mDefaultCallbackFunction != NULL)
+      {
+        (*mDefaultCallbackFunction)(*it);
+      }
     }
-    curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1L);
+    clearFileDownloadRequest(*it);
+  }
+}
 
-    if(downloadRequest->isProgressMeterSwitchOff())
-        curl_easy_setopt(curl_handle, CURLOPT_NOPROGRESS, 1);
+static char* copyDownloadBuffer(const char* data, size_t size)
+{
+  char* copy = (char*)malloc(size + 1);
+  if (copy != NULL)
+  {
+    memcpy(copy, data, size);
+    copy[size] = 0;
+  }
+  return copy;
+}
 
-    if(downloadRequest->isHTTPFailOnError())
-    {
-        memset(errorBuffer, 0, sizeof(errorBuffer));
-        curl_easy_setopt(curl_handle, CURLOPT_FAILONERROR, 1);
-        curl_easy_setopt(curl_handle, CURLOPT_VERBOSE, 1);
-        curl_easy_setopt(curl_handle, CURLOPT_ERRORBUFFER, errorBuffer);
-    }
-#if !defined(PX_PLATFORM_GENERIC_DFB) && !defined(PX_PLATFORM_DFB_NON_X11)
-    curl_easy_setopt(curl_handle, CURLOPT_TCP_KEEPALIVE, 1);
-    curl_easy_setopt(curl_handle, CURLOPT_TCP_KEEPIDLE, 60);
-    curl_easy_setopt(curl_handle, CURLOPT_TCP_KEEPINTVL, 30);
-#endif //!PX_PLATFORM_GENERIC_DFB && !PX_PLATFORM_DFB_NON_X11
+bool rtFileDownloader::coalescingKey(rtFileDownloadRequest* downloadRequest, rtString& key)
+{
+  // requests that send a body or need the transfer's callbacks for
+  // themselves get a transfer of their own.  Stream consumers share one
+  // as long as the body is collected for the waiters.
+  if (downloadRequest->readData().byteLength() > 0 ||
+      downloadRequest->hasDownloadProgressCallback() ||
+      !downloadRequest->collectsDownloadedData() ||
+      downloadRequest->useCallbackDataSize())
+  {
+    return false;
+  }
+#ifdef ENABLE_HTTP_CACHE
+  if (downloadRequest->deferCacheRead())
+  {
+    return false;
+  }
+#endif
 
-    double downloadHandleExpiresTime = downloadRequest->downloadHandleExpiresTime();
+  rtString method = downloadRequest->method();
+  key = method.isEmpty() ? rtString("GET") : method;
+  key.append(" ");
+  key.append(downloadRequest->fileUrl().cString());
+  key.append(downloadRequest->headerOnly() ? "\nheader-only" : "");
+  key.append(downloadRequest->isHTTPFailOnError() ? "\nfail-on-error" : "");
+#ifdef ENABLE_HTTP_CACHE
+  key.append(downloadRequest->cacheEnabled() ? "\ncache" : "");
+#endif
+  if (!downloadRequest->proxy().isEmpty())
+  {
+    key.append("\nproxy: ");
+    key.append(downloadRequest->proxy().cString());
+  }
 
-    vector<rtString>& additionalHttpHeaders = downloadRequest->additionalHttpHeaders();
-    struct curl_slist *list = NULL;
-    for (unsigned int headerOption = 0;headerOption < additionalHttpHeaders.size();headerOption++)
+  // the headers as they would be sent, including the CORS origin
+  struct curl_slist *list = NULL;
+  vector<rtString>& additionalHttpHeaders = downloadRequest->additionalHttpHeaders();
+  for (unsigned int headerOption = 0;headerOption < additionalHttpHeaders.size();headerOption++)
+  {
+    list = curl_slist_append(list, additionalHttpHeaders[headerOption].cString());
+  }
+  if (downloadRequest->cors() != NULL)
+  {
+    key.append("\ncors");
+    downloadRequest->cors()->updateRequestForAccessControl(&list);
+  }
+  for (struct curl_slist* header = list; header != NULL; header = header->next)
+  {
+    key.append("\n");
+    key.append(header->data);
+  }
+  curl_slist_free_all(list);
+  return true;
+}
+
+bool rtFileDownloader::coalesceDownloadRequest(rtFileDownloadRequest* downloadRequest)
+{
+  rtString key;
+  if (!coalescingKey(downloadRequest, key))
+  {
+    return false;
+  }
+  downloadRequest->setCoalescingKey(key);
+
+  bool coalesced = false;
+  mCoalescedRequestsMutex.lock();
+  std::map<rtString, rtFileDownloadCoalescedRequests>::iterator it = mCoalescedRequests.find(key);
+  if (it != mCoalescedRequests.end())
+  {
+    if (it->second.streamStarted)
     {
-      list = curl_slist_append(list, additionalHttpHeaders[headerOption].cString());
+      // the consumer decodes the collected body when it completes instead
+      downloadRequest->setStreamConsumer(NULL);
     }
-    if (downloadRequest->cors() != NULL)
-      downloadRequest->cors()->updateRequestForAccessControl(&list);
-    if (readDataSize > 0)
+    it->second.waiters.push_back(downloadRequest);
+    coalesced = true;
+    // a visible request joining a prefetch does not wait at prefetch priority
+    rtFileDownloadPriority priority = coalescedPriority(it->second);
+    if (it->second.owner != NULL && priority < it->second.owner->downloadPriority())
     {
-      list = curl_slist_append(list, "Expect:");
+      applyDownloadPriority(it->second.owner, priority);
     }
-    curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, list);
-    //CA certificates
-    // !CLF: Use system CA Cert rather than CA_CERTIFICATE fo now.  Revisit!
-    //curl_easy_setopt(curl_handle,CURLOPT_CAINFO,mCaCertFile.cString());
-    curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYHOST, 2);
-    curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYPEER, true);
-
-    /* some servers don't like requests that are made without a user-agent
-     field, so we provide one */
-    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+  }
+  else
+  {
+    rtFileDownloadCoalescedRequests& transfer = mCoalescedRequests[key];
+    transfer.owner = downloadRequest;
+    transfer.ownerPriority = downloadRequest->downloadPriority();
+  }
+  mCoalescedRequestsMutex.unlock();
+  return coalesced;
+}
 
-    if (useProxy)
+void rtFileDownloader::detachCoalescedRequests(rtFileDownloadRequest* downloadRequest, std::vector<rtFileDownloadRequest*>& waiters)
+{
+  rtString key = downloadRequest->coalescingKey();
+  if (key.isEmpty())
+  {
+    return;
+  }
+  downloadRequest->setCoalescingKey(rtString());
 
+  rtFileDownloadRequest* nextRequest = NULL;
+  bool transferCanceled = downloadRequest->isCanceled() && downloadRequest->downloadStatusCode() == -1;
+  mCoalescedRequestsMutex.lock();
+  std::map<rtString, rtFileDownloadCoalescedRequests>::iterator it = mCoalescedRequests.find(key);
+  if (it != mCoalescedRequests.end())
+  {
+    if (transferCanceled)
     {
-        curl_easy_setopt(curl_handle, CURLOPT_PROXY, proxyServer.cString());
-        curl_easy_setopt(curl_handle, CURLOPT_PROXYTYPE, CURLPROXY_HTTP);
-    }
-    else
-    {
-      curl_easy_setopt(curl_handle, CURLOPT_PROXY, "");
+      // the first waiter that still wants the data starts a new transfer
+      // and the others stay attached to it
+      for (vector<rtFileDownloadRequest*>::iterator w = it->second.waiters.begin(); w != it->second.waiters.end(); ++w)
+      {
+        if (!(*w)->isCanceled())
+        {
+          nextRequest = *w;
+          it->second.waiters.erase(w);
+          break;
+        }
+      }
     }
-
-    if (true == headerOnly)
+    if (nextRequest != NULL && it->second.streamStarted)
     {
-      curl_easy_setopt(curl_handle, CURLOPT_NOBODY, 1);
+      // the consumers saw part of the canceled body; the new transfer
+      // starts over, so they get the collected body instead
+      nextRequest->setStreamConsumer(NULL);
+      for (vector<rtFileDownloadRequest*>::iterator w = it->second.waiters.begin(); w != it->second.waiters.end(); ++w)
+      {
+        (*w)->setStreamConsumer(NULL);
+      }
+      it->second.streamStarted = false;
     }
-
-    if (!method.isEmpty() && method.compare("GET") != 0)
+    if (nextRequest != NULL)
     {
-      if (method.compare("POST") == 0)
-        curl_easy_setopt(curl_handle, CURLOPT_POST, 1L);
-      else if (method.compare("PUT") == 0)
-        curl_easy_setopt(curl_handle, CURLOPT_UPLOAD, 1L);
-      else
-        curl_easy_setopt(curl_handle, CURLOPT_CUSTOMREQUEST, method.cString());
+      it->second.owner = nextRequest;
+      it->second.ownerPriority = nextRequest->downloadPriority();
+      // not queued yet, so it can start at the best priority directly
+      nextRequest->setDownloadPriority(coalescedPriority(it->second));
     }
-
-    if (readDataSize > 0)
+    else
     {
-      chunk.downloadRequest = downloadRequest;
-      curl_easy_setopt(curl_handle, CURLOPT_READFUNCTION, ReadMemoryCallback);
-      curl_easy_setopt(curl_handle, CURLOPT_READDATA, (void *)&chunk);
-      curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDSIZE, readDataSize);
+      waiters.swap(it->second.waiters);
+      mCoalescedRequests.erase(it);
     }
+  }
+  mCoalescedRequestsMutex.unlock();
 
-    /* get it! */
-    res = curl_easy_perform(curl_handle);
-    curl_slist_free_all(list);
-
-    downloadRequest->setDownloadStatusCode(res);
-    if(downloadRequest->isHTTPFailOnError())
-        downloadRequest->setHTTPError(errorBuffer);
+  if (nextRequest != NULL)
+  {
+    rtLogDebug("restarting canceled download for %s", nextRequest->fileUrl().cString());
+    downloadFileInBackground(nextRequest);
+    return;
+  }
 
-    /* check for errors */
-    if (res != CURLE_OK)
+  for (vector<rtFileDownloadRequest*>::iterator it = waiters.begin(); it != waiters.end(); ++it)
+  {
+    rtFileDownloadRequest* waiter = *it;
+    waiter->setCoalescingKey(rtString());
+    if (waiter->isCanceled())
     {
-        rtString proxyMessage("Using proxy:"); 
-        if (useProxy)
-        {
-          proxyMessage.append("true - ");
-          proxyMessage.append(proxyServer.cString());
-        }
-        else
-        {
-          proxyMessage.append("false ");
-        }
-        char errorMessage[MAX_URL_SIZE+400];
-        memset(errorMessage, 0, sizeof(errorMessage));
-        sprintf(errorMessage, "Download error for:%s. Error code:%d. %s",downloadRequest->fileUrl().cString(), res, proxyMessage.cString());
-        downloadRequest->setErrorString(errorMessage);
-        rtFileDownloader::instance()->releaseDownloadHandle(curl_handle, downloadHandleExpiresTime);
-
-        //clean up contents on error
-        if (chunk.contentsBuffer != NULL)
-        {
-            free(chunk.contentsBuffer);
-            chunk.contentsBuffer = NULL;
-        }
-
-        if (chunk.headerBuffer != NULL)
-        {
-            free(chunk.headerBuffer);
-            chunk.headerBuffer = NULL;
-        }
-        downloadRequest->setDownloadedData(NULL, 0);
-        return false;
+      waiter->setDownloadedData(NULL, 0);
+      waiter->setDownloadStatusCode(-1);
+      waiter->setErrorString("canceled request");
+      continue;
     }
-
-    long httpCode = -1;
-    if (curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &httpCode) == CURLE_OK)
+    waiter->setDownloadStatusCode(downloadRequest->downloadStatusCode());
+    waiter->setHttpStatusCode(downloadRequest->httpStatusCode());
+    waiter->setErrorString(downloadRequest->errorString().cString());
+    waiter->setHTTPError(downloadRequest->httpErrorBuffer());
+#ifdef ENABLE_HTTP_CACHE
+    waiter->setDataQueuedForCache(downloadRequest->isDataQueuedForCache());
+#endif
+    if (downloadRequest->headerData() != NULL)
     {
-        downloadRequest->setHttpStatusCode(httpCode);
+      waiter->setHeaderData(copyDownloadBuffer(downloadRequest->headerData(), downloadRequest->headerDataSize()),
+                            downloadRequest->headerDataSize());
     }
-    rtFileDownloader::instance()->releaseDownloadHandle(curl_handle, downloadHandleExpiresTime);
-
-    //todo read the header information before closing
-    if (chunk.headerBuffer != NULL)
+    if (downloadRequest->downloadedData() != NULL)
     {
-        downloadRequest->setHeaderData(chunk.headerBuffer, chunk.headerSize);
+      waiter->setDownloadedData(copyDownloadBuffer(downloadRequest->downloadedData(), downloadRequest->downloadedDataSize()),
+                                downloadRequest->downloadedDataSize());
     }
+  }
+}
 
-    //don't free the downloaded data (contentsBuffer) because it will be used later
-    if (false == headerOnly)
-    {
-      downloadRequest->setDownloadedData(chunk.contentsBuffer, chunk.contentsSize);
-    }
-    else if (chunk.contentsBuffer != NULL)
+// Holding the lock keeps the waiters alive, since they are only completed
+// after they have been detached from the transfer
+void rtFileDownloader::streamToCoalescedRequests(rtFileDownloadRequest* downloadRequest, const char* data, size_t size)
+{
+  mCoalescedRequestsMutex.lock();
+  std::map<rtString, rtFileDownloadCoalescedRequests>::iterator it = mCoalescedRequests.find(downloadRequest->coalescingKey());
+  if (it != mCoalescedRequests.end() && it->second.owner == downloadRequest)
+  {
+    it->second.streamStarted = true;
+    for (vector<rtFileDownloadRequest*>::iterator w = it->second.waiters.begin(); w != it->second.waiters.end(); ++w)
     {
-        free(chunk.contentsBuffer);
-        chunk.contentsBuffer = NULL;
+      rtFileDownloadStreamConsumer* streamConsumer = (*w)->streamConsumer();
+      if (streamConsumer != NULL && !(*w)->isCanceled())
+      {
+        streamConsumer->onDownloadData(*w, data, size);
+      }
     }
-    chunk.headerBuffer = NULL;
-    chunk.contentsBuffer = NULL;
-    if (downloadRequest->cors() != NULL)
-      downloadRequest->cors()->updateResponseForAccessControl(downloadRequest);
-    return true;
+  }
+  mCoalescedRequestsMutex.unlock();
+}
+
+bool rtFileDownloader::downloadFromNetwork(rtFileDownloadRequest* downloadRequest)
+{
+    rtFileDownloadTransfer transfer(downloadRequest);
+
+    transfer.curlHandle = rtFileDownloader::instance()->retrieveDownloadHandle();
+    curl_easy_reset(transfer.curlHandle);
+    setupTransfer(transfer);
+
+    /* get it! */
+    CURLcode res = curl_easy_perform(transfer.curlHandle);
+    bool success = completeTransfer(transfer, res);
+    rtFileDownloader::instance()->releaseDownloadHandle(transfer.curlHandle, downloadRequest->downloadHandleExpiresTime());
+    return success;
 }
 
 #ifdef ENABLE_HTTP_CACHE
@@ -986,8 +2245,11 @@ bool rtFileDownloader::checkAndDownloadFromCache(rtFileDownloadRequest* download
       return false;
     }
 
+    // the contents stay in the mapped cache file; the request points into
+    // it and keeps a view for consumers that hold on to the data
     downloadRequest->setHeaderData((char *)cachedData.headerData().data(),cachedData.headerData().length());
     downloadRequest->setDownloadedData((char *)cachedData.contentsData().data(),cachedData.contentsData().length());
+    downloadRequest->setCachedData(cachedData.contentsData());
     downloadRequest->setDownloadStatusCode(0);
     downloadRequest->setHttpStatusCode(200);
     mFileCacheMutex.unlock();
@@ -996,6 +2258,68 @@ bool rtFileDownloader::checkAndDownloadFromCache(rtFileDownloadRequest* download
   mFileCacheMutex.unlock();
   return false;
 }
+
+// The cache copy of a network download is taken before the callback runs,
+// since the callback may take the data over
+rtHttpCacheData* rtFileDownloader::cacheDataForDownload(rtFileDownloadRequest* downloadRequest)
+{
+  if ((true == downloadRequest->cacheEnabled())  &&
+      (true == downloadRequest->collectsDownloadedData()) &&
+      (downloadRequest->httpStatusCode() != 206) &&
+      (downloadRequest->httpStatusCode() != 302) &&
+      (downloadRequest->httpStatusCode() != 307))
+  {
+    rtHttpCacheData* downloadedData = new rtHttpCacheData(downloadRequest->fileUrl(),
+                                                          downloadRequest->headerData(),
+                                                          downloadRequest->downloadedData(),
+                                                          downloadRequest->downloadedDataSize());
+    if (!downloadedData->isWritableToCache())
+    {
+      delete downloadedData;
+      return NULL;
+    }
+    // lets the callback know the bytes can be read back from the cache later
+    downloadRequest->setDataQueuedForCache(true);
+    return downloadedData;
+  }
+  return NULL;
+}
+
+void rtFileDownloader::addDownloadToCache(rtHttpCacheData* downloadedData)
+{
+  if (downloadedData == NULL)
+  {
+    return;
+  }
+  // writing the file, and any eviction that makes room for it, is
+  // housekeeping: it waits behind downloads and decodes on the pool rather
+  // than holding up the thread that finished the download
+  rtThreadTask* task = new rtThreadTask(addToCacheInBackground, (void*)downloadedData, "", RT_THREAD_PRIORITY_LOW);
+  task->setCancelFunction(releaseCacheData);
+  rtThreadPool::globalInstance()->executeTask(task);
+}
+
+void rtFileDownloader::addToCacheInBackground(void* data)
+{
+  rtHttpCacheData* cacheData = (rtHttpCacheData*)data;
+  rtFileDownloader* downloader = rtFileDownloader::instance();
+  downloader->mFileCacheMutex.lock();
+  if (NULL == rtFileCache::instance())
+    rtLogWarn("cache data not added");
+  else if (RT_OK != rtFileCache::instance()->addToCache(*cacheData))
+  {
+    rtString url;
+    cacheData->url(url);
+    rtLogWarn("Adding url to cache failed (%s)", url.cString());
+  }
+  downloader->mFileCacheMutex.unlock();
+  delete cacheData;
+}
+
+void rtFileDownloader::releaseCacheData(void* data)
+{
+  delete (rtHttpCacheData*)data;
+}
 #endif
 
 void rtFileDownloader::downloadFileInBackground(rtFileDownloadRequest* downloadRequest)
@@ -1007,7 +2331,8 @@ void rtFileDownloader::downloadFileInBackground(rtFileDownloadRequest* downloadR
       downloadRequest->setDownloadHandleExpiresTime(kDefaultDownloadHandleExpiresTime);
     }
 
-    rtThreadTask* task = new rtThreadTask(startFileDownloadInBackground, (void*)downloadRequest, downloadRequest->fileUrl());
+    rtThreadTask* task = new rtThreadTask(startFileDownloadInBackground, (void*)downloadRequest, downloadRequest->fileUrl(),
+                                          threadPriority(downloadRequest->downloadPriority()));
 
     mainThreadPool->executeTask(task);
 }
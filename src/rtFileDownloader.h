@@ -31,6 +31,8 @@
 // TODO Eliminate std::string
 #include <string.h>
 #include <vector>
+#include <map>
+#include <atomic>
 
 #if !defined(WIN32) && !defined(ENABLE_DFB)
 #pragma GCC diagnostic push
@@ -43,6 +45,36 @@
 #pragma GCC diagnostic pop
 #endif
 
+#if defined(__linux__) && !defined(PX_DISABLE_MULTI_DOWNLOADS)
+// background downloads share one curl multi I/O thread
+#define PX_MULTI_DOWNLOADS
+#endif
+
+class rtFileDownloadRequest;
+
+// Scheduling hint for a pending download, usually set by the scene from
+// where the content that needs it is drawn.  Pending downloads of a higher
+// priority are always started first.
+enum rtFileDownloadPriority
+{
+  RT_DOWNLOAD_PRIORITY_VISIBLE = 0,   // on screen now
+  RT_DOWNLOAD_PRIORITY_NEAR,          // close to the viewport, or no hint yet
+  RT_DOWNLOAD_PRIORITY_PREFETCH,      // not drawn
+  RT_DOWNLOAD_PRIORITY_COUNT
+};
+
+// Receives the response body of a download while it arrives.
+// onDownloadData() is called on the download thread for each chunk, so a
+// consumer can start work on the data before the transfer has finished.
+// It runs on the thread that drives every other transfer, so consumers
+// should copy the chunk and do the work elsewhere.
+class rtFileDownloadStreamConsumer
+{
+public:
+  virtual ~rtFileDownloadStreamConsumer() {}
+  virtual void onDownloadData(rtFileDownloadRequest* downloadRequest, const char* data, size_t size) = 0;
+};
+
 class rtFileDownloadRequest
 {
 public:
@@ -64,6 +96,11 @@ public:
   size_t executeDownloadProgressCallback(void *ptr, size_t size, size_t nmemb);
   void setDownloadedData(char* data, size_t size);
   void downloadedData(char*& data, size_t& size);
+  // Hands the malloc'ed data over to the caller, who must free() it.
+  // Returns false, keeping the data, if the request does not own it.
+  bool takeDownloadedData(char*& data, size_t& size);
+  void setDownloadBytesCopied(size_t bytesCopied);
+  size_t downloadBytesCopied();
   char* downloadedData();
   size_t downloadedDataSize();
   void setHeaderData(char* data, size_t size);
@@ -84,11 +121,18 @@ public:
   bool cacheEnabled();
   void setDataIsCached(bool val);
   bool isDataCached();
+  void setDataQueuedForCache(bool val);
+  bool isDataQueuedForCache();
   size_t getCachedFileReadSize(void);
   void setCachedFileReadSize(size_t cachedFileReadSize);
   void setDeferCacheRead(bool val);
   bool deferCacheRead();
-  FILE* cacheFilePointer(void);
+  // Shares the contents read from the cache as a view of the mapped cache
+  // file, so they can be kept past the callback without copying.  Returns
+  // false if the data did not come from a cache file.  Setting data that is
+  // not a view drops it.
+  bool cachedData(rtData& data);
+  void setCachedData(rtData& data);
 #endif //ENABLE_HTTP_CACHE
   void setProgressMeter(bool val);
   bool isProgressMeterSwitchOff();
@@ -108,6 +152,20 @@ public:
   rtString method() const;
   void setReadData(const rtString& val);
   rtString readData() const;
+  bool hasDownloadProgressCallback();
+  // Feeds the body to consumer as it arrives.  Unless collectData is set
+  // the body is not kept, downloadedDataSize() stays 0 and the response is
+  // not added to the cache.  Responses read from the cache are not
+  // streamed.
+  void setStreamConsumer(rtFileDownloadStreamConsumer* consumer, bool collectData = true);
+  rtFileDownloadStreamConsumer* streamConsumer();
+  bool collectsDownloadedData();
+  void setCoalescingKey(const rtString& key);
+  rtString coalescingKey() const;
+  // Use rtFileDownloader::setDownloadPriority() to change the priority of
+  // a request that has been queued
+  void setDownloadPriority(rtFileDownloadPriority priority);
+  rtFileDownloadPriority downloadPriority() const;
 
 private:
   rtString mFileUrl;
@@ -130,8 +188,10 @@ private:
 #ifdef ENABLE_HTTP_CACHE
   bool mCacheEnabled;
   bool mIsDataInCache;
+  bool mIsDataQueuedForCache;
   bool mDeferCacheRead;
   size_t mCachedFileReadSize;
+  rtData mCachedData;
 #endif //ENABLE_HTTP_CACHE
   bool mIsProgressMeterSwitchOff;
   bool mHTTPFailOnError;
@@ -143,6 +203,11 @@ private:
   rtMutex mCanceledMutex;
   rtString mMethod;
   rtString mReadData;
+  rtString mCoalescingKey;
+  size_t mDownloadBytesCopied;
+  rtFileDownloadStreamConsumer* mStreamConsumer;
+  bool mCollectDownloadedData;
+  std::atomic<int> mDownloadPriority;
 };
 
 struct rtFileDownloadHandle
@@ -153,6 +218,20 @@ struct rtFileDownloadHandle
   double expiresTime;
 };
 
+// A transfer in flight and the requests waiting on it
+struct rtFileDownloadCoalescedRequests
+{
+  rtFileDownloadCoalescedRequests() : owner(NULL), ownerPriority(RT_DOWNLOAD_PRIORITY_NEAR), waiters(), streamStarted(false) {}
+  rtFileDownloadRequest* owner;
+  // what the owner itself asked for; waiters can only raise the transfer
+  rtFileDownloadPriority ownerPriority;
+  std::vector<rtFileDownloadRequest*> waiters;
+  // once the body has started, a waiter joining it cannot stream it
+  bool streamStarted;
+};
+
+class rtFileDownloadEngine;
+
 class rtFileDownloader
 {
 public:
@@ -164,13 +243,29 @@ public:
 
     virtual bool addToDownloadQueue(rtFileDownloadRequest* downloadRequest);
     virtual void raiseDownloadPriority(rtFileDownloadRequest* downloadRequest);
+    // Thread safe.  Moves a request that has not started its transfer yet
+    // to the pending downloads of the new priority.
+    virtual void setDownloadPriority(rtFileDownloadRequest* downloadRequest, rtFileDownloadPriority priority);
     virtual void removeDownloadRequest(rtFileDownloadRequest* downloadRequest);
 
     void clearFileCache();
-    void downloadFile(rtFileDownloadRequest* downloadRequest);
+    // With useDownloadEngine set the network transfer is handed to the
+    // download engine if it is running, and the request completes later
+    // from the thread pool through finishDownload()
+    void downloadFile(rtFileDownloadRequest* downloadRequest, bool useDownloadEngine = false);
+    void finishDownload(rtFileDownloadRequest* downloadRequest, bool nwDownloadSuccess);
     void setDefaultCallbackFunction(void (*callbackFunction)(rtFileDownloadRequest*));
     bool downloadFromNetwork(rtFileDownloadRequest* downloadRequest);
     void checkForExpiredHandles();
+    // The download engine runs background transfers on one curl multi I/O
+    // thread ("enableMultiDownloads" setting).  Stopping it completes the
+    // requests it had queued or in flight as canceled before returning;
+    // later downloads run on the thread pool until it is started again.
+    bool startDownloadEngine();
+    void stopDownloadEngine();
+    // Passes a chunk of a coalesced transfer to the stream consumers of
+    // the requests waiting on it.  Called on the download thread.
+    void streamToCoalescedRequests(rtFileDownloadRequest* downloadRequest, const char* data, size_t size);
 
 private:
     rtFileDownloader();
@@ -182,7 +277,17 @@ private:
     void downloadFileInBackground(rtFileDownloadRequest* downloadRequest);
 #ifdef ENABLE_HTTP_CACHE
     bool checkAndDownloadFromCache(rtFileDownloadRequest* downloadRequest,rtHttpCacheData& cachedData);
+    rtHttpCacheData* cacheDataForDownload(rtFileDownloadRequest* downloadRequest);
+    void addDownloadToCache(rtHttpCacheData* downloadedData);
+    static void addToCacheInBackground(void* data);
+    static void releaseCacheData(void* data);
 #endif
+    void notifyDownloadComplete(rtFileDownloadRequest* downloadRequest);
+    bool coalesceDownloadRequest(rtFileDownloadRequest* downloadRequest);
+    void detachCoalescedRequests(rtFileDownloadRequest* downloadRequest, std::vector<rtFileDownloadRequest*>& waiters);
+    static bool coalescingKey(rtFileDownloadRequest* downloadRequest, rtString& key);
+    static rtFileDownloadPriority coalescedPriority(const rtFileDownloadCoalescedRequests& coalesced);
+    void applyDownloadPriority(rtFileDownloadRequest* downloadRequest, rtFileDownloadPriority priority);
     CURL* retrieveDownloadHandle();
     void releaseDownloadHandle(CURL* curlHandle, double expiresTime);
     static void addFileDownloadRequest(rtFileDownloadRequest* downloadRequest);
@@ -197,6 +302,11 @@ private:
     bool mReuseDownloadHandles;
     rtString mCaCertFile;
     rtMutex mFileCacheMutex;
+    rtFileDownloadEngine* mDownloadEngine;
+    // Requests waiting on a transfer already in flight for the same URL,
+    // method and headers.  A key is present while its transfer runs.
+    std::map<rtString, rtFileDownloadCoalescedRequests> mCoalescedRequests;
+    rtMutex mCoalescedRequestsMutex;
     static rtFileDownloader* mInstance;
     static std::vector<rtFileDownloadRequest*>* mDownloadRequestVector;
     static rtMutex* mDownloadRequestVectorMutex;
@@ -73,19 +73,17 @@ extern "C" time_t timegm(struct tm * a_tm)
 }
 #endif
 
-rtHttpCacheData::rtHttpCacheData():mExpirationDate(0),mUpdated(false),mFileName()
+rtHttpCacheData::rtHttpCacheData():mExpirationDate(0),mContentsOffset(0),mContentsLength(0),mUpdated(false),mFileName()
 {
-  fp = NULL;
 }
 
 rtHttpCacheData::rtHttpCacheData(const char* url) :
-     mUrl(url), mExpirationDate(0), mUpdated(false), mFileName()
+     mUrl(url), mExpirationDate(0), mContentsOffset(0), mContentsLength(0), mUpdated(false), mFileName()
 {
-  fp = NULL;
 }
 
 rtHttpCacheData::rtHttpCacheData(const char* url, const char* headerMetadata, const char* data, size_t size) :
-     mUrl(url), mExpirationDate(0), mUpdated(false), mFileName()
+     mUrl(url), mExpirationDate(0), mContentsOffset(0), mContentsLength(0), mUpdated(false), mFileName()
 {
   if ((NULL != headerMetadata) && (NULL != data))
   {
@@ -94,12 +92,10 @@ rtHttpCacheData::rtHttpCacheData(const char* url, const char* headerMetadata, co
     setExpirationDate();
     mData.init((uint8_t *)data,size);
   }
-  fp = NULL;
 }
 
 rtHttpCacheData::~rtHttpCacheData()
 {
-  fp = NULL;
 }
 
 void rtHttpCacheData::populateHeaderMap()
@@ -234,11 +230,9 @@ rtData& rtHttpCacheData::contentsData()
 
 rtError rtHttpCacheData::data(rtData& data)
 {
-  if (NULL == fp)
+  if (0 == mCacheFile.length())
     return RT_ERROR;
 
-  populateExpirationDateFromCache();
-
   if (mHeaderMap.end() != mHeaderMap.find("ETag"))
   {
     rtError res =  handleEtag(data);
@@ -271,7 +265,7 @@ rtError rtHttpCacheData::data(rtData& data)
   if (false == readFileData())
     return RT_ERROR;
 
-  data.init(mData.data(),mData.length());
+  data.initView(mData, 0, mData.length());
 
   if (true == revalidateOnlyHeaders)
   {
@@ -280,6 +274,18 @@ rtError rtHttpCacheData::data(rtData& data)
   return RT_OK;
 }
 
+rtError rtHttpCacheData::storedData(rtData& data)
+{
+  if (0 == mCacheFile.length())
+    return RT_ERROR;
+
+  if (false == readFileData())
+    return RT_ERROR;
+
+  data.initView(mData, 0, mData.length());
+  return RT_OK;
+}
+
 void rtHttpCacheData::setData(rtData& cacheData)
 {
   mData.init(cacheData.data(),cacheData.length());
@@ -287,49 +293,8 @@ void rtHttpCacheData::setData(rtData& cacheData)
 
 rtError rtHttpCacheData::deferCacheRead(rtData& data)
 {
-  if (NULL == fp)
-    return RT_ERROR;
-
-  populateExpirationDateFromCache();
-
-  if (mHeaderMap.end() != mHeaderMap.find("ETag"))
-  {
-    rtError res =  handleEtag(data);
-    if (RT_OK != res)
-      return RT_ERROR;
-    if (mUpdated)
-    {
-      return RT_OK;
-    }
-  }
-
-  bool revalidate =  false;
-  bool revalidateOnlyHeaders = false;
-
-  rtError res;
-  res = calculateRevalidationNeed(revalidate,revalidateOnlyHeaders);
-
-  if (RT_OK != res)
-    return res;
-
-  if (true == revalidate)
-    return performRevalidation(data);
-
-  if (true == revalidateOnlyHeaders)
-  {
-    if (RT_OK != performHeaderRevalidation())
-      return RT_ERROR;
-  }
-
-  char invalidData[8] = "Invalid";
-  mData.init((uint8_t*)invalidData, sizeof(invalidData));
-  data.init(mData.data(), mData.length());
-
-  if (true == revalidateOnlyHeaders)
-  {
-    mUpdated = true; //headers  modified , so rewriting the cache with new header data
-  }
-  return RT_OK;
+  // the contents are mapped rather than read, so there is nothing left to defer
+  return this->data(data);
 }
 
 rtError rtHttpCacheData::url(rtString& url) const
@@ -353,14 +318,17 @@ bool rtHttpCacheData::isUpdated()
   return mUpdated;
 }
 
-void rtHttpCacheData::setFilePointer(FILE* openedDescriptor)
+void rtHttpCacheData::setCacheFile(rtData& file, size_t contentsOffset, size_t contentsLength, time_t expirationDate)
 {
-  fp = openedDescriptor;
+  mCacheFile.initView(file, 0, file.length());
+  mContentsOffset = contentsOffset;
+  mContentsLength = contentsLength;
+  mExpirationDate = expirationDate;
 }
 
-FILE* rtHttpCacheData::filePointer(void)
+rtData& rtHttpCacheData::cacheFile()
 {
-  return fp;
+  return mCacheFile;
 }
 
 void rtHttpCacheData::setFileName(rtString& fileName)
@@ -501,64 +469,14 @@ bool rtHttpCacheData::handleDownloadRequest(vector<rtString>& headers,bool downl
 
 bool rtHttpCacheData::readFileData()
 {
-  char *contentsData = NULL;
-  char* tmp = NULL;
-  char buffer[100];
-  size_t bytesCount = 0;
-  uint32_t totalBytes = 0;
-  while (!feof(fp))
+  if (RT_OK != mData.initView(mCacheFile, mContentsOffset, mContentsLength))
   {
-    bytesCount = fread(buffer,1,100,fp);
-    if (NULL == contentsData)
-      tmp = (char *)malloc(bytesCount);
-    else
-    {
-      tmp = (char *)realloc(contentsData,totalBytes+bytesCount);
-    }
-    if (NULL == tmp)
-    {
-      rtLogError("reading the cache data failed due to memory lack \n");
-      fflush(stdout);
-      fclose(fp);
-      if (NULL != contentsData)
-        free(contentsData);
-      contentsData = NULL;
-      return false;
-    }
-    contentsData = tmp;
-    memcpy(contentsData+totalBytes,buffer,bytesCount);
-    totalBytes += bytesCount;
-    memset(buffer,0,100);
-  }
-  fclose(fp);
-  if (NULL != contentsData)
-  {
-    mData.init((uint8_t*)contentsData,totalBytes);
-    free(contentsData);
-    contentsData = NULL;
-    tmp = NULL;
+    rtLogError("the cache file for %s is shorter than its contents", mUrl.cString());
+    return false;
   }
   return true;
 }
 
-void rtHttpCacheData::populateExpirationDateFromCache()
-{
-  int buf;
-  string date;
-  while ( !feof(fp) )
-  {
-    buf = fgetc(fp);
-    if (buf == '|')
-    {
-      break;
-    }
-    date.append(1,(char)buf);
-  }
-
-  stringstream stream(date);
-  stream >> mExpirationDate;
-}
-
 rtError rtHttpCacheData::performRevalidation(rtData& data)
 {
   rtString headerOption = "Cache-Control: max-age=0";
@@ -575,7 +493,6 @@ rtError rtHttpCacheData::performRevalidation(rtData& data)
     populateHeaderMap();
     setExpirationDate();
     data.init(mData.data(),mData.length());
-    fclose(fp);
     return RT_OK;
   }
   else
@@ -623,7 +540,6 @@ rtError rtHttpCacheData::handleEtag(rtData& data)
       populateHeaderMap();
       setExpirationDate();
       data.init(mData.data(),mData.length());
-      fclose(fp);
     }
   #ifdef PX_ETAG_AVOID_NONSTALE
   }
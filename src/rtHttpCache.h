@@ -56,13 +56,17 @@ class rtHttpCacheData
     /* returns a map of all the headers associated with the cached data */
     rtError attributes(std::map<rtString, rtString>& cacheAttributes);
 
-    /* returns the file data in the cache.  This is a blocking call and will check the network for updated data if etag is used */
+    /* returns the file data in the cache as a view of the mapped cache file, without copying it.  This is a blocking call and will check the network for updated data if etag is used */
     rtError data(rtData& data);
 
+    /* returns the file data as stored in the cache, as a view of the mapped cache file.  Unlike data() it never
+       revalidates, so it does not reach the network; for reloading bytes that were already handed out once */
+    rtError storedData(rtData& data);
+
     /* sets the image file data to be stored in cache */
     void setData(rtData& cacheData);
 
-    /* returns "Invalid" as data, and it will not read data from cache.  This is a blocking call and will check the network for updated data if etag is used */
+    /* same as data(); the mapped contents are streamed by the caller instead of being handed over whole */
     rtError deferCacheRead(rtData& data);
 
     /* returns the url associated with the cache */
@@ -80,9 +84,12 @@ class rtHttpCacheData
     /* returns image data */
     rtData& contentsData();
 
-    void setFilePointer(FILE* fp);
+    /* sets the mapped cache file and where the contents are in it.  The expiration date stored with the file
+       replaces the one worked out from the headers, so this is called after setAttributes() */
+    void setCacheFile(rtData& file, size_t contentsOffset, size_t contentsLength, time_t expirationDate);
 
-    FILE* filePointer(void);
+    /* returns the mapped cache file, empty if the data was not read from the cache */
+    rtData& cacheFile();
 
     void setFileName(rtString& fileName);
 
@@ -99,12 +106,9 @@ class rtHttpCacheData
     /* initiate and handle download */
     bool handleDownloadRequest(std::vector<rtString>& headers,bool downloadBody=true);
 
-    /* read the file data and populate it in mData. returns true on sucess and false on failure/empty data */
+    /* point mData at the contents in the mapped cache file. returns true on sucess and false on failure/empty data */
     bool readFileData();
 
-    /* read the file and populate the previously calculated expiration date */
-    void populateExpirationDateFromCache();
-
     /* perform revalidation of entire response by querying the server and populating new data */
     rtError performRevalidation(rtData& data);
 
@@ -119,7 +123,9 @@ class rtHttpCacheData
     rtData mData;
     std::map<rtString, rtString> mHeaderMap;
     time_t mExpirationDate;
-    FILE* fp;
+    rtData mCacheFile;
+    size_t mContentsOffset;
+    size_t mContentsLength;
     bool mUpdated;
     rtString mFileName;
 
@@ -19,6 +19,7 @@
 // rtObject.cpp
 
 #include "rtObject.h"
+#include "rtFile.h"
 #include <errno.h>
 
 using namespace std;
@@ -760,3 +761,59 @@ rtDefineProperty(rtArrayObject, length);
 
 rtDefineObject(rtMapObject, rtObject);
 
+// rtBufferObject
+const char* rtBufferObject::kIsBufferObject = "3d5f4bb4-5e1b-4c8e-9b43-0f6e2a1d7c21";
+
+rtBufferObject::rtBufferObject(): mData(new rtData())
+{
+}
+
+rtBufferObject::~rtBufferObject()
+{
+  delete mData;
+}
+
+rtBufferObject* rtBufferObject::fromObject(const rtObjectRef& obj)
+{
+  rtValue value;
+  if (!obj || obj->Get(kIsBufferObject, &value) != RT_OK)
+    return NULL;
+  return (rtBufferObject*)value.toVoidPtr();
+}
+
+rtError rtBufferObject::Get(const char* name, rtValue* value) const
+{
+  if (!value)
+    return RT_FAIL;
+  if (!strcmp(name, kIsBufferObject))
+  {
+    value->setVoidPtr((void*)this);
+    return RT_OK;
+  }
+  return rtObject::Get(name, value);
+}
+
+rtError rtBufferObject::Get(uint32_t i, rtValue* value) const
+{
+  if (!value)
+    return RT_FAIL;
+  if (i >= mData->length())
+    return RT_PROP_NOT_FOUND;
+  value->setUInt32(mData->data()[i]);
+  return RT_OK;
+}
+
+rtError rtBufferObject::Set(uint32_t /*i*/, const rtValue* /*value*/)
+{
+  return RT_ERROR_NOT_ALLOWED;
+}
+
+rtError rtBufferObject::length(uint32_t& n) const
+{
+  n = mData->length();
+  return RT_OK;
+}
+
+rtDefineObject(rtBufferObject, rtObject);
+rtDefineProperty(rtBufferObject, length);
+
@@ -768,6 +768,39 @@ private:
   std::vector<rtNamedValue> mProps;
 };
 
+class rtData;
+
+// Read-only view of a block of bytes.  Script reads them by index without a
+// copy being made; indexed writes are refused.  Native code that recognises
+// the object through fromObject() uses the bytes directly.
+class rtBufferObject: public rtObject
+{
+public:
+  rtDeclareObject(rtBufferObject, rtObject);
+  rtReadOnlyProperty(length, length, uint32_t);
+
+  static const char* kIsBufferObject;
+
+  rtBufferObject();
+  virtual ~rtBufferObject();
+
+  // Returns the buffer behind obj or NULL if obj is not an rtBufferObject
+  static rtBufferObject* fromObject(const rtObjectRef& obj);
+
+  virtual rtError Get(const char* name, rtValue* value) const;
+  virtual rtError Get(uint32_t i, rtValue* value) const;
+  virtual rtError Set(uint32_t i, const rtValue* value);
+
+  rtError length(uint32_t& n) const;
+
+  // Filled in by whoever produces the bytes, before the object is shared
+  rtData& data() { return *mData; }
+  const rtData& data() const { return *mData; }
+
+private:
+  rtData* mData;
+};
+
 #endif
 #endif
 
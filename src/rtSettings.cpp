@@ -53,6 +53,34 @@ rtError rtSettings::value(const rtString& key, rtValue& value) const
   return RT_ERROR;
 }
 
+rtError rtSettings::boolValue(const rtString& key, bool& value) const
+{
+  std::map<rtString, rtValue>::const_iterator it = mValues.find(key);
+  if (it == mValues.end() || it->second.isEmpty())
+    return RT_ERROR;
+
+  const rtValue& v = it->second;
+  rtType t = v.getType();
+  if (t == RT_stringType)
+  {
+    rtString str = v.toString();
+    if (str.compare("true") == 0 || str.compare("1") == 0)
+      value = true;
+    else if (str.compare("false") == 0 || str.compare("0") == 0)
+      value = false;
+    else
+    {
+      rtLogWarn("%s : '%s' is not a flag: %s", __FUNCTION__, key.cString(), str.cString());
+      return RT_ERROR;
+    }
+    return RT_OK;
+  }
+  if (t == RT_objectType || t == RT_functionType || t == RT_voidPtrType)
+    return RT_ERROR;
+  value = v.toBool();
+  return RT_OK;
+}
+
 rtError rtSettings::setValue(const rtString& key, const rtValue& value)
 {
   mValues[key] = value;
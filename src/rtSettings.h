@@ -39,6 +39,12 @@ public:
   // if key is found then value is set and RT_OK is returned. otherwise RT_ERROR is returned
   rtError value(const rtString& key, rtValue& value) const;
 
+  // like value() for flags.  json booleans and numbers are taken as is, and
+  // strings from the command line or the environment must read "true",
+  // "false", "1" or "0".  value is left unchanged and RT_ERROR is returned
+  // if the key is not found or does not hold a flag
+  rtError boolValue(const rtString& key, bool& value) const;
+
   rtError setValue(const rtString& key, const rtValue& value);
   rtError keys(std::vector<rtString>& keys) const;
 
@@ -20,6 +20,8 @@
 
 #include "rtThreadPool.h"
 
+#include "pxTimer.h"
+
 #include <iostream>
 using namespace std;
 
@@ -27,13 +29,47 @@ using namespace std;
 
 rtThreadPool* rtThreadPool::mGlobalInstance = new rtThreadPool(RT_THREAD_POOL_DEFAULT_THREAD_COUNT);
 
+// the pool and queue of the calling thread, if it is a pool thread
+static thread_local rtThreadPool* tCurrentPool = NULL;
+static thread_local int tCurrentQueue = 0;
 
-rtThreadPool::rtThreadPool(int numberOfThreads) : rtThreadPoolNative(numberOfThreads)
+rtThreadPool::rtThreadPool(int numberOfThreads) : rtThreadPoolNative(numberOfThreads),
+  mQueues(), mEntries(0), mNextQueue(0), mKeyMutex(), mKeys(), mMetricsMutex(), mMetrics(),
+  mStartTime(pxSeconds())
 {
+  // a pool without threads still keeps what is queued on it
+  int queueCount = numberOfThreads > 0 ? numberOfThreads : 1;
+  for (int i = 0; i < queueCount; i++)
+  {
+    mQueues.push_back(new taskQueue());
+  }
+  initialize();
 }
 
 rtThreadPool::~rtThreadPool()
 {
+  if (mRunning)
+  {
+    destroy();
+  }
+  for (size_t i = 0; i < mQueues.size(); i++)
+  {
+    for (int p = 0; p < RT_THREAD_PRIORITY_COUNT; p++)
+    {
+      for (deque<entry>::iterator it = mQueues[i]->tasks[p].begin(); it != mQueues[i]->tasks[p].end(); ++it)
+      {
+        // tasks that never ran are dropped without their cancel function
+        int state = rtThreadTask::QUEUED;
+        if (it->task->mState.compare_exchange_strong(state, rtThreadTask::CANCELLED))
+        {
+          it->task->Release();
+        }
+        it->task->Release();
+      }
+    }
+    delete mQueues[i];
+  }
+  mQueues.clear();
   if (mGlobalInstance == this)
   {
     mGlobalInstance = NULL;
@@ -48,3 +84,231 @@ rtThreadPool* rtThreadPool::globalInstance()
     }
     return mGlobalInstance;
 }
+
+void rtThreadPool::executeTask(rtThreadTask* threadTask)
+{
+  if (threadTask == NULL)
+  {
+    return;
+  }
+  threadTask->AddRef();
+  threadTask->mQueuedTime = pxSeconds();
+  if (!threadTask->mKey.isEmpty())
+  {
+    rtMutexLockGuard lock(mKeyMutex);
+    mKeys.insert(std::make_pair(std::string(threadTask->mKey.cString()), threadTask));
+  }
+  mMetricsMutex.lock();
+  mMetrics.tasksQueued++;
+  mMetricsMutex.unlock();
+  push(threadTask, threadTask->mPriority.load());
+}
+
+void rtThreadPool::push(rtThreadTask* threadTask, int priority)
+{
+  size_t index = (tCurrentPool == this) ? tCurrentQueue : (mNextQueue++ % mQueues.size());
+  entry e;
+  e.task = threadTask;
+  e.priority = priority;
+  threadTask->AddRef();
+  mQueues[index]->mutex.lock();
+  mQueues[index]->tasks[priority].push_back(e);
+  mQueues[index]->mutex.unlock();
+  mEntries++;
+  signalTask();
+}
+
+void rtThreadPool::setPriority(rtThreadTask* threadTask, rtThreadPriority priority)
+{
+  if (threadTask == NULL || threadTask->mState.load() != rtThreadTask::QUEUED)
+  {
+    return;
+  }
+  if (threadTask->mPriority.exchange(priority) != priority)
+  {
+    // the entry at the old priority is skipped when it comes up
+    push(threadTask, priority);
+  }
+}
+
+bool rtThreadPool::cancelTask(rtThreadTask* threadTask)
+{
+  if (threadTask == NULL)
+  {
+    return false;
+  }
+  int state = rtThreadTask::QUEUED;
+  if (!threadTask->mState.compare_exchange_strong(state, rtThreadTask::CANCELLED))
+  {
+    return false;
+  }
+  forget(threadTask);
+  mMetricsMutex.lock();
+  mMetrics.tasksQueued--;
+  mMetrics.tasksCancelled++;
+  mMetricsMutex.unlock();
+  threadTask->cancelled();
+  threadTask->Release();
+  return true;
+}
+
+void rtThreadPool::raisePriority(const rtString& key)
+{
+  setPriority(key, RT_THREAD_PRIORITY_HIGH);
+}
+
+void rtThreadPool::setPriority(const rtString& key, rtThreadPriority priority)
+{
+  vector<rtThreadTaskRef> tasks;
+  mKeyMutex.lock();
+  std::pair<unordered_multimap<std::string, rtThreadTask*>::iterator,
+            unordered_multimap<std::string, rtThreadTask*>::iterator> range = mKeys.equal_range(key.cString());
+  for (unordered_multimap<std::string, rtThreadTask*>::iterator it = range.first; it != range.second; ++it)
+  {
+    tasks.push_back(it->second);
+  }
+  mKeyMutex.unlock();
+  for (size_t i = 0; i < tasks.size(); i++)
+  {
+    setPriority(tasks[i].getPtr(), priority);
+  }
+}
+
+int rtThreadPool::cancelTasks(const rtString& key)
+{
+  vector<rtThreadTaskRef> tasks;
+  mKeyMutex.lock();
+  std::pair<unordered_multimap<std::string, rtThreadTask*>::iterator,
+            unordered_multimap<std::string, rtThreadTask*>::iterator> range = mKeys.equal_range(key.cString());
+  for (unordered_multimap<std::string, rtThreadTask*>::iterator it = range.first; it != range.second; ++it)
+  {
+    tasks.push_back(it->second);
+  }
+  mKeyMutex.unlock();
+  int cancelled = 0;
+  for (size_t i = 0; i < tasks.size(); i++)
+  {
+    if (cancelTask(tasks[i].getPtr()))
+    {
+      cancelled++;
+    }
+  }
+  return cancelled;
+}
+
+// drops the key entry of a task that is no longer queued
+void rtThreadPool::forget(rtThreadTask* threadTask)
+{
+  if (threadTask->mKey.isEmpty())
+  {
+    return;
+  }
+  rtMutexLockGuard lock(mKeyMutex);
+  std::pair<unordered_multimap<std::string, rtThreadTask*>::iterator,
+            unordered_multimap<std::string, rtThreadTask*>::iterator> range = mKeys.equal_range(threadTask->mKey.cString());
+  for (unordered_multimap<std::string, rtThreadTask*>::iterator it = range.first; it != range.second; ++it)
+  {
+    if (it->second == threadTask)
+    {
+      mKeys.erase(it);
+      break;
+    }
+  }
+}
+
+void rtThreadPool::metrics(rtThreadPoolMetrics& m)
+{
+  mMetricsMutex.lock();
+  m = mMetrics;
+  mMetricsMutex.unlock();
+  m.elapsedSeconds = pxSeconds() - mStartTime;
+  m.utilisation = (mNumberOfThreads > 0 && m.elapsedSeconds > 0) ?
+                  m.busySeconds / (mNumberOfThreads * m.elapsedSeconds) : 0;
+}
+
+bool rtThreadPool::hasTask()
+{
+  return mEntries.load() > 0;
+}
+
+// next live task at the highest priority, from the thread's own queue
+// first; stale entries met on the way are released
+rtThreadTask* rtThreadPool::take(int threadIndex, bool& stolen)
+{
+  size_t count = mQueues.size();
+  for (int p = 0; p < RT_THREAD_PRIORITY_COUNT; p++)
+  {
+    for (size_t n = 0; n < count; n++)
+    {
+      taskQueue* q = mQueues[(threadIndex + n) % count];
+      while (true)
+      {
+        q->mutex.lock();
+        if (q->tasks[p].empty())
+        {
+          q->mutex.unlock();
+          break;
+        }
+        entry e;
+        if (n == 0)
+        {
+          e = q->tasks[p].front();
+          q->tasks[p].pop_front();
+        }
+        else
+        {
+          e = q->tasks[p].back();
+          q->tasks[p].pop_back();
+        }
+        q->mutex.unlock();
+        mEntries--;
+
+        int state = rtThreadTask::QUEUED;
+        if (e.task->mPriority.load() == e.priority &&
+            e.task->mState.compare_exchange_strong(state, rtThreadTask::RUNNING))
+        {
+          stolen = (n != 0);
+          return e.task;
+        }
+        e.task->Release();
+      }
+    }
+  }
+  return NULL;
+}
+
+void rtThreadPool::runTask(int threadIndex)
+{
+  int queueIndex = threadIndex % mQueues.size();
+  bool stolen = false;
+  rtThreadTask* threadTask = take(queueIndex, stolen);
+  if (threadTask == NULL)
+  {
+    return;
+  }
+  forget(threadTask);
+
+  // tasks queued by this one stay on this thread's queue
+  tCurrentPool = this;
+  tCurrentQueue = queueIndex;
+  double start = pxSeconds();
+  threadTask->execute();
+  double end = pxSeconds();
+  tCurrentPool = NULL;
+  threadTask->mState = rtThreadTask::DONE;
+
+  mMetricsMutex.lock();
+  mMetrics.tasksQueued--;
+  mMetrics.tasksExecuted++;
+  if (stolen)
+  {
+    mMetrics.tasksStolen++;
+  }
+  mMetrics.busySeconds += end - start;
+  mMetrics.waitSeconds += start - threadTask->mQueuedTime;
+  mMetricsMutex.unlock();
+
+  // the queue entry's reference and the one taken by executeTask
+  threadTask->Release();
+  threadTask->Release();
+}
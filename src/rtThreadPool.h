@@ -20,7 +20,28 @@ limitations under the License.
 #define RT_THREAD_POOL_H
 
 #include "rtCore.h"
+#include "rtThreadTask.h"
 
+#include <atomic>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+struct rtThreadPoolMetrics
+{
+    uint64_t tasksQueued;     // waiting to run now
+    uint64_t tasksExecuted;
+    uint64_t tasksStolen;     // run by a thread other than the one they were queued on
+    uint64_t tasksCancelled;
+    double busySeconds;       // time spent running tasks, all threads
+    double waitSeconds;       // time tasks spent queued before they ran
+    double elapsedSeconds;    // since the pool was created
+    double utilisation;       // busySeconds / (threads * elapsedSeconds)
+};
+
+// Each thread has its own queue per priority and takes from the front of
+// it; a thread whose queues are empty steals from the back of the others.
+// Tasks submitted from outside the pool are spread round robin.
 class rtThreadPool : public rtThreadPoolNative
 {
 public:
@@ -29,12 +50,55 @@ public:
     
     static rtThreadPool* globalInstance();
 
-	void raisePriority(const rtString & /*url*/) {
-		//TODO
-	};
+    // The pool takes a reference to the task and drops it once the task
+    // has run or been cancelled
+    void executeTask(rtThreadTask* threadTask);
+
+    // Reprioritise or cancel a task that has not started yet
+    void setPriority(rtThreadTask* threadTask, rtThreadPriority priority);
+    bool cancelTask(rtThreadTask* threadTask);
+
+    // Same for every queued task with the key
+    void raisePriority(const rtString& key);
+    void setPriority(const rtString& key, rtThreadPriority priority);
+    int cancelTasks(const rtString& key);
+
+    void metrics(rtThreadPoolMetrics& m);
+
+protected:
+    virtual bool hasTask();
+    virtual void runTask(int threadIndex);
     
 private:
-    
+    // a task is queued once per priority it was given; entries left behind
+    // by setPriority() or cancelTask() are dropped when they come up
+    struct entry
+    {
+        rtThreadTask* task;
+        int priority;
+    };
+
+    struct taskQueue
+    {
+        rtMutex mutex;
+        std::deque<entry> tasks[RT_THREAD_PRIORITY_COUNT];
+    };
+
+    void push(rtThreadTask* threadTask, int priority);
+    rtThreadTask* take(int threadIndex, bool& stolen);
+    void forget(rtThreadTask* threadTask);
+
+    std::vector<taskQueue*> mQueues;
+    std::atomic<int> mEntries;        // queued entries, including stale ones
+    std::atomic<unsigned int> mNextQueue;
+
+    rtMutex mKeyMutex;
+    std::unordered_multimap<std::string, rtThreadTask*> mKeys;
+
+    rtMutex mMetricsMutex;
+    rtThreadPoolMetrics mMetrics;
+    double mStartTime;
+
     static rtThreadPool* mGlobalInstance;
 };
 
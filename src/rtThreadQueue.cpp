@@ -23,62 +23,143 @@
 
 using namespace std;
 
-rtThreadQueue::rtThreadQueue(){}
-rtThreadQueue::~rtThreadQueue() {}
+rtThreadQueue::rtThreadQueue(): mIncoming(NULL), mNextSequence(0), mAdding(0),
+  mPendingHead(NULL), mPendingTail(NULL), mTombstoneCount(0), mTombstones(), mTombstoneMutex() {}
+
+rtThreadQueue::~rtThreadQueue()
+{
+  drain();
+  while (mPendingHead)
+  {
+    ThreadQueueEntry* entry = mPendingHead;
+    mPendingHead = entry->next;
+    delete entry;
+  }
+}
 
 rtError rtThreadQueue::addTask(rtThreadTaskCB t, void* context, void* data)
 {
-  mTaskMutex.lock();
-  ThreadQueueEntry entry;
-  entry.task = t;
-  entry.context = context;
-  entry.data = data;
-  mTasks.push_back(entry);
-  mTaskMutex.unlock();
+  ThreadQueueEntry* entry = new ThreadQueueEntry;
+  entry->task = t;
+  entry->context = context;
+  entry->data = data;
+
+  mAdding++;
+  entry->sequence = mNextSequence++;
+  entry->next = mIncoming.load(memory_order_relaxed);
+  while (!mIncoming.compare_exchange_weak(entry->next, entry, memory_order_release, memory_order_relaxed));
+  mAdding--;
 
   return RT_OK;
 }
 
 rtError rtThreadQueue::removeAllTasksForObject(void* context)
 {
-  mTaskMutex.lock();
-  for(deque<ThreadQueueEntry>::iterator it = mTasks.begin();
-        it != mTasks.end(); ++it)
+  // tasks may already be in a batch taken by the dispatching thread, so
+  // they are skipped when their turn comes rather than unlinked here
+  rtMutexLockGuard lock(mTombstoneMutex);
+  // a later removal covers everything an earlier one did
+  uint64_t sequence = mNextSequence.load();
+  pair<unordered_map<void*, uint64_t>::iterator, bool> inserted = mTombstones.insert(make_pair(context, sequence));
+  if (inserted.second)
+    mTombstoneCount++;
+  else
+    inserted.first->second = sequence;
+
+  return RT_OK;
+}
+
+// moves everything added so far to the end of the pending list
+bool rtThreadQueue::drain()
+{
+  // read before the swap: with no producer between sequence and push,
+  // every task below sequence is in this batch or has already run
+  uint64_t sequence = mNextSequence.load();
+  bool settled = (mAdding.load() == 0);
+  bool idle = (mPendingHead == NULL);
+
+  ThreadQueueEntry* entry = mIncoming.exchange(NULL, memory_order_acquire);
+  if (!entry)
   {
-    if ((it)->context == context)
+    if (settled && idle)
+      pruneTombstones(sequence);
+    return false;
+  }
+
+  uint64_t oldest = sequence;
+  ThreadQueueEntry* batch = NULL;
+  ThreadQueueEntry* last = entry;
+  while (entry)
+  {
+    ThreadQueueEntry* next = entry->next;
+    if (entry->sequence < oldest)
+      oldest = entry->sequence;
+    entry->next = batch;
+    batch = entry;
+    entry = next;
+  }
+  if (mPendingTail)
+    mPendingTail->next = batch;
+  else
+    mPendingHead = batch;
+  mPendingTail = last;
+
+  if (settled && idle)
+    pruneTombstones(oldest);
+  return true;
+}
+
+bool rtThreadQueue::removed(const ThreadQueueEntry* entry)
+{
+  if (mTombstoneCount.load() == 0)
+    return false;
+  rtMutexLockGuard lock(mTombstoneMutex);
+  unordered_map<void*, uint64_t>::const_iterator it = mTombstones.find(entry->context);
+  return (it != mTombstones.end() && entry->sequence < it->second);
+}
+
+// drops the tombstones that can no longer match a task; nothing older than
+// oldestQueued is still queued
+void rtThreadQueue::pruneTombstones(uint64_t oldestQueued)
+{
+  if (mTombstoneCount.load() == 0)
+    return;
+  rtMutexLockGuard lock(mTombstoneMutex);
+  for (unordered_map<void*, uint64_t>::iterator it = mTombstones.begin(); it != mTombstones.end();)
+  {
+    if (it->second <= oldestQueued)
     {
-      it = mTasks.erase(it);
-      break;
+      it = mTombstones.erase(it);
+      mTombstoneCount--;
     }
+    else
+      ++it;
   }
-  mTaskMutex.unlock();
-
-  return RT_OK;
 }
 
 rtError rtThreadQueue::process(double maxSeconds)
 {
-  bool done = false;
   double start = pxSeconds();
-  do
+  while (mPendingHead || drain())
   {
-    ThreadQueueEntry entry;
-    mTaskMutex.lock();
-    if (!mTasks.empty())
-    {
-      entry = mTasks.front();
-      mTasks.pop_front();
-    }
-    else done = true;
-    mTaskMutex.unlock();
-    
-    if (!done)
+    ThreadQueueEntry* entry = mPendingHead;
+    mPendingHead = entry->next;
+    if (!mPendingHead)
+      mPendingTail = NULL;
+
+    bool run = !removed(entry);
+    rtThreadTaskCB task = entry->task;
+    void* context = entry->context;
+    void* data = entry->data;
+    delete entry;
+
+    if (run)
     {
-      entry.task(entry.context,entry.data);  
-      if (maxSeconds > 0)
-        done = (pxSeconds()-start) >= maxSeconds;
+      task(context, data);
+      if (maxSeconds > 0 && (pxSeconds()-start) >= maxSeconds)
+        break;
     }
-  } while (!done);
+  }
 
   return RT_OK;
 }
@@ -23,7 +23,8 @@
 #include "rtError.h"
 #include "rtMutex.h"
 
-#include <deque>
+#include <atomic>
+#include <unordered_map>
 
 typedef void (*rtThreadTaskCB)(void* context, void* data);
 
@@ -32,8 +33,13 @@ struct ThreadQueueEntry
   rtThreadTaskCB task;
   void* context;
   void* data;
+  uint64_t sequence; // order in which addTask was called
+  ThreadQueueEntry* next;
 };
 
+// Multi-producer, single-consumer task queue.  Producers push onto a lock
+// free stack; the dispatching thread takes the whole stack at once and runs
+// it in the order the tasks were added.
 class rtThreadQueue
 {
 public:
@@ -44,6 +50,8 @@ public:
   // Thread safe
   rtError addTask(rtThreadTaskCB t, void* context, void* data);
 
+  // Tasks for context queued before this call will not run.
+  // Thread safe
   rtError removeAllTasksForObject(void* context);
 
   // Invoke this method periodically on the dispatching (owning) thread
@@ -51,7 +59,18 @@ public:
   rtError process(double maxSeconds = 0);
 
 private:
-  std::deque<ThreadQueueEntry> mTasks;
-  rtMutex mTaskMutex;
+  bool drain();
+  bool removed(const ThreadQueueEntry* entry);
+  void pruneTombstones(uint64_t oldestQueued);
+
+  std::atomic<ThreadQueueEntry*> mIncoming;  // newest first
+  std::atomic<uint64_t> mNextSequence;
+  std::atomic<int32_t> mAdding;              // producers between sequence and push
+  ThreadQueueEntry* mPendingHead;            // oldest first, dispatching thread only
+  ThreadQueueEntry* mPendingTail;
+  std::atomic<int32_t> mTombstoneCount;
+  // tasks for a context added before its sequence are skipped
+  std::unordered_map<void*, uint64_t> mTombstones;
+  rtMutex mTombstoneMutex;
 };
 #endif //RT_THREAD_QUEUE_H
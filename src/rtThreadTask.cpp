@@ -20,8 +20,10 @@
 
 #include <stddef.h>
 
-rtThreadTask::rtThreadTask(void (*functionPointer)(void*), void* data, rtString key) :
-    mFunctionPointer(functionPointer), mData(data), mKey(key)
+rtThreadTask::rtThreadTask(void (*functionPointer)(void*), void* data, rtString key,
+                           rtThreadPriority priority) :
+    mFunctionPointer(functionPointer), mCancelFunction(NULL), mData(data), mKey(key),
+    mRefCount(0), mPriority(priority), mState(QUEUED), mQueuedTime(0)
 {
 }
 
@@ -39,7 +41,25 @@ void rtThreadTask::execute()
     }
 }
 
+void rtThreadTask::cancelled()
+{
+    if (mCancelFunction != NULL)
+    {
+        (*mCancelFunction)(mData);
+    }
+}
+
 rtString rtThreadTask::getKey()
 {
     return mKey;
 }
+
+unsigned long rtThreadTask::Release()
+{
+    unsigned long count = --mRefCount;
+    if (count == 0)
+    {
+        delete this;
+    }
+    return count;
+}
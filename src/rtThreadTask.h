@@ -20,19 +20,54 @@
 #define RT_THREAD_TASK_H
 
 #include "rtString.h"
+#include "rtRef.h"
 
+#include <atomic>
+
+// Queued work of a higher priority is always started first
+enum rtThreadPriority
+{
+    RT_THREAD_PRIORITY_HIGH = 0,   // work for what is on screen now
+    RT_THREAD_PRIORITY_NORMAL,
+    RT_THREAD_PRIORITY_LOW,        // prefetching and housekeeping
+    RT_THREAD_PRIORITY_COUNT
+};
+
+// Tasks are reference counted; the pool holds a reference until the task
+// has run or been cancelled, so an rtThreadTaskRef kept by the caller is a
+// handle that can reprioritise or cancel it.
 class rtThreadTask
 {  
 public:
-    rtThreadTask(void (*functionPointer)(void*), void* data, rtString key);
+    rtThreadTask(void (*functionPointer)(void*), void* data, rtString key,
+                 rtThreadPriority priority = RT_THREAD_PRIORITY_NORMAL);
     ~rtThreadTask();
     void execute();
     rtString getKey();
-    
+    rtThreadPriority priority() { return (rtThreadPriority)mPriority.load(); }
+
+    // Called with the data instead of the task function if the task is
+    // cancelled before it starts, so the data can be released
+    void setCancelFunction(void (*cancelFunction)(void*)) { mCancelFunction = cancelFunction; }
+    void cancelled();
+
+    unsigned long AddRef() { return ++mRefCount; }
+    unsigned long Release();
+
 private:
+    friend class rtThreadPool;
+    enum state { QUEUED = 0, RUNNING, DONE, CANCELLED };
+
     void (*mFunctionPointer)(void*);
+    void (*mCancelFunction)(void*);
     void* mData;
     rtString mKey;
+    std::atomic<unsigned long> mRefCount;
+    std::atomic<int> mPriority;
+    std::atomic<int> mState;
+    double mQueuedTime;
 };
 
+typedef rtRef<rtThreadTask> rtThreadTaskRef;
+
 #endif //RT_THREAD_TASK_H
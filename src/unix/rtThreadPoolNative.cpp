@@ -30,9 +30,8 @@ void* launchThread(void* threadPool)
 
 rtThreadPoolNative::rtThreadPoolNative(int numberOfThreads) : 
     mNumberOfThreads(numberOfThreads), mRunning(false), mThreadTaskMutex(),
-    mThreadTaskCondition(), mThreads(), mThreadTasks()
+    mThreadTaskCondition(), mThreads(), mStartedThreads(0)
 {
-    initialize();
 }
 
 rtThreadPoolNative::~rtThreadPoolNative()
@@ -68,7 +67,7 @@ void rtThreadPoolNative::destroy()
     mThreadTaskMutex.unlock();
     //broadcast to all the threads that we are shutting down
     mThreadTaskCondition.broadcast();
-    for (int i = 0; i < mNumberOfThreads; i++)
+    for (size_t i = 0; i < mThreads.size(); i++)
     {
         void* result;
         int returnValue = pthread_join(mThreads[i], &result);
@@ -83,11 +82,13 @@ void rtThreadPoolNative::destroy()
 
 void rtThreadPoolNative::startThread()
 {
-    rtThreadTask* threadTask = NULL;
+    mThreadTaskMutex.lock();
+    int threadIndex = mStartedThreads++;
+    mThreadTaskMutex.unlock();
     while(true)
     {
         mThreadTaskMutex.lock();
-        while (mRunning && (mThreadTasks.empty()))
+        while (mRunning && !hasTask())
         {
             mThreadTaskCondition.wait(mThreadTaskMutex.getNativeMutexDescription());
         }
@@ -96,44 +97,15 @@ void rtThreadPoolNative::startThread()
             mThreadTaskMutex.unlock();
             pthread_exit(NULL);
         }
-        threadTask = mThreadTasks.front();
-        mThreadTasks.pop_front();
         mThreadTaskMutex.unlock();
         
-        if (threadTask != NULL)
-        {
-            threadTask->execute();
-            delete threadTask;
-            threadTask = NULL;
-        }
+        runTask(threadIndex);
     }
 }
 
-void rtThreadPoolNative::executeTask(rtThreadTask* threadTask)
+void rtThreadPoolNative::signalTask()
 {
     mThreadTaskMutex.lock();
-    mThreadTasks.push_back(threadTask);
-    mThreadTaskCondition.signal();
-    mThreadTaskMutex.unlock();
-}
-
-void rtThreadPoolNative::raisePriority(rtString key)
-{
-    mThreadTaskMutex.lock();
-    rtThreadTask* threadTask = NULL;
-    for (std::deque<rtThreadTask*>::iterator it = mThreadTasks.begin(); it!=mThreadTasks.end(); ++it)
-    {
-        if ((*it)->getKey().compare(key) == 0)
-        {
-            threadTask = *it;
-            it = mThreadTasks.erase(it);
-            break;
-        }
-    }
-    if (threadTask != NULL)
-    {
-        mThreadTasks.push_front(threadTask);
-    }
     mThreadTaskCondition.signal();
     mThreadTaskMutex.unlock();
 }
@@ -26,30 +26,33 @@ limitations under the License.
 #include <pthread.h>
 
 #include <vector>
-#include <deque>
 
+// Threads of an rtThreadPool.  The pool decides which task a thread runs.
 class rtThreadPoolNative
 {
 public:
     rtThreadPoolNative(int numberOfThreads);
-    ~rtThreadPoolNative();
+    virtual ~rtThreadPoolNative();
     
-    void executeTask(rtThreadTask* threadTask);
-    void raisePriority(rtString key);
     void startThread();
     void destroy();
     
 protected:
     
     bool initialize();
-
+    // Called with mThreadTaskMutex held
+    virtual bool hasTask() = 0;
+    // Runs the next task for the thread, if there still is one
+    virtual void runTask(int threadIndex) = 0;
+    // Wakes a thread waiting for tasks
+    void signalTask();
     
     int mNumberOfThreads;
     bool mRunning;
     rtMutex mThreadTaskMutex;
     rtThreadCondition mThreadTaskCondition;
     std::vector<pthread_t> mThreads;
-    std::deque<rtThreadTask*> mThreadTasks;
+    int mStartedThreads;
 };
 
 #endif //RT_THREAD_POOL_H
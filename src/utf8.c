@@ -39,6 +39,11 @@ limitations under the License.
 
 #include "./utf8.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define U8_DECODE_SSE2 1
+#endif
+
 static const u_int32_t offsetsFromUTF8[6] = {
     0x00000000UL, 0x00003080UL, 0x000E2080UL,
     0x03C82080UL, 0xFA082080UL, 0x82082080UL
@@ -239,6 +244,81 @@ u_int32_t u8_nextchar(char *s, int *i)
     return ch;
 }
 
+/* bulk variant of u8_nextchar.  ASCII is copied 16 bytes at a time with
+   SSE2 where available, 8 bytes at a time otherwise; everything else is
+   decoded exactly like u8_nextchar. */
+int u8_decode(u_int32_t *dest, int *offsets, int sz, const char *src, int srcsz)
+{
+    const unsigned char *s = (const unsigned char *)src;
+    int n = 0;
+    int i = 0;
+    int k;
+
+    if (srcsz < 0)
+        srcsz = (int)strlen(src);
+
+    while (n < sz && i < srcsz) {
+#ifdef U8_DECODE_SSE2
+        while (i + 16 <= srcsz && n + 16 <= sz) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+            __m128i zero = _mm_setzero_si128();
+            __m128i lo, hi;
+            if (_mm_movemask_epi8(v) != 0 ||
+                _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0 ||
+                (i + 16 < srcsz && !isutf(s[i + 16])))
+                break;
+            lo = _mm_unpacklo_epi8(v, zero);
+            hi = _mm_unpackhi_epi8(v, zero);
+            _mm_storeu_si128((__m128i *)(dest + n), _mm_unpacklo_epi16(lo, zero));
+            _mm_storeu_si128((__m128i *)(dest + n + 4), _mm_unpackhi_epi16(lo, zero));
+            _mm_storeu_si128((__m128i *)(dest + n + 8), _mm_unpacklo_epi16(hi, zero));
+            _mm_storeu_si128((__m128i *)(dest + n + 12), _mm_unpackhi_epi16(hi, zero));
+            if (offsets)
+                for (k = 0; k < 16; k++)
+                    offsets[n + k] = i + k;
+            n += 16;
+            i += 16;
+        }
+#endif
+        while (i + 8 <= srcsz && n + 8 <= sz) {
+            /* any byte with the top bit set or equal to zero ends the run,
+               as does a stray continuation byte that u8_nextchar would
+               append to the last character */
+            u_int32_t w0, w1;
+            memcpy(&w0, s + i, 4);
+            memcpy(&w1, s + i + 4, 4);
+            if (((w0 | w1) & 0x80808080UL) ||
+                ((w0 - 0x01010101UL) & ~w0 & 0x80808080UL) ||
+                ((w1 - 0x01010101UL) & ~w1 & 0x80808080UL) ||
+                (i + 8 < srcsz && !isutf(s[i + 8])))
+                break;
+            for (k = 0; k < 8; k++) {
+                if (offsets)
+                    offsets[n] = i;
+                dest[n++] = s[i++];
+            }
+        }
+        if (n >= sz || i >= srcsz)
+            break;
+
+        if (s[i] == 0)
+            break;
+        if (offsets)
+            offsets[n] = i;
+        {
+            u_int32_t ch = 0;
+            int nb = 0;
+            do {
+                ch <<= 6;
+                ch += s[i++];
+                nb++;
+            } while (i < srcsz && s[i] && !isutf(s[i]));
+            dest[n++] = ch - offsetsFromUTF8[nb < 6 ? nb-1 : 5];
+        }
+    }
+    return n;
+}
+
 void u8_inc(char *s, int *i)
 {
     (void)(isutf(s[++(*i)]) || isutf(s[++(*i)]) ||
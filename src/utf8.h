@@ -55,6 +55,13 @@ int u8_charnum(char *s, int offset);
 /* return next character, updating an index variable */
 u_int32_t u8_nextchar(char *s, int *i);
 
+/* decode up to sz characters of src at once, storing the byte offset each
+   one starts at in offsets unless it is NULL.  srcsz = source size in bytes,
+   or -1 if 0-terminated.  decoding stops at a NUL byte and matches repeated
+   u8_nextchar calls.  returns # characters decoded; sz = srcsz is always
+   enough. */
+int u8_decode(u_int32_t *dest, int *offsets, int sz, const char *src, int srcsz);
+
 /* move to next character */
 void u8_inc(char *s, int *i);
 
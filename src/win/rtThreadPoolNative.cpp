@@ -43,9 +43,8 @@ void* launchThread(void* threadPool)
 
 rtThreadPoolNative::rtThreadPoolNative(int numberOfThreads) : 
     mNumberOfThreads(numberOfThreads), mRunning(false), mThreadTaskMutex(),
-    mThreadTaskCondition(), mThreads(), mThreadTasks()
+    mThreadTaskCondition(), mThreads(), mStartedThreads(0)
 {
-    initialize();
 }
 
 rtThreadPoolNative::~rtThreadPoolNative()
@@ -74,7 +73,7 @@ void rtThreadPoolNative::destroy()
     mThreadTaskMutex.unlock();
     //broadcast to all the threads that we are shutting down
     mThreadTaskCondition.broadcast();
-    for (int i = 0; i < mNumberOfThreads; i++)
+    for (size_t i = 0; i < mThreads.size(); i++)
     {
       WaitForSingleObject(mThreads[i], 10000);
       
@@ -85,11 +84,13 @@ void rtThreadPoolNative::destroy()
 
 void rtThreadPoolNative::startThread()
 {
-    rtThreadTask* threadTask = NULL;
+    mThreadTaskMutex.lock();
+    int threadIndex = mStartedThreads++;
+    mThreadTaskMutex.unlock();
     while(true)
     {
         mThreadTaskMutex.lock();
-        while (mRunning && (mThreadTasks.empty()))
+        while (mRunning && !hasTask())
         {
 			mThreadTaskMutex.unlock();
             mThreadTaskCondition.wait(mThreadTaskMutex.getNativeMutexDescription());
@@ -100,23 +101,15 @@ void rtThreadPoolNative::startThread()
             mThreadTaskMutex.unlock();
             return;
         }
-        threadTask = mThreadTasks.front();
-        mThreadTasks.pop_front();
         mThreadTaskMutex.unlock();
         
-        if (threadTask != NULL)
-        {
-            threadTask->execute();
-            delete threadTask;
-            threadTask = NULL;
-        }
+        runTask(threadIndex);
     }
 }
 
-void rtThreadPoolNative::executeTask(rtThreadTask* threadTask)
+void rtThreadPoolNative::signalTask()
 {
     mThreadTaskMutex.lock();
-    mThreadTasks.push_back(threadTask);
     mThreadTaskCondition.signal();
     mThreadTaskMutex.unlock();
 }
@@ -23,15 +23,14 @@ limitations under the License.
 #include "../rtThreadTask.h"
 
 #include <vector>
-#include <deque>
 
+// Threads of an rtThreadPool.  The pool decides which task a thread runs.
 class rtThreadPoolNative
 {
 public:
   rtThreadPoolNative(int numberOfThreads);
-  ~rtThreadPoolNative();
+  virtual ~rtThreadPoolNative();
 
-  void executeTask(rtThreadTask* threadTask);
   void startThread();
 
   void destroy();
@@ -39,13 +38,19 @@ public:
 protected:
 
   bool initialize();
+  // Called with mThreadTaskMutex held
+  virtual bool hasTask() = 0;
+  // Runs the next task for the thread, if there still is one
+  virtual void runTask(int threadIndex) = 0;
+  // Wakes a thread waiting for tasks
+  void signalTask();
 
   int mNumberOfThreads;
   bool mRunning;
   rtMutex mThreadTaskMutex;
   rtThreadCondition mThreadTaskCondition;
   std::vector<void*> mThreads;
-  std::deque<rtThreadTask*> mThreadTasks;
+  int mStartedThreads;
 };
 
 #endif //RT_THREAD_POOL_H
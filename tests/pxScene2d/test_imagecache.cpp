@@ -160,19 +160,136 @@ class pxFileCacheTest : public testing::Test, public commonTestFns
     void fileCachePopulateExistingFilesWithCacheTest()
     {
       rtFileCache::instance()->initCache();
-      bool sysret = system("touch /tmp/cache/a.txt");
+      addDataToCache("http://fileserver/a.jpeg","","abcde",5);
+      int64_t cacheSize = rtFileCache::instance()->cacheSize();
+      EXPECT_TRUE (cacheSize > 0);
+
+      // the index brings the entries back without the files being read
+      rtFileCache::destroy();
+      EXPECT_TRUE (rtFileCache::instance()->cacheSize() == cacheSize);
+      rtHttpCacheData data;
+      EXPECT_TRUE (rtFileCache::instance()->httpCacheData("http://fileserver/a.jpeg",data) == RT_OK);
+      EXPECT_TRUE (rtFileCache::instance()->httpCacheData("http://fileserver/b.jpeg",data) == RT_ERROR);
+
+      // files not in the index are ignored
+      bool sysret = system("echo \"Hello\" >  /tmp/cache/a.txt");
       UNUSED_PARAM(sysret);
-      sysret = system("echo \"Hello\" >  /tmp/cache/a.txt");
       rtFileCache::instance()->populateExistingFiles();
-      EXPECT_TRUE (rtFileCache::instance()->cacheSize() > 0);
+      EXPECT_TRUE (rtFileCache::instance()->cacheSize() == cacheSize);
+    }
+
+    void fileCacheIndexRebuildTest()
+    {
+      rtFileCache::instance()->clearCache();
+      addDataToCache("http://fileserver/a.jpeg","","abcde",5);
+      int64_t cacheSize = rtFileCache::instance()->cacheSize();
+
+      // without an index the cached files are adopted and files named the
+      // way older releases did are removed
+      bool sysret = system("rm -f /tmp/cache/index; echo \"Hello\" > /tmp/cache/1234567890");
+      UNUSED_PARAM(sysret);
+      rtFileCache::instance()->populateExistingFiles();
+      EXPECT_TRUE (rtFileCache::instance()->cacheSize() == cacheSize);
+      struct stat st;
+      EXPECT_TRUE (stat("/tmp/cache/1234567890", &st) == -1);
+      EXPECT_TRUE (stat("/tmp/cache/index", &st) == 0);
+      rtHttpCacheData data;
+      EXPECT_TRUE (rtFileCache::instance()->httpCacheData("http://fileserver/a.jpeg",data) == RT_OK);
+    }
+
+    void fileCacheIndexTornRecordTest()
+    {
+      rtFileCache::instance()->clearCache();
+      addDataToCache("http://fileserver/a.jpeg","","abcde",5);
+      addDataToCache("http://fileserver/b.jpeg","","abcde",5);
+      struct stat st;
+      EXPECT_TRUE (stat("/tmp/cache/index", &st) == 0);
+
+      // a record cut short by a crash is dropped, and the ones before it kept
+      EXPECT_TRUE (truncate("/tmp/cache/index", st.st_size - 10) == 0);
+      rtFileCache::instance()->populateExistingFiles();
+      EXPECT_TRUE (rtFileCache::instance()->mIndexRecords == 1);
+      rtHttpCacheData data;
+      EXPECT_TRUE (rtFileCache::instance()->httpCacheData("http://fileserver/a.jpeg",data) == RT_OK);
+      EXPECT_TRUE (rtFileCache::instance()->httpCacheData("http://fileserver/b.jpeg",data) == RT_ERROR);
+    }
+
+    void fileCacheIndexCompactionTest()
+    {
+      rtFileCache::instance()->clearCache();
+      addDataToCache("http://fileserver/a.jpeg","","abcde",5);
+      rtHttpCacheData data;
+      for (int i = 0; i < 1024; i++)
+      {
+        rtFileCache::instance()->httpCacheData("http://fileserver/a.jpeg",data);
+      }
+      EXPECT_TRUE (rtFileCache::instance()->mIndexRecords < 1024);
+      rtFileCache::destroy();
+      EXPECT_TRUE (rtFileCache::instance()->httpCacheData("http://fileserver/a.jpeg",data) == RT_OK);
+    }
+
+    void fileCacheIndexCompactionBacklogTest()
+    {
+      rtFileCache::instance()->clearCache();
+      addDataToCache("http://fileserver/a.jpeg","","abcde",5);
+
+      // records appended while a compaction writes its snapshot are kept
+      rtFileCache* cache = rtFileCache::instance();
+      cache->mCompacting = true;
+      addDataToCache("http://fileserver/b.jpeg","","abcde",5);
+      EXPECT_FALSE (cache->mCompactionBacklog.empty());
+      cache->mCompactionBacklog.clear();
+      cache->mCompacting = false;
+      cache->mCompactionPending = true;
+      cache->compactIndexIfNeeded();
+      EXPECT_TRUE (cache->mIndexRecords == 2);
+      rtFileCache::destroy();
+      rtHttpCacheData data;
+      EXPECT_TRUE (rtFileCache::instance()->httpCacheData("http://fileserver/a.jpeg",data) == RT_OK);
+      EXPECT_TRUE (rtFileCache::instance()->httpCacheData("http://fileserver/b.jpeg",data) == RT_OK);
+    }
+
+    void fileCacheUncleanShutdownTest()
+    {
+      rtFileCache::instance()->clearCache();
+      addDataToCache("http://fileserver/a.jpeg","","abcde",5);
+      int64_t cacheSize = rtFileCache::instance()->cacheSize();
+      addDataToCache("http://fileserver/b.jpeg","","abcde",5);
+      struct stat st;
+      EXPECT_TRUE (stat("/tmp/cache/index.open", &st) == 0);
+
+      // the marker is left behind by a crash along with a temp file, a file
+      // the index never heard of and an entry whose file never made it
+      rtString b("http://fileserver/b.jpeg");
+      rtString command("echo x > /tmp/cache/0123456789abcdef0123456789abcdef; echo x > /tmp/cache/a.tmp; rm /tmp/cache/");
+      command.append(rtFileCache::instance()->hashedFileName(b).cString());
+      bool sysret = system(command.cString());
+      UNUSED_PARAM(sysret);
+      rtFileCache::instance()->populateExistingFiles();
+      EXPECT_TRUE (stat("/tmp/cache/0123456789abcdef0123456789abcdef", &st) == -1);
+      EXPECT_TRUE (stat("/tmp/cache/a.tmp", &st) == -1);
+      EXPECT_TRUE (rtFileCache::instance()->cacheSize() == cacheSize);
+      rtHttpCacheData data;
+      EXPECT_TRUE (rtFileCache::instance()->httpCacheData("http://fileserver/a.jpeg",data) == RT_OK);
+
+      // after a clean close the directory is left alone
+      rtFileCache::destroy();
+      EXPECT_TRUE (stat("/tmp/cache/index.open", &st) == -1);
+      sysret = system("echo x > /tmp/cache/0123456789abcdef0123456789abcdef");
+      EXPECT_TRUE (rtFileCache::instance()->cacheSize() == cacheSize);
+      EXPECT_TRUE (stat("/tmp/cache/0123456789abcdef0123456789abcdef", &st) == 0);
+      EXPECT_TRUE (stat("/tmp/cache/index.open", &st) == 0);
+      unlink("/tmp/cache/0123456789abcdef0123456789abcdef");
     }
 
     void fileCacheSetMaxCacheSizeTest ()
     {
+       int64_t oldMaxSize  = rtFileCache::instance()->maxCacheSize();
        rtFileCache::instance()->setMaxCacheSize(200);
        int64_t cacheSize;
        cacheSize  = rtFileCache::instance()->maxCacheSize();
        EXPECT_TRUE (cacheSize == 200);
+       rtFileCache::instance()->setMaxCacheSize(oldMaxSize);
     }
 
     void fileCacheSetDirectoryTest()
@@ -210,12 +327,7 @@ class pxFileCacheTest : public testing::Test, public commonTestFns
       resetAndAddCacheData();
       addDataToCache("http://fileserver/b.jpeg","","abcde",5);
       EXPECT_TRUE (rtFileCache::instance()->removeData("http://fileserver/a.jpeg") == RT_OK);
-      rtHttpCacheData data;
-      rtFileCache::instance()->httpCacheData("http://fileserver/b.jpeg",data);
-      stringstream stream;
-      stream << data.expirationDateUnix();
-      string date = stream.str().c_str();
-      int expectedSize = strlen(mNonExpireDate) + 1 + strlen("abcde") + 1 + date.length();
+      int expectedSize = sizeof(rtFileCacheFileHeader) + strlen("http://fileserver/b.jpeg") + strlen(mNonExpireDate) + strlen("abcde") + 1;
       EXPECT_TRUE (rtFileCache::instance()->cacheSize() == expectedSize);
     }
 
@@ -248,6 +360,16 @@ class pxFileCacheTest : public testing::Test, public commonTestFns
       EXPECT_TRUE (rtFileCache::instance()->httpCacheData("http://fileserver/b.jpeg",data) == RT_ERROR);
     }
 
+    void fileCacheContainsTest()
+    {
+      resetAndAddCacheData();
+      EXPECT_TRUE (rtFileCache::instance()->contains("http://fileserver/a.jpeg"));
+      EXPECT_FALSE (rtFileCache::instance()->contains("http://fileserver/b.jpeg"));
+      EXPECT_FALSE (rtFileCache::instance()->contains(NULL));
+      rtFileCache::instance()->removeData("http://fileserver/a.jpeg");
+      EXPECT_FALSE (rtFileCache::instance()->contains("http://fileserver/a.jpeg"));
+    }
+
     void fileCacheAddNullUrlToCacheTest()
     {
       rtFileCache::instance()->clearCache();
@@ -259,9 +381,37 @@ class pxFileCacheTest : public testing::Test, public commonTestFns
     {
       resetAndAddCacheData();
       rtHttpCacheData data;
-      rtFileCache::instance()->httpCacheData("http://fileserver/a.jpeg",data);
-      int expectedSize = strlen(mNonExpireDate) + 1 + + strlen("abcde") + 1 + to_string(data.expirationDateUnix()).length();
+      EXPECT_TRUE (rtFileCache::instance()->httpCacheData("http://fileserver/a.jpeg",data) == RT_OK);
+      int expectedSize = sizeof(rtFileCacheFileHeader) + strlen("http://fileserver/a.jpeg") + strlen(mNonExpireDate) + strlen("abcde") + 1;
       EXPECT_TRUE (rtFileCache::instance()->cacheSize() == expectedSize);
+
+      // the contents are handed out as a view of the mapped file
+      rtData contents;
+      EXPECT_TRUE (data.data(contents) == RT_OK);
+      EXPECT_TRUE (contents.isView());
+      EXPECT_TRUE (contents.length() == 5);
+      EXPECT_TRUE (strcmp("abcde", (const char*)contents.data()) == 0);
+      rtData& file = data.cacheFile();
+      EXPECT_TRUE (contents.data() > file.data() && contents.data() + contents.length() < file.data() + file.length());
+    }
+
+    void fileCacheUrlCollisionTest()
+    {
+      resetAndAddCacheData();
+      addDataToCache("http://fileserver/b.jpeg","","abcde",5);
+
+      // a file found under the digest of another url is not handed out
+      rtString a("http://fileserver/a.jpeg");
+      rtString b("http://fileserver/b.jpeg");
+      rtString command("cp /tmp/cache/");
+      command.append(rtFileCache::instance()->hashedFileName(a).cString());
+      command.append(" /tmp/cache/");
+      command.append(rtFileCache::instance()->hashedFileName(b).cString());
+      bool sysret = system(command.cString());
+      UNUSED_PARAM(sysret);
+      rtHttpCacheData data;
+      EXPECT_TRUE (rtFileCache::instance()->httpCacheData("http://fileserver/b.jpeg",data) == RT_ERROR);
+      EXPECT_TRUE (rtFileCache::instance()->httpCacheData("http://fileserver/a.jpeg",data) == RT_OK);
     }
 
     void fileCacheAddProperUrlToCacheNonWritableTest()
@@ -291,6 +441,33 @@ class pxFileCacheTest : public testing::Test, public commonTestFns
       rtFileCache::instance()->setMaxCacheSize(oldMaxSize);
     }
 
+    void cleanupLeastRecentlyUsedTest()
+    {
+      resetAndAddCacheData();
+      addDataToCache("http://fileserver/b.jpeg","","abcde",5);
+      addDataToCache("http://fileserver/c.jpeg","","abcde",5);
+      int64_t entrySize = rtFileCache::instance()->cacheSize() / 3;
+      rtHttpCacheData data;
+      EXPECT_TRUE (rtFileCache::instance()->httpCacheData("http://fileserver/a.jpeg",data) == RT_OK);
+
+      // b was used longest ago, even though a was added before it
+      int64_t oldMaxSize  = rtFileCache::instance()->maxCacheSize();
+      rtFileCache::instance()->setMaxCacheSize(4 * entrySize - 1);
+      addDataToCache("http://fileserver/d.jpeg","","abcde",5);
+      EXPECT_TRUE (rtFileCache::instance()->cacheSize() == 3 * entrySize);
+      EXPECT_TRUE (rtFileCache::instance()->httpCacheData("http://fileserver/b.jpeg",data) == RT_ERROR);
+      EXPECT_TRUE (rtFileCache::instance()->httpCacheData("http://fileserver/a.jpeg",data) == RT_OK);
+      EXPECT_TRUE (rtFileCache::instance()->httpCacheData("http://fileserver/c.jpeg",data) == RT_OK);
+      EXPECT_TRUE (rtFileCache::instance()->httpCacheData("http://fileserver/d.jpeg",data) == RT_OK);
+
+      // eviction goes down to the low water mark, not just under the limit
+      rtFileCache::instance()->setMaxCacheSize(2 * entrySize);
+      addDataToCache("http://fileserver/d.jpeg","","abcde",5);
+      EXPECT_TRUE (rtFileCache::instance()->cacheSize() == entrySize);
+      EXPECT_TRUE (rtFileCache::instance()->httpCacheData("http://fileserver/d.jpeg",data) == RT_OK);
+      rtFileCache::instance()->setMaxCacheSize(oldMaxSize);
+    }
+
     void createNewDirectoryCacheTest()
     {
       rtFileCache::instance()->setCacheDirectory("/tmp/cache1");
@@ -310,7 +487,15 @@ class pxFileCacheTest : public testing::Test, public commonTestFns
       FILE* fp = fopen(resultFile.cString(),"w");
       fclose(fp);
       rtHttpCacheData data;
-      EXPECT_FALSE  (rtFileCache::instance()->readFileHeader(fileName,data));
+      EXPECT_FALSE  (rtFileCache::instance()->readFileHeader(hashName,fileName,0,data));
+
+      // files in the old "header|expiry|body" layout are not read
+      fp = fopen(resultFile.cString(),"w");
+      fprintf(fp, "HTTP/1.1 200 OK\n|1700000000|abcde");
+      fclose(fp);
+      struct stat st;
+      EXPECT_TRUE (stat(resultFile.cString(), &st) == 0);
+      EXPECT_FALSE  (rtFileCache::instance()->readFileHeader(hashName,fileName,st.st_size,data));
     }
   private:
 
@@ -328,6 +513,11 @@ TEST_F(pxFileCacheTest, fileCacheCompleteTest)
   fileCacheSetEmptyCacheDirectoryTest();
   fileCachePopulateExistingFilesWoCacheTest();
   fileCachePopulateExistingFilesWithCacheTest();
+  fileCacheIndexRebuildTest();
+  fileCacheIndexTornRecordTest();
+  fileCacheIndexCompactionTest();
+  fileCacheIndexCompactionBacklogTest();
+  fileCacheUncleanShutdownTest();
   fileCacheSetMaxCacheSizeTest();
   fileCacheSetDirectoryTest();
   fileCacheRemoveDataUrlNullTest();
@@ -339,10 +529,13 @@ TEST_F(pxFileCacheTest, fileCacheCompleteTest)
   fileCacheClearCacheTest();
   fileCacheGetHttpCacheDataAvailableTest();
   fileCacheGetHttpCacheDataUnAvailableTest();
+  fileCacheContainsTest();
   fileCacheAddNullUrlToCacheTest();
   fileCacheAddProperUrlToCacheTest();
+  fileCacheUrlCollisionTest();
   fileCacheAddProperUrlToCacheNonWritableTest();
   cleanupCacheTest();
+  cleanupLeastRecentlyUsedTest();
   createNewDirectoryCacheTest();
   improperCacheFileFailReadTest();
 }
@@ -763,10 +956,10 @@ class rtHttpCacheTest : public testing::Test, public commonTestFns
       EXPECT_TRUE(true == ret); 
     }
 
-    void filePointerTest()
+    void cacheFileTest()
     {
       rtHttpCacheData data("http://www.pxscene.org/examples/px-reference/gallery/fancy.js");
-      EXPECT_TRUE(NULL == data.filePointer());
+      EXPECT_TRUE(0 == data.cacheFile().length());
     }
 
     void deferCacheReadFailTest()
@@ -817,7 +1010,7 @@ TEST_F(rtHttpCacheTest, httpCacheCompleteTest)
 #endif // } UNAVAILABLE_MEMORY_TEST_ENABLED
   handleDownloadRequest404Test();
   handleDownloadRequestProperTest();
-  filePointerTest();
+  cacheFileTest();
   deferCacheReadFailTest();
 }
 
@@ -25,12 +25,18 @@ limitations under the License.
 #include "pxWindow.h"
 #include "pxScene2d.h"
 #include "pxFont.h"
+#include "pxTextBox.h"
+#include "pxContext.h"
+#include "pxTimer.h"
+#include "rtThreadQueue.h"
 #include <string.h>
 #include <sstream>
 
 #include "test_includes.h" // Needs to be included last
 
 //pxFontManager fontManager;
+extern pxContext context;
+extern rtThreadQueue* gUIThreadQueue;
 
 uint32_t font1Id, font2Id, font3Id;
 
@@ -94,3 +100,440 @@ TEST(pxFontTest, loadResourceFromArchiveFailureTest)
       delete scene;
 }
 
+
+TEST(pxFontTest, glyphFaceTest)
+{
+  pxGlyphFace face;
+  EXPECT_TRUE(NULL == face.find('A'));
+  EXPECT_TRUE(NULL == face.find(0x4e2d));
+
+  pxGlyphSlot* slot = face.insert('A');
+  ASSERT_TRUE(NULL != slot);
+  slot->glyph.advancedotx = 7;
+  slot->hasGlyph = true;
+  EXPECT_EQ(slot, face.find('A'));
+  EXPECT_EQ(slot, face.insert('A'));
+  EXPECT_EQ(1u, face.size());
+
+  // enough code points outside Latin-1 to grow the probed table a few times
+  for (uint32_t codePoint = 0x400; codePoint < 0x400 + 500; codePoint++)
+  {
+    slot = face.insert(codePoint);
+    ASSERT_TRUE(NULL != slot);
+    slot->glyph.advancedotx = (int32_t)codePoint;
+    slot->hasGlyph = true;
+  }
+  EXPECT_EQ(501u, face.size());
+  for (uint32_t codePoint = 0x400; codePoint < 0x400 + 500; codePoint++)
+  {
+    slot = face.find(codePoint);
+    ASSERT_TRUE(NULL != slot);
+    EXPECT_EQ((int32_t)codePoint, slot->glyph.advancedotx);
+  }
+  EXPECT_EQ(7, face.find('A')->glyph.advancedotx);
+  EXPECT_TRUE(NULL == face.insert(PX_GLYPH_SLOT_EMPTY));
+
+  face.clear();
+  EXPECT_EQ(0u, face.size());
+  EXPECT_TRUE(NULL == face.find('A'));
+  EXPECT_TRUE(NULL == face.find(0x400));
+
+  // a full Latin-1 range lives in the direct array and leaves the probed
+  // table at its initial size
+  for (uint32_t codePoint = 0; codePoint < pxGlyphFace::directSize; codePoint++)
+  {
+    ASSERT_TRUE(NULL != face.insert(codePoint));
+  }
+  for (uint32_t codePoint = 0x400; codePoint < 0x400 + 40; codePoint++)
+  {
+    ASSERT_TRUE(NULL != face.insert(codePoint));
+  }
+  EXPECT_EQ(pxGlyphFace::directSize + 40, face.size());
+  EXPECT_EQ(40u, face.mProbedSize);
+  EXPECT_EQ((size_t)pxGlyphFace::initialSlots, face.mSlots.size());
+}
+
+TEST(pxFontTest, measureTextRunTest)
+{
+  pxScene2d* scene = new pxScene2d();
+  rtObjectRef archive;
+  EXPECT_TRUE(RT_OK == scene->loadArchive("supportfiles/test_arc_resources.jar", archive));
+  pxFont* font = new pxFont("", 0, "");
+  font->setUrl("XFINITYSansTTCond-Medium.ttf");
+  font->loadResourceFromArchive(scene->getArchive());
+  ASSERT_TRUE(font->isFontLoaded());
+
+  // every prefix of the run matches measuring that prefix on its own
+  const char* text = "Caf\xc3\xa9 au lait\ntwo lines";
+  std::vector<int> offsets;
+  std::vector<float> widths, heights;
+  font->measureTextRun(text, 20, offsets, widths, heights);
+  EXPECT_EQ(23u, offsets.size());
+  EXPECT_EQ((int)strlen(text), offsets.back());
+  for (size_t k = 0; k < offsets.size(); k++)
+  {
+    std::string prefix(text, offsets[k]);
+    float w = 0, h = 0;
+    font->measureTextInternal(prefix.c_str(), 20, 1.0, 1.0, w, h);
+    EXPECT_EQ(w, widths[k]);
+    EXPECT_EQ(h, heights[k]);
+    if (k > 0)
+    {
+      EXPECT_GE(widths[k], widths[k-1]);
+    }
+  }
+  delete scene;
+}
+
+TEST(pxFontTest, sharedFontFaceTest)
+{
+  pxScene2d* scene = new pxScene2d();
+  rtObjectRef archive;
+  EXPECT_TRUE(RT_OK == scene->loadArchive("supportfiles/test_arc_resources.jar", archive));
+  rtRef<pxFont> font1 = new pxFont("", 0, "");
+  font1->setUrl("XFINITYSansTTCond-Medium.ttf");
+  font1->loadResourceFromArchive(scene->getArchive());
+  ASSERT_TRUE(font1->isFontLoaded());
+  uint32_t faces = pxFontFace::faceCount();
+
+  // the same bytes under another font share the face
+  rtRef<pxFont> font2 = new pxFont("", 0, "");
+  font2->setUrl("XFINITYSansTTCond-Medium.ttf");
+  font2->loadResourceFromArchive(scene->getArchive());
+  ASSERT_TRUE(font2->isFontLoaded());
+  EXPECT_EQ(font1->mFontFace.getPtr(), font2->mFontFace.getPtr());
+  EXPECT_EQ(faces, pxFontFace::faceCount());
+
+  // a local file is shared by identity, not by hashing its content
+  rtData d;
+  d.init((const uint8_t*)font1->mFontFace->data(), font1->mFontFace->size());
+  EXPECT_TRUE(RT_OK == rtStoreFile("supportfiles/sharedFontFace.ttf", d));
+  pxFontFaceRef fileFace = pxFontFace::fromFile("supportfiles/sharedFontFace.ttf");
+  ASSERT_TRUE(NULL != fileFace);
+  EXPECT_EQ(fileFace.getPtr(), pxFontFace::fromFile("supportfiles/sharedFontFace.ttf").getPtr());
+#ifndef WIN32
+  EXPECT_TRUE(fileFace->isMapped());
+  EXPECT_NE(font1->mFontFace.getPtr(), fileFace.getPtr());
+#endif
+  fileFace = NULL;
+  unlink("supportfiles/sharedFontFace.ttf");
+
+  // sizes are tracked on the shared face
+  font1->setPixelSize(20);
+  font2->setPixelSize(30);
+  font1->setPixelSize(20);
+  EXPECT_EQ(20u, font1->mFontFace->pixelSize());
+  EXPECT_EQ(20u, font1->mFace->size->metrics.y_ppem);
+  delete scene;
+}
+
+TEST(pxFontTest, warmupGlyphsTest)
+{
+  pxScene2d* scene = new pxScene2d();
+  rtObjectRef archive;
+  EXPECT_TRUE(RT_OK == scene->loadArchive("supportfiles/test_arc_resources.jar", archive));
+  pxFont* font = new pxFont("", 0, "");
+  font->setUrl("XFINITYSansTTCond-Medium.ttf");
+  font->loadResourceFromArchive(scene->getArchive());
+  ASSERT_TRUE(font->isFontLoaded());
+
+  // pending text picks the sizes and code points
+  font->addWarmupText(20, "AB");
+  font->addWarmupText(24, "BC");
+  EXPECT_EQ(2u, font->mWarmupSizes.size());
+  EXPECT_EQ(3u, font->mWarmupCodePoints.size());
+
+  vector<uint32_t> sizes(font->mWarmupSizes.begin(), font->mWarmupSizes.end());
+  vector<uint32_t> codePoints(font->mWarmupCodePoints.begin(), font->mWarmupCodePoints.end());
+  vector<pxWarmupGlyph> glyphs;
+  pxRasterizeGlyphs(font->mFace, sizes, codePoints, false, glyphs);
+  ASSERT_EQ(6u, glyphs.size());
+  for (uint32_t i = 0; i < glyphs.size(); i++)
+  {
+    EXPECT_EQ(glyphs[i].width*glyphs[i].rows, glyphs[i].bitmap.size());
+    EXPECT_EQ((int32_t)glyphs[i].width, glyphs[i].metrics.bitmapdotwidth);
+  }
+
+  // warmed glyphs are served from the cache with the same metrics
+  font->addWarmupGlyphs(glyphs);
+  pxGlyphSlot* slot = font->glyphFace(20)->find('A');
+  ASSERT_TRUE(NULL != slot);
+  EXPECT_TRUE(slot->hasGlyph);
+  int32_t advance = slot->glyph.advancedotx;
+  font->clearGlyphCache();
+  font->setPixelSize(20);
+  const GlyphCacheEntry* entry = font->getGlyph('A');
+  ASSERT_TRUE(NULL != entry);
+  EXPECT_EQ(advance, entry->advancedotx);
+
+#ifdef PXSCENE_FONT_ATLAS
+  // a lookup while the warm-up is in flight rasterises the glyph on the
+  // spot instead of waiting; the batch fills in the rest when it arrives
+  if (gUIThreadQueue && pxFontManager::warmupEnabled())
+  {
+    font->clearGlyphCache();
+    font->mWarmupStarted = false;
+    font->addWarmupText(20, "QR");
+    font->startWarmup();
+    ASSERT_TRUE(NULL != font->mWarmup);
+    font->setPixelSize(20);
+    const GlyphCacheEntry* q = font->getGlyph('Q');
+    ASSERT_TRUE(NULL != q);
+    int32_t qAdvance = q->advancedotx;
+    double timeout = pxSeconds() + 5;
+    while (NULL != font->mWarmup && pxSeconds() < timeout)
+    {
+      gUIThreadQueue->process(0.01);
+      pxSleepMS(10);
+    }
+    EXPECT_TRUE(NULL == font->mWarmup);
+    EXPECT_EQ(qAdvance, font->glyphFace(20)->find('Q')->glyph.advancedotx);
+    pxGlyphSlot* warmed = font->glyphFace(20)->find('R');
+    ASSERT_TRUE(NULL != warmed);
+    EXPECT_TRUE(warmed->hasGlyph);
+    EXPECT_TRUE(warmed->hasTexture);
+  }
+#endif
+
+  // with no text waiting Latin-1 is warmed up unless another set is configured
+  vector<uint32_t> configured;
+  rtString saved = pxFontManager::mWarmupGlyphs;
+  EXPECT_TRUE(saved.compare("latin1") == 0);
+  pxFontManager::mWarmupGlyphs = "";
+  pxFontManager::warmupCodePoints(configured);
+  EXPECT_EQ(0u, configured.size());
+  pxFontManager::mWarmupGlyphs = "latin1";
+  pxFontManager::warmupCodePoints(configured);
+  EXPECT_EQ(95u + 96u, configured.size());
+  pxFontManager::mWarmupGlyphs = "abca";
+  pxFontManager::warmupCodePoints(configured);
+  EXPECT_EQ(3u, configured.size());
+  pxFontManager::mWarmupGlyphs = saved;
+  delete scene;
+}
+
+#ifdef PXSCENE_FONT_ATLAS
+TEST(pxFontTest, fontAtlasTest)
+{
+  pxFontAtlas atlas;
+  std::vector<uint8_t> glyph(40*40, 0xff);
+
+  GlyphTextureEntry a, b;
+  EXPECT_TRUE(atlas.addGlyph(40, 40, &glyph[0], a));
+  EXPECT_TRUE(atlas.addGlyph(20, 30, &glyph[0], b));
+  EXPECT_EQ(1u, atlas.pageCount());
+  EXPECT_EQ(a.t, b.t);
+  EXPECT_TRUE(a.u2 <= b.u1 || b.u2 <= a.u1 || a.v2 <= b.v1 || b.v2 <= a.v1);
+  EXPECT_TRUE(atlas.isValid(a));
+
+  // too large for the atlas
+  GlyphTextureEntry big;
+  EXPECT_FALSE(atlas.addGlyph(4096, 16, &glyph[0], big));
+
+  // fill every page; pages used in this frame are not evicted
+  uint32_t quarter = PXSCENE_FONT_ATLAS_DIM/4 - 1;
+  std::vector<uint8_t> large(quarter*quarter, 0x80);
+  GlyphTextureEntry e;
+  int added = 0;
+  while (added < 16 * PXSCENE_FONT_ATLAS_MAX_PAGES && atlas.addGlyph(quarter, quarter, &large[0], e))
+    added++;
+  EXPECT_EQ((uint32_t)PXSCENE_FONT_ATLAS_MAX_PAGES, atlas.pageCount());
+  EXPECT_LT(added, 16 * PXSCENE_FONT_ATLAS_MAX_PAGES);
+  EXPECT_TRUE(atlas.isValid(a));
+
+  // in a later frame the least recently used page is evicted, and only
+  // entries on that page go stale
+  GlyphTextureEntry last = e;
+  context.beginFrame();
+  EXPECT_TRUE(atlas.addGlyph(quarter, quarter, &large[0], e));
+  EXPECT_EQ(a.page, e.page);
+  EXPECT_FALSE(atlas.isValid(a));
+  EXPECT_TRUE(atlas.isValid(e));
+  EXPECT_TRUE(atlas.isValid(last));
+  EXPECT_EQ((uint64_t)PXSCENE_FONT_ATLAS_MAX_PAGES * PXSCENE_FONT_ATLAS_DIM * PXSCENE_FONT_ATLAS_DIM, atlas.textureMemoryUsage());
+
+  atlas.clearTexture();
+  EXPECT_EQ(0u, atlas.pageCount());
+  EXPECT_FALSE(atlas.isValid(e));
+}
+
+TEST(pxFontTest, distanceFieldTest)
+{
+  // 10x10 solid square
+  std::vector<uint8_t> square(100, 0xff);
+  std::vector<uint8_t> field;
+  int fw = 0, fh = 0;
+  pxBuildDistanceField(&square[0], 10, 10, 10, PXSCENE_FONT_SDF_SPREAD, field, fw, fh);
+  EXPECT_EQ(10 + 2*PXSCENE_FONT_SDF_SPREAD, fw);
+  EXPECT_EQ(10 + 2*PXSCENE_FONT_SDF_SPREAD, fh);
+
+  int s = PXSCENE_FONT_SDF_SPREAD;
+  EXPECT_EQ(0, field[0]);
+  EXPECT_GT(field[(s+5)*fw + s+5], 200);
+  // values cross the 128 midpoint at the outline
+  EXPECT_GT(field[(s+5)*fw + s], 128);
+  EXPECT_LT(field[(s+5)*fw + s-1], 128);
+
+  // empty glyphs (spaces) are fully outside
+  pxBuildDistanceField(NULL, 0, 0, 0, PXSCENE_FONT_SDF_SPREAD, field, fw, fh);
+  EXPECT_EQ(2*PXSCENE_FONT_SDF_SPREAD, fw);
+  EXPECT_EQ(0, field[fw*fh/2]);
+}
+
+TEST(pxFontTest, textLayoutCacheTest)
+{
+  pxTextLayoutCache::clear();
+
+  pxTextLayoutKey key;
+  key.text = "hello";
+  key.textHash = 1;
+  key.fontId = 1;
+  key.pixelSize = 16;
+  key.distanceField = false;
+  key.positionReads = 0;
+  key.x = key.y = 0;
+  key.w = 100;
+  key.h = 20;
+  key.xStartPos = key.xStopPos = key.leading = 0;
+  key.truncation = key.alignVertical = key.alignHorizontal = 0;
+  key.wordWrap = key.ellipsis = key.clip = false;
+
+  EXPECT_TRUE(NULL == pxTextLayoutCache::find(key));
+  pxTextLayout layout;
+  layout.noClipW = 42;
+  pxTextLayoutCache::insert(key, layout);
+  ASSERT_TRUE(NULL != pxTextLayoutCache::find(key));
+  EXPECT_EQ(42, pxTextLayoutCache::find(key)->noClipW);
+  EXPECT_LT(0u, pxTextLayoutCache::bytes());
+
+  // any layout property or the text itself makes a different entry
+  pxTextLayoutKey wider = key;
+  wider.w = 200;
+  EXPECT_TRUE(NULL == pxTextLayoutCache::find(wider));
+  pxTextLayoutKey other = key;
+  other.text = "world";
+  EXPECT_TRUE(NULL == pxTextLayoutCache::find(other));
+
+  // least recently used entries go first once the cache is out of bytes;
+  // every entry takes at least sizeof(pxTextLayout)
+  size_t count = PXSCENE_TEXT_LAYOUT_CACHE_BYTES / sizeof(pxTextLayout) + 1;
+  for (size_t i = 0; i < count; i++)
+  {
+    pxTextLayoutKey k = key;
+    k.textHash = (uint32_t)i + 2;
+    pxTextLayoutCache::insert(k, layout);
+    pxTextLayoutCache::find(key);
+  }
+  EXPECT_LT(pxTextLayoutCache::size(), (uint32_t)count);
+  EXPECT_GE((size_t)PXSCENE_TEXT_LAYOUT_CACHE_BYTES, pxTextLayoutCache::bytes());
+  EXPECT_TRUE(NULL != pxTextLayoutCache::find(key));
+  pxTextLayoutKey first = key;
+  first.textHash = 2;
+  EXPECT_TRUE(NULL == pxTextLayoutCache::find(first));
+
+  pxTextLayoutCache::clear();
+  EXPECT_EQ(0u, pxTextLayoutCache::size());
+  EXPECT_EQ(0u, pxTextLayoutCache::bytes());
+}
+
+TEST(pxFontTest, appendedTextLayoutTest)
+{
+  pxScene2d* scene = new pxScene2d();
+  rtObjectRef archive;
+  EXPECT_TRUE(RT_OK == scene->loadArchive("supportfiles/test_arc_resources.jar", archive));
+  rtRef<pxFont> font = new pxFont("", 0, "");
+  font->setUrl("XFINITYSansTTCond-Medium.ttf");
+  font->loadResourceFromArchive(scene->getArchive());
+  ASSERT_TRUE(font->isFontLoaded());
+  pxTextLayoutCache::clear();
+
+  rtRef<pxTextBox> incremental = new pxTextBox(scene);
+  rtRef<pxTextBox> full = new pxTextBox(scene);
+  pxTextBox* boxes[2] = { incremental.getPtr(), full.getPtr() };
+  for (int b = 0; b < 2; b++)
+  {
+    boxes[b]->setFont(rtObjectRef(font.getPtr()));
+    boxes[b]->mFontLoaded = true;
+    boxes[b]->mInitialized = true;
+    boxes[b]->setWordWrap(true);
+    boxes[b]->setW(120);
+    boxes[b]->setH(400);
+  }
+
+  const char* text = "a log console that keeps growing\nwith each new message";
+  const char* appended = "a log console that keeps growing\nwith each new message and one more line of it";
+  incremental->setText(text);
+  incremental->recalc();
+  uint32_t lines = (uint32_t)incremental->mRenderPass.lines.size();
+  EXPECT_LT(2u, lines);
+
+  // the appended layout resumes from a recorded line start...
+  incremental->setText(appended);
+  EXPECT_TRUE(NULL != incremental->resumePoint(incremental->mMeasurePass, appended, false));
+  incremental->recalc();
+  EXPECT_LT(lines, (uint32_t)incremental->mRenderPass.lines.size());
+
+  // ...and matches laying out the whole text again
+  pxTextLayoutCache::clear();
+  full->setText(appended);
+  full->recalc();
+  pxTextMeasurements* a = incremental->getMeasurements();
+  pxTextMeasurements* b = full->getMeasurements();
+  EXPECT_EQ(b->getBounds()->x2(), a->getBounds()->x2());
+  EXPECT_EQ(b->getBounds()->y2(), a->getBounds()->y2());
+  EXPECT_EQ(b->getCharLast()->x(), a->getCharLast()->x());
+  EXPECT_EQ(b->getCharLast()->y(), a->getCharLast()->y());
+  EXPECT_EQ(full->lineNumber, incremental->lineNumber);
+  ASSERT_EQ(full->mQuadsVector.size(), incremental->mQuadsVector.size());
+  for (uint32_t i = 0; i < full->mQuadsVector.size(); i++)
+  {
+    pxTexturedQuads& f = full->mQuadsVector[i]->quads;
+    pxTexturedQuads& n = incremental->mQuadsVector[i]->quads;
+    ASSERT_EQ(f.mQuads.size(), n.mQuads.size());
+    for (uint32_t q = 0; q < f.mQuads.size(); q++)
+      EXPECT_TRUE(f.mQuads[q].vertices == n.mQuads[q].vertices);
+  }
+
+  // other layouts do not resume
+  incremental->setWordWrap(false);
+  incremental->recalc();
+  EXPECT_FALSE(incremental->mRenderPass.valid);
+  pxTextLayoutCache::clear();
+  delete scene;
+}
+
+TEST(pxFontTest, texturedQuadsTest)
+{
+  pxFontAtlas atlas;
+  std::vector<uint8_t> glyph(8*8, 0xff);
+  GlyphTextureEntry a;
+  EXPECT_TRUE(atlas.addGlyph(8, 8, &glyph[0], a));
+
+  pxTexturedQuads quads;
+  quads.reserve(3);
+  quads.addQuad(0, 0, 8, 8, a);
+  quads.addQuad(8, 0, 16, 8, a);
+  EXPECT_EQ(1u, quads.mQuads.size());
+  EXPECT_EQ(a.page, quads.mQuads[0].page);
+
+  // x,y,u,v per vertex, two triangles per quad
+  vector<float>& v = quads.mQuads[0].vertices;
+  EXPECT_EQ(2*pxTexturedQuads::floatsPerQuad, v.size());
+  EXPECT_LE(3*pxTexturedQuads::floatsPerQuad, v.capacity());
+  EXPECT_EQ(8, v[24]);
+  EXPECT_EQ(a.u1, v[26]);
+  EXPECT_EQ(16, v[44]);
+  EXPECT_EQ(a.v2, v[47]);
+
+  // a different texture starts a new batch
+  GlyphTextureEntry other;
+  other.u2 = 1;
+  other.v2 = 1;
+  quads.addQuad(0, 0, 8, 8, other);
+  EXPECT_EQ(2u, quads.mQuads.size());
+
+  quads.clear();
+  EXPECT_EQ(0u, quads.mQuads.size());
+  atlas.clearTexture();
+}
+#endif
@@ -25,7 +25,11 @@ limitations under the License.
 #include "pxImage.h"
 #include "pxResource.h"
 #include "rtPromise.h"
+#include "rtSettings.h"
+#include "rtFile.h"
+#include "rtFileDownloader.h"
 #include <string.h>
+#include <algorithm>
 #include <sstream>
 
 #include "test_includes.h" // Needs to be included last
@@ -48,6 +52,14 @@ class MockImageResource : public rtImageResource {
     rtError description(rtString& d) const { d = "rtImageResource"; return RT_OK; }
 };
 
+class countingImageResource : public rtImageResource
+{
+  public:
+    countingImageResource(const char* url) : rtImageResource(url), mReadyCount(0) {}
+    virtual void textureReady() { mReadyCount++; }
+    int mReadyCount;
+};
+
 class pxImageTest : public testing::Test
 {
   public:
@@ -192,12 +204,164 @@ class rtImageResourceTest : public testing::Test
       EXPECT_TRUE(status == PX_RESOURCE_STATUS_FILE_NOT_FOUND);
       delete scene;
     }
+
+    void rtImageResourceContentDedupTest()
+    {
+      pxImageManager::enableContentDedup(true);
+      uint32_t hits = pxImageManager::contentDedupHits();
+
+      // same bytes reached through two different urls
+      rtRef<rtImageResource> first = new rtImageResource("supportfiles/status_bg.png");
+      rtRef<rtImageResource> second = new rtImageResource("supportfiles/../supportfiles/status_bg.png");
+      first->loadResourceFromFile();
+      second->loadResourceFromFile();
+
+      EXPECT_TRUE(first->mTexture.getPtr() != NULL);
+      EXPECT_TRUE(first->mTexture == second->mTexture);
+      EXPECT_TRUE(first->mContentHash == second->mContentHash);
+      EXPECT_EQ(hits + 1, pxImageManager::contentDedupHits());
+
+      ImageContentMap::iterator it = pxImageManager::mImageContentMap.find(first->mContentHash);
+      EXPECT_TRUE(it != pxImageManager::mImageContentMap.end());
+      EXPECT_EQ(2u, it->second.users.size());
+      pxImageManager::enableContentDedup(false);
+    }
+
+    void rtImageResourceContentDedupListenerTest()
+    {
+      pxImageManager::enableContentDedup(true);
+
+      rtRef<countingImageResource> first = new countingImageResource("supportfiles/status_bg.png");
+      rtRef<countingImageResource> second = new countingImageResource("supportfiles/../supportfiles/status_bg.png");
+      first->loadResourceFromFile();
+      second->loadResourceFromFile();
+      EXPECT_TRUE(first->mTexture == second->mTexture);
+
+      // every resource sharing the texture hears that it was (re)created
+      pxOffscreen o;
+      o.init(4, 4);
+      first->mTexture->createTexture(o);
+      EXPECT_EQ(1, first->mReadyCount);
+      EXPECT_EQ(1, second->mReadyCount);
+
+      rtString hash = first->mContentHash;
+      pxTextureRef texture = first->mTexture;
+      second = NULL;
+      texture->createTexture(o);
+      EXPECT_EQ(2, first->mReadyCount);
+
+      first = NULL;
+      EXPECT_TRUE(pxImageManager::mImageContentMap.find(hash) == pxImageManager::mImageContentMap.end());
+      pxImageManager::enableContentDedup(false);
+    }
+
+    void rtImageResourceStreamingDecodeSettingsTest()
+    {
+      // streaming is on unless disabled; partial images are opt-in
+      rtSettings::instance()->remove("enableStreamingImageDecode");
+      rtSettings::instance()->remove("enablePartialImages");
+      pxImageManager::mStreamingDecodeEnabled = -1;
+      pxImageManager::mPartialImagesEnabled = -1;
+      EXPECT_TRUE(pxImageManager::streamingDecodeEnabled());
+      EXPECT_FALSE(pxImageManager::partialImagesEnabled());
+
+      rtSettings::instance()->setValue("enablePartialImages", true);
+      pxImageManager::mPartialImagesEnabled = -1;
+      EXPECT_TRUE(pxImageManager::partialImagesEnabled());
+
+      rtSettings::instance()->setValue("enableStreamingImageDecode", "0");
+      pxImageManager::mStreamingDecodeEnabled = -1;
+      pxImageManager::mPartialImagesEnabled = -1;
+      EXPECT_FALSE(pxImageManager::streamingDecodeEnabled());
+      EXPECT_FALSE(pxImageManager::partialImagesEnabled());
+
+      rtSettings::instance()->remove("enableStreamingImageDecode");
+      rtSettings::instance()->remove("enablePartialImages");
+      pxImageManager::mStreamingDecodeEnabled = -1;
+      pxImageManager::mPartialImagesEnabled = -1;
+    }
+
+    void rtImageResourceStreamChunksTest()
+    {
+      rtData data;
+      EXPECT_EQ(RT_OK, rtLoadFile("supportfiles/status_bg.png", data));
+      pxImageManager::enableStreamingDecode(true, false);
+
+      rtRef<rtImageResource> resource = new rtImageResource("http://localhost/status_bg.png");
+      rtFileDownloadRequest* request = new rtFileDownloadRequest("http://localhost/status_bg.png", NULL);
+      resource->prepareDownloadRequest(request);
+      EXPECT_TRUE(request->streamConsumer() == resource.getPtr());
+
+      // the download thread only queues the chunks; decoding happens on a pool
+      const char* bytes = (const char*)data.data();
+      size_t size = data.length();
+      for (size_t offset = 0; offset < size; offset += 100)
+      {
+        resource->onDownloadData(request, bytes + offset, std::min(size - offset, (size_t)100));
+      }
+      resource->waitForStreamChunks();
+      EXPECT_FALSE(resource->mStreamDecodeScheduled);
+      EXPECT_TRUE(resource->mStreamChunks.empty());
+      ASSERT_TRUE(resource->mStreamDecoder != NULL);
+      EXPECT_TRUE(resource->mStreamDecoder->isComplete());
+
+      // chunks of a request the resource no longer follows are dropped
+      rtFileDownloadRequest* stale = new rtFileDownloadRequest("http://localhost/status_bg.png", NULL);
+      resource->onDownloadData(stale, bytes, size);
+      EXPECT_FALSE(resource->mStreamDecodeScheduled);
+
+      resource->releaseStreamDecoder(request);
+      EXPECT_TRUE(resource->mStreamDecoder == NULL);
+      pxImageManager::removePendingDownload(resource.getPtr(), request);
+      delete stale;
+      delete request;
+      pxImageManager::mStreamingDecodeEnabled = -1;
+      pxImageManager::mPartialImagesEnabled = -1;
+    }
+
+    void rtImageResourceNestedSceneHintTest()
+    {
+      // an object outside its small child scene but inside the top scene
+      // the child is drawn in is visible
+      pxScene2d* top = new pxScene2d(true);
+      top->onSize(1000, 1000);
+      pxScene2d* child = new pxScene2d(false);
+      child->onSize(100, 100);
+      rtRef<pxSceneContainer> container = new pxSceneContainer(top);
+      container->setParent(top->getRoot());
+      child->setViewContainer(container.getPtr());
+      rtRef<pxObject> o = new pxObject(child);
+      o->setParent(child->getRoot());
+      o->setX(500);
+      o->setY(500);
+
+      rtImageResource res("supportfiles/status_bg.png");
+      res.takeDownloadPriorityHint();
+      res.hintDownloadPriority(o.getPtr(), 10, 10);
+      EXPECT_EQ(RT_DOWNLOAD_PRIORITY_VISIBLE, res.takeDownloadPriorityHint());
+
+      // the container's position in the top scene counts too
+      container->setX(600);
+      res.hintDownloadPriority(o.getPtr(), 10, 10);
+      EXPECT_EQ(RT_DOWNLOAD_PRIORITY_NEAR, res.takeDownloadPriorityHint());
+
+      child->setViewContainer(NULL);
+      o->remove();
+      container->remove();
+      delete child;
+      delete top;
+    }
 };
 
 TEST_F(rtImageResourceTest, rtImageResourcesTest)
 {
     rtImageResourceLoadFromArchiveSuccessTest();
     rtImageResourceLoadFromArchiveFailureTest();
+    rtImageResourceContentDedupTest();
+    rtImageResourceContentDedupListenerTest();
+    rtImageResourceStreamingDecodeSettingsTest();
+    rtImageResourceStreamChunksTest();
+    rtImageResourceNestedSceneHintTest();
 }
 
 class rtImageAResourceTest : public testing::Test
@@ -34,6 +34,8 @@ limitations under the License.
 #include <pxCore.h>
 #include <dlfcn.h>
 #include <png.h>
+#include <stdio.h>
+#include <jpeglib.h>
 
 #include "test_includes.h" // Needs to be included last
 
@@ -438,3 +440,154 @@ TEST_F(pxUtilTest, pxutilsTest)
     pxIsPngImageTest();
     pxIsJpgImageTest();
 };
+
+class pxImageStreamDecoderTest : public testing::Test
+{
+  public:
+    // Encodes a gradient with libjpeg, baseline or progressive
+    void encodeJpeg(int width, int height, bool progressive, rtData& jpegData)
+    {
+      struct jpeg_compress_struct cinfo;
+      struct jpeg_error_mgr jerr;
+      unsigned char* buffer = NULL;
+      unsigned long bufferSize = 0;
+
+      cinfo.err = jpeg_std_error(&jerr);
+      jpeg_create_compress(&cinfo);
+      jpeg_mem_dest(&cinfo, &buffer, &bufferSize);
+      cinfo.image_width = width;
+      cinfo.image_height = height;
+      cinfo.input_components = 3;
+      cinfo.in_color_space = JCS_RGB;
+      jpeg_set_defaults(&cinfo);
+      jpeg_set_quality(&cinfo, 90, TRUE);
+      if (progressive)
+      {
+        jpeg_simple_progression(&cinfo);
+      }
+      jpeg_start_compress(&cinfo, TRUE);
+      std::vector<unsigned char> row(width * 3);
+      while (cinfo.next_scanline < cinfo.image_height)
+      {
+        for (int x = 0; x < width; x++)
+        {
+          row[x * 3] = (unsigned char)(x * 255 / width);
+          row[x * 3 + 1] = (unsigned char)(cinfo.next_scanline * 255 / height);
+          row[x * 3 + 2] = (unsigned char)((x + cinfo.next_scanline) & 0xff);
+        }
+        JSAMPROW rowPointer = &row[0];
+        jpeg_write_scanlines(&cinfo, &rowPointer, 1);
+      }
+      jpeg_finish_compress(&cinfo);
+      jpeg_destroy_compress(&cinfo);
+      jpegData.init(buffer, bufferSize);
+      free(buffer);
+    }
+
+    // Feeds the data in chunkSize pieces and checks the result against pxLoadImage()
+    void streamAndCompare(rtData& d, size_t chunkSize, bool expectPartialRows)
+    {
+      pxOffscreen expected;
+      EXPECT_EQ (RT_OK, pxLoadImage((const char*)d.data(), d.length(), expected));
+
+      pxImageStreamDecoder decoder;
+      bool sawPartialRows = false;
+      for (size_t offset = 0; offset < d.length(); offset += chunkSize)
+      {
+        size_t size = (d.length() - offset < chunkSize) ? d.length() - offset : chunkSize;
+        EXPECT_EQ (RT_OK, decoder.write((const char*)d.data() + offset, size));
+        if (!decoder.isComplete() && decoder.rowsDecoded() > 0)
+        {
+          sawPartialRows = true;
+        }
+      }
+      EXPECT_TRUE (decoder.isComplete());
+      EXPECT_EQ (expectPartialRows, sawPartialRows);
+      EXPECT_EQ (RT_OK, decoder.finish());
+
+      pxOffscreen& o = decoder.offscreen();
+      EXPECT_EQ (expected.width(), o.width());
+      EXPECT_EQ (expected.height(), o.height());
+      EXPECT_EQ (expected.mPixelFormat, o.mPixelFormat);
+      bool samePixels = (expected.width() == o.width() && expected.height() == o.height());
+      for (int y = 0; samePixels && y < o.height(); y++)
+      {
+        samePixels = (memcmp(expected.scanline(y), o.scanline(y), o.width() * 4) == 0);
+      }
+      EXPECT_TRUE (samePixels);
+    }
+
+    void pngTest()
+    {
+      rtData d;
+      EXPECT_EQ (RT_OK, rtLoadFile("supportfiles/status_bg.png", d));
+      streamAndCompare(d, 7, true);
+      streamAndCompare(d, d.length(), false);
+    }
+
+    void jpegTest()
+    {
+      rtData d;
+      encodeJpeg(320, 240, false, d);
+      streamAndCompare(d, 100, true);
+      streamAndCompare(d, d.length(), false);
+    }
+
+    void progressiveJpegTest()
+    {
+      rtData d;
+      encodeJpeg(320, 240, true, d);
+      streamAndCompare(d, 100, true);
+      streamAndCompare(d, 1, true);
+    }
+
+    void snapshotTest()
+    {
+      rtData d;
+      encodeJpeg(256, 256, false, d);
+
+      pxImageStreamDecoder decoder;
+      pxOffscreen o;
+      EXPECT_EQ (RT_FAIL, decoder.snapshot(o));
+      EXPECT_EQ (RT_OK, decoder.write((const char*)d.data(), d.length() / 2));
+      EXPECT_TRUE (decoder.hasImageSize());
+      EXPECT_FALSE (decoder.isComplete());
+      EXPECT_EQ (RT_FAIL, decoder.finish());
+      EXPECT_EQ (RT_OK, decoder.snapshot(o));
+      EXPECT_EQ (256, o.width());
+      EXPECT_EQ (256, o.height());
+    }
+
+    void failureTest()
+    {
+      pxImageStreamDecoder svgDecoder;
+      const char* svg = "<svg xmlns=\"http://www.w3.org/2000/svg\"></svg>";
+      EXPECT_EQ (RT_FAIL, svgDecoder.write(svg, strlen(svg)));
+      EXPECT_TRUE (svgDecoder.failed());
+
+      rtData d;
+      encodeJpeg(64, 64, false, d);
+      // corrupt the frame header so the image size is zero
+      for (size_t i = 0; i + 1 < d.length(); i++)
+      {
+        if (d.data()[i] == 0xFF && d.data()[i + 1] == 0xC0)
+        {
+          memset(d.data() + i + 5, 0, 4);
+          break;
+        }
+      }
+      pxImageStreamDecoder jpegDecoder;
+      EXPECT_EQ (RT_FAIL, jpegDecoder.write((const char*)d.data(), d.length()));
+      EXPECT_TRUE (jpegDecoder.failed());
+      EXPECT_EQ (RT_FAIL, jpegDecoder.write((const char*)d.data(), d.length()));
+    }
+};
+
+TEST_F(pxImageStreamDecoderTest, pxImageStreamDecoderTests)
+{
+  pngTest();
+  jpegTest();
+  progressiveJpegTest();
+  snapshotTest();
+  failureTest();
+}
@@ -27,6 +27,7 @@ limitations under the License.
 #include "rtObject.h"
 #include <pxTexture.h>
 #include <pxContext.h>
+#include <pxUtil.h>
 #include <rtRef.h>
 #include <stdlib.h>
 
@@ -37,6 +38,7 @@ class solidShaderProgram;
 extern solidShaderProgram*  gSolidShader;
 extern std::vector<pxTexture*> textureList;
 extern rtMutex textureListMutex;
+extern pxContext context;
 pxError addToTextureList(pxTexture* texture);
 pxError removeFromTextureList(pxTexture* texture);
 pxError ejectNotRecentlyUsedTextureMemory(int64_t bytesNeeded, uint32_t maxAge=5);
@@ -357,6 +359,96 @@ class pxContextTest : public testing::Test
       mContext.mEnableTextureMemoryMonitoring = mEnableTextureMemoryMonitoringTemp;
     }   
 
+    void autoMipmapTest()
+    {
+      pxOffscreen o;
+      o.init(64, 64);
+      o.fill(pxRed);
+      pxTextureRef texture = mContext.createTexture(o);
+      EXPECT_FALSE (texture->mipmapRequested());
+      EXPECT_TRUE (texture->mipmapMemoryUsage() == 0);
+      // drawn at full size, no mipmaps needed
+      mContext.drawImage(0, 0, 64, 64, texture, NULL, false);
+      EXPECT_FALSE (texture->mipmapRequested());
+      // drawn at an eighth of its size
+      mContext.drawImage(0, 0, 8, 8, texture, NULL, false);
+      EXPECT_TRUE (texture->mipmapRequested());
+      // 32x32 + 16x16 + ... + 1x1
+      EXPECT_TRUE (texture->mipmapMemoryUsage() == 5460);
+    }
+
+
+    void cpuMemoryAccountingTest()
+    {
+      int64_t before = mContext.currentCpuMemoryUsageInBytes();
+      int64_t fontBefore = mContext.currentCpuMemoryUsageInBytes(PX_CPU_MEMORY_FONT);
+      mContext.adjustCurrentCpuMemorySize(PX_CPU_MEMORY_FONT, 1000);
+      EXPECT_TRUE (mContext.currentCpuMemoryUsageInBytes(PX_CPU_MEMORY_FONT) == fontBefore + 1000);
+      EXPECT_TRUE (mContext.currentCpuMemoryUsageInBytes() == before + 1000);
+
+      // no limit by default
+      EXPECT_TRUE (mContext.cpuMemoryOverflow() == 0);
+      mContext.setCpuMemoryLimit(before + 400);
+      EXPECT_TRUE (mContext.cpuMemoryOverflow() == 600);
+      mContext.setCpuMemoryLimit(0);
+      mContext.adjustCurrentCpuMemorySize(PX_CPU_MEMORY_FONT, -1000);
+      EXPECT_TRUE (mContext.currentCpuMemoryUsageInBytes() == before);
+    }
+
+    void compressedImageAccountingTest()
+    {
+      pxOffscreen o;
+      o.init(128, 128);
+      rtData png;
+      EXPECT_TRUE (pxStorePNGImage(o, png) == RT_OK);
+      int64_t before = context.currentCpuMemoryUsageInBytes(PX_CPU_MEMORY_COMPRESSED_IMAGE);
+      {
+        pxTextureRef texture = mContext.createTexture(o, (const char*)png.data(), png.length());
+        EXPECT_TRUE (context.currentCpuMemoryUsageInBytes(PX_CPU_MEMORY_COMPRESSED_IMAGE) == before + (int64_t)png.length());
+        EXPECT_TRUE (texture->cpuMemoryUsage() >= (int64_t)png.length());
+        // nothing to fetch it back from, so it has to stay
+        EXPECT_TRUE (texture->releaseCompressedData() == 0);
+        // never uploaded, so the decode still needs it
+        texture->setCompressedDataUrl("supportfiles/status_bg.png");
+        EXPECT_TRUE (texture->releaseCompressedData() == 0);
+        EXPECT_TRUE (context.currentCpuMemoryUsageInBytes(PX_CPU_MEMORY_COMPRESSED_IMAGE) == before + (int64_t)png.length());
+      }
+      EXPECT_TRUE (context.currentCpuMemoryUsageInBytes(PX_CPU_MEMORY_COMPRESSED_IMAGE) == before);
+    }
+
+#ifdef PXSCENE_IMAGE_ATLAS
+    void imageAtlasTest()
+    {
+      pxOffscreen o;
+      o.init(16, 16);
+      o.fill(pxRed);
+      rtData png;
+      EXPECT_TRUE (pxStorePNGImage(o, png) == RT_OK);
+      pxTextureRef small = mContext.createTexture(o, (const char*)png.data(), png.length());
+      mContext.drawImage(0, 0, 16, 16, small, NULL, false);
+      float u1, v1, u2, v2;
+      pxTextureRef page;
+      EXPECT_TRUE (small->atlasRect(page, u1, v1, u2, v2) == PX_OK);
+      EXPECT_TRUE (page.getPtr() != NULL && page.getPtr() != small.getPtr());
+      EXPECT_TRUE (u1 > 0 && u2 > u1 && u2 <= 1);
+      EXPECT_TRUE (v1 > 0 && v2 > v1 && v2 <= 1);
+      // an evicted entry has to reload before it can go back into a page
+      small->unloadTextureData();
+      EXPECT_TRUE (small->atlasRect(page, u1, v1, u2, v2) == PX_NOTINITIALIZED);
+
+      // pages carry no mip chain, so mipmapped images leave the atlas
+      pxTextureRef mipmapped = mContext.createTexture(o, (const char*)png.data(), png.length());
+      mContext.drawImage(0, 0, 16, 16, mipmapped, NULL, false);
+      EXPECT_TRUE (mipmapped->atlasRect(page, u1, v1, u2, v2) == PX_OK);
+      mipmapped->setMipmapRequested(true);
+      EXPECT_TRUE (mipmapped->atlasRect(page, u1, v1, u2, v2) == PX_FAIL);
+
+      pxOffscreen big;
+      big.init(512, 512);
+      pxTextureRef large = mContext.createTexture(big, (const char*)png.data(), png.length());
+      EXPECT_TRUE (large->atlasRect(page, u1, v1, u2, v2) == PX_FAIL);
+    }
+#endif //PXSCENE_IMAGE_ATLAS
 
 private:
 
@@ -396,6 +488,12 @@ TEST_F(pxContextTest, pxContextTests)
   drawImageTextureDimDefault();
   drawImage9BorderTest();
   isTextureSpaceAvailableTest();
+  autoMipmapTest();
+  cpuMemoryAccountingTest();
+  compressedImageAccountingTest();
+#ifdef PXSCENE_IMAGE_ATLAS
+  imageAtlasTest();
+#endif //PXSCENE_IMAGE_ATLAS
 }
 
 
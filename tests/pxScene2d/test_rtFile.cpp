@@ -138,6 +138,43 @@ class rtDataTest : public testing::Test
       EXPECT_TRUE (rtLoadFile("supportfiles1/storedata.txt",mData) == RT_FAIL);
       EXPECT_TRUE (mData.length() == 0);
     }
+
+    void mapDataSuccessTest()
+    {
+      int sysret = system("echo \"Hello\" > supportfiles/storedata.txt");
+      EXPECT_TRUE (rtMapFile("supportfiles/storedata.txt",mData) == RT_OK);
+      EXPECT_TRUE (mData.isView());
+      EXPECT_TRUE (mData.length() == 6);
+      EXPECT_TRUE (memcmp("Hello\n", mData.data(), 6) == 0);
+
+      // a view of part of the mapping outlives the rtData it came from
+      rtData part;
+      EXPECT_TRUE (part.initView(mData, 1, 4) == RT_OK);
+      EXPECT_TRUE (part.initView(mData, 4, 4) == RT_FAIL);
+      mData.term();
+      EXPECT_TRUE (part.isView());
+      EXPECT_TRUE (part.length() == 4);
+      EXPECT_TRUE (memcmp("ello", part.data(), 4) == 0);
+      sysret = system("rm -rf supportfiles/storedata.txt");
+      EXPECT_TRUE(sysret == RT_OK);
+    }
+
+    void mapDataFailureTest()
+    {
+      EXPECT_TRUE (rtMapFile("supportfiles1/storedata.txt",mData) == RT_FAIL);
+      EXPECT_FALSE (mData.isView());
+    }
+
+    void viewOfOwnedDataCopiesTest()
+    {
+      char data[] = "test";
+      mData.init((uint8_t*) &data, 4);
+      rtData copy;
+      EXPECT_TRUE (copy.initView(mData, 0, 4) == RT_OK);
+      EXPECT_FALSE (copy.isView());
+      EXPECT_TRUE (copy.data() != mData.data());
+      EXPECT_TRUE (strcmp((char*) copy.data(), "test") == 0);
+    }
     private:
       rtData mData;
 };
@@ -154,6 +191,9 @@ TEST_F(rtDataTest, rtDataTests)
   storeDataFailedTest();
   loadDataSuccessTest();
   loadDataFailureTest();
+  mapDataSuccessTest();
+  mapDataFailureTest();
+  viewOfOwnedDataCopiesTest();
 }
 
 class rtFilePointerTest : public testing::Test
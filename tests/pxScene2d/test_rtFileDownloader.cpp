@@ -0,0 +1,729 @@
+/*
+
+pxCore Copyright 2005-2018 John Robinson
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+*/
+
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#define private public
+#define protected public
+
+#include "rtFileDownloader.h"
+#include "rtThreadPool.h"
+#include "rtMutex.h"
+#include "rtLog.h"
+#include "pxTimer.h"
+
+#include "test_includes.h" // Needs to be included last
+
+using namespace std;
+
+namespace
+{
+  const size_t kBodySize = 16 * 1024;
+  const size_t kLargeBodySize = 4 * 1024 * 1024;
+
+  // Minimal HTTP/1.1 stand-in with keep-alive, so the tests and the
+  // benchmark do not depend on the network.  Every response is delayed by
+  // the configured latency; /slow responses take a couple of seconds.
+  // /large sends a large body and /chunked sends the same body with chunked
+  // encoding, so without a Content-Length.
+  class localHttpServer
+  {
+  public:
+    localHttpServer()
+      : mListenFd(-1), mPort(0), mRunning(false), mConnections(0), mRequests(0),
+        mLatencyInMilliSeconds(0), mAcceptThread(NULL), mBody(kBodySize, 'x'),
+        mLargeBody(kLargeBodySize, 'y')
+    {
+    }
+
+    ~localHttpServer()
+    {
+      stop();
+    }
+
+    bool start()
+    {
+      mListenFd = socket(AF_INET, SOCK_STREAM, 0);
+      if (mListenFd < 0)
+        return false;
+      int one = 1;
+      setsockopt(mListenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      struct sockaddr_in address;
+      memset(&address, 0, sizeof(address));
+      address.sin_family = AF_INET;
+      address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      address.sin_port = 0;
+      socklen_t length = sizeof(address);
+      if (bind(mListenFd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+          listen(mListenFd, 128) != 0 ||
+          getsockname(mListenFd, (struct sockaddr*)&address, &length) != 0)
+      {
+        close(mListenFd);
+        mListenFd = -1;
+        return false;
+      }
+      mPort = ntohs(address.sin_port);
+      mRunning = true;
+      mAcceptThread = new std::thread(&localHttpServer::acceptConnections, this);
+      return true;
+    }
+
+    void stop()
+    {
+      if (mAcceptThread == NULL)
+        return;
+      mRunning = false;
+      shutdown(mListenFd, SHUT_RDWR);
+      mAcceptThread->join();
+      delete mAcceptThread;
+      mAcceptThread = NULL;
+      close(mListenFd);
+      mListenFd = -1;
+
+      mMutex.lock();
+      for (size_t i = 0; i < mConnectionFds.size(); i++)
+        shutdown(mConnectionFds[i], SHUT_RDWR);
+      mMutex.unlock();
+      for (size_t i = 0; i < mConnectionThreads.size(); i++)
+      {
+        mConnectionThreads[i]->join();
+        delete mConnectionThreads[i];
+      }
+      mConnectionThreads.clear();
+      for (size_t i = 0; i < mConnectionFds.size(); i++)
+        close(mConnectionFds[i]);
+      mConnectionFds.clear();
+    }
+
+    std::vector<std::string> paths()
+    {
+      mMutex.lock();
+      std::vector<std::string> paths = mPaths;
+      mMutex.unlock();
+      return paths;
+    }
+
+    rtString url(const char* path)
+    {
+      char buffer[64];
+      sprintf(buffer, "http://127.0.0.1:%d%s", mPort, path);
+      return rtString(buffer);
+    }
+
+    int mListenFd;
+    int mPort;
+    std::atomic<bool> mRunning;
+    std::atomic<int> mConnections;
+    std::atomic<int> mRequests;
+    std::atomic<int> mLatencyInMilliSeconds;
+
+  private:
+    void acceptConnections()
+    {
+      while (mRunning)
+      {
+        int fd = accept(mListenFd, NULL, NULL);
+        if (fd < 0)
+          continue;
+        mConnections++;
+        mMutex.lock();
+        mConnectionFds.push_back(fd);
+        mConnectionThreads.push_back(new std::thread(&localHttpServer::serveConnection, this, fd));
+        mMutex.unlock();
+      }
+    }
+
+    void sleepWhileRunning(int ms)
+    {
+      for (int slept = 0; slept < ms && mRunning; slept += 10)
+        pxSleepMS(10);
+    }
+
+    void serveConnection(int fd)
+    {
+      std::string request;
+      char buffer[4096];
+      while (mRunning)
+      {
+        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+        if (received <= 0)
+          break;
+        request.append(buffer, received);
+        size_t end;
+        while ((end = request.find("\r\n\r\n")) != std::string::npos)
+        {
+          bool slow = request.compare(0, 9, "GET /slow") == 0;
+          bool large = request.compare(0, 10, "GET /large") == 0;
+          bool chunked = request.compare(0, 12, "GET /chunked") == 0;
+          mMutex.lock();
+          mPaths.push_back(request.substr(4, request.find(' ', 4) - 4));
+          mMutex.unlock();
+          request.erase(0, end + 4);
+          mRequests++;
+          sleepWhileRunning(slow ? 2000 : mLatencyInMilliSeconds.load());
+
+          std::string response;
+          if (chunked)
+          {
+            response = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nContent-Type: text/plain\r\n\r\n";
+            for (size_t offset = 0; offset < mLargeBody.size(); offset += 4096)
+            {
+              size_t length = min((size_t)4096, mLargeBody.size() - offset);
+              char chunkHeader[16];
+              sprintf(chunkHeader, "%x\r\n", (unsigned int)length);
+              response.append(chunkHeader);
+              response.append(mLargeBody, offset, length);
+              response.append("\r\n");
+            }
+            response.append("0\r\n\r\n");
+          }
+          else
+          {
+            const std::string& body = large ? mLargeBody : mBody;
+            char header[128];
+            sprintf(header, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\nContent-Type: text/plain\r\n\r\n", (int)body.size());
+            response = header;
+            response.append(body);
+          }
+          if (send(fd, response.data(), response.size(), MSG_NOSIGNAL) < 0)
+            return;
+        }
+      }
+    }
+
+    std::thread* mAcceptThread;
+    std::string mBody;
+    std::string mLargeBody;
+    rtMutex mMutex;
+    std::vector<int> mConnectionFds;
+    std::vector<std::thread*> mConnectionThreads;
+    std::vector<std::string> mPaths;
+  };
+}
+
+class countingStreamConsumer : public rtFileDownloadStreamConsumer
+{
+public:
+  countingStreamConsumer() : mBytes(0), mChunks(0), mLastByte(0) {}
+
+  virtual void onDownloadData(rtFileDownloadRequest* /*downloadRequest*/, const char* data, size_t size)
+  {
+    mBytes += size;
+    mChunks++;
+    if (size > 0)
+    {
+      mLastByte = data[size - 1];
+    }
+  }
+
+  size_t mBytes;
+  int mChunks;
+  char mLastByte;
+};
+
+class rtFileDownloaderTest : public testing::Test
+{
+public:
+  virtual void SetUp()
+  {
+    mCompleted = 0;
+    mSucceeded = 0;
+    mCanceled = 0;
+    EXPECT_TRUE(mServer.start());
+  }
+
+  virtual void TearDown()
+  {
+    mServer.stop();
+  }
+
+  static void downloadCallback(rtFileDownloadRequest* request)
+  {
+    rtFileDownloaderTest* test = (rtFileDownloaderTest*)request->callbackData();
+    if (request->downloadStatusCode() == 0 && request->httpStatusCode() == 200 &&
+        request->downloadedDataSize() == kBodySize)
+    {
+      test->mSucceeded++;
+    }
+    if (request->downloadStatusCode() == -1)
+    {
+      test->mCanceled++;
+    }
+    test->mCompleted++;
+  }
+
+  rtFileDownloadRequest* queueDownload(const char* path)
+  {
+    rtFileDownloadRequest* request = new rtFileDownloadRequest(mServer.url(path).cString(), this, downloadCallback);
+#ifdef ENABLE_HTTP_CACHE
+    request->setCacheEnabled(false);
+#endif
+    rtFileDownloader::instance()->addToDownloadQueue(request);
+    return request;
+  }
+
+  bool waitForDownloads(int count, double timeoutInSeconds)
+  {
+    double end = pxSeconds() + timeoutInSeconds;
+    while (mCompleted < count && pxSeconds() < end)
+    {
+      pxSleepMS(5);
+    }
+    return mCompleted == count;
+  }
+
+  double timeDownloads(int count)
+  {
+    mCompleted = 0;
+    mSucceeded = 0;
+    double start = pxMilliseconds();
+    for (int i = 0; i < count; i++)
+    {
+      char path[32];
+      sprintf(path, "/file%d", i);
+      queueDownload(path);
+    }
+    EXPECT_TRUE(waitForDownloads(count, 60));
+    EXPECT_EQ(count, mSucceeded.load());
+    return pxMilliseconds() - start;
+  }
+
+  void concurrentDownloadsTest()
+  {
+    const int count = 50;
+    mServer.mLatencyInMilliSeconds = 10;
+    for (int i = 0; i < count; i++)
+    {
+      char path[32];
+      sprintf(path, "/image%d.png", i);
+      queueDownload(path);
+    }
+    EXPECT_TRUE(waitForDownloads(count, 30));
+    EXPECT_EQ(count, mSucceeded.load());
+    EXPECT_EQ(count, mServer.mRequests.load());
+#ifdef PX_MULTI_DOWNLOADS
+    // connections are reused and capped per host
+    if (rtFileDownloader::instance()->mDownloadEngine != NULL)
+    {
+      EXPECT_TRUE(mServer.mConnections.load() <= 6); // maxDownloadConnectionsPerHost
+    }
+#endif
+  }
+
+  void cancelInFlightTest()
+  {
+    rtFileDownloadRequest* request = queueDownload("/slow");
+    pxSleepMS(100);
+    rtFileDownloader::cancelDownloadRequestThreadSafe(request, this);
+#ifdef PX_MULTI_DOWNLOADS
+    // the transfer is aborted rather than left to finish
+    if (rtFileDownloader::instance()->mDownloadEngine != NULL)
+    {
+      EXPECT_TRUE(waitForDownloads(1, 1.5));
+      EXPECT_EQ(1, mCanceled.load());
+      EXPECT_EQ(0, mSucceeded.load());
+    }
+#endif
+    waitForDownloads(1, 10);
+  }
+
+  void cancelQueuedTest()
+  {
+#ifdef PX_MULTI_DOWNLOADS
+    if (rtFileDownloader::instance()->mDownloadEngine == NULL)
+      return;
+    // a request waiting for one of the host's connections completes as
+    // canceled without waiting for a connection to free up
+    const int hostConnections = 6; // maxDownloadConnectionsPerHost
+    mServer.mLatencyInMilliSeconds = 1000;
+    for (int i = 0; i < hostConnections; i++)
+    {
+      char path[32];
+      sprintf(path, "/slow%d", i);
+      queueDownload(path);
+    }
+    queueDownload("/queued0");
+    rtFileDownloadRequest* second = queueDownload("/queued1");
+    pxSleepMS(100);
+    rtFileDownloader::cancelDownloadRequestThreadSafe(second, this);
+    EXPECT_TRUE(waitForDownloads(1, 0.5));
+    EXPECT_EQ(1, mCanceled.load());
+    EXPECT_EQ(0, mSucceeded.load());
+
+    // the request ahead of it still starts once a connection is free
+    EXPECT_TRUE(waitForDownloads(hostConnections + 2, 10));
+    EXPECT_EQ(hostConnections + 1, mSucceeded.load());
+    EXPECT_EQ(hostConnections + 1, mServer.mRequests.load());
+#endif
+  }
+
+  void coalesceTest()
+  {
+    mServer.mLatencyInMilliSeconds = 100;
+    for (int i = 0; i < 3; i++)
+    {
+      queueDownload("/logo.png");
+    }
+    queueDownload("/other.png");
+    EXPECT_TRUE(waitForDownloads(4, 10));
+    EXPECT_EQ(4, mSucceeded.load());
+    EXPECT_EQ(2, mServer.mRequests.load());
+  }
+
+  void coalesceCancelWaiterTest()
+  {
+    mServer.mLatencyInMilliSeconds = 100;
+    queueDownload("/logo.png");
+    rtFileDownloadRequest* waiter = queueDownload("/logo.png");
+    queueDownload("/logo.png");
+    rtFileDownloader::cancelDownloadRequestThreadSafe(waiter, this);
+    EXPECT_TRUE(waitForDownloads(3, 10));
+    EXPECT_EQ(2, mSucceeded.load());
+    EXPECT_EQ(1, mCanceled.load());
+    EXPECT_EQ(1, mServer.mRequests.load());
+  }
+
+  void coalesceCancelFirstTest()
+  {
+    mServer.mLatencyInMilliSeconds = 300;
+    rtFileDownloadRequest* first = queueDownload("/logo.png");
+    queueDownload("/logo.png");
+    pxSleepMS(50);
+    rtFileDownloader::cancelDownloadRequestThreadSafe(first, this);
+    EXPECT_TRUE(waitForDownloads(2, 10));
+    // the other request gets the data whether the canceled transfer was
+    // abandoned or ran to completion
+    if (mCanceled.load() == 1)
+    {
+      EXPECT_EQ(1, mSucceeded.load());
+    }
+    else
+    {
+      EXPECT_EQ(2, mSucceeded.load());
+    }
+  }
+
+  void coalesceStreamTest()
+  {
+    // streamed requests share the transfer and each consumer sees the body
+    mServer.mLatencyInMilliSeconds = 100;
+    countingStreamConsumer consumers[3];
+    for (int i = 0; i < 3; i++)
+    {
+      rtFileDownloadRequest* request = new rtFileDownloadRequest(mServer.url("/logo.png").cString(), this, downloadCallback);
+#ifdef ENABLE_HTTP_CACHE
+      request->setCacheEnabled(false);
+#endif
+      request->setStreamConsumer(&consumers[i]);
+      rtFileDownloader::instance()->addToDownloadQueue(request);
+    }
+    EXPECT_TRUE(waitForDownloads(3, 10));
+    EXPECT_EQ(3, mSucceeded.load());
+    EXPECT_EQ(1, mServer.mRequests.load());
+    for (int i = 0; i < 3; i++)
+    {
+      EXPECT_EQ(kBodySize, consumers[i].mBytes);
+    }
+  }
+
+  void coalescePriorityTest()
+  {
+#ifdef PX_MULTI_DOWNLOADS
+    rtFileDownloader* downloader = rtFileDownloader::instance();
+    if (downloader->mDownloadEngine == NULL)
+      return;
+    // the shared transfer waits in the engine behind the busy connections
+    const int hostConnections = 6; // maxDownloadConnectionsPerHost
+    mServer.mLatencyInMilliSeconds = 500;
+    for (int i = 0; i < hostConnections; i++)
+    {
+      char path[32];
+      sprintf(path, "/slow%d", i);
+      queueDownload(path);
+    }
+    rtFileDownloadRequest* owner = queueDownload("/shared.png");
+    downloader->setDownloadPriority(owner, RT_DOWNLOAD_PRIORITY_PREFETCH);
+    EXPECT_EQ(RT_DOWNLOAD_PRIORITY_PREFETCH, owner->downloadPriority());
+
+    // a waiter becoming visible moves the transfer it waits on
+    rtFileDownloadRequest* waiter = queueDownload("/shared.png");
+    downloader->setDownloadPriority(waiter, RT_DOWNLOAD_PRIORITY_VISIBLE);
+    EXPECT_EQ(RT_DOWNLOAD_PRIORITY_VISIBLE, owner->downloadPriority());
+
+    // and the transfer drops back once no request needs it sooner
+    downloader->setDownloadPriority(waiter, RT_DOWNLOAD_PRIORITY_PREFETCH);
+    EXPECT_EQ(RT_DOWNLOAD_PRIORITY_PREFETCH, owner->downloadPriority());
+
+    EXPECT_TRUE(waitForDownloads(hostConnections + 2, 10));
+    EXPECT_EQ(hostConnections + 2, mSucceeded.load());
+    EXPECT_EQ(hostConnections + 1, mServer.mRequests.load());
+#endif
+  }
+
+  void synchronousDownloadTest()
+  {
+    rtFileDownloadRequest* request = new rtFileDownloadRequest(mServer.url("/sync").cString(), this, downloadCallback);
+#ifdef ENABLE_HTTP_CACHE
+    request->setCacheEnabled(false);
+#endif
+    rtFileDownloader::instance()->downloadFile(request);
+    // downloadFile() without the engine still completes before returning
+    EXPECT_EQ(1, mCompleted.load());
+    EXPECT_EQ(1, mSucceeded.load());
+  }
+
+  void bufferTest()
+  {
+    // with a Content-Length the body is written once into a buffer of the
+    // right size
+    rtFileDownloadRequest* request = new rtFileDownloadRequest(mServer.url("/large").cString(), this);
+    EXPECT_TRUE(rtFileDownloader::instance()->downloadFromNetwork(request));
+    EXPECT_EQ(kLargeBodySize, request->downloadedDataSize());
+    EXPECT_EQ(request->headerDataSize() + kLargeBodySize, request->downloadBytesCopied());
+    delete request;
+
+    // without one the buffer grows geometrically, so each byte is moved a
+    // bounded number of times rather than once per later chunk
+    request = new rtFileDownloadRequest(mServer.url("/chunked").cString(), this);
+    EXPECT_TRUE(rtFileDownloader::instance()->downloadFromNetwork(request));
+    EXPECT_EQ(kLargeBodySize, request->downloadedDataSize());
+    EXPECT_TRUE(request->downloadBytesCopied() < 5 * kLargeBodySize);
+    rtLogInfo("chunked download of %d bytes copied %d bytes", (int)kLargeBodySize, (int)request->downloadBytesCopied());
+
+    char* data = NULL;
+    size_t dataSize = 0;
+    EXPECT_TRUE(request->takeDownloadedData(data, dataSize));
+    EXPECT_EQ(kLargeBodySize, dataSize);
+    EXPECT_TRUE(request->downloadedData() == NULL);
+    EXPECT_EQ('y', data[dataSize - 1]);
+    free(data);
+    delete request;
+  }
+
+  void streamTest()
+  {
+    // the consumer sees the body as it arrives, and it is not kept
+    countingStreamConsumer consumer;
+    rtFileDownloadRequest* request = new rtFileDownloadRequest(mServer.url("/chunked").cString(), this);
+    request->setStreamConsumer(&consumer, false);
+    EXPECT_TRUE(rtFileDownloader::instance()->downloadFromNetwork(request));
+    EXPECT_EQ(kLargeBodySize, consumer.mBytes);
+    EXPECT_TRUE(consumer.mChunks > 1);
+    EXPECT_EQ('y', consumer.mLastByte);
+    EXPECT_EQ(0u, request->downloadedDataSize());
+    EXPECT_EQ(request->headerDataSize(), request->downloadBytesCopied());
+    delete request;
+
+    // or it is both streamed and collected
+    countingStreamConsumer collectingConsumer;
+    request = new rtFileDownloadRequest(mServer.url("/large").cString(), this);
+    request->setStreamConsumer(&collectingConsumer);
+    EXPECT_TRUE(rtFileDownloader::instance()->downloadFromNetwork(request));
+    EXPECT_EQ(kLargeBodySize, collectingConsumer.mBytes);
+    EXPECT_EQ(kLargeBodySize, request->downloadedDataSize());
+    delete request;
+  }
+
+  void priorityTest()
+  {
+#ifdef PX_MULTI_DOWNLOADS
+    if (rtFileDownloader::instance()->mDownloadEngine == NULL)
+      return;
+    // fill the connections to the host so the next requests wait in the
+    // engine, then queue prefetches ahead of visible downloads
+    const int hostConnections = 6; // maxDownloadConnectionsPerHost
+    mServer.mLatencyInMilliSeconds = 100;
+    for (int i = 0; i < hostConnections; i++)
+    {
+      char path[32];
+      sprintf(path, "/slow%d", i);
+      queueDownload(path);
+    }
+    pxSleepMS(200);
+    std::vector<rtFileDownloadRequest*> prefetches;
+    for (int i = 0; i < hostConnections; i++)
+    {
+      char path[32];
+      sprintf(path, "/prefetch%d", i);
+      prefetches.push_back(queueDownload(path));
+    }
+    std::vector<rtFileDownloadRequest*> visible;
+    for (int i = 0; i < hostConnections; i++)
+    {
+      char path[32];
+      sprintf(path, "/visible%d", i);
+      visible.push_back(queueDownload(path));
+    }
+    for (int i = 0; i < hostConnections; i++)
+    {
+      rtFileDownloader::instance()->setDownloadPriority(prefetches[i], RT_DOWNLOAD_PRIORITY_PREFETCH);
+      rtFileDownloader::instance()->setDownloadPriority(visible[i], RT_DOWNLOAD_PRIORITY_VISIBLE);
+    }
+    EXPECT_TRUE(waitForDownloads(3 * hostConnections, 10));
+
+    // the visible downloads were sent as soon as connections freed up
+    std::vector<std::string> paths = mServer.paths();
+    EXPECT_EQ(3 * hostConnections, (int)paths.size());
+    for (int i = hostConnections; i < 2 * hostConnections && i < (int)paths.size(); i++)
+    {
+      EXPECT_EQ(0u, paths[i].find("/visible"));
+    }
+#endif
+  }
+
+  void stopTest()
+  {
+#ifdef PX_MULTI_DOWNLOADS
+    rtFileDownloader* downloader = rtFileDownloader::instance();
+    if (downloader->mDownloadEngine == NULL)
+      return;
+    // stopping the engine with requests queued and in flight completes them
+    // all as canceled before it returns
+    mServer.mLatencyInMilliSeconds = 1000;
+    const int count = 10; // more than maxDownloadConnectionsPerHost
+    for (int i = 0; i < count; i++)
+    {
+      char path[32];
+      sprintf(path, "/stop%d", i);
+      queueDownload(path);
+    }
+    // the first transfers reach the server, the rest wait in the engine
+    double end = pxSeconds() + 5;
+    while (mServer.mRequests < 6 && pxSeconds() < end)
+    {
+      pxSleepMS(5);
+    }
+    pxSleepMS(100);
+    EXPECT_EQ(0, mCompleted.load());
+    downloader->stopDownloadEngine();
+    EXPECT_EQ(count, mCompleted.load());
+    EXPECT_EQ(count, mCanceled.load());
+
+    // later downloads still complete, and the engine can be started again
+    mServer.mLatencyInMilliSeconds = 0;
+    queueDownload("/afterStop");
+    EXPECT_TRUE(waitForDownloads(count + 1, 10));
+    EXPECT_EQ(1, mSucceeded.load());
+    EXPECT_TRUE(downloader->startDownloadEngine());
+    queueDownload("/afterStart");
+    EXPECT_TRUE(waitForDownloads(count + 2, 10));
+    EXPECT_EQ(2, mSucceeded.load());
+#endif
+  }
+
+  void downloadBenchmark()
+  {
+    const int count = 64;
+    mServer.mLatencyInMilliSeconds = 20;
+    rtFileDownloader* downloader = rtFileDownloader::instance();
+    rtFileDownloadEngine* engine = downloader->mDownloadEngine;
+
+    // a transfer per thread pool thread, as before the download engine
+    downloader->mDownloadEngine = NULL;
+    double poolTime = timeDownloads(count);
+    int poolConnections = mServer.mConnections;
+    downloader->mDownloadEngine = engine;
+
+    mServer.mConnections = 0;
+    double engineTime = timeDownloads(count);
+    rtLogInfo("%d downloads with %d ms latency: thread pool %.1f ms (%d connections), download engine %.1f ms (%d connections)",
+              count, mServer.mLatencyInMilliSeconds.load(), poolTime, poolConnections,
+              engineTime, mServer.mConnections.load());
+  }
+
+  std::atomic<int> mCompleted;
+  std::atomic<int> mSucceeded;
+  std::atomic<int> mCanceled;
+  localHttpServer mServer;
+};
+
+TEST_F(rtFileDownloaderTest, rtFileDownloaderTests)
+{
+  concurrentDownloadsTest();
+}
+
+TEST_F(rtFileDownloaderTest, rtFileDownloaderCancelTests)
+{
+  cancelInFlightTest();
+  mServer.mRequests = 0;
+  mCompleted = 0;
+  mSucceeded = 0;
+  mCanceled = 0;
+  cancelQueuedTest();
+}
+
+TEST_F(rtFileDownloaderTest, rtFileDownloaderCoalesceTests)
+{
+  coalesceTest();
+  mServer.mRequests = 0;
+  mCompleted = 0;
+  mSucceeded = 0;
+  coalesceCancelWaiterTest();
+  mCompleted = 0;
+  mSucceeded = 0;
+  mCanceled = 0;
+  coalesceCancelFirstTest();
+  mServer.mRequests = 0;
+  mCompleted = 0;
+  mSucceeded = 0;
+  mCanceled = 0;
+  coalescePriorityTest();
+  mServer.mRequests = 0;
+  mCompleted = 0;
+  mSucceeded = 0;
+  coalesceStreamTest();
+}
+
+TEST_F(rtFileDownloaderTest, rtFileDownloaderSynchronousTests)
+{
+  synchronousDownloadTest();
+}
+
+TEST_F(rtFileDownloaderTest, rtFileDownloaderBufferTests)
+{
+  bufferTest();
+}
+
+TEST_F(rtFileDownloaderTest, rtFileDownloaderStreamTests)
+{
+  streamTest();
+}
+
+TEST_F(rtFileDownloaderTest, rtFileDownloaderPriorityTests)
+{
+  priorityTest();
+}
+
+TEST_F(rtFileDownloaderTest, rtFileDownloaderStopTests)
+{
+  stopTest();
+}
+
+TEST_F(rtFileDownloaderTest, rtFileDownloaderBenchmark)
+{
+  downloadBenchmark();
+}
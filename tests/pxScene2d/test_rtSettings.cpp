@@ -152,6 +152,37 @@ public:
     EXPECT_EQ((int)0, strcmp("true", value.toString().cString()));
   }
 
+  void testBoolValue()
+  {
+    rtSettings s;
+    EXPECT_EQ((int)RT_OK, (int)s.setValue("jsonFalse", false));
+    EXPECT_EQ((int)RT_OK, (int)s.setValue("argFalse", "false"));
+    EXPECT_EQ((int)RT_OK, (int)s.setValue("argTrue", "true"));
+    EXPECT_EQ((int)RT_OK, (int)s.setValue("argZero", "0"));
+    EXPECT_EQ((int)RT_OK, (int)s.setValue("number", 1));
+    EXPECT_EQ((int)RT_OK, (int)s.setValue("other", "no thanks"));
+
+    bool flag = true;
+    EXPECT_EQ((int)RT_OK, (int)s.boolValue("jsonFalse", flag));
+    EXPECT_FALSE(flag);
+    flag = true;
+    EXPECT_EQ((int)RT_OK, (int)s.boolValue("argFalse", flag));
+    EXPECT_FALSE(flag);
+    EXPECT_EQ((int)RT_OK, (int)s.boolValue("argTrue", flag));
+    EXPECT_TRUE(flag);
+    EXPECT_EQ((int)RT_OK, (int)s.boolValue("argZero", flag));
+    EXPECT_FALSE(flag);
+    EXPECT_EQ((int)RT_OK, (int)s.boolValue("number", flag));
+    EXPECT_TRUE(flag);
+
+    // anything else leaves the default alone
+    flag = false;
+    EXPECT_EQ((int)RT_ERROR, (int)s.boolValue("other", flag));
+    EXPECT_FALSE(flag);
+    EXPECT_EQ((int)RT_ERROR, (int)s.boolValue("missing", flag));
+    EXPECT_FALSE(flag);
+  }
+
   void testNotFound()
   {
     rtSettings s;
@@ -240,6 +271,7 @@ TEST_F(rtSettingsTest, rtSettingsTests)
 {
   testWriteRead();
   testFromArgs();
+  testBoolValue();
   testNotFound();
   testOverwrite();
   // read permission value from scene
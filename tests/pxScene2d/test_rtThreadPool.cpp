@@ -23,12 +23,35 @@ limitations under the License.
 
 #include "rtThreadPool.h"
 #include "rtString.h"
+#include "pxTimer.h"
 #include <string.h>
+#include <string>
+#include <atomic>
 
 #include "test_includes.h" // Needs to be included last
 
 using namespace std;
 
+namespace
+{
+  string gRunOrder;
+
+  void appendTask(void* data)
+  {
+    gRunOrder += (const char*)data;
+  }
+
+  void cancelledTask(void* data)
+  {
+    gRunOrder += string("-") + (const char*)data;
+  }
+
+  void countTask(void* data)
+  {
+    (*(std::atomic<int>*)data)++;
+  }
+}
+
 class rtThreadPoolTest : public testing::Test
 {
   public:
@@ -72,6 +95,111 @@ class rtThreadPoolTest : public testing::Test
       p.raisePriority(s);
       EXPECT_TRUE(p.mRunning == true);
     }
+
+    // a pool without threads keeps its tasks until runTask() is called here
+    void priorityOrderTest()
+    {
+      rtThreadPool p(0);
+      gRunOrder.clear();
+      p.executeTask(new rtThreadTask(appendTask, (void*)"l", "", RT_THREAD_PRIORITY_LOW));
+      p.executeTask(new rtThreadTask(appendTask, (void*)"n", ""));
+      p.executeTask(new rtThreadTask(appendTask, (void*)"h", "", RT_THREAD_PRIORITY_HIGH));
+      p.executeTask(new rtThreadTask(appendTask, (void*)"N", ""));
+      for (int i = 0; i < 4; i++)
+        p.runTask(0);
+      EXPECT_EQ(string("hnNl"), gRunOrder);
+      EXPECT_FALSE(p.hasTask());
+    }
+
+    void reprioritiseTest()
+    {
+      rtThreadPool p(0);
+      gRunOrder.clear();
+      rtThreadTaskRef a = new rtThreadTask(appendTask, (void*)"a", "http://a");
+      rtThreadTaskRef b = new rtThreadTask(appendTask, (void*)"b", "http://b");
+      rtThreadTaskRef c = new rtThreadTask(appendTask, (void*)"c", "");
+      p.executeTask(a);
+      p.executeTask(b);
+      p.executeTask(c);
+      p.raisePriority("http://b");
+      p.setPriority(a.getPtr(), RT_THREAD_PRIORITY_LOW);
+      EXPECT_EQ(RT_THREAD_PRIORITY_HIGH, b->priority());
+      while (p.hasTask())
+        p.runTask(0);
+      EXPECT_EQ(string("bca"), gRunOrder);
+      // started tasks keep their priority
+      p.setPriority(c.getPtr(), RT_THREAD_PRIORITY_HIGH);
+      EXPECT_EQ(RT_THREAD_PRIORITY_NORMAL, c->priority());
+      EXPECT_TRUE(p.mKeys.empty());
+    }
+
+    void cancelTest()
+    {
+      rtThreadPool p(0);
+      gRunOrder.clear();
+      rtThreadTaskRef a = new rtThreadTask(appendTask, (void*)"a", "http://a");
+      a->setCancelFunction(cancelledTask);
+      rtThreadTask* b = new rtThreadTask(appendTask, (void*)"b", "http://b");
+      b->setCancelFunction(cancelledTask);
+      p.executeTask(a);
+      p.executeTask(b);
+      p.executeTask(new rtThreadTask(appendTask, (void*)"c", "http://b"));
+      EXPECT_EQ(2, p.cancelTasks("http://b"));
+      EXPECT_TRUE(p.cancelTask(a));
+      EXPECT_FALSE(p.cancelTask(a));
+      while (p.hasTask())
+        p.runTask(0);
+      EXPECT_EQ(string("-b-a"), gRunOrder);
+
+      rtThreadPoolMetrics m;
+      p.metrics(m);
+      EXPECT_EQ(0u, m.tasksQueued);
+      EXPECT_EQ(3u, m.tasksCancelled);
+      EXPECT_EQ(0u, m.tasksExecuted);
+    }
+
+    void stealTest()
+    {
+      rtThreadPool p(0);
+      p.mQueues.push_back(new rtThreadPool::taskQueue());
+      gRunOrder.clear();
+      // round robin puts one task on each queue
+      p.executeTask(new rtThreadTask(appendTask, (void*)"a", ""));
+      p.executeTask(new rtThreadTask(appendTask, (void*)"b", ""));
+      p.runTask(1);
+      p.runTask(1);
+      EXPECT_FALSE(p.hasTask());
+
+      rtThreadPoolMetrics m;
+      p.metrics(m);
+      EXPECT_EQ(2u, m.tasksExecuted);
+      EXPECT_EQ(1u, m.tasksStolen);
+      EXPECT_EQ(2u, gRunOrder.size());
+    }
+
+    void threadedTest()
+    {
+      rtThreadPool p(3);
+      std::atomic<int> count(0);
+      for (int i = 0; i < 200; i++)
+        p.executeTask(new rtThreadTask(countTask, &count, "", (rtThreadPriority)(i % RT_THREAD_PRIORITY_COUNT)));
+      double start = pxSeconds();
+      while (count.load() < 200 && pxSeconds() - start < 10)
+        pxSleepMS(1);
+      EXPECT_EQ(200, count.load());
+
+      rtThreadPoolMetrics m;
+      p.metrics(m);
+      while (m.tasksExecuted < 200 && pxSeconds() - start < 10)
+      {
+        pxSleepMS(1);
+        p.metrics(m);
+      }
+      EXPECT_EQ(200u, m.tasksExecuted);
+      EXPECT_EQ(0u, m.tasksQueued);
+      EXPECT_GE(m.utilisation, 0.0);
+      EXPECT_LE(m.utilisation, 1.0);
+    }
 };
 
 TEST_F(rtThreadPoolTest, rtThreadPoolTests)
@@ -80,4 +208,9 @@ TEST_F(rtThreadPoolTest, rtThreadPoolTests)
   destructionNonGlobalTest();
   destructionGlobalTest();
   raisePriorityTest();
+  priorityOrderTest();
+  reprioritiseTest();
+  cancelTest();
+  stealTest();
+  threadedTest();
 }
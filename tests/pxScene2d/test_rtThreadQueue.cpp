@@ -0,0 +1,247 @@
+/*
+
+pxCore Copyright 2005-2018 John Robinson
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+*/
+
+#include <sstream>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#define private public
+#define protected public
+
+#include "rtThreadQueue.h"
+#include "rtLog.h"
+#include "pxTimer.h"
+
+#include "test_includes.h" // Needs to be included last
+
+using namespace std;
+
+namespace
+{
+  struct taskLog
+  {
+    vector<intptr_t> order;
+    int count;
+  };
+
+  void logTask(void* context, void* data)
+  {
+    taskLog* log = (taskLog*)context;
+    log->order.push_back((intptr_t)data);
+    log->count++;
+  }
+
+  void countTask(void* context, void* /*data*/)
+  {
+    (*(int*)context)++;
+  }
+
+  void slowTask(void* context, void* /*data*/)
+  {
+    (*(int*)context)++;
+    pxSleepMS(20);
+  }
+
+  // the mutex and deque queue rtThreadQueue used to be, for comparison
+  class lockedQueue
+  {
+  public:
+    rtError addTask(rtThreadTaskCB t, void* context, void* data)
+    {
+      ThreadQueueEntry entry;
+      entry.task = t;
+      entry.context = context;
+      entry.data = data;
+      mMutex.lock();
+      mTasks.push_back(entry);
+      mMutex.unlock();
+      return RT_OK;
+    }
+
+    rtError process()
+    {
+      bool done = false;
+      do
+      {
+        ThreadQueueEntry entry;
+        mMutex.lock();
+        if (!mTasks.empty())
+        {
+          entry = mTasks.front();
+          mTasks.pop_front();
+        }
+        else done = true;
+        mMutex.unlock();
+        if (!done)
+          entry.task(entry.context, entry.data);
+      } while (!done);
+      return RT_OK;
+    }
+
+  private:
+    deque<ThreadQueueEntry> mTasks;
+    rtMutex mMutex;
+  };
+
+  // producers add tasksPerProducer tasks each while the calling thread keeps
+  // processing until all of them ran; returns the time taken in ms
+  template <class Queue>
+  double contend(Queue& queue, int producers, int tasksPerProducer)
+  {
+    int count = 0;
+    double start = pxMilliseconds();
+    vector<thread> threads;
+    for (int p = 0; p < producers; p++)
+    {
+      threads.push_back(thread([&queue, &count, tasksPerProducer]()
+      {
+        for (int i = 0; i < tasksPerProducer; i++)
+          queue.addTask(countTask, &count, NULL);
+      }));
+    }
+    while (count < producers*tasksPerProducer)
+      queue.process();
+    double elapsed = pxMilliseconds() - start;
+    for (size_t p = 0; p < threads.size(); p++)
+      threads[p].join();
+    return elapsed;
+  }
+}
+
+class rtThreadQueueTest : public testing::Test
+{
+  public:
+    virtual void SetUp()
+    {
+    }
+
+    virtual void TearDown()
+    {
+    }
+
+    void orderTest()
+    {
+      rtThreadQueue q;
+      taskLog log;
+      log.count = 0;
+      for (intptr_t i = 0; i < 100; i++)
+        q.addTask(logTask, &log, (void*)i);
+      q.process();
+      ASSERT_EQ(100, log.count);
+      for (intptr_t i = 0; i < 100; i++)
+        EXPECT_EQ(i, log.order[i]);
+      EXPECT_TRUE(q.mPendingHead == NULL);
+      EXPECT_TRUE(q.mIncoming.load() == NULL);
+    }
+
+    void timeBudgetTest()
+    {
+      rtThreadQueue q;
+      int count = 0;
+      for (int i = 0; i < 5; i++)
+        q.addTask(slowTask, &count, NULL);
+      // the rest of the batch waits for the next call
+      q.process(0.001);
+      EXPECT_EQ(1, count);
+      EXPECT_TRUE(q.mPendingHead != NULL);
+      q.process();
+      EXPECT_EQ(5, count);
+    }
+
+    void removeAllTasksTest()
+    {
+      rtThreadQueue q;
+      taskLog removed, kept;
+      removed.count = kept.count = 0;
+      for (intptr_t i = 0; i < 10; i++)
+      {
+        q.addTask(logTask, &removed, (void*)i);
+        q.addTask(logTask, &kept, (void*)i);
+      }
+      // some tasks already taken into a batch, the rest still incoming
+      q.drain();
+      q.addTask(logTask, &removed, (void*)10);
+      q.removeAllTasksForObject(&removed);
+      q.addTask(logTask, &removed, (void*)11);
+      q.process();
+      EXPECT_EQ(10, kept.count);
+      ASSERT_EQ(1, removed.count);
+      EXPECT_EQ(11, removed.order[0]);
+      // nothing is queued any more so the tombstone goes
+      EXPECT_EQ(0, q.mTombstoneCount.load());
+      EXPECT_TRUE(q.mTombstones.empty());
+    }
+
+    void tombstonePruneTest()
+    {
+      rtThreadQueue q;
+      taskLog removed;
+      removed.count = 0;
+      int count = 0;
+      q.addTask(logTask, &removed, (void*)0);
+      q.removeAllTasksForObject(&removed);
+      q.removeAllTasksForObject(&removed);
+      EXPECT_EQ(1, q.mTombstoneCount.load());
+      for (int i = 0; i < 3; i++)
+        q.addTask(slowTask, &count, NULL);
+      q.process(0.001);
+      EXPECT_EQ(0, removed.count);
+      EXPECT_EQ(1, q.mTombstoneCount.load());
+
+      // once everything older than the tombstone has gone the next batch
+      // drops it, although the queue never runs empty
+      q.addTask(slowTask, &count, NULL);
+      q.addTask(slowTask, &count, NULL);
+      q.process(0.001);
+      q.process(0.001);
+      q.process(0.001);
+      EXPECT_EQ(4, count);
+      EXPECT_TRUE(q.mPendingHead != NULL);
+      EXPECT_EQ(0, q.mTombstoneCount.load());
+      EXPECT_TRUE(q.mTombstones.empty());
+      q.process();
+      EXPECT_EQ(5, count);
+    }
+
+    void contentionTest()
+    {
+      const int producers = 4;
+      const int tasksPerProducer = 100000;
+      rtThreadQueue q;
+      lockedQueue locked;
+      double lockFree = contend(q, producers, tasksPerProducer);
+      double mutex = contend(locked, producers, tasksPerProducer);
+      rtLogInfo("%d producers adding %d tasks each: lock free queue %.2fms, mutex queue %.2fms",
+                producers, tasksPerProducer, lockFree, mutex);
+      EXPECT_TRUE(q.mPendingHead == NULL);
+    }
+};
+
+TEST_F(rtThreadQueueTest, rtThreadQueueTests)
+{
+  orderTest();
+  timeBudgetTest();
+  removeAllTasksTest();
+  tombstonePruneTest();
+}
+
+TEST_F(rtThreadQueueTest, rtThreadQueueContentionBenchmark)
+{
+  contentionTest();
+}
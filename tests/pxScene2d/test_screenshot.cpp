@@ -22,8 +22,25 @@ limitations under the License.
 #include "pxContext.h"
 #include "pxWindow.h"
 #include "pxUtil.h"
+#include "pxTimer.h"
+#include "rtThreadQueue.h"
 #include "test_includes.h" // Needs to be included last
 
+extern rtThreadQueue* gUIThreadQueue;
+
+static rtError onScreenshotResolved(int numArgs, const rtValue* args, rtValue* /*result*/, void* context)
+{
+  if (numArgs > 0)
+    *(rtObjectRef*)context = args[0].toObject();
+  return RT_OK;
+}
+
+static rtError onScreenshotRejected(int /*numArgs*/, const rtValue* /*args*/, rtValue* /*result*/, void* context)
+{
+  *(bool*)context = true;
+  return RT_OK;
+}
+
 class screenshotTest : public testing::Test
 {
 public:
@@ -117,6 +134,28 @@ printf("\n >>>>>>>>>>>>>>>>>>>>> [%d]  len = %d   res = %d",i, out.length(), res
     }
   }
 
+  void test_pxStorePNGImage_compressionLevel()
+  {
+    pxOffscreen o;
+    EXPECT_EQ ((int)RT_OK, (int)o.init(256, 256));
+    o.fill(pxRed);
+    o.setUpsideDown(true);
+
+    rtData fast, small;
+    EXPECT_EQ ((int)RT_OK, (int)pxStorePNGImage(o, fast, 1));
+    EXPECT_EQ ((int)RT_OK, (int)pxStorePNGImage(o, small, 9));
+    EXPECT_GT ((int)fast.length(), 0);
+    EXPECT_GT ((int)small.length(), 0);
+    EXPECT_LE (small.length(), fast.length());
+
+    // both must decode back to the same image
+    pxOffscreen o1, o2;
+    EXPECT_EQ ((int)RT_OK, (int)pxLoadPNGImage((const char*)fast.data(), fast.length(), o1));
+    EXPECT_EQ ((int)RT_OK, (int)pxLoadPNGImage((const char*)small.data(), small.length(), o2));
+    EXPECT_EQ (o1.width(), o2.width());
+    EXPECT_EQ (o1.height(), o2.height());
+  }
+
   void test_pixels()
   {
     int fbo_w = 640;
@@ -192,6 +231,75 @@ printf("\n >>>>>>>>>>>>>>>>>>>>> [%d]  len = %d   res = %d",i, out.length(), res
 
     delete win;
   }
+
+  void test_screenshotAsync()
+  {
+    pxWindow* win = new pxWindow();
+    win->init(0,0,320,240);
+
+    rtRef<pxScene2d> scene = new pxScene2d();
+    scene->onSize(320,240);
+
+    rtObjectRef promise;
+    EXPECT_EQ ((int)RT_FAIL, (int)scene->screenshotAsync("image/gif", rtObjectRef(), promise));
+
+    EXPECT_EQ ((int)RT_OK, (int)scene->screenshotAsync("image/raw;rgba", rtObjectRef(), promise));
+    EXPECT_TRUE (promise);
+    if (!promise)
+    {
+      delete win;
+      return;
+    }
+
+    rtObjectRef screenshot;
+    bool rejected = false;
+    promise.send("then", new rtFunctionCallback(onScreenshotResolved, &screenshot),
+                 new rtFunctionCallback(onScreenshotRejected, &rejected));
+
+    // the readback is collected once a frame has been drawn and the encode
+    // resolves the promise from the UI thread queue
+    scene->onDraw();
+    double timeout = pxSeconds() + 5;
+    while (!screenshot && !rejected && pxSeconds() < timeout)
+    {
+      scene->onUpdate(pxSeconds());
+      if (gUIThreadQueue)
+        gUIThreadQueue->process(0.01);
+      pxSleepMS(10);
+    }
+
+    EXPECT_FALSE (rejected);
+    EXPECT_TRUE (screenshot);
+    if (screenshot)
+    {
+      EXPECT_EQ (std::string("image/raw;rgba"), std::string(screenshot.get<rtString>("type").cString()));
+      int32_t w = screenshot.get<int32_t>("width");
+      int32_t h = screenshot.get<int32_t>("height");
+      EXPECT_EQ (320, w);
+      EXPECT_EQ (240, h);
+      EXPECT_EQ ((uint32_t)(w*h*4), screenshot.get<uint32_t>("length"));
+
+      rtObjectRef data = screenshot.get<rtObjectRef>("data");
+      EXPECT_TRUE (rtBufferObject::fromObject(data) != NULL);
+      EXPECT_EQ (screenshot.get<uint32_t>("length"), data.get<uint32_t>("length"));
+
+      // the bytes are readable by index but not writable
+      rtValue byte;
+      EXPECT_EQ ((int)RT_OK, (int)data->Get(0u, &byte));
+      rtValue zero((uint32_t)0);
+      EXPECT_NE ((int)RT_OK, (int)data->Set(0u, &zero));
+    }
+
+    // readbacks still pending when the scene goes away are rejected
+    rejected = false;
+    EXPECT_EQ ((int)RT_OK, (int)scene->screenshotAsync("image/png", rtObjectRef(), promise));
+    promise.send("then", new rtFunctionCallback(onScreenshotResolved, &screenshot),
+                 new rtFunctionCallback(onScreenshotRejected, &rejected));
+    scene->dispose();
+    EXPECT_TRUE (rejected);
+
+    delete win;
+  }
 };
 
 TEST_F(screenshotTest, screenshotTests)
@@ -201,5 +309,7 @@ TEST_F(screenshotTest, screenshotTests)
   test_pxStorePNGImage_empty();
   test_pxStorePNGImage_zero();
   test_pxStorePNGImage_normal();
+  test_pxStorePNGImage_compressionLevel();
   test_pixels();
+  test_screenshotAsync();
 }
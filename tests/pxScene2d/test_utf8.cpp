@@ -19,15 +19,29 @@ limitations under the License.
 #include <sstream>
 #include <string.h>
 #include <unistd.h>
+#include <vector>
 extern "C"
 {
 #include <utf8.h>
 }
+#include "rtLog.h"
+#include "pxTimer.h"
 
 #include "test_includes.h" // Needs to be included last
 
 #define STR_SIZE 32
 
+// strings used by the tests below plus longer runs of ASCII, Latin-1,
+// Greek and CJK text and a stray continuation byte
+static const char* corpus[] =
+{
+  "\x46\x6F\x6F\x20\xC2", "\x46\x6F\x6E", "Foo", "spark", "\"u20\"", "\u2026",
+  "The quick brown fox jumps over the lazy dog, then naps in the sun.",
+  "Fa\xc3\xa7" "ade na\xc3\xafve r\xc3\xa9sum\xc3\xa9 \xce\xb1\xce\xb2\xce\xb3 \xd0\xb0\xd0\xb1\xd0\xb2",
+  "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\xe3\x81\xae\xe3\x83\x86\xe3\x82\xad\xe3\x82\xb9\xe3\x83\x88",
+  "abcdefghijklmnop\x80qrstuvwxyz0123456789\xf0\x9f\x98\x80"
+};
+
 using namespace std;
 
 class UTF8Test : public testing::Test
@@ -284,6 +298,80 @@ class UTF8Test : public testing::Test
       EXPECT_TRUE (8230 == dest);
     }
 
+    // u8_decode must give exactly what a u8_nextchar loop gives
+    void decodeTest()
+    {
+      for (size_t c = 0; c < sizeof(corpus)/sizeof(corpus[0]); c++)
+      {
+        char* str = (char*)corpus[c];
+        int len = (int)strlen(str);
+        std::vector<u_int32_t> expected;
+        std::vector<int> expectedOffsets;
+        int i = 0, lasti = 0;
+        u_int32_t ch;
+        while ((ch = u8_nextchar(str, &i)) != 0)
+        {
+          expected.push_back(ch);
+          expectedOffsets.push_back(lasti);
+          lasti = i;
+        }
+
+        std::vector<u_int32_t> dest(len + 1);
+        std::vector<int> offsets(len + 1);
+        int n = u8_decode(&dest[0], &offsets[0], len, str, -1);
+        EXPECT_EQ((int)expected.size(), n);
+        for (int k = 0; k < n && k < (int)expected.size(); k++)
+        {
+          EXPECT_EQ(expected[k], dest[k]);
+          EXPECT_EQ(expectedOffsets[k], offsets[k]);
+        }
+      }
+
+      // a short destination stops early
+      u_int32_t dest[3];
+      EXPECT_EQ(3, u8_decode(dest, NULL, 3, corpus[6], -1));
+      EXPECT_EQ((u_int32_t)'T', dest[0]);
+      EXPECT_EQ(0, u8_decode(dest, NULL, 3, "", -1));
+    }
+
+    // decodes the corpus repeated to 1MB both ways and logs the times
+    void decodeBenchmark()
+    {
+      std::string text;
+      while (text.size() < 1024*1024)
+        for (size_t c = 0; c < sizeof(corpus)/sizeof(corpus[0]); c++)
+          text += corpus[c];
+      char* str = (char*)text.c_str();
+      int len = (int)text.size();
+      std::vector<u_int32_t> dest(len);
+      const int runs = 20;
+
+      double start = pxMilliseconds();
+      uint64_t nextcharSum = 0;
+      for (int r = 0; r < runs; r++)
+      {
+        int i = 0;
+        u_int32_t ch;
+        while ((ch = u8_nextchar(str, &i)) != 0)
+          nextcharSum += ch;
+      }
+      double nextcharTime = pxMilliseconds() - start;
+
+      start = pxMilliseconds();
+      uint64_t decodeSum = 0;
+      for (int r = 0; r < runs; r++)
+      {
+        int n = u8_decode(&dest[0], NULL, len, str, len);
+        for (int k = 0; k < n; k++)
+          decodeSum += dest[k];
+      }
+      double decodeTime = pxMilliseconds() - start;
+
+      EXPECT_EQ(nextcharSum, decodeSum);
+      rtLogInfo("decoding %d bytes %d times: u8_nextchar %.2fms, u8_decode %.2fms",
+                len, runs, nextcharTime, decodeTime);
+    }
+
     void u8_toucsTest()
     {
 	u_int32_t dest[STR_SIZE] = {0};
@@ -320,4 +408,10 @@ TEST_F(UTF8Test, UTF8Tests)
   u8_incTest();
   u8_decTest();
   u8_toucsTest();
+  decodeTest();
+}
+
+TEST_F(UTF8Test, UTF8DecodeBenchmark)
+{
+  decodeBenchmark();
 }